@@ -0,0 +1,227 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include "defines.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Timings of one benchmark case. Times are in seconds per repetition
+*/
+struct BenchResult {
+	std::string name;
+	std::vector<std::pair<std::string, std::string>> params;
+	size_t warmup = 0;
+	size_t repetitions = 0;
+	double mean = 0.0;
+	double stddev = 0.0;
+	double min = 0.0;
+	double median = 0.0;
+	double max = 0.0;
+	// Items (samples, layers, files...) processed per second at the mean time, 0 if the case has no items
+	double rate = 0.0;
+};
+
+/* @brief Runs benchmark cases and writes their results as a table, JSON or CSV.
+ * Anything the library prints to std::cout while a case runs is dropped, so it cannot interleave with the results.
+*/
+class BenchReport {
+public:
+	enum Format {
+		TABLE,
+		JSON,
+		CSV
+	};
+
+	/* @brief Create a report
+	 * @param[in] format	The output format
+	 * @param[in] out		The stream to write the results to. Only its buffer is kept, so std::cout works even though it is muted while cases run
+	*/
+	BenchReport(Format format, std::ostream& out) : format(format), out(out.rdbuf()) {
+		this->out << std::setprecision(9);
+	}
+
+	/* @brief Parse a format name
+	 * @param[in] name		table, json or csv
+	 * @param[out] format	The parsed format
+	 * @return				True if the name was recognized
+	*/
+	static bool parseFormat(std::string const& name, Format& format) {
+		if (name == "table") {
+			format = TABLE;
+		} else if (name == "json") {
+			format = JSON;
+		} else if (name == "csv") {
+			format = CSV;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	/* @brief Time a case. The body runs warmup times untimed, then repetitions times individually timed
+	 * @param[in] name			The case name, like layer.forward
+	 * @param[in] params		Key value pairs describing the case, like the layer shape
+	 * @param[in] warmup		Untimed runs before timing
+	 * @param[in] repetitions	Timed runs
+	 * @param[in] items			Items processed by one run of the body, used for the rate
+	 * @param[in] body			The work to time. Must finish all of its work before returning, GPU cases included
+	 * @return					The result, which is also written to the report
+	*/
+	BenchResult run(std::string const& name, std::vector<std::pair<std::string, std::string>> const& params, size_t warmup, size_t repetitions, double items, std::function<void()> const& body) {
+		std::vector<double> times;
+		times.reserve(repetitions);
+
+		std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+		for (size_t i=0;i<warmup;i++) {
+			body();
+		}
+		for (size_t i=0;i<repetitions;i++) {
+			auto start = std::chrono::steady_clock::now();
+			body();
+			times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		std::cout.rdbuf(stdoutBuffer);
+
+		BenchResult result;
+		result.name = name;
+		result.params = params;
+		result.warmup = warmup;
+		result.repetitions = repetitions;
+		summarize(times, result);
+		result.rate = items > 0.0 && result.mean > 0.0 ? items / result.mean : 0.0;
+
+		this->write(result);
+		return result;
+	}
+
+	/* @brief Finish the report. JSON is only valid once this has been called
+	*/
+	void finish() {
+		if (this->count == 0) {
+			this->writeHeader();
+		}
+		if (this->format == JSON) {
+			this->out << (this->count > 0 ? "\n" : "") << "\t]" << std::endl << "}" << std::endl;
+		}
+		this->out.flush();
+	}
+
+private:
+	Format format;
+	std::ostream out;
+	size_t count = 0;
+
+	/* @brief Fill in the statistics of a set of times
+	 * @param[in] times		The time of each repetition
+	 * @param[out] result	The result to fill in
+	*/
+	static void summarize(std::vector<double> times, BenchResult& result) {
+		if (times.empty()) {
+			return;
+		}
+
+		std::sort(times.begin(), times.end());
+		result.min = times.front();
+		result.max = times.back();
+		result.median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2.0;
+
+		double sum = 0.0;
+		for (double time : times) {
+			sum += time;
+		}
+		result.mean = sum / times.size();
+
+		// Sample standard deviation
+		double squares = 0.0;
+		for (double time : times) {
+			squares += (time - result.mean) * (time - result.mean);
+		}
+		result.stddev = times.size() > 1 ? std::sqrt(squares / (times.size() - 1)) : 0.0;
+	}
+
+	/* @brief Join the parameters of a case into one key=value;key=value string
+	 * @param[in] result	The result to describe
+	 * @return				The joined parameters
+	*/
+	static std::string joinParams(BenchResult const& result) {
+		std::string joined;
+		for (size_t i=0;i<result.params.size();i++) {
+			joined += (i > 0 ? ";" : "") + result.params[i].first + "=" + result.params[i].second;
+		}
+		return joined;
+	}
+
+	/* @brief Write the report header
+	*/
+	void writeHeader() {
+		switch (this->format) {
+			case TABLE:
+				this->out << std::left << std::setw(24) << "case" << std::setw(44) << "params" << std::right
+					<< std::setw(12) << "mean ms" << std::setw(12) << "stddev ms" << std::setw(12) << "min ms" << std::setw(12) << "median ms" << std::setw(14) << "items/s" << std::endl;
+				break;
+			case JSON: {
+				std::time_t now = std::time(nullptr);
+				char timestamp[32];
+				std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+#ifdef __OPTIMIZE__
+				const bool optimized = true;
+#else
+				const bool optimized = false;
+#endif
+				this->out << "{" << std::endl
+					<< "\t\"version\": \"" << SKML_VERSION << "\"," << std::endl
+					<< "\t\"timestamp\": \"" << timestamp << "\"," << std::endl
+					<< "\t\"optimized\": " << (optimized ? "true" : "false") << "," << std::endl
+					<< "\t\"results\": [" << std::endl;
+				break;
+			}
+			case CSV:
+				this->out << "case,params,warmup,repetitions,mean_s,stddev_s,min_s,median_s,max_s,items_per_s" << std::endl;
+				break;
+		}
+	}
+
+	/* @brief Write one result in the report format
+	 * @param[in] result	The result to write
+	*/
+	void write(BenchResult const& result) {
+		if (this->count == 0) {
+			this->writeHeader();
+		}
+
+		switch (this->format) {
+			case TABLE:
+				this->out << std::left << std::setw(24) << result.name << std::setw(44) << joinParams(result) << std::right << std::fixed << std::setprecision(3)
+					<< std::setw(12) << result.mean * 1e3 << std::setw(12) << result.stddev * 1e3 << std::setw(12) << result.min * 1e3 << std::setw(12) << result.median * 1e3
+					<< std::setw(14) << std::setprecision(1) << result.rate << std::endl;
+				this->out << std::defaultfloat << std::setprecision(9);
+				break;
+			case JSON:
+				this->out << (this->count > 0 ? ",\n" : "") << "\t\t{\"case\": \"" << result.name << "\", \"params\": {";
+				for (size_t i=0;i<result.params.size();i++) {
+					this->out << (i > 0 ? ", " : "") << "\"" << result.params[i].first << "\": \"" << result.params[i].second << "\"";
+				}
+				this->out << "}, \"warmup\": " << result.warmup << ", \"repetitions\": " << result.repetitions
+					<< ", \"mean_s\": " << result.mean << ", \"stddev_s\": " << result.stddev << ", \"min_s\": " << result.min
+					<< ", \"median_s\": " << result.median << ", \"max_s\": " << result.max << ", \"items_per_s\": " << result.rate << "}";
+				break;
+			case CSV:
+				this->out << result.name << "," << joinParams(result) << "," << result.warmup << "," << result.repetitions
+					<< "," << result.mean << "," << result.stddev << "," << result.min << "," << result.median << "," << result.max << "," << result.rate << std::endl;
+				break;
+		}
+
+		this->count++;
+	}
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include "server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define OPT_STRING "hc:d:n:o:t:"
+
+/* @brief Connect to a server socket
+ * @param[in] path	The socket path
+ * @return			The connected socket, or -1
+*/
+static int connectTo(std::string const& path) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* @brief Read exactly some number of bytes
+ * @param[in] fd		The socket
+ * @param[out] data		Where to read to
+ * @param[in] size		The number of bytes
+ * @return				True if every byte was read
+*/
+static bool readAll(int fd, void* data, size_t size) {
+	uint8_t* bytes = static_cast<uint8_t*>(data);
+	while (size > 0) {
+		ssize_t got = recv(fd, bytes, size, 0);
+		if (got <= 0) {
+			return false;
+		}
+		bytes += got;
+		size -= got;
+	}
+	return true;
+}
+
+/* @brief Send exactly some number of bytes
+ * @param[in] fd	The socket
+ * @param[in] data	The bytes to send
+ * @param[in] size	The number of bytes
+ * @return			True if every byte was sent
+*/
+static bool writeAll(int fd, void const* data, size_t size) {
+	uint8_t const* bytes = static_cast<uint8_t const*>(data);
+	while (size > 0) {
+		ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			return false;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	size_t connections = 8;
+	size_t depth = 1;
+	size_t floats = 32*32;
+	uint32_t op = SERVER_OP_RECONSTRUCT;
+	double seconds = 5.0;
+
+	while ((opt = getopt(argc, argv, OPT_STRING)) != -1) {
+		switch (opt) {
+			case 'c':
+				connections = strtoul(optarg, nullptr, 10);
+				break;
+			case 'd':
+				depth = strtoul(optarg, nullptr, 10);
+				break;
+			case 'n':
+				floats = strtoul(optarg, nullptr, 10);
+				break;
+			case 'o':
+				if (strcmp(optarg, "encode") == 0) {
+					op = SERVER_OP_ENCODE;
+				} else if (strcmp(optarg, "decode") == 0) {
+					op = SERVER_OP_DECODE;
+				} else if (strcmp(optarg, "reconstruct") == 0) {
+					op = SERVER_OP_RECONSTRUCT;
+				} else {
+					std::cerr << "Unknown operation " << optarg << ", expected encode, decode or reconstruct" << std::endl;
+					return 1;
+				}
+				break;
+			case 't':
+				seconds = strtod(optarg, nullptr);
+				break;
+			case 'h':
+				std::cout << "Usage: loadgen [options] [socket]" << std::endl
+				<< "-c [count]\tConcurrent connections. Defaults to 8" << std::endl
+				<< "-d [requests]\tRequests in flight on each connection. Defaults to 1" << std::endl
+				<< "-n [floats]\tFloats in each request, the input layer size or the bottleneck size for decode. Defaults to 1024" << std::endl
+				<< "-o [op]\t\tOne of encode, decode, reconstruct. Defaults to reconstruct" << std::endl
+				<< "-t [seconds]\tHow long to run. Defaults to 5" << std::endl;
+				return 0;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind >= argc || connections < 1 || depth < 1) {
+		std::cerr << "Expected a socket path, see -h" << std::endl;
+		return 1;
+	}
+	std::string path = argv[optind];
+
+	std::atomic<bool> running(true);
+	std::atomic<bool> failed(false);
+	std::mutex latencyLock;
+	std::vector<double> latencies;
+
+	// Each connection keeps 'depth' requests in flight, sending the next as soon as a response arrives
+	auto client = [&]() {
+		int fd = connectTo(path);
+		if (fd < 0) {
+			failed = true;
+			return;
+		}
+
+		std::vector<uint8_t> request(sizeof(ServerRequest) + floats * sizeof(float));
+		ServerRequest header = {op, static_cast<uint32_t>(floats)};
+		memcpy(request.data(), &header, sizeof(header));
+		float* values = reinterpret_cast<float*>(request.data() + sizeof(header));
+		for (size_t i=0;i<floats;i++) {
+			values[i] = (rand() % 4 == 0) ? 1.0 : 0.0;
+		}
+
+		std::vector<std::chrono::steady_clock::time_point> sent;
+		std::vector<double> local;
+		std::vector<float> response;
+		size_t next = 0;
+		size_t inFlight = 0;
+
+		for (size_t i=0;i<depth;i++) {
+			sent.push_back(std::chrono::steady_clock::now());
+			writeAll(fd, request.data(), request.size());
+			inFlight++;
+		}
+
+		while (inFlight > 0) {
+			ServerResponse result;
+			if (!readAll(fd, &result, sizeof(result)) || result.status != SERVER_STATUS_OK) {
+				failed = true;
+				break;
+			}
+			response.resize(result.count);
+			readAll(fd, response.data(), result.count * sizeof(float));
+			local.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - sent[next]).count());
+			inFlight--;
+
+			// Once stopped, only drain the requests still in flight
+			if (running) {
+				sent[next] = std::chrono::steady_clock::now();
+				writeAll(fd, request.data(), request.size());
+				inFlight++;
+			}
+			next = (next + 1) % depth;
+		}
+
+		close(fd);
+		std::lock_guard<std::mutex> lock(latencyLock);
+		latencies.insert(latencies.end(), local.begin(), local.end());
+	};
+
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i=0;i<connections;i++) {
+		threads.emplace_back(client);
+	}
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	running = false;
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (failed) {
+		std::cerr << "Some requests failed. Is the server running, and does -n match the layer size?" << std::endl;
+	}
+	if (latencies.empty()) {
+		return 1;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	std::cout << std::fixed << std::setprecision(3)
+		<< "requests\t" << latencies.size() << std::endl
+		<< "requests/s\t" << latencies.size() / elapsed << std::endl
+		<< "p50 ms\t\t" << latencies[latencies.size() / 2] * 1e3 << std::endl
+		<< "p99 ms\t\t" << latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)] * 1e3 << std::endl;
+
+	return failed ? 1 : 0;
+}
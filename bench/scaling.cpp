@@ -0,0 +1,110 @@
+#include "network.h"
+#include "cpubackend.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <unistd.h>
+
+#define OPT_STRING "hB:i:j:"
+
+/* @brief Time training steps of the default autoencoder on the CPU backend
+ * @param[in] threadCount	The number of threads to split each batch across
+ * @param[in] hogwild		True to use hogwild updates
+ * @param[in] batchSize		The number of samples per step
+ * @param[in] iterations	The number of steps to time
+ * @return					Samples trained per second
+*/
+static double measure(size_t threadCount, bool hogwild, uint32_t batchSize, size_t iterations) {
+	CPUBackend backend(threadCount, hogwild);
+	Network network;
+	network.setBatchSize(batchSize);
+	network.setup(backend, 32*32, {50*50, 20*20, 16, 20*20, 50*50}, 32*32);
+
+	std::vector<float> batch(static_cast<size_t>(batchSize) * 32*32);
+	for (float& value : batch) {
+		value = (rand() % 4 == 0) ? 1.0 : 0.0;
+	}
+
+	// One untimed step to fault in every buffer
+	network.loadBatch(batch.data());
+	network.feedForward();
+	network.backProp();
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i=0;i<iterations;i++) {
+		network.loadBatch(batch.data());
+		network.feedForward();
+		network.backProp();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	return iterations * batchSize / seconds;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	uint32_t batchSize = MAX_BATCH_SIZE;
+	size_t iterations = 5;
+	size_t maxThreads = ThreadPool::getPhysicalCoreCount();
+
+	while ((opt = getopt(argc, argv, OPT_STRING)) != -1) {
+		switch (opt) {
+			case 'B':
+				batchSize = atoi(optarg);
+				break;
+			case 'i':
+				iterations = strtoull(optarg, nullptr, 10);
+				break;
+			case 'j':
+				maxThreads = strtoul(optarg, nullptr, 10);
+				break;
+			case 'h':
+				std::cout << "-B [samples]\tBatch size. Defaults to " << MAX_BATCH_SIZE << std::endl
+				<< "-i [steps]\tTimed steps per thread count. Defaults to 5" << std::endl
+				<< "-j [threads]\tLargest thread count to measure. Defaults to the number of physical cores" << std::endl;
+				return 0;
+			default:
+				return 1;
+		}
+	}
+
+	if (batchSize < 1 || batchSize > MAX_BATCH_SIZE || iterations < 1 || maxThreads < 1) {
+		std::cerr << "Invalid options, see -h" << std::endl;
+		return 1;
+	}
+
+	// Powers of two, then the core count itself
+	std::vector<size_t> threadCounts;
+	for (size_t threads=1;threads<maxThreads;threads*=2) {
+		threadCounts.push_back(threads);
+	}
+	threadCounts.push_back(maxThreads);
+
+	std::cout << "threads\tmode\tsamples/s\tspeedup\tefficiency" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+
+	double baseline = 0.0;
+	for (size_t threads : threadCounts) {
+		for (bool hogwild : {false, true}) {
+			// A single thread is the same in both modes
+			if (threads == 1 && hogwild) {
+				continue;
+			}
+
+			double rate = measure(threads, hogwild, batchSize, iterations);
+			if (threads == 1) {
+				baseline = rate;
+			}
+
+			double speedup = rate / baseline;
+			std::cout << threads << "\t" << (hogwild ? "hogwild" : "reduce") << "\t" << rate << "\t" << speedup << "x\t" << 100.0 * speedup / threads << "%" << std::endl;
+		}
+	}
+
+	return 0;
+}
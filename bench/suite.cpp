@@ -0,0 +1,508 @@
+#include "harness.h"
+#include "network.h"
+#include "cpubackend.h"
+#include "gpubackend.h"
+#include "dataset.h"
+#include "feeder.h"
+#include "netutil.h"
+#include "oglopp/compute.h"
+#include "oglopp/window.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#define OPT_STRING "hb:B:j:w:r:f:o:n:S:gFI:L:O:c:u:p:d:"
+
+using Params = std::vector<std::pair<std::string, std::string>>;
+
+/* Everything the cases need to know about the run
+*/
+struct SuiteSettings {
+	Backend::Type backendType = Backend::CPU;
+	size_t threadCount = 0;
+	uint32_t batchSize = MAX_BATCH_SIZE;
+	size_t warmup = 2;
+	size_t repetitions = 10;
+	size_t datasetSamples = 2000;
+	size_t inputSize = 32*32;
+	std::vector<size_t> hiddenSizes;
+	size_t outputSize = 32*32;
+	std::vector<ConvolutionShape> convolutions;	// One per hidden layer, then the output layer, see Network::shapeConvolutions()
+	float sparsity = 0.9;
+	float density = 0.15;						// Fraction of the values set in the inputs of the sketch cases
+	std::string scratch;
+};
+
+/* @brief Wait for the backend to finish everything it was asked to do, so GPU work is inside the timed region
+ * @param[in] backend	The backend to wait for
+*/
+static void finish(Backend& backend) {
+	if (backend.getType() == Backend::GPU) {
+		glFinish();
+	}
+}
+
+/* @brief Fill a buffer with a sparse binary pattern, like a drawn sample
+ * @param[in] count	The number of floats
+ * @return			The buffer
+*/
+static std::vector<float> makeSamples(size_t count) {
+	std::vector<float> samples(count);
+	for (float& value : samples) {
+		value = (rand() % 4 == 0) ? 1.0 : 0.0;
+	}
+	return samples;
+}
+
+/* @brief Fill a buffer with drawings, which only set values in the middle of the canvas and leave the border blank
+ * @param[in] count		The number of floats
+ * @param[in] size		The number of floats per sample
+ * @param[in] density	The fraction of each sample's values that are set
+ * @return				The buffer
+*/
+static std::vector<float> makeSketches(size_t count, size_t size, float density) {
+	std::vector<float> samples(count, 0.0);
+	// Two thirds of the values of a band half again as wide as the density are set, so the samples of a batch overlap like drawings of the same digits
+	size_t band = std::min(size, static_cast<size_t>(1.5 * density * size));
+	size_t start = (size - band) / 2;
+	for (size_t i=0;i<count;i++) {
+		size_t position = i % size;
+		if (position >= start && position < start + band && rand() % 3 != 0) {
+			samples[i] = 1.0;
+		}
+	}
+	return samples;
+}
+
+/* @brief Time the forward and backward pass of every layer shape in the topology on its own, pruned, the fp16 and bf16 forward passes, and the int8
+ * forward pass on the CPU.
+ * Convolutional layers are only timed as they are. Dense layers are also timed with sketch inputs, mostly blank like a drawing or the output of a ReLU layer
+ * @param[in] report	The report to write to
+ * @param[in] backend	The backend to run the layers on
+ * @param[in] settings	The run settings
+*/
+static void benchLayers(BenchReport& report, Backend& backend, SuiteSettings const& settings) {
+	std::vector<size_t> sizes = {settings.inputSize};
+	sizes.insert(sizes.end(), settings.hiddenSizes.begin(), settings.hiddenSizes.end());
+	sizes.push_back(settings.outputSize);
+
+	for (size_t i=1;i<sizes.size();i++) {
+		Layer lastLayer;
+		Layer thisLayer;
+		ConvolutionShape const& convolution = settings.convolutions[i-1];
+		lastLayer.setup(sizes[i-1], 0, backend.getType(), settings.batchSize);
+		if (convolution.kernel > 0) {
+			thisLayer.setup(convolution, backend.getType(), settings.batchSize);
+		} else {
+			thisLayer.setup(sizes[i], sizes[i-1], backend.getType(), settings.batchSize);
+		}
+
+		std::vector<float> input = makeSamples(sizes[i-1] * settings.batchSize);
+		float* values = lastLayer.mapValues();
+		memcpy(values, input.data(), sizeof(float) * input.size());
+		lastLayer.unmapValues();
+
+		Params params = {{"in", std::to_string(sizes[i-1])}, {"out", std::to_string(sizes[i])}, {"batch", std::to_string(settings.batchSize)}};
+		if (convolution.kernel > 0) {
+			// Named after the option that makes it
+			params.push_back({"conv", std::string(convolution.transposed ? "u" : "c") + std::to_string(convolution.kernel) + "," + std::to_string(convolution.stride)});
+		}
+
+		report.run("layer.forward", params, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			thisLayer.feedForward(lastLayer, backend);
+			finish(backend);
+		});
+
+		// Hidden layers carry their costs back, which is the more expensive path
+		report.run("layer.backward", params, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			thisLayer.backPropagate(lastLayer, backend, false);
+			finish(backend);
+		});
+
+		if (convolution.kernel > 0) {
+			continue;
+		}
+
+		// The CPU backend only gathers the weight columns a sketch uses. Marking the inputs as coming from a ReLU layer lets the backward pass skip the
+		// carried costs of the blank values too, as it would for the input layer
+		Layer sketchLayer;
+		sketchLayer.setup(sizes[i-1], 0, backend.getType(), settings.batchSize);
+		sketchLayer.setActivation(ACTIVATION_RELU);
+		std::vector<float> sketches = makeSketches(sizes[i-1] * settings.batchSize, sizes[i-1], settings.density);
+		values = sketchLayer.mapValues();
+		memcpy(values, sketches.data(), sizeof(float) * sketches.size());
+		sketchLayer.unmapValues();
+
+		std::ostringstream density;
+		density << settings.density;
+		Params sketchParams = params;
+		sketchParams.push_back({"density", density.str()});
+
+		report.run("layer.forward.sketch", sketchParams, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			thisLayer.feedForward(sketchLayer, backend);
+			finish(backend);
+		});
+
+		report.run("layer.backward.sketch", sketchParams, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			thisLayer.backPropagate(sketchLayer, backend, false);
+			finish(backend);
+		});
+
+		// Pruned copy of the layer, so the sparse kernels can be compared with the dense ones at the same shape
+		Layer sparseLayer;
+		sparseLayer.setup(sizes[i], sizes[i-1], backend.getType(), settings.batchSize);
+		sparseLayer.prune(0.0, settings.sparsity);
+		std::ostringstream sparsity;
+		sparsity << settings.sparsity;
+		Params sparseParams = params;
+		sparseParams.push_back({"sparsity", sparsity.str()});
+
+		report.run("layer.forward.sparse", sparseParams, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			sparseLayer.feedForward(lastLayer, backend);
+			finish(backend);
+		});
+
+		report.run("layer.backward.sparse", sparseParams, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+			sparseLayer.backPropagate(lastLayer, backend, false);
+			finish(backend);
+		});
+
+		// Copies of the layer keeping only their reduced weights, like a served model
+		for (uint32_t format : {MODEL_FORMAT_FP16, MODEL_FORMAT_BF16}) {
+			Layer reducedLayer;
+			reducedLayer.setup(sizes[i], sizes[i-1], backend.getType(), settings.batchSize);
+			reducedLayer.setPrecision(format, false);
+			report.run(format == MODEL_FORMAT_FP16 ? "layer.forward.fp16" : "layer.forward.bf16", params, settings.warmup, settings.repetitions,
+				settings.batchSize, [&]() {
+				reducedLayer.feedForward(lastLayer, backend);
+				finish(backend);
+			});
+		}
+
+		// The generated inputs are all 0 or 1, which is the range calibration would find
+		if (backend.getType() == Backend::CPU) {
+			thisLayer.quantize(0.0, 1.0);
+			report.run("layer.forward.int8", params, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+				thisLayer.feedForward(lastLayer, backend);
+			});
+		}
+	}
+}
+
+/* @brief Time single sample inference and batched training of the whole network
+ * @param[in] report	The report to write to
+ * @param[in] backend	The backend to run the network on
+ * @param[in] settings	The run settings
+*/
+static void benchNetwork(BenchReport& report, Backend& backend, SuiteSettings const& settings) {
+	Network network;
+	network.setup(backend, settings.inputSize, settings.hiddenSizes, settings.outputSize, settings.convolutions);
+
+	std::vector<float> batch = makeSamples(settings.inputSize * settings.batchSize);
+	network.loadBatch(batch.data());
+
+	report.run("network.inference", {{"batch", "1"}}, settings.warmup, settings.repetitions, 1, [&]() {
+		network.feedForward();
+		finish(backend);
+	});
+
+	network.setBatchSize(settings.batchSize);
+	report.run("network.train", {{"batch", std::to_string(settings.batchSize)}}, settings.warmup, settings.repetitions, settings.batchSize, [&]() {
+		network.loadBatch(batch.data());
+		network.feedForward();
+		network.backProp();
+		finish(backend);
+	});
+}
+
+/* @brief Time saving and loading the network as a model file
+ * @param[in] report	The report to write to
+ * @param[in] backend	The backend the model is loaded for
+ * @param[in] settings	The run settings
+*/
+static void benchModel(BenchReport& report, Backend& backend, SuiteSettings const& settings) {
+	Network network;
+	network.setup(backend, settings.inputSize, settings.hiddenSizes, settings.outputSize, settings.convolutions);
+
+	std::string directory = settings.scratch + "models/";
+	network.save(directory);
+
+	std::string path;
+	for (auto const& entry : std::filesystem::directory_iterator(directory)) {
+		path = entry.path();
+	}
+	Params params = {{"bytes", std::to_string(std::filesystem::file_size(path))}};
+
+	report.run("model.save", params, settings.warmup, settings.repetitions, 1, [&]() {
+		network.save(directory);
+	});
+
+	report.run("model.load", params, settings.warmup, settings.repetitions, 1, [&]() {
+		Network loaded;
+		loaded.setup(backend, path);
+		finish(backend);
+	});
+}
+
+/* @brief Time opening a sample pack and a directory of .raw samples, reading every sample of each, and staging an epoch of batches from the pack
+ * @param[in] report	The report to write to
+ * @param[in] settings	The run settings
+*/
+static void benchDataset(BenchReport& report, SuiteSettings const& settings) {
+	std::string directory = settings.scratch + "samples/";
+	std::string pack = settings.scratch + DATASET_FILE;
+	std::filesystem::create_directories(directory);
+
+	std::vector<float> samples = makeSamples(settings.inputSize * settings.datasetSamples);
+	for (size_t i=0;i<settings.datasetSamples;i++) {
+		std::ofstream stream(directory + std::to_string(i) + ".raw", std::ios::out | std::ios::binary);
+		stream.write(reinterpret_cast<char const*>(samples.data() + i * settings.inputSize), sizeof(float) * settings.inputSize);
+	}
+	if (Dataset::convert(directory, pack) != 0) {
+		std::cerr << "Failed to create the benchmark sample pack" << std::endl;
+		return;
+	}
+
+	// Sum every sample so the pages of the mapping are actually read
+	volatile float sink = 0.0;
+	auto readAll = [&sink](Dataset& dataset) {
+		float sum = 0.0;
+		for (uint64_t i=0;i<dataset.size();i++) {
+			float const* sample = dataset.getSample(i);
+			for (uint32_t j=0;j<dataset.getSampleSize();j++) {
+				sum += sample[j];
+			}
+		}
+		sink = sum;
+	};
+
+	Params params = {{"samples", std::to_string(settings.datasetSamples)}, {"size", std::to_string(settings.inputSize)}};
+
+	report.run("dataset.pack", params, settings.warmup, settings.repetitions, settings.datasetSamples, [&]() {
+		Dataset dataset(pack);
+		readAll(dataset);
+	});
+
+	report.run("dataset.directory", params, settings.warmup, settings.repetitions, settings.datasetSamples, [&]() {
+		Dataset dataset(directory);
+		readAll(dataset);
+	});
+
+	// Shuffled every epoch, then read in order through a buffer of a quarter of the samples
+	size_t batches = std::max<size_t>(settings.datasetSamples / settings.batchSize, 1);
+	for (uint32_t bufferSize : {static_cast<uint32_t>(0), static_cast<uint32_t>(settings.datasetSamples / 4)}) {
+		Dataset dataset(pack);
+		std::vector<uint32_t> indices(dataset.size());
+		std::iota(indices.begin(), indices.end(), 0);
+
+		ShuffleSettings shuffle;
+		shuffle.bufferSize = bufferSize;
+		Feeder feeder(dataset, indices, settings.batchSize, settings.inputSize, shuffle);
+
+		Params feedParams = params;
+		feedParams.push_back({"batch", std::to_string(settings.batchSize)});
+		feedParams.push_back({"buffer", std::to_string(bufferSize)});
+		report.run("dataset.feed", feedParams, settings.warmup, settings.repetitions, batches * settings.batchSize, [&]() {
+			for (size_t i=0;i<batches;i++) {
+				sink = feeder.acquire()[0];
+				feeder.release();
+			}
+		});
+	}
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	SuiteSettings settings;
+	BenchReport::Format format = BenchReport::TABLE;
+	std::string outputPath;
+	std::string shaderPath = "shaders/compute.glsl";
+	bool genericShader = false;
+	bool fuseLayers = false;
+	bool defaultHidden = true;
+	// -c and -u apply to whichever of -L and -O came last
+	std::vector<ConvolutionShape> hiddenConvolutions;
+	ConvolutionShape outputConvolution;
+	int lastLayerOption = 0;
+
+	while ((opt = getopt(argc, argv, OPT_STRING)) != -1) {
+		switch (opt) {
+			case 'b':
+				if (strcmp(optarg, "cpu") == 0) {
+					settings.backendType = Backend::CPU;
+				} else if (strcmp(optarg, "gpu") == 0) {
+					settings.backendType = Backend::GPU;
+				} else {
+					std::cerr << "Unknown backend " << optarg << ", expected cpu or gpu" << std::endl;
+					return 1;
+				}
+				break;
+			case 'B':
+				settings.batchSize = atoi(optarg);
+				break;
+			case 'j':
+				settings.threadCount = strtoul(optarg, nullptr, 10);
+				break;
+			case 'w':
+				settings.warmup = strtoull(optarg, nullptr, 10);
+				break;
+			case 'r':
+				settings.repetitions = strtoull(optarg, nullptr, 10);
+				break;
+			case 'f':
+				if (!BenchReport::parseFormat(optarg, format)) {
+					std::cerr << "Unknown format " << optarg << ", expected table, json or csv" << std::endl;
+					return 1;
+				}
+				break;
+			case 'o':
+				outputPath = optarg;
+				break;
+			case 'n':
+				settings.datasetSamples = strtoull(optarg, nullptr, 10);
+				break;
+			case 'S':
+				shaderPath = optarg;
+				break;
+			case 'g':
+				genericShader = true;
+				break;
+			case 'F':
+				fuseLayers = true;
+				break;
+			case 'I':
+				settings.inputSize = strtoull(optarg, nullptr, 10);
+				break;
+			case 'L':
+				if (defaultHidden) {
+					settings.hiddenSizes.clear();
+					defaultHidden = false;
+				}
+				settings.hiddenSizes.push_back(strtoull(optarg, nullptr, 10));
+				hiddenConvolutions.emplace_back();
+				lastLayerOption = opt;
+				break;
+			case 'O':
+				settings.outputSize = strtoull(optarg, nullptr, 10);
+				lastLayerOption = opt;
+				break;
+			case 'c':
+			case 'u':
+				if (lastLayerOption == 0 || !parseConvolution(optarg, opt == 'u', lastLayerOption == 'L' ? hiddenConvolutions.back() : outputConvolution)) {
+					std::cerr << "Invalid convolution, see -h" << std::endl;
+					return 1;
+				}
+				break;
+			case 'p':
+				settings.sparsity = strtof(optarg, nullptr);
+				break;
+			case 'd':
+				settings.density = strtof(optarg, nullptr);
+				break;
+			case 'h':
+				std::cout << "-b [cpu|gpu]\tBackend to benchmark. Defaults to cpu" << std::endl
+				<< "-B [samples]\tBatch size for the layer and training cases. Defaults to " << MAX_BATCH_SIZE << std::endl
+				<< "-j [threads]\tCPU backend threads. Defaults to one per physical core" << std::endl
+				<< "-w [runs]\tUntimed warmup runs per case. Defaults to 2" << std::endl
+				<< "-r [runs]\tTimed repetitions per case. Defaults to 10" << std::endl
+				<< "-f [format]\tOutput format: table, json or csv. Defaults to table" << std::endl
+				<< "-o [file]\tWrite the results to a file instead of stdout" << std::endl
+				<< "-n [samples]\tSamples in the generated dataset. Defaults to 2000" << std::endl
+				<< "-S [file]\tCompute shader for the GPU backend. Defaults to shaders/compute.glsl" << std::endl
+				<< "-g\t\tRun the generic compute shader instead of variants specialized per layer" << std::endl
+				<< "-F\t\tFuse tiny layers with the layer after them in the GPU forward pass" << std::endl
+				<< "-I [neurons]\tInput layer size. Defaults to 1024" << std::endl
+				<< "-L [neurons]\tAdd a hidden layer. Defaults to 2500, 400, 16, 400, 2500" << std::endl
+				<< "-O [neurons]\tOutput layer size. Defaults to 1024" << std::endl
+				<< "-c [k,stride]\tMake the layer of the previous -L or -O a convolution, as in the main program" << std::endl
+				<< "-u [k,stride]\tMake the layer of the previous -L or -O a transposed convolution, as in the main program" << std::endl
+				<< "-p [fraction]\tFraction of the weights pruned for the sparse layer cases. Defaults to 0.9" << std::endl
+				<< "-d [fraction]\tFraction of the values set in the inputs of the sketch cases. Defaults to 0.15" << std::endl;
+				return 0;
+			default:
+				return 1;
+		}
+	}
+
+	if (defaultHidden) {
+		settings.hiddenSizes = {50*50, 20*20, 16, 20*20, 50*50};
+		hiddenConvolutions.resize(settings.hiddenSizes.size());
+	}
+
+	std::vector<size_t> sizes = {settings.inputSize};
+	sizes.insert(sizes.end(), settings.hiddenSizes.begin(), settings.hiddenSizes.end());
+	sizes.push_back(settings.outputSize);
+	settings.convolutions = hiddenConvolutions;
+	settings.convolutions.push_back(outputConvolution);
+	if (!Network::shapeConvolutions(sizes, settings.convolutions)) {
+		return 1;
+	}
+
+	if (settings.batchSize < 1 || settings.batchSize > MAX_BATCH_SIZE || settings.repetitions < 1 || settings.datasetSamples < 1 || settings.inputSize < 1 || settings.outputSize < 1
+		|| settings.sparsity < 0.0 || settings.sparsity >= 1.0 || settings.density <= 0.0 || settings.density > 1.0) {
+		std::cerr << "Invalid options, see -h" << std::endl;
+		return 1;
+	}
+
+	std::ofstream outputFile;
+	if (!outputPath.empty()) {
+		outputFile.open(outputPath, std::ios::out | std::ios::trunc);
+		if (outputFile.fail()) {
+			std::cerr << "Failed to open " << outputPath << " for writing" << std::endl;
+			return 1;
+		}
+	}
+
+	// Models and samples are written to a scratch directory, removed when done
+	settings.scratch = (std::filesystem::temp_directory_path() / ("skml-bench-" + std::to_string(getpid()))).string() + "/";
+	std::filesystem::create_directories(settings.scratch);
+
+	// The GPU backend needs an OpenGL context, which needs a (hidden) window
+	std::unique_ptr<oglopp::Window> window;
+	std::unique_ptr<oglopp::Compute> compute;
+	std::unique_ptr<ShaderVariants> variants;
+	std::unique_ptr<Backend> backend;
+	if (settings.backendType == Backend::GPU) {
+		oglopp::Window::Settings options;
+		options.visible = false;
+		options.doFaceCulling = false;
+		options.modifyPointSize = false;
+		options.clearColor = glm::vec4(0.0);
+
+		window = std::make_unique<oglopp::Window>();
+		window->create(64, 64, "Sketch-ML Benchmark", options);
+		compute = std::make_unique<oglopp::Compute>(shaderPath.c_str(), oglopp::ShaderType::FILE);
+		if (!genericShader) {
+			// Cached in the scratch directory, so every run compiles them once before the warmup
+			variants = std::make_unique<ShaderVariants>(shaderPath, settings.scratch + "shadercache/");
+		}
+		auto gpuBackend = std::make_unique<GPUBackend>(*compute, variants != nullptr && !variants->getError() ? variants.get() : nullptr);
+		gpuBackend->setFusion(fuseLayers);
+		backend = std::move(gpuBackend);
+	} else {
+		backend = std::make_unique<CPUBackend>(settings.threadCount);
+	}
+
+	BenchReport report(format, outputPath.empty() ? std::cout : outputFile);
+
+	// The setup of each case logs too, so keep the library quiet for the whole run. The report holds on to the real buffer
+	std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+	benchLayers(report, *backend, settings);
+	benchNetwork(report, *backend, settings);
+	benchModel(report, *backend, settings);
+	benchDataset(report, settings);
+	report.finish();
+	std::cout.rdbuf(stdoutBuffer);
+
+	std::filesystem::remove_all(settings.scratch);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#include <cmath>
+#include <cstdint>
+
+// Activation functions. Stored in models, so the values must never change
+#define ACTIVATION_SIGMOID	0
+#define ACTIVATION_RELU		1
+#define ACTIVATION_TANH		2
+#define ACTIVATION_LINEAR	3
+
+/* Activation policies for the templated CPU kernels, see kernelActivate() and kernelDelta(). Each has the function itself,
+ * and its derivative taken from the function's output rather than its input, since the output is all backprop keeps.
+ * Must match activation() and activationD() in shaders/compute.glsl
+*/
+
+// Soft step activation function
+struct SigmoidActivation {
+	static inline float apply(float x) {
+		return 1.0f / (1.0f + std::exp(-x));
+	}
+
+	static inline float derivative(float sigmoid) {
+		// Same learning offset as the shader (0.005)
+		return (sigmoid * (1.f - sigmoid)) + 0.005f;
+	}
+};
+
+struct ReLUActivation {
+	static inline float apply(float x) {
+		return x > 0.0f ? x : 0.0f;
+	}
+
+	static inline float derivative(float y) {
+		return y > 0.0f ? 1.0f : 0.0f;
+	}
+};
+
+struct TanhActivation {
+	static inline float apply(float x) {
+		return std::tanh(x);
+	}
+
+	static inline float derivative(float y) {
+		return 1.0f - y * y;
+	}
+};
+
+struct LinearActivation {
+	static inline float apply(float x) {
+		return x;
+	}
+
+	static inline float derivative(float) {
+		return 1.0f;
+	}
+};
+
+/* @brief Get the name of an activation function
+ * @param[in] activation	ACTIVATION_*
+ * @return					One of 'sigmoid,relu,tanh,linear'
+*/
+inline char const* getActivationName(uint32_t activation) {
+	switch (activation) {
+		case ACTIVATION_RELU:
+			return "relu";
+		case ACTIVATION_TANH:
+			return "tanh";
+		case ACTIVATION_LINEAR:
+			return "linear";
+		default:
+			return "sigmoid";
+	}
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ALIGNED_H
+#define ALIGNED_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#define CACHE_LINE_SIZE 64
+
+/* @brief Allocator handing out cache line aligned memory, so SIMD kernels can use aligned loads at the start of each row
+*/
+template <typename T, size_t Alignment = CACHE_LINE_SIZE>
+struct AlignedAllocator {
+	using value_type = T;
+
+	template <typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, Alignment>;
+	};
+
+	AlignedAllocator() = default;
+
+	template <typename U>
+	AlignedAllocator(AlignedAllocator<U, Alignment> const&) {}
+
+	T* allocate(size_t count) {
+		return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+	}
+
+	void deallocate(T* pointer, size_t) {
+		::operator delete(pointer, std::align_val_t(Alignment));
+	}
+
+	template <typename U>
+	bool operator==(AlignedAllocator<U, Alignment> const&) const { return true; }
+
+	template <typename U>
+	bool operator!=(AlignedAllocator<U, Alignment> const&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "optimizer.h"
+#include <cstddef>
+#include <vector>
+
+class Layer;
+
+/* @brief Interface for the piece of hardware that executes the layer math. The network picks one at construction time and
+ * every layer in the network is stored and executed using that backend.
+*/
+class Backend {
+public:
+	enum Type {
+		GPU,
+		CPU
+	};
+
+	virtual ~Backend() = default;
+
+	/* @brief Get the type of this backend, which decides where the layers keep their neurons and weights
+	 * @return The backend type
+	*/
+	virtual Type getType() const = 0;
+
+	/* @brief Perform the feed forward algorithm on a layer using a reference to the previous layer
+	 * @param[in] thisLayer	The layer to calculate the values for
+	 * @param[in] lastLayer	A reference to the last layer to be fed into this layer
+	 * @return				A reference to thisLayer
+	*/
+	virtual Layer& feedForward(Layer& thisLayer, Layer& lastLayer) = 0;
+
+	/* @brief Perform back propagation on a layer, adjusting its weights and biases and carrying the deltas into the last layer
+	 * @param[in] thisLayer		The layer to adjust
+	 * @param[in] lastLayer		The layer before thisLayer, which receives the carried deltas in its expected values
+	 * @param[in] isLastLayer	True if thisLayer is the output layer of the network
+	 * @param[in] step			The optimizer and learning rate to adjust the weights and biases with
+	 * @return					A reference to thisLayer
+	*/
+	virtual Layer& backPropagate(Layer& thisLayer, Layer& lastLayer, bool isLastLayer, OptimizerStep const& step) = 0;
+
+	/* @brief Load a batch of samples into the input layer, and into the expected values of the output layer, without mapping either layer
+	 * @param[in] inputLayer	The first layer of the network
+	 * @param[in] outputLayer	The last layer of the network
+	 * @param[in] batch			inputLayer.getBatchSize() rows of inputLayer.getNeuronCount() floats
+	 * @return					A reference to inputLayer
+	*/
+	virtual Layer& loadBatch(Layer& inputLayer, Layer& outputLayer, float const* batch) = 0;
+
+	/* @brief Feed forward a range of layers in order, each from the one before it. Runs feedForward() on every layer unless the backend can do better
+	 * @param[in] layers	The layers of the network
+	 * @param[in] first		The first layer to compute, at least 1
+	 * @param[in] last		The last layer to compute
+	*/
+	virtual void forwardPass(std::vector<Layer>& layers, size_t first, size_t last);
+
+	/* @brief Back propagate every layer of a network, from the output layer down to the first hidden layer. Runs backPropagate() on every layer
+	 * unless the backend can do better
+	 * @param[in] layers	The layers of the network
+	 * @param[in] step		The optimizer and learning rate to adjust every layer with
+	*/
+	virtual void backwardPass(std::vector<Layer>& layers, OptimizerStep const& step);
+
+	/* @brief Feed forward every layer of a network again after its input changed, recomputing only as much as the change reaches. Runs forwardPass() over
+	 * the whole network unless the backend can do better
+	 * @param[in] layers	The layers of the network
+	 * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+	*/
+	virtual void incrementalPass(std::vector<Layer>& layers, float tolerance);
+};
+
+#endif
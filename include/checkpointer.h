@@ -0,0 +1,57 @@
+#ifndef CHECKPOINTER_H
+#define CHECKPOINTER_H
+
+#include "model.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Snapshots kept, so the next checkpoint can be captured while the last one is written
+#define CHECKPOINT_SNAPSHOTS	2
+
+/* @brief Saves models on a background thread. A checkpoint copies the layers into a snapshot on the calling thread, which is all training waits for,
+ * then the writer thread checksums it and writes it beside the target before renaming it over, see ModelSnapshot::write().
+ * A checkpoint taken before the writer got to the last one replaces it, so training never waits on the disk
+*/
+class Checkpointer {
+public:
+	Checkpointer();
+	Checkpointer(Checkpointer const&) = delete;
+	Checkpointer& operator=(Checkpointer const&) = delete;
+	~Checkpointer();
+
+	/* @brief Copy layers into a free snapshot and queue it to be written
+	 * @param[in] layers	The layers to save, starting with the input layer
+	 * @param[in] training	The training state to save with the layers, or nullptr for none
+	 * @param[in] path		The file to write
+	 * @return				The size of the file that will be written, in bytes
+	*/
+	uint64_t save(std::vector<Layer>& layers, ModelTrainingState const* training, std::string const& path);
+
+	/* @brief Wait for every queued checkpoint to be written
+	 * @return False if any write failed since the last wait
+	*/
+	bool wait();
+
+private:
+	/* @brief Writing loop of the background thread
+	*/
+	void run();
+
+	ModelSnapshot snapshots[CHECKPOINT_SNAPSHOTS];
+	std::string paths[CHECKPOINT_SNAPSHOTS];
+	// Indices into snapshots, -1 when there is none. The writer only touches the snapshot it is writing
+	int writing = -1;
+	int pending = -1;
+	bool failed = false;
+
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread worker;
+};
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+/* @brief Calculate the CRC-32C (Castagnoli) of a block of memory. Uses the SSE4.2 crc32 instruction when the host supports it
+ * @param[in] data	The memory to checksum
+ * @param[in] size	The number of bytes
+ * @param[in] crc	The checksum of any data before this block, to checksum a stream in pieces
+ * @return			The checksum
+*/
+uint32_t crc32c(void const* data, size_t size, uint32_t crc = 0);
+
+#endif
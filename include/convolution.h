@@ -0,0 +1,22 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include <cstdint>
+
+/* Shape of a convolutional layer. Images are square, and a layer holds its image channel by channel, row by row ([channel][y][x]).
+ * Weight [s][c][ky][kx] connects channel s of the small image at (y, x) with channel c of the big image at (y * stride - padding + ky, x * stride - padding + kx),
+ * anything outside the big image being zero. A convolution maps the big image fed to it to the small one, a transposed convolution maps the small image fed to it
+ * back to the big one with the same connections. A kernel of 0 means a dense layer
+*/
+struct ConvolutionShape {
+	bool transposed = false;
+	uint32_t kernel = 0;		// Width and height of the kernel
+	uint32_t stride = 1;
+	uint32_t padding = 0;		// Zero rows and columns before the big image
+	uint32_t smallSize = 0;		// Width and height of the small image
+	uint32_t smallChannels = 0;
+	uint32_t bigSize = 0;		// Width and height of the big image
+	uint32_t bigChannels = 0;
+};
+
+#endif
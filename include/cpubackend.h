@@ -0,0 +1,103 @@
+#ifndef CPUBACKEND_H
+#define CPUBACKEND_H
+
+#include "backend.h"
+#include "aligned.h"
+#include "threadpool.h"
+#include <vector>
+
+/* @brief Backend which runs the layers natively on the host. Does the same math as shaders/compute.glsl without requiring an OpenGL context.
+ * Each batch is split into one shard of samples per thread. Every shard computes its own weight and bias gradients, which are summed with a tree reduction
+ * and applied once per batch with the optimizer's fused update. In hogwild mode the shards apply their gradients straight to the shared weights instead,
+ * without any locking, except in convolutions and with optimizers that keep moments
+*/
+class CPUBackend : public Backend {
+public:
+	/* @brief Start the backend's threads
+	 * @param[in] threadCount	The number of threads to split each batch across. 0 uses one per physical core, see ThreadPool::getPhysicalCoreCount()
+	 * @param[in] hogwild		True to let every thread update the weights as soon as its shard is done, racing the others
+	*/
+	CPUBackend(size_t threadCount = 1, bool hogwild = false);
+	~CPUBackend() = default;
+
+	Type getType() const override;
+	Layer& feedForward(Layer& thisLayer, Layer& lastLayer) override;
+	Layer& backPropagate(Layer& thisLayer, Layer& lastLayer, bool isLastLayer, OptimizerStep const& step) override;
+	Layer& loadBatch(Layer& inputLayer, Layer& outputLayer, float const* batch) override;
+
+	/* @brief Feed forward only what changed since the last incremental pass. Every layer keeps its pre-activations and the inputs they were computed from,
+	 * and a dense layer adds (new input - old input) times the weight column of each input that moved by more than the tolerance, then activates again.
+	 * Layers whose inputs all held still keep their values, so a few painted pixels only cost a few columns of the first layer. Layers are recomputed in full
+	 * the first time, after anything else changed their weights or values, when too many inputs moved, and every so often to drop the rounding error
+	 * @param[in] layers	The layers of the network
+	 * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+	*/
+	void incrementalPass(std::vector<Layer>& layers, float tolerance) override;
+
+	/* @brief Get the number of threads each batch is split across
+	 * @return The thread count
+	*/
+	size_t getThreadCount();
+
+	/* @brief True if shards update the weights without a reduction
+	 * @return True if hogwild updates are enabled
+	*/
+	bool getHogwild();
+
+private:
+	ThreadPool pool;
+	bool hogwild;
+
+	// Scratch deltas reused between layers so the hot path never allocates. Each shard works on its own rows
+	AlignedVector<float> delta;
+	// Values of the last layer quantized for an int8 layer, one padded row per sample
+	AlignedVector<uint8_t> quantizedInput;
+	// The inputs that moved during an incremental pass, sample by sample. Sample b's are from changedStarts[b] to changedStarts[b+1]
+	std::vector<uint32_t> changedColumns;
+	AlignedVector<float> changedDeltas;
+	std::vector<size_t> changedStarts;
+	// Scratch space of each shard for the sparse, convolution and compact kernels, see kernelSparseScratch(), kernelConvolutionScratch() and kernelCompactScratch()
+	std::vector<AlignedVector<float>> scratch;
+	// The columns of its input each shard's compact kernels use, see kernelCompact()
+	std::vector<AlignedVector<uint32_t>> compactColumns;
+
+	// Gradients of each shard, summed into the first shard's buffers by the reduction
+	std::vector<AlignedVector<float>> weightGradients;
+	std::vector<AlignedVector<float>> biasGradients;
+
+	/* @brief Run the forward kernels of a layer, one shard of the batch per thread
+	 * @param[in] thisLayer	The layer to calculate the values for
+	 * @param[in] lastLayer	The layer fed into it
+	 * @param[out] z		batch rows of thisCount values before activation, or nullptr if they are not needed
+	*/
+	void forward(Layer& thisLayer, Layer& lastLayer, float* z);
+
+	/* @brief Bring a layer up to date with the inputs that moved since its last incremental pass, see incrementalPass()
+	 * @param[in] thisLayer	The layer to update
+	 * @param[in] lastLayer	The layer fed into it
+	 * @param[in] tolerance	How far an input has to move to count
+	*/
+	void updateIncremental(Layer& thisLayer, Layer& lastLayer, float tolerance);
+
+	/* @brief Get the number of shards a batch is split into
+	 * @param[in] batch	The number of samples in the batch
+	 * @return			The shard count, at most one per thread and one per sample
+	*/
+	uint32_t getShardCount(uint32_t batch);
+
+	/* @brief Sum the gradients of every shard into the first shard, pairing shards up in log2(shards) rounds
+	 * @param[in] shards		The number of shards to reduce
+	 * @param[in] weightCount	The number of weight gradients per shard
+	 * @param[in] thisCount		The number of bias gradients per shard
+	*/
+	void reduceGradients(uint32_t shards, size_t weightCount, uint32_t thisCount);
+
+	/* @brief Make sure every shard has the scratch space a layer's kernels need
+	 * @param[in] shards	The number of shards
+	 * @param[in] layer		The layer
+	 * @param[in] lastCount	The number of neurons in the last layer
+	*/
+	void reserveScratch(uint32_t shards, Layer& layer, uint32_t lastCount);
+};
+
+#endif
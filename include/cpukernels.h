@@ -0,0 +1,343 @@
+#ifndef CPUKERNELS_H
+#define CPUKERNELS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+#include "activation.h"
+#include "convolution.h"
+#include "optimizer.h"
+
+/* Host implementations of the math in shaders/compute.glsl. Weights are stored the same way as in the
+ * weights SSBO: weights[thisIndex * lastCount + lastIndex], one contiguous row per neuron of this layer.
+ * The dense kernels are also instantiated with the width of the last layer baked in for the layer sizes of the default autoencoder, and the activation
+ * kernels once per activation function, so their branches are taken once per call rather than once per value. See dispatchWidth() in cpukernels.cpp
+*/
+
+inline float valCostD(float actual, float expected) {
+	return 2.0f * (actual - expected);
+}
+
+/* @brief Apply an activation function to some values in place
+ * @param[in] activation	ACTIVATION_*
+ * @param[in,out] values	count values, z on the way in
+ * @param[in] count			The number of values
+*/
+void kernelActivate(uint32_t activation, float* values, size_t count);
+
+/* @brief Calculate the deltas (activation derivative times error) of some samples of a layer, and sum them into the bias gradients
+ * @param[in] activation	ACTIVATION_*
+ * @param[in] isLastLayer	True if the layer is the output layer, whose error is the cost derivative. Otherwise the error is the activation cost carried back in 'expected'
+ * @param[in] values		batch rows of thisCount activated values
+ * @param[in] expected		batch rows of thisCount expected values, or carried activation costs
+ * @param[in] errorScale	What the cost derivative of the output layer is scaled by, see Optimizer::getErrorScale()
+ * @param[out] delta		batch rows of thisCount deltas
+ * @param[in,out] bias		thisCount bias gradients, or the biases themselves
+ * @param[in] biasScale		What every delta is multiplied by before it is added to 'bias'. 1 to sum gradients, -1 to apply them
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in the layer
+*/
+void kernelDelta(uint32_t activation, bool isLastLayer, float const* values, float const* expected, float errorScale, float* delta, float* bias, float biasScale,
+	uint32_t batch, uint32_t thisCount);
+
+/* @brief Compute z = weights * input + bias for every neuron of a layer and every sample in the batch
+ * @param[in] weights	thisCount rows of lastCount weights
+ * @param[in] input		batch rows of lastCount values from the last layer
+ * @param[in] bias		thisCount biases
+ * @param[out] z		batch rows of thisCount outputs, before activation
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelForward(float const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Carry the deltas backwards and apply the gradient accumulated over the batch to the weights, as in doBackProp2.
+ * carry[b][k] = sum_i(weights[i][k] * delta[b][i]) using the weights before the update, then weights[i][k] -= sum_b(input[b][k] * delta[b][i])
+ * @param[in,out] weights	thisCount rows of lastCount weights
+ * @param[in] input			batch rows of lastCount values from the last layer
+ * @param[in] delta			batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry		batch rows of lastCount carried activation costs for the last layer
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+ * @param[in] lastCount		The number of neurons in the last layer
+ * @param[in] update		How the gradient is applied, see OptimizerUpdate. The plain SGD update subtracts it as it is
+ * @param[in,out] first		The first moments of the weights, or nullptr if the optimizer keeps none
+ * @param[in,out] second	The second moments of the weights, or nullptr if the optimizer keeps none
+*/
+void kernelBackward(float* weights, float const* input, float const* delta, float* carry, uint32_t batch, uint32_t thisCount, uint32_t lastCount,
+	OptimizerUpdate const& update, float* first, float* second);
+
+/* @brief Same as kernelBackward(), but writes the gradient summed over the batch to 'gradient' instead of applying it, leaving the weights untouched
+ * @param[in] weights	thisCount rows of lastCount weights
+ * @param[in] input		batch rows of lastCount values from the last layer
+ * @param[in] delta		batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry	batch rows of lastCount carried activation costs for the last layer
+ * @param[out] gradient	thisCount rows of lastCount weight gradients
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelGradient(float const* weights, float const* input, float const* delta, float* carry, float* gradient, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Quantize rows of values to unsigned 8 bits, q = clamp(round(x / scale) + zero, 0, 255), zero padding every row out to 'stride'
+ * @param[in] input		batch rows of count values
+ * @param[out] output	batch rows of stride quantized values
+ * @param[in] batch		The number of rows
+ * @param[in] count		The number of values per row
+ * @param[in] stride	The number of bytes per output row, at least count
+ * @param[in] scale		The value of one step
+ * @param[in] zero		The quantized value of 0
+*/
+void kernelQuantize(float const* input, uint8_t* output, uint32_t batch, uint32_t count, uint32_t stride, float scale, uint8_t zero);
+
+/* @brief Same as kernelForward() with int8 weights and quantized inputs. The dot products are summed exactly in 32 bits, then
+ * z[b][i] = bias[i] + inputScale * scales[i] * (sum_k(weights[i][k] * input[b][k]) - inputZero * rowSums[i])
+ * @param[in] weights		thisCount rows of stride int8 weights, zero padded past the last layer's neuron count
+ * @param[in] scales		thisCount weight scales
+ * @param[in] rowSums		thisCount sums of the int8 weights of each row
+ * @param[in] stride		The number of bytes per row, a multiple of 64
+ * @param[in] input			batch rows of stride quantized values from the last layer, see kernelQuantize()
+ * @param[in] inputScale	The scale the inputs were quantized with
+ * @param[in] inputZero		The zero point the inputs were quantized with
+ * @param[in] bias			thisCount biases
+ * @param[out] z			batch rows of thisCount outputs, before activation
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+*/
+void kernelForwardInt8(int8_t const* weights, float const* scales, int32_t const* rowSums, uint32_t stride, uint8_t const* input, float inputScale, uint8_t inputZero,
+	float const* bias, float* z, uint32_t batch, uint32_t thisCount);
+
+/* Reduced precision layers hold their weights as fp16 or bf16, laid out like fp32 weights, see ReducedWeights. The forward kernels widen them to fp32
+ * as they are loaded and sum in fp32, so they read half the memory of kernelForward(). With AVX-512 BF16 the samples are rounded to bf16 as well,
+ * and every pair of products is summed straight into fp32
+*/
+
+/* @brief Round values to fp16, to nearest even
+ * @param[in] values	count values
+ * @param[out] rounded	count halves
+ * @param[in] count		The number of values
+*/
+void kernelRoundFP16(float const* values, uint16_t* rounded, size_t count);
+
+/* @brief Round values to bf16, to nearest even
+ * @param[in] values	count values
+ * @param[out] rounded	count halves
+ * @param[in] count		The number of values
+*/
+void kernelRoundBF16(float const* values, uint16_t* rounded, size_t count);
+
+/* @brief Same as kernelForward() with fp16 weights
+ * @param[in] weights	thisCount rows of lastCount fp16 weights
+ * @param[in] input		batch rows of lastCount values from the last layer
+ * @param[in] bias		thisCount biases
+ * @param[out] z		batch rows of thisCount outputs, before activation
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelForwardFP16(uint16_t const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Get the scratch space kernelForwardBF16() needs
+ * @param[in] batch		The number of samples
+ * @param[in] lastCount	The number of neurons in the last layer
+ * @return				The number of floats
+*/
+size_t kernelBF16Scratch(uint32_t batch, uint32_t lastCount);
+
+/* @brief Same as kernelForward() with bf16 weights
+ * @param[in] weights	thisCount rows of lastCount bf16 weights
+ * @param[in] input		batch rows of lastCount values from the last layer
+ * @param[in] bias		thisCount biases
+ * @param[out] z		batch rows of thisCount outputs, before activation
+ * @param[out] scratch	kernelBF16Scratch() floats
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelForwardBF16(uint16_t const* weights, float const* input, float const* bias, float* z, float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* Pruned layers hold their weights row by row (CSR), see SparseWeights. The weights of neuron i are values[rowOffsets[i]] to values[rowOffsets[i+1] - 1],
+ * and connect it to the last layer neurons at the same positions in columns
+*/
+
+/* @brief Get the scratch space the sparse kernels need
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+ * @return				The number of floats
+*/
+size_t kernelSparseScratch(uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Same as kernelForward() with the weights of a pruned layer. Costs time in proportion to the weights left
+ * @param[in] rowOffsets	thisCount + 1 offsets into columns and values
+ * @param[in] columns		The last layer neuron of every weight
+ * @param[in] values		The weights
+ * @param[in] input			batch rows of lastCount values from the last layer
+ * @param[in] bias			thisCount biases
+ * @param[out] z			batch rows of thisCount outputs, before activation
+ * @param[out] scratch		kernelSparseScratch() floats
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+ * @param[in] lastCount		The number of neurons in the last layer
+*/
+void kernelForwardSparse(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Same as kernelBackward() with the weights of a pruned layer. Only the weights left are updated, so pruned weights stay pruned
+ * @param[in] rowOffsets	thisCount + 1 offsets into columns and values
+ * @param[in] columns		The last layer neuron of every weight
+ * @param[in,out] values	The weights
+ * @param[in] input			batch rows of lastCount values from the last layer
+ * @param[in] delta			batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry		batch rows of lastCount carried activation costs for the last layer
+ * @param[out] scratch		kernelSparseScratch() floats
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+ * @param[in] lastCount		The number of neurons in the last layer
+ * @param[in] update		How the gradient is applied, see OptimizerUpdate
+ * @param[in,out] first		The first moments of the values, or nullptr if the optimizer keeps none
+ * @param[in,out] second	The second moments of the values, or nullptr if the optimizer keeps none
+*/
+void kernelBackwardSparse(uint32_t const* rowOffsets, uint16_t const* columns, float* values, float const* input, float const* delta, float* carry, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update, float* first, float* second);
+
+/* @brief Same as kernelBackwardSparse(), but writes the gradient of every weight left to 'gradient' instead of applying it
+ * @param[in] rowOffsets	thisCount + 1 offsets into columns and values
+ * @param[in] columns		The last layer neuron of every weight
+ * @param[in] values		The weights
+ * @param[in] input			batch rows of lastCount values from the last layer
+ * @param[in] delta			batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry		batch rows of lastCount carried activation costs for the last layer
+ * @param[out] gradient		One gradient per weight, in the same order as values
+ * @param[out] scratch		kernelSparseScratch() floats
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+ * @param[in] lastCount		The number of neurons in the last layer
+*/
+void kernelGradientSparse(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* delta, float* carry, float* gradient,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* Inputs that are mostly exact zeros, like the blank canvas around a drawing or the outputs of a ReLU layer, leave most weight columns unused.
+ * kernelCompact() lists the columns some sample of the batch uses and packs those values of every sample together, and the compact kernels
+ * then only gather those columns from each row of the dense weights
+*/
+
+/* @brief Get the scratch space the compact kernels need, not counting the packed input
+ * @param[in] batch		The number of samples
+ * @param[in] lastCount	The number of neurons in the last layer
+ * @return				The number of floats
+*/
+size_t kernelCompactScratch(uint32_t batch, uint32_t lastCount);
+
+/* @brief Find the columns of a batch of inputs that are nonzero in any sample, and pack those values of every sample together
+ * @param[in] input		batch rows of lastCount values from the last layer
+ * @param[out] columns	The nonzero columns in order, room for lastCount
+ * @param[out] packed	batch rows of one value per nonzero column, room for batch * lastCount
+ * @param[in] batch		The number of samples
+ * @param[in] lastCount	The number of neurons in the last layer
+ * @param[in] limit		Give up once more than this many columns are nonzero
+ * @return				The number of nonzero columns, or more than limit if the input is too dense, in which case nothing is packed
+*/
+uint32_t kernelCompact(float const* input, uint32_t* columns, float* packed, uint32_t batch, uint32_t lastCount, uint32_t limit);
+
+/* @brief Same as kernelForward() with a compacted input, see kernelCompact()
+ * @param[in] weights	thisCount rows of lastCount weights
+ * @param[in] columns	The count columns of the input that are used
+ * @param[in] count		The number of columns used
+ * @param[in] packed	batch rows of count values
+ * @param[in] bias		thisCount biases
+ * @param[out] z		batch rows of thisCount outputs, before activation
+ * @param[out] scratch	kernelCompactScratch() floats
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelForwardCompact(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Same as kernelBackward() with a compacted input, see kernelCompact(). The weights of unused columns have no gradient and are left alone, which
+ * is only the same as kernelBackward() for plain SGD. Their carried costs are left at 0, which only matters if the last layer's activation has a
+ * derivative at 0, and it is not the input layer
+ * @param[in,out] weights	thisCount rows of lastCount weights
+ * @param[in] columns		The count columns of the input that are used
+ * @param[in] count			The number of columns used
+ * @param[in] packed		batch rows of count values
+ * @param[in] delta			batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry		batch rows of lastCount carried activation costs for the last layer
+ * @param[out] scratch		kernelCompactScratch() floats
+ * @param[in] batch			The number of samples
+ * @param[in] thisCount		The number of neurons in this layer
+ * @param[in] lastCount		The number of neurons in the last layer
+ * @param[in] update		How the gradient is applied, see OptimizerUpdate
+*/
+void kernelBackwardCompact(float* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update);
+
+/* @brief Same as kernelGradient() with a compacted input, see kernelCompact(). The gradients of unused columns are 0, and their carried costs are left at 0
+ * as in kernelBackwardCompact()
+ * @param[in] weights	thisCount rows of lastCount weights
+ * @param[in] columns	The count columns of the input that are used
+ * @param[in] count		The number of columns used
+ * @param[in] packed	batch rows of count values
+ * @param[in] delta		batch rows of thisCount deltas (activation derivative times error)
+ * @param[out] carry	batch rows of lastCount carried activation costs for the last layer
+ * @param[out] gradient	thisCount rows of lastCount weight gradients
+ * @param[out] scratch	kernelCompactScratch() floats
+ * @param[in] batch		The number of samples
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void kernelGradientCompact(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* gradient,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount);
+
+/* @brief Get the number of floats of scratch space the convolution kernels need for one sample, which they reuse for every sample of the batch
+ * @param[in] shape	The shape of the convolution
+ * @return			The number of floats
+*/
+size_t kernelConvolutionScratch(ConvolutionShape const& shape);
+
+/* @brief Same as kernelForward() for a convolution or a transposed convolution, see ConvolutionShape. The big image is unfolded into one column per position
+ * of the small image (im2col), so every sample is a single matrix product with the weights
+ * @param[in] shape		The shape of the convolution
+ * @param[in] weights	smallChannels rows of bigChannels * kernel * kernel weights
+ * @param[in] input		batch rows of last layer values, the big image for a convolution or the small image for a transposed convolution
+ * @param[in] bias		One bias per neuron of this layer
+ * @param[out] z		batch rows of outputs, before activation
+ * @param[out] scratch	kernelConvolutionScratch() floats
+ * @param[in] batch		The number of samples
+*/
+void kernelForwardConvolution(ConvolutionShape const& shape, float const* weights, float const* input, float const* bias, float* z, float* scratch, uint32_t batch);
+
+/* @brief Same as kernelGradient() for a convolution or a transposed convolution. The gradient of every weight is summed over every position of every sample
+ * @param[in] shape		The shape of the convolution
+ * @param[in] weights	smallChannels rows of bigChannels * kernel * kernel weights
+ * @param[in] input		batch rows of last layer values
+ * @param[in] delta		batch rows of deltas (activation derivative times error), one per neuron of this layer
+ * @param[out] carry	batch rows of carried activation costs for the last layer
+ * @param[out] gradient	One gradient per weight, in the same order as the weights
+ * @param[out] scratch	kernelConvolutionScratch() floats
+ * @param[in] batch		The number of samples
+*/
+void kernelGradientConvolution(ConvolutionShape const& shape, float const* weights, float const* input, float const* delta, float* carry, float* gradient, float* scratch,
+	uint32_t batch);
+
+/* @brief target[i] += scale * source[i]
+ * @param[in,out] target	count floats to add to
+ * @param[in] source		count floats to add
+ * @param[in] count			The number of floats
+ * @param[in] scale			The factor to multiply the source by
+*/
+void kernelAccumulate(float* target, float const* source, size_t count, float scale);
+
+/* @brief Apply the summed gradients of a batch to some parameters with an optimizer, updating its moments in the same pass. See OptimizerUpdate for the math
+ * @param[in] update		The update, see Optimizer::getUpdate()
+ * @param[in,out] params	count weights or biases
+ * @param[in] gradient		count summed gradients
+ * @param[in,out] first		count first moments for momentum and Adam, otherwise unused
+ * @param[in,out] second	count second moments for Adam, otherwise unused
+ * @param[in] count			The number of parameters
+*/
+void kernelOptimize(OptimizerUpdate const& update, float* params, float const* gradient, float* first, float* second, size_t count);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "aligned.h"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#define DATASET_EXTENSION	".skd"
+#define DATASET_FILE		"samples" DATASET_EXTENSION
+#define DATASET_MAGIC		"SKDS"
+#define DATASET_VERSION		1
+#define DATASET_ALIGNMENT	CACHE_LINE_SIZE
+
+// [DatasetHeader, padded to dataOffset]
+// [record 0 : float[sampleSize] sample, uint8_t label, padded to recordSize]
+// [record 1 ...]
+struct DatasetHeader {
+	char magic[4];			// DATASET_MAGIC
+	uint32_t version;		// DATASET_VERSION
+	uint64_t sampleCount;	// Number of records in the file
+	uint32_t sampleSize;	// Floats per sample
+	uint32_t recordSize;	// Bytes per record, a multiple of DATASET_ALIGNMENT
+	uint64_t dataOffset;	// Byte offset of the first record, a multiple of DATASET_ALIGNMENT
+};
+
+/* @brief A set of training samples stored as fixed size records in one contiguous block of memory.
+ * Packed .skd files are memory mapped and read in place. Directories of .raw samples are read in parallel into an owned arena with the same layout.
+*/
+class Dataset {
+public:
+	Dataset() = default;
+	Dataset(std::string const& path);
+	Dataset(Dataset const&) = delete;
+	Dataset& operator=(Dataset const&) = delete;
+	~Dataset();
+
+	/* @brief Open a dataset, replacing any dataset already open
+	 * @param[in] path	A packed .skd file, or a directory of .raw samples
+	 * @return			A reference to this dataset object
+	*/
+	Dataset& open(std::string const& path);
+
+	/* @brief Release the mapping or arena
+	 * @return A reference to this dataset object
+	*/
+	Dataset& close();
+
+	/* @brief True if there was an error opening the dataset, false otherwise
+	 * @return True if error, false otherwise
+	*/
+	bool getError();
+
+	/* @brief Get the number of samples in the dataset
+	 * @return The sample count
+	*/
+	uint64_t size();
+
+	/* @brief Get the number of floats in each sample
+	 * @return The sample size
+	*/
+	uint32_t getSampleSize();
+
+	/* @brief Get a pointer to a sample. Points straight into the mapping, so it is only valid while the dataset is open
+	 * @param[in] index	The sample index
+	 * @return			A pointer to getSampleSize() floats, aligned to DATASET_ALIGNMENT
+	*/
+	float const* getSample(uint64_t index);
+
+	/* @brief Get the label of a sample, which is the key that was pressed when it was saved
+	 * @param[in] index	The sample index
+	 * @return			The label byte
+	*/
+	uint8_t getLabel(uint64_t index);
+
+	/* @brief Tell the kernel a mapped pack will be read from start to end rather than all over, so it reads ahead and drops pages behind the reader
+	 * instead of keeping the whole pack resident. Does nothing for directories, which are already in memory
+	 * @return A reference to this dataset object
+	*/
+	Dataset& adviseSequential();
+
+	/* @brief Write the dataset as a packed .skd file
+	 * @param[in] path	The file to write
+	 * @return			0 on success, -1 on failure
+	*/
+	int save(std::string const& path);
+
+	/* @brief Append one sample to a packed .skd file, creating the file if it does not exist
+	 * @param[in] path			The file to append to
+	 * @param[in] sample		sampleSize floats
+	 * @param[in] sampleSize	The number of floats in the sample. Must match the samples already in the file
+	 * @param[in] label			The label byte to store with the sample
+	 * @return					0 on success, -1 on failure
+	*/
+	static int append(std::string const& path, float const* sample, uint32_t sampleSize, uint8_t label);
+
+	/* @brief Convert a directory of .raw samples into a packed .skd file
+	 * @param[in] sampleDir	The directory of .raw samples
+	 * @param[in] path		The file to write
+	 * @return				0 on success, -1 on failure
+	*/
+	static int convert(std::string const& sampleDir, std::string const& path);
+
+private:
+	/* @brief Memory map a packed .skd file
+	 * @param[in] path	The file to map
+	 * @return			A reference to this dataset object
+	*/
+	Dataset& openPack(std::string const& path);
+
+	/* @brief Read a directory of .raw samples into the arena, one file per task of a thread pool. Samples of the wrong size, or holding values that are
+	 * not finite, are skipped
+	 * @param[in] path	The directory to read
+	 * @return			A reference to this dataset object
+	*/
+	Dataset& openDirectory(std::string const& path);
+
+	/* @brief Fill in a header for some number of samples
+	 * @param[out] header		The header to fill in
+	 * @param[in] sampleSize	The number of floats in each sample
+	 * @param[in] sampleCount	The number of samples
+	*/
+	static void makeHeader(DatasetHeader& header, uint32_t sampleSize, uint64_t sampleCount);
+
+	// Memory mapped .skd file
+	void* mapping = nullptr;
+	size_t mappingSize = 0;
+
+	// Records read from a directory of .raw samples
+	AlignedVector<uint8_t> arena;
+
+	uint8_t const* records = nullptr;
+	uint64_t sampleCount = 0;
+	uint32_t sampleSize = 0;
+	uint32_t recordSize = 0;
+	bool error = false;
+};
+
+#endif
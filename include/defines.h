@@ -6,4 +6,30 @@
 
 #define SKML_VERSION	"0.2"
 
+#define LEARNING_RATE	0.003
+
+// How far a value has to move before an incremental forward pass recomputes the layer it feeds, see Network::feedForwardIncremental()
+#define INCREMENTAL_TOLERANCE	1e-4f
+
+// Largest number of samples a layer can process at once. Must match shaders/compute.glsl
+#define MAX_BATCH_SIZE	64
+
+// Workgroup layout of shaders/compute.glsl. Must match the defines at the top of the shader
+#define GPU_WORKGROUP_SIZE		64
+#define GPU_FORWARD_ROWS		8
+#define GPU_FORWARD_SAMPLES		4
+// Smallest limit on workgroups per dispatch dimension OpenGL guarantees
+#define GPU_MAX_WORKGROUPS		65535
+
+// Batches the GPU backend can have staged or in flight at once, see GPUBackend::loadBatch()
+#define GPU_STAGING_SLOTS		3
+
+// Largest layer the GPU backend can fuse into one dispatch with the layer after it, see GPUBackend::setFusion(). Must fit the shader's shared memory
+#define GPU_FUSE_NEURONS		32
+// Execution plans the GPU backend keeps before starting over, see GPUBackend::forwardPass()
+#define GPU_MAX_PLANS			16
+
+// Where the program binaries of specialized compute shader variants are cached, next to the executable. See ShaderVariants
+#define SHADER_CACHE_DIRECTORY	"shaders/cache/"
+
 #endif
@@ -0,0 +1,99 @@
+#ifndef FEEDER_H
+#define FEEDER_H
+
+#include "dataset.h"
+#include "aligned.h"
+#include "random.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Batches staged ahead of the one being trained on
+#define FEEDER_DEPTH	3
+
+/* How the feeder orders the samples
+*/
+struct ShuffleSettings {
+	uint64_t seed = 0;			// The same seed visits the samples in the same order
+	uint32_t bufferSize = 0;	// 0 to shuffle the whole set every epoch, otherwise the number of samples in the shuffle buffer, see Feeder
+};
+
+/* @brief Stages batches of training samples on a background thread, so gathering sample N+1 out of the dataset overlaps training on sample N.
+ * By default the sample indices are shuffled again at the start of every epoch. With a shuffle buffer the samples are instead read in the order of the
+ * indices, wrapping around at the end, into a buffer that every sample of a batch is drawn from at random and replaced by the next one read. Reading in
+ * order suits packs too large to stay in memory, at the cost of samples read close together also tending to be trained close together
+*/
+class Feeder {
+public:
+	/* @brief Start staging batches
+	 * @param[in] dataset		The dataset to read samples from. Must stay open for the lifetime of the feeder
+	 * @param[in] sampleIndices	The order to visit the samples in
+	 * @param[in] batchSize		The number of samples in each batch
+	 * @param[in] inputCount	The number of floats in each row of a batch. Samples are truncated or zero padded to fit
+	 * @param[in] shuffle		How to order the samples
+	*/
+	Feeder(Dataset& dataset, std::vector<uint32_t> const& sampleIndices, uint32_t batchSize, uint32_t inputCount, ShuffleSettings const& shuffle);
+	Feeder(Feeder const&) = delete;
+	Feeder& operator=(Feeder const&) = delete;
+	~Feeder();
+
+	/* @brief Wait for the next batch to be staged. Must be followed by release() once the batch has been consumed
+	 * @return batchSize rows of inputCount floats
+	*/
+	float const* acquire();
+
+	/* @brief Hand the batch from acquire() back to be refilled
+	 * @return A reference to this feeder object
+	*/
+	Feeder& release();
+
+	/* @brief Get the number of samples being fed
+	 * @return The sample count
+	*/
+	size_t size();
+
+private:
+	/* @brief Staging loop of the background thread
+	*/
+	void run();
+
+	/* @brief Gather the next batch of samples into a slot
+	 * @param[out] slot	batchSize rows of inputCount floats
+	*/
+	void stage(float* slot);
+
+	/* @brief Get the next sample in the order of the sample indices, shuffling them at the start of every epoch unless there is a shuffle buffer
+	 * @return The sample
+	*/
+	float const* nextSample();
+
+	Dataset& dataset;
+	std::vector<uint32_t> sampleIndices;
+	uint32_t batchSize;
+	uint32_t inputCount;
+
+	// Only used by the background thread
+	Random random;
+	size_t position = 0;		// In sampleIndices of the next sample
+	bool shuffled = false;		// The sample indices are shuffled every epoch
+	// Shuffle buffer of bufferCount samples, getSampleSize() floats each
+	AlignedVector<float> buffer;
+	size_t bufferCount = 0;
+
+	// FEEDER_DEPTH slots of one batch each
+	AlignedVector<float> slots;
+	size_t slotSize;
+	// Batches staged and consumed so far. The slot of batch 'n' is n % FEEDER_DEPTH
+	size_t staged = 0;
+	size_t consumed = 0;
+
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread worker;
+};
+
+#endif
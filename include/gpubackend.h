@@ -0,0 +1,175 @@
+#ifndef GPUBACKEND_H
+#define GPUBACKEND_H
+
+#include "backend.h"
+#include "defines.h"
+#include "oglopp/compute.h"
+#include "oglopp/ssbo.h"
+#include "shadervariants.h"
+#include <cstddef>
+#include <map>
+#include <vector>
+
+// Storage buffer binding points of shaders/compute.glsl
+#define GPU_PLAN_BINDINGS		12
+// Optimizer uniforms set before every backward dispatch, see GPUBackend::setUpdate()
+#define GPU_UPDATE_UNIFORMS		9
+
+/* One dispatch of an execution plan: the buffers it binds, the program that runs it, and the barrier after it
+*/
+struct PlanStep {
+	ShaderVariant variant;
+	GLuint program = 0;									// The specialized program, or 0 to run the generic shader with the variant as uniforms
+	oglopp::SSBO* bindings[GPU_PLAN_BINDINGS] = {};		// By binding point, nullptr where the step binds nothing. The moments are bound when the update starts
+	Layer* updated = nullptr;							// The layer a backward step updates, whose optimizer uniforms are set before the dispatch
+	GLint updateLocations[GPU_UPDATE_UNIFORMS] = {};	// Of the optimizer uniforms in the specialized program
+	uint32_t x = 1;
+	uint32_t y = 1;
+	GLbitfield barrier = GL_SHADER_STORAGE_BARRIER_BIT;
+};
+
+/* @brief Backend which runs the layers through shaders/compute.glsl. Requires an OpenGL context.
+ * Given shader variants, each dispatch runs the variant specialized on its pass and layer shape, falling back to the generic shader if it fails to build.
+ * Whole passes over the network are recorded once per topology as an execution plan, which later passes replay without looking anything up again
+*/
+class GPUBackend : public Backend {
+public:
+	GPUBackend(oglopp::Compute& compute, ShaderVariants* variants = nullptr);
+	GPUBackend(GPUBackend const&) = delete;
+	GPUBackend& operator=(GPUBackend const&) = delete;
+	~GPUBackend();
+
+	Type getType() const override;
+	Layer& feedForward(Layer& thisLayer, Layer& lastLayer) override;
+	Layer& backPropagate(Layer& thisLayer, Layer& lastLayer, bool isLastLayer, OptimizerStep const& step) override;
+	Layer& loadBatch(Layer& inputLayer, Layer& outputLayer, float const* batch) override;
+	void forwardPass(std::vector<Layer>& layers, size_t first, size_t last) override;
+	void backwardPass(std::vector<Layer>& layers, OptimizerStep const& step) override;
+
+	/* @brief Fuse the forward pass of every dense layer of at most GPU_FUSE_NEURONS neurons into the dispatch of the dense layer after it, like the
+	 * bottleneck of an autoencoder. Every workgroup of the fused dispatch computes the whole small layer, which costs less than a dispatch and barrier
+	 * when it is that small. Only applies to forwardPass(), and needs shader variants
+	 * @param[in] fuse	True to fuse
+	 * @return			A reference to this backend
+	*/
+	GPUBackend& setFusion(bool fuse);
+
+private:
+	oglopp::Compute& compute;
+	ShaderVariants* variants;
+	// The specialized program in use, or 0 while on the generic shader
+	GLuint program = 0;
+	bool fuse = false;
+
+	// Recorded passes by what they were recorded for, see getPlanKey()
+	std::map<std::vector<uintptr_t>, std::vector<PlanStep>> plans;
+
+	// Ring of GPU_STAGING_SLOTS batches the load pass copies from. Persistently mapped when the driver supports it, so staging a batch never waits on the GPU
+	GLuint stagingBuffer = 0;
+	float* stagingMap = nullptr;
+	size_t stagingSlotSize = 0;
+	uint32_t stagingSlot = 0;
+	// Signalled once the load pass reading each slot has finished
+	GLsync stagingFences[GPU_STAGING_SLOTS] = {};
+
+	/* @brief Bind the value and expected buffers of two layers to the 'this' and 'other' bindings of a step
+	 * @param[in] step			The step
+	 * @param[in] thisLayer		The layer bound to thisValues and thisExpected
+	 * @param[in] otherLayer	The layer bound to otherValues and otherExpected
+	*/
+	void bindLayers(PlanStep& step, Layer& thisLayer, Layer& otherLayer);
+
+	/* @brief Describe the variant of a pass over a layer
+	 * @param[in] pass		SHADER_PASS_FORWARD or SHADER_PASS_BACKWARD
+	 * @param[in] thisLayer	The layer about to be dispatched
+	 * @param[in] lastLayer	The layer before it
+	 * @return				The variant, with no optimizer set
+	*/
+	ShaderVariant getVariant(uint32_t pass, Layer& thisLayer, Layer& lastLayer) const;
+
+	/* @brief Get the specialized program of a variant
+	 * @param[in] variant	The variant
+	 * @return				The program, or 0 to run the generic shader
+	*/
+	GLuint getProgram(ShaderVariant const& variant);
+
+	/* @brief Use a specialized program, or the generic shader with a variant set as uniforms
+	 * @param[in] program	The program from getProgram(), or 0
+	 * @param[in] variant	The variant about to be dispatched
+	*/
+	void useProgram(GLuint program, ShaderVariant const& variant);
+
+	/* @brief Record the forward pass of a layer
+	 * @param[in] steps		The steps to add to
+	 * @param[in] thisLayer	The layer to calculate the values for
+	 * @param[in] lastLayer	The layer fed into it
+	*/
+	void recordForward(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& lastLayer);
+
+	/* @brief Record the forward pass of a small layer and the layer after it as one dispatch, see setFusion()
+	 * @param[in] steps			The steps to add to
+	 * @param[in] thisLayer		The layer after the small one
+	 * @param[in] smallLayer	The small layer
+	 * @param[in] lastLayer		The layer fed into the small one
+	 * @return					False if the pair can not be fused, recording nothing
+	*/
+	bool recordFused(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& smallLayer, Layer& lastLayer);
+
+	/* @brief Record the back propagation of a layer
+	 * @param[in] steps			The steps to add to
+	 * @param[in] thisLayer		The layer to adjust
+	 * @param[in] lastLayer		The layer before it, which receives the carried deltas
+	 * @param[in] isLastLayer	True if thisLayer is the output layer of the network
+	 * @param[in] optimizer		OPTIMIZER_*
+	*/
+	void recordBackward(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& lastLayer, bool isLastLayer, uint32_t optimizer);
+
+	/* @brief Run recorded steps. Buffers the step before already bound are not bound again, and the last step makes its writes visible to the host
+	 * @param[in] steps	The steps
+	 * @param[in] step	The optimizer step backward steps update their layers with, or nullptr for forward steps
+	*/
+	void replay(std::vector<PlanStep> const& steps, OptimizerStep const* step);
+
+	/* @brief Describe everything a pass over a range of layers is recorded from, so a plan is only replayed on the topology it was recorded for
+	 * @param[in] layers	The layers of the network
+	 * @param[in] first		The first layer of the pass
+	 * @param[in] last		The last layer of the pass
+	 * @param[in] pass		SHADER_PASS_FORWARD or SHADER_PASS_BACKWARD
+	 * @param[in] optimizer	OPTIMIZER_* for backward passes
+	 * @return				The key
+	*/
+	std::vector<uintptr_t> getPlanKey(std::vector<Layer>& layers, size_t first, size_t last, uint32_t pass, uint32_t optimizer) const;
+
+	/* @brief Set a uniform of the program in use. Uniforms a variant baked in as constants are ignored
+	 * @param[in] name	The uniform name
+	 * @param[in] value	The value
+	*/
+	void setInt(char const* name, int value);
+
+	/* @brief Dispatch the program in use, with a barrier so the next pass and the host see what it wrote
+	 * @param[in] x	Workgroups along x
+	 * @param[in] y	Workgroups along y
+	*/
+	void dispatch(uint32_t x, uint32_t y);
+
+	/* @brief Bind the moments of a layer and work out its optimizer update for one step, counting the update
+	 * @param[in] layer	The layer about to be updated
+	 * @param[in] step	The optimizer and learning rate to update it with
+	 * @return			The update
+	*/
+	OptimizerUpdate startUpdate(Layer& layer, OptimizerStep const& step);
+
+	/* @brief Set the optimizer uniforms of the program in use
+	 * @param[in] update	The update from startUpdate()
+	 * @param[in] step		The step it was worked out for
+	 * @param[in] locations	The locations of the uniforms in the program, or nullptr to set them by name
+	*/
+	void setUpdate(OptimizerUpdate const& update, OptimizerStep const& step, GLint const* locations);
+
+	/* @brief (Re)create the staging ring if the slots are too small for a batch
+	 * @param[in] slotSize	The number of floats in one batch
+	*/
+	void reserveStaging(size_t slotSize);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/* Conversions between fp32 and the 16 bit formats reduced precision layers keep their weights in, see Layer::setPrecision().
+ * fp16 is IEEE half precision: 5 exponent bits, 10 mantissa bits, and a largest value of 65504. bf16 is the upper half of an fp32: the same range
+ * with 7 mantissa bits. Both round to nearest, ties to even. The kernels convert whole rows with F16C or AVX-512 BF16 instead, see cpukernels.h
+*/
+
+inline float bf16ToFloat(uint16_t half) {
+	uint32_t bits = static_cast<uint32_t>(half) << 16;
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline uint16_t floatToBF16(float value) {
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	// Rounding would carry a NaN's mantissa into the exponent, so keep it quiet instead
+	if ((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+		return static_cast<uint16_t>((bits >> 16) | 0x40);
+	}
+	bits += 0x7FFFu + ((bits >> 16) & 1);
+	return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float fp16ToFloat(uint16_t half) {
+	uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+	uint32_t exponent = (half >> 10) & 0x1Fu;
+	uint32_t mantissa = half & 0x3FFu;
+
+	uint32_t bits;
+	if (exponent == 0x1F) {
+		bits = sign | 0x7F800000u | (mantissa << 13);
+	} else if (exponent == 0) {
+		// Zero and subnormals, mantissa * 2^-24
+		float value = std::ldexp(static_cast<float>(mantissa), -24);
+		return sign != 0 ? -value : value;
+	} else {
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline uint16_t floatToFP16(float value) {
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+	uint32_t magnitude = bits & 0x7FFFFFFFu;
+
+	if (magnitude > 0x7F800000u) {
+		return sign | 0x7E00;
+	}
+	// 65520 and up round to infinity
+	if (magnitude >= 0x477FF000u) {
+		return sign | 0x7C00;
+	}
+	// Below the smallest normal, 2^-14, the value is a multiple of 2^-24. Rounding up to 1024 of them lands on the smallest normal's bits
+	if (magnitude < 0x38800000u) {
+		return sign | static_cast<uint16_t>(std::nearbyint(std::ldexp(std::fabs(value), 24)));
+	}
+
+	// Round the 13 dropped mantissa bits, carrying into the exponent, then rebias it from 127 to 15
+	magnitude += 0xFFFu + ((magnitude >> 13) & 1);
+	return sign | static_cast<uint16_t>((magnitude - 0x38000000u) >> 13);
+}
+
+#endif
@@ -1,22 +1,95 @@
 #ifndef LAYER_H
 #define LAYER_H
 
-#include "neuron.h"
+#include "backend.h"
+#include "activation.h"
+#include "aligned.h"
+#include "convolution.h"
+#include "model.h"
+#include "optimizer.h"
 #include "oglopp/compute.h"
 #include <vector>
+#include <memory>
 #include <cstdlib>
 #include <fstream>
 
+// Rows of int8 weights are zero padded to a multiple of this many bytes, so the int8 kernels never handle a tail
+#define QUANT_ROW_ALIGNMENT	CACHE_LINE_SIZE
+
+/* Int8 weights of a quantized layer. Row i holds the weights of neuron i as w = scales[i] * q, zero padded to 'stride' bytes.
+ * The values feeding the layer are quantized to unsigned 8 bits with one scale and zero point for the whole layer, x = inputScale * (q - inputZero)
+*/
+struct QuantizedWeights {
+	int8_t const* weights = nullptr;	// Points into 'storage', or into a mapped model
+	AlignedVector<int8_t> storage;
+	AlignedVector<float> scales;
+	AlignedVector<int32_t> rowSums;		// Sum of every row, to take the input zero point back out of the dot products
+	uint32_t stride = 0;
+	float inputScale = 1.0;
+	uint8_t inputZero = 0;
+};
+
+// Sparse column indices are 16 bits, so only layers fed by at most this many neurons can be pruned
+#define SPARSE_MAX_COLUMNS	65536
+
+/* Weights of a pruned layer, stored row by row (CSR). The weights of neuron i are values[rowOffsets[i]] to values[rowOffsets[i+1] - 1],
+ * and columns holds the last layer neuron each of them connects to. GPU layers keep the values in the weights SSBO and the index in the sparse index SSBO
+*/
+struct SparseWeights {
+	uint32_t const* rowOffsets = nullptr;	// neuronCount + 1 offsets, in 'offsetStorage' or in a mapped model
+	uint16_t const* columns = nullptr;		// nonzeroCount last layer indices, in 'columnStorage' or in a mapped model
+	float* values = nullptr;				// nonzeroCount weights of a CPU layer, in 'valueStorage' or in a mapped model
+	uint64_t nonzeroCount = 0;
+	AlignedVector<uint32_t> offsetStorage;
+	AlignedVector<uint16_t> columnStorage;
+	AlignedVector<float> valueStorage;
+};
+
+/* Weights of a reduced precision layer, rounded to fp16 or bf16 and laid out like the fp32 weights. The fp32 weights are kept as a master copy to train,
+ * and rounded again after every update. Without them the layer can only run forward. GPU layers keep the rounded weights in the weights SSBO instead,
+ * packed two to a uint, and only while they have no master copy
+*/
+struct ReducedWeights {
+	uint16_t const* weights = nullptr;	// Points into 'storage', or into a mapped model. nullptr for GPU layers
+	AlignedVector<uint16_t> storage;
+	bool master = false;				// The fp32 weights are kept
+};
+
+/* What the last incremental forward pass of a CPU layer computed, see CPUBackend::incrementalPass(). The pre-activations hold for exactly the inputs
+ * saved with them, so the next pass only has to add in the inputs that moved since
+*/
+struct IncrementalCache {
+	AlignedVector<float> input;		// batch rows of the last layer's values
+	AlignedVector<float> z;			// batch rows of this layer's values before activation
+	uint32_t updates = 0;			// Incremental updates since z was last computed in full
+	bool valid = false;
+};
+
+/* A layer of neurons. The values and expected values are stored in separate buffers of [batch size x neuron count] floats, sample by sample.
+ * For hidden layers the expected values hold the activation costs carried back during backprop. The biases are shared by the whole batch.
+*/
 class Layer {
 public:
 	Layer() = default;
+	Layer(Layer&&) = default;
+	Layer& operator=(Layer&&) = default;
 	~Layer() = default;
 
-	/* @brief Setup the SSBO with some neurons
+	/* @brief Setup the layer storage with some neurons
 	 * @param[in] neuronCount	The number of neurons to randomly initialize and prepare in the SSBO
 	 * @param[in] weightCount	The number of weights per neuron (the number of neurons in the last layer)
+	 * @param[in] type			The backend the layer will be executed on. GPU layers live in SSBOs, CPU layers live in host memory
+	 * @param[in] batchSize		The number of samples the layer holds values for at once
+	*/
+	Layer& setup(uint32_t const neuronCount, uint32_t const weightCount, Backend::Type type, uint32_t const batchSize = 1);
+
+	/* @brief Setup the layer storage as a convolution or a transposed convolution. Every neuron keeps its own bias
+	 * @param[in] shape		The shape of the convolution, with every field filled in. See Network::shapeConvolutions()
+	 * @param[in] type		The backend the layer will be executed on. GPU layers live in SSBOs, CPU layers live in host memory
+	 * @param[in] batchSize	The number of samples the layer holds values for at once
+	 * @return				A reference to this layer object
 	*/
-	Layer& setup(uint32_t const neuronCount, uint32_t const weightCount);
+	Layer& setup(ConvolutionShape const& shape, Backend::Type type, uint32_t const batchSize = 1);
 
 	/* @brief Setup the layer using an SSBO
 	 * @param[in] neuronCopy	A constant reference to an SSBO object to copy into the neurons
@@ -24,40 +97,376 @@ public:
 	*/
 	Layer& setup(oglopp::SSBO const& neuronCopy);
 
-	/* @brief Perform the feed forward algorithm on this layer using a reference to the previous layer. Performs on the GPU with oglopp compute shaders
+	/* @brief Perform the feed forward algorithm on this layer using a reference to the previous layer
 	 * @param[in] lastLayer	A reference to the last layer to be fed into this layer
+	 * @param[in] backend	The backend to perform the computation with
 	 * @return				A reference to this layer
 	*/
-	Layer& feedForward(Layer& lastLayer, oglopp::Compute& compute);
+	Layer& feedForward(Layer& lastLayer, Backend& backend);
+
+	/* @brief Perform back propagation on this layer, carrying the deltas into the previous layer
+	 * @param[in] lastLayer		A reference to the last layer that was fed into this layer
+	 * @param[in] backend		The backend to perform the computation with
+	 * @param[in] isLastLayer	True if this is the output layer
+	 * @param[in] step			The optimizer and learning rate to adjust the weights and biases with. Defaults to plain SGD at LEARNING_RATE
+	 * @return					A reference to this layer
+	*/
+	Layer& backPropagate(Layer& lastLayer, Backend& backend, bool isLastLayer, OptimizerStep const& step = OptimizerStep());
+
+	/* @brief Get the backend type this layer's storage was created for
+	 * @return The backend type
+	*/
+	Backend::Type getType();
+
+	/* @brief Get the number of neurons in this layer
+	 * @return The neuron count
+	*/
+	uint32_t getNeuronCount();
+
+	/* @brief Get the number of samples the layer holds values for at once
+	 * @return The batch size
+	*/
+	uint32_t getBatchSize();
+
+	/* @brief Resize the neurons to hold some number of samples. Values are reset, biases and weights are kept
+	 * @param[in] batchSize	The number of samples
+	 * @return				A reference to this layer object
+	*/
+	Layer& setBatchSize(uint32_t const batchSize);
 
+	/* @brief Get the number of weights connecting the last layer to this layer
+	 * @return The weight count (neuron count * last layer neuron count, or small channels * big channels * kernel * kernel for convolutions)
+	*/
+	uint64_t getWeightCount();
+
+	/* @brief Get the number of weights actually stored. Less than getWeightCount() once pruned
+	 * @return The stored weight count
+	*/
+	uint64_t getStoredWeightCount();
+
+	/* @brief Get the number of bytes the weights take, including the scales of quantized layers, the index of pruned layers and the master copy of reduced layers
+	 * @return The weight bytes
+	*/
+	uint64_t getWeightBytes();
+
+	/* @brief Get a reference to the value SSBO. For CPU layers this is a display copy, see upload() and download()
+	 * @return A reference to the value SSBo
+	*/
+	oglopp::SSBO& getValues();
 
-	Layer& backPropagate(Layer& lastLayer, oglopp::Compute& compute, bool isLastLayer);
+	/* @brief Get a reference to the expected value SSBO. For CPU layers this is a display copy, see upload() and download()
+	 * @return A reference to the expected value SSBo
+	*/
+	oglopp::SSBO& getExpected();
 
-	/* @brief Get a reference to the neuron SSBO
-	 * @return A reference to the neuron SSBo
+	/* @brief Get a reference to the bias SSBO. Only valid for GPU layers
+	 * @return A reference to the bias SSBo
 	*/
-	oglopp::SSBO& getNeurons();
+	oglopp::SSBO& getBiases();
 
-	/* @brief Get a reference to the neuron SSBO
-	 * @return A reference to the neuron SSBo
+	/* @brief Get a reference to the weights SSBO. Only valid for GPU layers
+	 * @return A reference to the weights SSBo
 	*/
 	oglopp::SSBO& getWeights();
 
-	/* @brief Write the layer to
-	 * @param[in] stream	The stream to write the layer to
+	/* @brief Get a reference to the sparse index SSBO of a pruned GPU layer, see shaders/compute.glsl for the layout
+	 * @return A reference to the sparse index SSBO
+	*/
+	oglopp::SSBO& getSparseIndex();
+
+	/* @brief Get a host pointer to the values, independent of the backend. Must be followed by unmapValues()
+	 * @param[in] readOnly	True if the values will not be modified
+	 * @return				A pointer to getBatchSize() rows of getNeuronCount() values
+	*/
+	float* mapValues(bool readOnly = false);
+	Layer& unmapValues();
+
+	/* @brief Get a host pointer to the expected values, independent of the backend. Must be followed by unmapExpected()
+	 * @param[in] readOnly	True if the expected values will not be modified
+	 * @return				A pointer to getBatchSize() rows of getNeuronCount() expected values
+	*/
+	float* mapExpected(bool readOnly = false);
+	Layer& unmapExpected();
+
+	/* @brief Get a host pointer to the weights, independent of the backend. Must be followed by unmapWeights()
+	 * @return A pointer to getStoredWeightCount() weights, or nullptr for reduced layers without a master copy
+	*/
+	float* mapWeights();
+	Layer& unmapWeights();
+
+	/* @brief Get a host pointer to the biases, independent of the backend. Must be followed by unmapBiases()
+	 * @return A pointer to getNeuronCount() biases
+	*/
+	float* mapBiases();
+	Layer& unmapBiases();
+
+	/* @brief Get the host value storage of a CPU layer
+	 * @return A pointer to the values, or nullptr for GPU layers
+	*/
+	float* getHostValues();
+
+	/* @brief Get the host expected value storage of a CPU layer
+	 * @return A pointer to the expected values, or nullptr for GPU layers
+	*/
+	float* getHostExpected();
+
+	/* @brief Get the host bias storage of a CPU layer
+	 * @return A pointer to the biases, or nullptr for GPU layers
+	*/
+	float* getHostBiases();
+
+	/* @brief Get the host weight storage of a CPU layer. Weights loaded from a v2 model live in the model's private mapping
+	 * @return A pointer to getStoredWeightCount() weights, or nullptr for GPU layers, quantized layers and reduced layers without a master copy
+	*/
+	float* getHostWeights();
+
+	/* @brief Make room for an optimizer's moments, zeroing them the first time, or if the optimizer or the stored weights changed since the last update,
+	 * and count one more update. Call before every update
+	 * @param[in] slots	Moments per weight and bias, see Optimizer::getMomentSlots()
+	 * @return			The number of updates the moments have seen, including this one
+	*/
+	uint64_t advanceMoments(uint32_t slots);
+
+	/* @brief Get the host optimizer state of a CPU layer, see advanceMoments(). Each moment is a row of getStoredWeightCount() weight moments followed by
+	 * getNeuronCount() bias moments
+	 * @return A pointer to the moments, or nullptr if there are none
+	*/
+	float* getHostMoments();
+
+	/* @brief Get a reference to the optimizer state SSBO of a GPU layer, laid out like getHostMoments()
+	 * @return A reference to the moment SSBO
+	*/
+	oglopp::SSBO& getMoments();
+
+	/* @brief Drop the weights smaller than a threshold, then the smallest of the rest until a fraction of the weights is gone, and store the rest sparsely.
+	 * Training only updates the weights that are left, so a pruned layer can be fine tuned
+	 * @param[in] threshold	Weights with a smaller magnitude are dropped
+	 * @param[in] sparsity	The fraction of the weights to drop, between 0 and 1
+	 * @return				A reference to this layer object
+	*/
+	Layer& prune(float threshold, float sparsity);
+
+	/* @brief Check if the layer has been pruned and stores its weights sparsely
+	 * @return True if sparse
+	*/
+	bool isSparse();
+
+	/* @brief Get the sparse weights of a pruned layer
+	 * @return A reference to the sparse weights
+	*/
+	SparseWeights const& getSparse();
+
+	/* @brief Check if the layer is a convolution or a transposed convolution
+	 * @return True if convolutional
+	*/
+	bool isConvolution();
+
+	/* @brief Get the shape of a convolutional layer
+	 * @return A reference to the shape. The kernel is 0 for dense layers
+	*/
+	ConvolutionShape const& getConvolution();
+
+	/* @brief Get the activation function of the layer
+	 * @return ACTIVATION_*
+	*/
+	uint32_t getActivation();
+
+	/* @brief Set the activation function of the layer. Every setup() resets it to sigmoid
+	 * @param[in] activation	ACTIVATION_*
+	 * @return					A reference to this layer object
+	*/
+	Layer& setActivation(uint32_t activation);
+
+	/* @brief Get the kind of layer as stored in a model
+	 * @return MODEL_LAYER_DENSE, MODEL_LAYER_CONV or MODEL_LAYER_CONV_TRANSPOSED
+	*/
+	uint16_t getKind();
+
+	/* @brief Get the image this layer's values make up, for the next layer to convolve. A dense layer is taken as a single channel square image
+	 * @param[out] size		The width and height of the image
+	 * @param[out] channels	The number of channels
+	 * @return				False if the layer is dense and its neuron count is not a square
+	*/
+	bool getImageShape(uint32_t& size, uint32_t& channels);
+
+	/* @brief Replace the fp32 weights of a CPU layer with int8 weights and one scale per neuron. The layer can still run forward, but no longer train
+	 * @param[in] inputMin	The smallest value seen feeding this layer during calibration
+	 * @param[in] inputMax	The largest value seen feeding this layer during calibration
 	 * @return				A reference to this layer object
 	*/
-	Layer& writeLayer(std::fstream& stream);
+	Layer& quantize(float inputMin, float inputMax);
+
+	/* @brief Check if the layer runs on int8 weights
+	 * @return True if quantized
+	*/
+	bool isQuantized();
+
+	/* @brief Get the int8 weights of a quantized layer
+	 * @return A reference to the quantized weights
+	*/
+	QuantizedWeights const& getQuantized();
 
-	/* @brief Write the layer to
-	 * @param[in] stream	The stream to write the layer to
+	/* @brief Store the weights of a dense layer in fp16 or bf16, which halves the memory the forward pass reads, or back in fp32.
+	 * Rounding from the current weights, or widening them back if there is no fp32 copy left
+	 * @param[in] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+	 * @param[in] master	True to keep the fp32 weights as a master copy to train, false to drop them. GPU layers with a master copy run in fp32
 	 * @return				A reference to this layer object
 	*/
-	Layer& readLayer(std::fstream& stream);
+	Layer& setPrecision(uint32_t format, bool master);
+
+	/* @brief Get the format the weights are stored in
+	 * @return MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16. Quantized and pruned layers are MODEL_FORMAT_FP32
+	*/
+	uint32_t getPrecision();
+
+	/* @brief Check if the weights are stored in fp16 or bf16
+	 * @return True if reduced
+	*/
+	bool isReduced();
+
+	/* @brief Check if the layer has fp32 weights to train. False only for reduced layers that dropped them
+	 * @return True if there are fp32 weights
+	*/
+	bool hasMasterWeights();
+
+	/* @brief Get the rounded weights of a reduced CPU layer
+	 * @return A reference to the reduced weights
+	*/
+	ReducedWeights const& getReduced();
+
+	/* @brief Round the master weights of a reduced CPU layer into its reduced weights again. Call after the master weights change
+	 * @return A reference to this layer object
+	*/
+	Layer& roundWeights();
+
+	/* @brief Get a host pointer to the rounded weights of a reduced layer, independent of the backend. Must be followed by unmapReduced()
+	 * @return A pointer to getWeightCount() 16 bit weights
+	*/
+	uint16_t const* mapReduced();
+	Layer& unmapReduced();
+
+	/* @brief Get the cache of the last incremental forward pass of a CPU layer, see CPUBackend::incrementalPass()
+	 * @return A reference to the cache
+	*/
+	IncrementalCache& getIncremental();
+
+	/* @brief Drop the cache of the incremental forward pass, so the next one computes the layer in full. Needed whenever the values or weights change some other way
+	 * @return A reference to this layer object
+	*/
+	Layer& invalidateIncremental();
+
+	/* @brief Copy the host values and expected values of a CPU layer into the display SSBOs. Does nothing for GPU layers
+	 * @return A reference to this layer object
+	*/
+	Layer& upload();
+
+	/* @brief Copy the display SSBOs of a CPU layer back into host memory, picking up anything the shaders wrote. Does nothing for GPU layers
+	 * @return A reference to this layer object
+	*/
+	Layer& download();
+
+	/* @brief Read the layer from a v1 model stream
+	 * @param[in] stream	The stream to read the layer from
+	 * @param[in] type		The backend to create the layer storage for
+	 * @return				A reference to this layer object
+	*/
+	Layer& readLayer(std::fstream& stream, Backend::Type type);
+
+	/* @brief Read the layer from a mapped v2 model. CPU layers use the mapped weights in place, GPU layers upload them straight from the mapping.
+	 * Int8 layers stay quantized on the CPU, and are expanded back to fp32 for the GPU. fp16 and bf16 layers stay reduced, without a master copy
+	 * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+	 * @param[in] index	The index of this layer in the model
+	 * @param[in] type	The backend to create the layer storage for
+	 * @return			A reference to this layer object
+	*/
+	Layer& readLayer(std::shared_ptr<ModelFile> const& model, uint32_t index, Backend::Type type);
 
 private:
-	oglopp::SSBO neurons;
-	oglopp::SSBO weights;
+	Backend::Type type = Backend::GPU;
+	uint32_t neuronCount = 0;
+	uint32_t batchSize = 1;
+	uint64_t weightCount = 0;
+
+	// GPU storage. Created on demand, so CPU layers never touch OpenGL unless they are drawn
+	std::unique_ptr<oglopp::SSBO> values;
+	std::unique_ptr<oglopp::SSBO> expected;
+	std::unique_ptr<oglopp::SSBO> biases;
+	std::unique_ptr<oglopp::SSBO> weights;
+	std::unique_ptr<oglopp::SSBO> sparseIndex;
+	std::unique_ptr<oglopp::SSBO> moments;
+
+	// CPU storage
+	AlignedVector<float> hostValues;
+	AlignedVector<float> hostExpected;
+	AlignedVector<float> hostBiases;
+	AlignedVector<float> hostWeights;
+
+	// Weights used in place from a mapped model, replacing hostWeights
+	std::shared_ptr<ModelFile> model;
+	float* modelWeights = nullptr;
+
+	// Replaces both of the above once quantized
+	QuantizedWeights quantized;
+	// Replaces the dense weights once pruned
+	SparseWeights sparse;
+	// Rounded copy of the dense weights, see setPrecision()
+	ReducedWeights reduced;
+	uint32_t precision = MODEL_FORMAT_FP32;
+	// Kernel is 0 for dense layers
+	ConvolutionShape convolution;
+	uint32_t activation = ACTIVATION_SIGMOID;
+	IncrementalCache incremental;
+
+	// Optimizer state, see advanceMoments(). Dropped whenever the weights are replaced
+	AlignedVector<float> hostMoments;
+	uint32_t momentSlots = 0;
+	uint64_t momentRow = 0;
+	uint64_t momentUpdates = 0;
+
+	/* @brief Store random biases and weights, see store()
+	*/
+	void randomize();
+
+	/* @brief Drop the optimizer state, so the next update starts from zeroed moments
+	*/
+	void resetMoments();
+
+	/* @brief Store zeroed values and expected values for every sample in the batch, along with the biases and weights, in the storage for this layer's backend
+	 * @param[in] pBiases	neuronCount biases, may be nullptr to keep the current biases
+	 * @param[in] pWeights	weightCount weights, may be nullptr if there are no weights or to keep the current weights. Replaces any mapped, quantized or sparse weights
+	*/
+	void store(float const* pBiases, float const* pWeights);
+
+	/* @brief Read an int8 layer from a mapped v2 model. CPU layers use the mapped int8 weights in place, GPU layers have no int8 path and get them expanded to fp32
+	 * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+	 * @param[in] index	The index of this layer in the model
+	 * @return			A reference to this layer object
+	*/
+	Layer& readQuantized(std::shared_ptr<ModelFile> const& model, uint32_t index);
+
+	/* @brief Read a sparse layer from a mapped v2 model. CPU layers use the mapped index and weights in place
+	 * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+	 * @param[in] index	The index of this layer in the model
+	 * @return			A reference to this layer object
+	*/
+	Layer& readSparse(std::shared_ptr<ModelFile> const& model, uint32_t index);
+
+	/* @brief Read an fp16 or bf16 layer from a mapped v2 model. CPU layers use the mapped weights in place, GPU layers upload them packed
+	 * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+	 * @param[in] index	The index of this layer in the model
+	 * @return			A reference to this layer object
+	*/
+	Layer& readReduced(std::shared_ptr<ModelFile> const& model, uint32_t index);
+
+	/* @brief Copy the dense weights out in fp32, widening the rounded weights if there is no master copy
+	 * @return getWeightCount() weights
+	*/
+	std::vector<float> copyWeights();
+
+	/* @brief Make 'sparse' the weights of this layer. CPU layers drop their dense weights, GPU layers upload the values and the sparse index
+	 * @param[in] result	The sparse weights. For GPU layers 'values' points at the values to upload
+	*/
+	void storeSparse(SparseWeights&& result);
 };
 
 #endif
@@ -0,0 +1,289 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "aligned.h"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define MODEL_MAGIC			"SKML"
+#define MODEL_FORMAT_VERSION	2
+#define MODEL_ENDIAN_MARKER	0x01020304u
+#define MODEL_ALIGNMENT		CACHE_LINE_SIZE
+
+// Layer kinds
+#define MODEL_LAYER_DENSE				0
+#define MODEL_LAYER_CONV				1	// See ModelConvHeader
+#define MODEL_LAYER_CONV_TRANSPOSED		2	// See ModelConvHeader
+
+// Weight storage formats
+#define MODEL_FORMAT_FP32	0
+#define MODEL_FORMAT_INT8	1	// See ModelQuantHeader
+#define MODEL_FORMAT_CSR	2	// See ModelSparseHeader
+#define MODEL_FORMAT_FP16	3	// Dense weights rounded to IEEE half precision, two bytes each
+#define MODEL_FORMAT_BF16	4	// Dense weights rounded to bfloat16, two bytes each
+
+class Layer;
+
+/* The first 64 bytes of a v2 .skm file
+*/
+struct ModelHeader {
+	char magic[4];			// MODEL_MAGIC
+	uint32_t version;		// MODEL_FORMAT_VERSION
+	uint32_t endianMarker;	// MODEL_ENDIAN_MARKER as written by the saving machine
+	uint32_t layerCount;	// Number of layers, including the input layer
+	uint64_t tocOffset;		// Byte offset of the table of contents
+	uint64_t fileSize;		// Total file size, to catch truncated files
+	uint32_t tocChecksum;	// CRC-32C of the table of contents
+	uint32_t trainingChecksum;	// CRC-32C of the training state
+	uint64_t trainingOffset;	// Byte offset of the ModelTrainingState, 0 if the model was saved without one
+	uint8_t reserved[16];
+};
+
+/* How the model was being trained, so training resumes where it left off. See OptimizerSettings for the meaning of the fields
+*/
+struct ModelTrainingState {
+	uint64_t step;			// Batches trained so far
+	uint32_t optimizer;		// OPTIMIZER_*
+	uint32_t schedule;		// SCHEDULE_*
+	float learningRate;
+	float momentum;
+	float beta2;
+	float epsilon;
+	float weightDecay;
+	uint32_t warmupSteps;
+	uint32_t decaySteps;
+	float decayFactor;
+	uint8_t reserved[16];
+};
+
+/* One table of contents entry per layer. Blob offsets are multiples of MODEL_ALIGNMENT
+*/
+struct ModelLayerEntry {
+	uint32_t neuronCount;	// Neurons in the layer
+	uint32_t inputCount;	// Neurons in the layer feeding this one, 0 for the input layer
+	uint16_t kind;			// MODEL_LAYER_*
+	uint16_t format;		// MODEL_FORMAT_*
+	uint32_t weightChecksum;// CRC-32C of the weight blob
+	uint64_t weightCount;	// Number of weights
+	uint64_t weightOffset;	// Byte offset of the weight blob
+	uint64_t weightBytes;	// Size of the weight blob
+	uint64_t biasOffset;	// Byte offset of the bias blob
+	uint64_t biasBytes;		// Size of the bias blob
+	uint32_t biasChecksum;	// CRC-32C of the bias blob
+	uint8_t activation;		// ACTIVATION_*, 0 (sigmoid) in models saved before it was stored
+	uint8_t reserved[3];
+};
+
+/* Start of the weight blob of an int8 layer. It is followed by neuronCount float scales padded to MODEL_ALIGNMENT,
+ * then neuronCount rows of stride int8 weights, laid out exactly as QuantizedWeights so CPU layers can use them in place
+*/
+struct ModelQuantHeader {
+	float inputScale;		// Scale of the quantized values feeding the layer
+	uint32_t inputZero;		// Zero point of the quantized values feeding the layer
+	uint32_t stride;		// Bytes per row of weights, a multiple of MODEL_ALIGNMENT
+	uint8_t reserved[52];
+};
+
+/* Start of the weight blob of a pruned layer. It is followed by neuronCount + 1 uint32 row offsets, then nonzeroCount uint16 column indices
+ * and nonzeroCount float weights, each padded to MODEL_ALIGNMENT and laid out exactly as SparseWeights so CPU layers can use them in place
+*/
+struct ModelSparseHeader {
+	uint64_t nonzeroCount;	// Weights left after pruning
+	uint8_t reserved[56];
+};
+
+/* Start of the weight blob of a convolutional layer, followed by its fp32 weights. See ConvolutionShape for the meaning of the fields
+*/
+struct ModelConvHeader {
+	uint32_t kernel;
+	uint32_t stride;
+	uint32_t padding;
+	uint32_t smallSize;
+	uint32_t smallChannels;
+	uint32_t bigSize;
+	uint32_t bigChannels;
+	uint8_t reserved[36];
+};
+
+static_assert(sizeof(ModelHeader) == 64, "ModelHeader must be 64 bytes");
+static_assert(sizeof(ModelTrainingState) == 64, "ModelTrainingState must be 64 bytes");
+static_assert(sizeof(ModelLayerEntry) == 64, "ModelLayerEntry must be 64 bytes");
+static_assert(sizeof(ModelQuantHeader) == 64, "ModelQuantHeader must be 64 bytes");
+static_assert(sizeof(ModelSparseHeader) == 64, "ModelSparseHeader must be 64 bytes");
+static_assert(sizeof(ModelConvHeader) == 64, "ModelConvHeader must be 64 bytes");
+
+/* @brief A copy of layers laid out exactly as ModelFile::write() saves them. Capturing only copies the weights out of the layers, so the copy can be
+ * checksummed and written on another thread while the layers keep training. See Checkpointer
+*/
+class ModelSnapshot {
+public:
+	/* @brief Copy layers into the snapshot, laid out as they are saved, replacing anything it held. Its memory is kept for the next capture
+	 * @param[in] layers	The layers to copy, starting with the input layer
+	 * @param[in] training	The training state to save with the layers, or nullptr for none
+	 * @return				A reference to this snapshot object
+	*/
+	ModelSnapshot& capture(std::vector<Layer>& layers, ModelTrainingState const* training = nullptr);
+
+	/* @brief Checksum the snapshot and write it to a v2 model file. The file is written and flushed to disk beside the target, then renamed over it, so a
+	 * crash part way through leaves the last file whole, and a model that is currently mapped can be saved over safely.
+	 * Only touches the snapshot, so it may run on another thread than the capture, as long as the two never overlap
+	 * @param[in] path	The file to write
+	 * @return			0 on success, -1 on failure
+	*/
+	int write(std::string const& path);
+
+	/* @brief Get the size of the file the snapshot writes
+	 * @return The size in bytes, 0 before the first capture
+	*/
+	uint64_t getSize() const;
+
+private:
+	ModelHeader header;
+	ModelTrainingState training;
+	std::vector<ModelLayerEntry> toc;
+	// The whole file, with the header and table of contents left for write() to fill in once the checksums are known
+	AlignedVector<uint8_t> image;
+};
+
+/* @brief A memory mapped v2 .skm model. The mapping is private and writable, so layers can train on their weights in place
+ * without the changes ever reaching the file. Layers keep a shared pointer to the file for as long as they use its weights.
+*/
+class ModelFile {
+public:
+	ModelFile() = default;
+	ModelFile(std::string const& path);
+	ModelFile(ModelFile const&) = delete;
+	ModelFile& operator=(ModelFile const&) = delete;
+	~ModelFile();
+
+	/* @brief Map a model file and validate its header and table of contents, replacing any file already open
+	 * @param[in] path	The file to map
+	 * @return			A reference to this model file object
+	*/
+	ModelFile& open(std::string const& path);
+
+	/* @brief Release the mapping
+	 * @return A reference to this model file object
+	*/
+	ModelFile& close();
+
+	/* @brief True if there was an error opening the model, false otherwise
+	 * @return True if error, false otherwise
+	*/
+	bool getError();
+
+	/* @brief Get the number of layers, including the input layer
+	 * @return The layer count
+	*/
+	uint32_t getLayerCount();
+
+	/* @brief Get the training state saved with the model, straight from the mapping
+	 * @return A pointer to the state, or nullptr if the model was saved without one
+	*/
+	ModelTrainingState const* getTraining();
+
+	/* @brief Get the table of contents entry of a layer
+	 * @param[in] index	The layer index
+	 * @return			A reference to the entry
+	*/
+	ModelLayerEntry const& getLayer(uint32_t index);
+
+	/* @brief Get a pointer to the weights of an fp32 layer, straight from the mapping. The weights of a convolutional layer start after its header
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).weightCount weights aligned to MODEL_ALIGNMENT, or nullptr if there are none
+	*/
+	float* getWeights(uint32_t index);
+
+	/* @brief Get the shape of a convolutional layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to the header, or nullptr if the layer is dense
+	*/
+	ModelConvHeader const* getConvHeader(uint32_t index);
+
+	/* @brief Get the quantization header of an int8 layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to the header, or nullptr if the layer is not int8
+	*/
+	ModelQuantHeader const* getQuantHeader(uint32_t index);
+
+	/* @brief Get the per neuron weight scales of an int8 layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).neuronCount scales, or nullptr if the layer is not int8
+	*/
+	float const* getQuantScales(uint32_t index);
+
+	/* @brief Get the int8 weights of a layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).neuronCount rows of getQuantHeader(index)->stride weights, or nullptr if the layer is not int8
+	*/
+	int8_t const* getQuantWeights(uint32_t index);
+
+	/* @brief Get the sparse header of a pruned layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to the header, or nullptr if the layer is not sparse
+	*/
+	ModelSparseHeader const* getSparseHeader(uint32_t index);
+
+	/* @brief Get the row offsets of a pruned layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).neuronCount + 1 offsets, or nullptr if the layer is not sparse
+	*/
+	uint32_t const* getSparseOffsets(uint32_t index);
+
+	/* @brief Get the column indices of a pruned layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getSparseHeader(index)->nonzeroCount indices, or nullptr if the layer is not sparse
+	*/
+	uint16_t const* getSparseColumns(uint32_t index);
+
+	/* @brief Get the weights of a pruned layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getSparseHeader(index)->nonzeroCount weights, or nullptr if the layer is not sparse
+	*/
+	float* getSparseValues(uint32_t index);
+
+	/* @brief Get the weights of an fp16 or bf16 layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).weightCount 16 bit weights, or nullptr if the layer is not stored in reduced precision
+	*/
+	uint16_t const* getReducedWeights(uint32_t index);
+
+	/* @brief Get a pointer to the biases of a layer, straight from the mapping
+	 * @param[in] index	The layer index
+	 * @return			A pointer to getLayer(index).neuronCount biases, or nullptr if there are none
+	*/
+	float* getBiases(uint32_t index);
+
+	/* @brief Check the weight and bias checksums of a layer. Must be called before the layer's weights are modified
+	 * @param[in] index	The layer index
+	 * @return			True if both blobs match their checksums
+	*/
+	bool verify(uint32_t index);
+
+	/* @brief Check if a file starts with the v2 magic
+	 * @param[in] path	The file to check
+	 * @return			True if the file is a v2 model
+	*/
+	static bool isModelFile(std::string const& path);
+
+	/* @brief Write layers to a v2 model file. The file is written beside the target and renamed over it, so a model that is
+	 * currently mapped can be saved over safely
+	 * @param[in] path		The file to write
+	 * @param[in] layers	The layers to write, starting with the input layer
+	 * @param[in] training	The training state to save with the layers, or nullptr for none
+	 * @return				0 on success, -1 on failure
+	*/
+	static int write(std::string const& path, std::vector<Layer>& layers, ModelTrainingState const* training = nullptr);
+
+private:
+	uint8_t* mapping = nullptr;
+	size_t mappingSize = 0;
+
+	ModelHeader const* header = nullptr;
+	ModelLayerEntry const* toc = nullptr;
+	bool error = false;
+};
+
+#endif
@@ -3,7 +3,10 @@
 
 #include "defines.h"
 #include "network.h"
+#include "dataset.h"
+#include "feeder.h"
 
+#include <chrono>
 #include <cstddef>
 #include <iostream>
 #include <filesystem>
@@ -13,12 +16,119 @@
 #include <fstream>
 #include <vector>
 
-#define SAMPLES_DIR	"samples/"
+// How often headless training prints its progress
+#define HEADLESS_REPORT_SECONDS	2.0
 
 size_t charToIndex(char key);
-int saveTrainingElement(oglopp::SSBO& buffer, uint8_t key, std::string const& parentDir);
-void loadTrainingFiles(std::vector<std::vector<float>>& files, std::vector<uint32_t>& fileIndices, std::string const& parentDir);
+
+/* @brief Save the first sample of a layer as a training sample
+ * @param[in] layer			The layer to save, usually the input layer
+ * @param[in] key			The key that was pressed, stored as the sample's label
+ * @param[in] samplePath	A .skd pack to append to, or a directory to write a .raw file into
+ * @return					0 on success, -1 on failure
+*/
+int saveTrainingElement(Layer& layer, uint8_t key, std::string const& samplePath);
+
+/* @brief Open the training samples. The feeder shuffles the order they are trained in, see Feeder
+ * @param[out] dataset			The dataset to open
+ * @param[out] sampleIndices	Every sample index, in the order they are stored
+ * @param[in] samplePath		A .skd pack, or a directory of .raw samples
+*/
+void loadTrainingSet(Dataset& dataset, std::vector<uint32_t>& sampleIndices, std::string const& samplePath);
 void setExpectedOutput(Network& network);
-void doSomeSamples(oglopp::Compute& compute, Network& network, std::string const& parentDir, std::vector<std::vector<float>>& files, std::vector<uint32_t>& fileIndices, size_t& offset, size_t countToDo);
+
+/* @brief Train the network on the next batches staged by a feeder
+ * @param[in] network	The network to train
+ * @param[in] feeder	The feeder staging batches of the network's batch size
+ * @param[in] countToDo	The number of samples to train on, rounded up to whole batches
+*/
+void doSomeSamples(Network& network, Feeder& feeder, size_t countToDo);
+
+/* @brief Train the network as fast as possible without rendering anything, printing the throughput and loss periodically, then save the model
+ * @param[in] network		The network to train
+ * @param[in] samplePath	A .skd pack, or a directory of .raw samples
+ * @param[in] shuffle		How to order the samples
+ * @param[in] iterations	The number of batches to train on
+ * @param[in] modelDir		The directory to save the model into
+ * @return					0 on success, non-zero if the samples could not be loaded
+*/
+int trainHeadless(Network& network, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations, std::string const& modelDir);
+
+/* @brief Quantize a CPU network to int8 weights, calibrating on some samples, print how far the outputs moved from the fp32 network, then save it
+ * @param[in] network				The network to quantize
+ * @param[in] samplePath			A .skd pack, or a directory of .raw samples
+ * @param[in] calibrationSamples	The number of samples to calibrate with
+ * @param[in] modelPath				The file to save the quantized model to
+ * @return							0 on success, non-zero on failure
+*/
+int quantizeModel(Network& network, std::string const& samplePath, size_t calibrationSamples, std::string const& modelPath);
+
+/* @brief Prune a network by weight magnitude, print how many weights each layer kept, optionally fine tune it, then save it
+ * @param[in] network		The network to prune
+ * @param[in] threshold		Weights with a smaller magnitude are dropped
+ * @param[in] sparsity		The fraction of the weights of each layer to drop, between 0 and 1
+ * @param[in] samplePath	A .skd pack, or a directory of .raw samples, to fine tune on
+ * @param[in] shuffle		How to order the samples
+ * @param[in] iterations	The number of batches to fine tune for, 0 to skip fine tuning
+ * @param[in] modelPath		The file to save the pruned model to
+ * @return					0 on success, non-zero on failure
+*/
+int pruneModel(Network& network, float threshold, float sparsity, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations,
+	std::string const& modelPath);
+
+/* @brief Store a network's dense layers in fp16 or bf16, or back in fp32, print how much the weights take, optionally fine tune it on fp32 master
+ * weights, then save it
+ * @param[in] network		The network to convert
+ * @param[in] format		MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @param[in] samplePath	A .skd pack, or a directory of .raw samples, to fine tune on
+ * @param[in] shuffle		How to order the samples
+ * @param[in] iterations	The number of batches to fine tune for, 0 to skip fine tuning
+ * @param[in] modelPath		The file to save the converted model to
+ * @return					0 on success, non-zero on failure
+*/
+int reduceModel(Network& network, uint32_t format, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations, std::string const& modelPath);
+
+/* @brief Get the name of a weight format, as parsePrecision() accepts it
+ * @param[in] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @return				The name
+*/
+char const* getPrecisionName(uint32_t format);
+
+/* @brief Parse a precision option, one of "fp32", "fp16" or "bf16"
+ * @param[in] option	The option argument
+ * @param[out] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @return				False if the option is not a precision, printing why
+*/
+bool parsePrecision(char const* option, uint32_t& format);
+
+/* @brief Parse a convolution option of the form "kernel" or "kernel,stride". The stride defaults to 1
+ * @param[in] option		The option argument
+ * @param[in] transposed	True for a transposed convolution
+ * @param[out] shape		The shape, with only 'transposed', 'kernel' and 'stride' set. See Network::shapeConvolutions()
+ * @return					False if the option is malformed, printing why
+*/
+bool parseConvolution(char const* option, bool transposed, ConvolutionShape& shape);
+
+/* @brief Parse an activation option, one of "sigmoid", "relu", "tanh" or "linear"
+ * @param[in] option		The option argument
+ * @param[out] activation	ACTIVATION_*
+ * @return					False if the option is not an activation, printing why
+*/
+bool parseActivation(char const* option, uint32_t& activation);
+
+/* @brief Parse an optimizer option of the form "sgd", "momentum[,momentum]", "adam[,beta1[,beta2]]" or "adamw[,beta1[,beta2]]"
+ * @param[in] option		The option argument
+ * @param[in,out] settings	The settings to set the optimizer, momentum and betas of
+ * @return					False if the option is malformed, printing why
+*/
+bool parseOptimizer(char const* option, OptimizerSettings& settings);
+
+/* @brief Parse a learning rate schedule option of the form "constant", "cosine,steps[,floor]" or "step,steps[,factor]". The cosine floor defaults to 0
+ * and the step factor to 0.1
+ * @param[in] option		The option argument
+ * @param[in,out] settings	The settings to set the schedule, decay steps and decay factor of
+ * @return					False if the option is malformed, printing why
+*/
+bool parseSchedule(char const* option, OptimizerSettings& settings);
 
 #endif
@@ -2,30 +2,52 @@
 #define NETWORK_H
 
 #include "layer.h"
+#include "backend.h"
+#include "checkpointer.h"
+#include "optimizer.h"
 #include "oglopp/compute.h"
 #include "oglopp/more_shapes.h"
 #include "oglopp/shader.h"
 #include "oglopp/shape.h"
 #include "oglopp/window.h"
 #include <vector>
+#include <memory>
 #include <oglopp.h>
 #include <cstddef>
 #include "defines.h"
 
 class Network {
 public:
-	Network(size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize);
-	Network(std::string const& filename);
+	Network(Backend& backend, size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize, std::vector<ConvolutionShape> convolutions = {},
+		std::vector<uint32_t> activations = {});
+	Network(Backend& backend, std::string const& filename);
 	Network() = default;
 	~Network();
 
 	/* @brief Setup the network based on a list of layers and sizes
+	 * @param[in] backend		The backend which stores and executes every layer of the network
 	 * @param[in] inputSize		The input layer size
 	 * @param[in] layerSizes	The number of neurons in each hidden layer
 	 * @param[in] outputSize	The ouput layer size
+	 * @param[in] convolutions	Empty for a dense network, or one shape per layer after the input, see shapeConvolutions(). Layers with a kernel of 0 are dense
+	 * @param[in] activations	Empty for sigmoid everywhere, or one ACTIVATION_* per layer after the input
  	 */
-	Network& setup(size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize);
-	Network& setup(std::string const& filename);
+	Network& setup(Backend& backend, size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize, std::vector<ConvolutionShape> convolutions = {},
+		std::vector<uint32_t> activations = {});
+	Network& setup(Backend& backend, std::string const& filename);
+
+	/* @brief Work out the padding, image sizes and channels of convolutional layers from their kernel, stride and neuron count. A convolution shrinks the image
+	 * feeding it by its stride, a transposed convolution grows it by its stride, and both take as many channels as their neuron count allows.
+	 * A dense layer feeding a convolution is taken as a single channel square image
+	 * @param[in] sizes				The neuron count of every layer, input layer first
+	 * @param[in,out] convolutions	One shape per layer after the input, with 'transposed', 'kernel' and 'stride' set. Layers with a kernel of 0 are left dense
+	 * @return						False if some layer's neuron count does not fit its image, printing why
+	*/
+	static bool shapeConvolutions(std::vector<size_t> const& sizes, std::vector<ConvolutionShape>& convolutions);
+
+	/* @brief Create the rectangles the layers are drawn on. Only needed when the network is drawn, and requires an OpenGL context
+	 * @return A reference to this network object
+	*/
 	Network& setupUI();
 
 	/* @brief True if there was an error with the network, false otherwise
@@ -44,17 +66,87 @@ public:
 	*/
 	size_t size();
 
+	/* @brief Get the backend the network was constructed with
+	 * @return A reference to the backend
+	*/
+	Backend& getBackend();
+
+	/* @brief Set the number of samples every layer processes at once. Resets the neuron values, keeps the weights and biases
+	 * @param[in] batchSize	The number of samples, between 1 and MAX_BATCH_SIZE
+	 * @return				A reference to this network object
+	*/
+	Network& setBatchSize(uint32_t batchSize);
+
+	/* @brief Get the number of samples every layer processes at once
+	 * @return The batch size
+	*/
+	uint32_t getBatchSize();
+
 	/* @brief Perform a feed forward computation on the network. Performs layer 1, then 2, then 3, etc...
-	 * @param[in] compute	A reference to a compute shader to use
 	 * @return	A reference to the output layer storing the calculated result
 	*/
-	Layer& feedForward(oglopp::Compute& compute);
+	Layer& feedForward();
 
-	/* @brief Perform back propagation on the network
-	 * @param[in] compute	A reference to a compute shader to use
-	 * @return	A reference to the output layer storing the calculated result
+	/* @brief Perform a feed forward computation on a range of layers, starting from the values already in the layer before the first
+	 * @param[in] first	The first layer to compute, at least 1
+	 * @param[in] last	The last layer to compute
+	 * @return			A reference to the last layer computed
+	*/
+	Layer& feedForward(size_t first, size_t last);
+
+	/* @brief Feed the input forward again, recomputing only as much of the network as the inputs that changed since the last call reach. Meant for
+	 * redrawing a drawing as it is painted, see Backend::incrementalPass()
+	 * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+	 * @return				A reference to the output layer storing the calculated result
+	*/
+	Layer& feedForwardIncremental(float tolerance = INCREMENTAL_TOLERANCE);
+
+	/* @brief Get the index of the smallest hidden layer, which holds the encoding of an autoencoder
+	 * @return The layer index, or the output layer index if there are no hidden layers
+	*/
+	size_t getBottleneck();
+
+	/* @brief Perform back propagation on the network with the next step of the optimizer. Does nothing if any layer is quantized.
+	 * Reduced precision layers without fp32 weights get them back first, widened from the reduced weights. Checkpoints the network after the step if
+	 * one is due, see setCheckpointInterval()
+	 * @return	A reference to this network object
+	*/
+	Network& backProp();
+
+	/* @brief Get the optimizer backProp() trains with. Its settings and step count are saved with the model, and restored when a model is loaded
+	 * @return A reference to the optimizer
+	*/
+	Optimizer& getOptimizer();
+
+	/* @brief Check if any layer runs on int8 weights, which makes the network inference only
+	 * @return True if quantized
+	*/
+	bool isQuantized();
+
+	/* @brief Prune every layer, see Layer::prune(). Each layer drops the same fraction of its own weights
+	 * @param[in] threshold	Weights with a smaller magnitude are dropped
+	 * @param[in] sparsity	The fraction of the weights of each layer to drop, between 0 and 1
+	 * @return				A reference to this network object
 	*/
-	Network& backProp(oglopp::Compute& compute);
+	Network& prune(float threshold, float sparsity);
+
+	/* @brief Store the weights of every dense layer in fp16, bf16 or fp32, see Layer::setPrecision(). Convolutions, pruned and quantized layers stay as they are
+	 * @param[in] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+	 * @param[in] master	True to keep fp32 master weights to train, false for inference only
+	 * @return				A reference to this network object
+	*/
+	Network& setPrecision(uint32_t format, bool master);
+
+	/* @brief Load a batch of samples into the input layer, and into the expected values of the output layer
+	 * @param[in] batch	getBatchSize() rows of input layer neuron count floats
+	 * @return			A reference to this network object
+	*/
+	Network& loadBatch(float const* batch);
+
+	/* @brief Get the mean squared error between the output layer's values and expected values, over every sample in the batch
+	 * @return The loss of the last feed forward
+	*/
+	float getLoss();
 
 	/* @brief Bind the network to a shader
 	 * @param[in] shader	The shader object to bind the layers' ssbo objects for display
@@ -66,23 +158,69 @@ public:
 	*/
 	std::vector<Layer>& getLayers();
 
-	/* @brief Save the network layers to a model file. The model file is tagged using information about the model layers, as well as a timestamp
+	/* @brief Save the network layers and the optimizer state to a v2 model file. The model file is tagged using information about the model layers, as well as a timestamp
 	 * @param[in] directory	The directory to save the file into
 	 * @return A reference to this network object
 	*/
 	Network& save(std::string const& directory);
 
-	/* @brief Load network layers from a model file. The file can have any name.
+	/* @brief Save the network like save(), but only copy it here and write it on a background thread, see Checkpointer. A checkpoint still waiting to be
+	 * written is replaced. save() and destroying the network wait for the checkpoints to be written
+	 * @param[in] directory	The directory to save the file into
+	 * @return				A reference to this network object
+	*/
+	Network& checkpoint(std::string const& directory);
+
+	/* @brief Checkpoint the network every so many optimizer steps of backProp(), see checkpoint()
+	 * @param[in] steps		The number of steps between checkpoints, 0 to never checkpoint
+	 * @param[in] directory	The directory to save the checkpoints into
+	 * @return				A reference to this network object
+	*/
+	Network& setCheckpointInterval(uint64_t steps, std::string const& directory);
+
+	/* @brief Set the name save() gives the model file
+	 * @param[in] filename	The file name, relative to the directory given to save()
+	 * @return				A reference to this network object
+	*/
+	Network& setFilename(std::string const& filename);
+
+	/* @brief Load network layers from a model file. The file can have any name. v2 files are memory mapped, v1 files are read through a stream.
+	 * The optimizer picks up the settings and step count saved with a v2 model, and starts over otherwise
 	 * @param[in] networkFile	The network file to load
 	 * @return					A reference to this network object
 	*/
 	Network& load(std::string const& networkFile);
 
 private:
+	/* @brief Load network layers from a mapped v2 model file, checking every layer's checksums first
+	 * @param[in] networkFile	The network file to load
+	 * @return					A reference to this network object
+	*/
+	Network& loadMapped(std::string const& networkFile);
+
+	/* @brief Load network layers from a v1 model file
+	 * @param[in] networkFile	The network file to load
+	 * @return					A reference to this network object
+	*/
+	Network& loadStream(std::string const& networkFile);
+
+	/* @brief Get the optimizer state saved with the model
+	 * @return The training state
+	*/
+	ModelTrainingState getTrainingState();
+
 	std::vector<oglopp::Rectangle*> monitors;
 	std::vector<Layer> layers;
-	bool error;
+	Backend* backend = nullptr;
+	Optimizer optimizer;
+	uint32_t batchSize = 1;
+	bool error = false;
 	std::string networkFilename;
+
+	// Created on the first checkpoint, so networks that never checkpoint have no writer thread
+	std::unique_ptr<Checkpointer> checkpointer;
+	uint64_t checkpointInterval = 0;
+	std::string checkpointDirectory;
 };
 
 #endif
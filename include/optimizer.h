@@ -0,0 +1,153 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "defines.h"
+#include <cstdint>
+
+// Optimizers. Stored in models, so the values must never change
+#define OPTIMIZER_SGD		0	// w -= rate * g
+#define OPTIMIZER_MOMENTUM	1	// m = momentum * m + rate * g, w -= m
+#define OPTIMIZER_ADAM		2	// Adam, with weight decay added to the gradient
+#define OPTIMIZER_ADAMW		3	// Adam, with weight decay applied to the weights separately
+
+// Learning rate schedules, applied after the warmup. Stored in models, so the values must never change
+#define SCHEDULE_CONSTANT	0
+#define SCHEDULE_COSINE		1	// Cosine from the rate down to decayFactor * rate over decaySteps, then flat
+#define SCHEDULE_STEP		2	// Multiply the rate by decayFactor every decaySteps
+
+// Defaults of the Adam optimizers, which normalize the gradient so want a smaller rate than SGD
+#define ADAM_LEARNING_RATE	0.001
+#define ADAM_BETA1			0.9
+#define ADAM_BETA2			0.999
+#define ADAM_EPSILON		1e-8
+#define SGD_MOMENTUM		0.9
+
+/* How a network is trained. Saved with the model, so training resumes where it left off
+*/
+struct OptimizerSettings {
+	uint32_t optimizer = OPTIMIZER_SGD;
+	float learningRate = LEARNING_RATE;	// Peak rate, reached at the end of the warmup
+	float momentum = SGD_MOMENTUM;		// Momentum, or the decay of Adam's first moment
+	float beta2 = ADAM_BETA2;			// Decay of Adam's second moment
+	float epsilon = ADAM_EPSILON;
+	float weightDecay = 0.0;			// Applied to the weights only, never the biases
+	uint32_t schedule = SCHEDULE_CONSTANT;
+	uint32_t warmupSteps = 0;			// Batches the rate ramps up from 0 over before the schedule starts
+	uint32_t decaySteps = 0;			// See SCHEDULE_*
+	float decayFactor = 0.0;			// See SCHEDULE_*
+};
+
+/* The optimizer settings and scheduled rate of one batch, handed to the backends by Network::backProp()
+*/
+struct OptimizerStep {
+	OptimizerSettings settings;
+	float learningRate = LEARNING_RATE;
+};
+
+/* Everything the fused update of one layer needs, see Optimizer::getUpdate(). Every parameter p with the summed gradient g over the batch is updated as
+ *	g' = g + l2Decay * p
+ *	SGD:		p -= g'
+ *	Momentum:	m = momentum * m + g', p -= m
+ *	Adam(W):	m = momentum * m + (1 - momentum) * g', v = beta2 * v + (1 - beta2) * g'^2, p -= rate * (m * firstCorrection / (sqrt(v * secondCorrection) + epsilon) + decoupledDecay * p)
+ * SGD and momentum have the learning rate folded into the output error, so their gradients already carry it
+*/
+struct OptimizerUpdate {
+	uint32_t optimizer = OPTIMIZER_SGD;
+	float rate = 0.0;
+	float momentum = 0.0;
+	float beta2 = 0.0;
+	float epsilon = 0.0;
+	float l2Decay = 0.0;
+	float decoupledDecay = 0.0;
+	float firstCorrection = 1.0;
+	float secondCorrection = 1.0;
+};
+
+/* @brief Tracks the number of batches a network has been trained for, and works out the learning rate of each from the schedule.
+ * The moments live with each layer's weights, see Layer::advanceMoments()
+*/
+class Optimizer {
+public:
+	/* @brief Start an optimizer
+	 * @param[in] settings	The optimizer settings
+	 * @param[in] step		The number of batches already trained
+	*/
+	Optimizer(OptimizerSettings const& settings = OptimizerSettings(), uint64_t step = 0);
+
+	/* @brief Get the settings and scheduled rate of the next batch, counting the batch
+	 * @return The step
+	*/
+	OptimizerStep nextStep();
+
+	/* @brief Get the scheduled learning rate of a batch
+	 * @param[in] step	The number of batches trained before it
+	 * @return			The learning rate
+	*/
+	float getLearningRate(uint64_t step) const;
+
+	/* @brief Get the optimizer settings
+	 * @return A reference to the settings
+	*/
+	OptimizerSettings const& getSettings() const;
+
+	/* @brief Replace the optimizer settings, keeping the step count
+	 * @param[in] settings	The settings, see validSettings()
+	 * @return				A reference to this optimizer object
+	*/
+	Optimizer& setSettings(OptimizerSettings const& settings);
+
+	/* @brief Get the number of batches trained so far
+	 * @return The step count
+	*/
+	uint64_t getStep() const;
+
+	/* @brief Set the number of batches trained so far, which is where the schedule resumes
+	 * @param[in] step	The step count
+	 * @return			A reference to this optimizer object
+	*/
+	Optimizer& setStep(uint64_t step);
+
+	/* @brief Check that settings are in range
+	 * @param[in] settings	The settings to check
+	 * @return				False if some setting is out of range, printing why
+	*/
+	static bool validSettings(OptimizerSettings const& settings);
+
+	/* @brief Get the number of moments an optimizer keeps per weight and bias
+	 * @param[in] optimizer	OPTIMIZER_*
+	 * @return				0 for SGD, 1 for momentum, 2 for Adam
+	*/
+	static uint32_t getMomentSlots(uint32_t optimizer);
+
+	/* @brief Get what the output error is scaled by. SGD and momentum fold the learning rate into it, like plain backprop always has, so their
+	 * gradients come out already scaled. Adam normalizes the gradient away, so it runs on the plain error and applies the rate itself
+	 * @param[in] step	The step
+	 * @return			The error scale
+	*/
+	static float getErrorScale(OptimizerStep const& step);
+
+	/* @brief True if the backends can apply the gradient of a step straight to the weights as it is calculated, without any state or decay
+	 * @param[in] step	The step
+	 * @return			True for SGD without weight decay
+	*/
+	static bool isPlainStep(OptimizerStep const& step);
+
+	/* @brief Work out the fused update of a layer's weights for a step
+	 * @param[in] step		The step
+	 * @param[in] updates	The number of updates the layer's moments have seen, including this one, for Adam's bias correction
+	 * @return				The weight update. The biases use the same update without any decay
+	*/
+	static OptimizerUpdate getUpdate(OptimizerStep const& step, uint64_t updates);
+
+	/* @brief Get the name of an optimizer
+	 * @param[in] optimizer	OPTIMIZER_*
+	 * @return				One of 'sgd,momentum,adam,adamw'
+	*/
+	static char const* getOptimizerName(uint32_t optimizer);
+
+private:
+	OptimizerSettings settings;
+	uint64_t step = 0;
+};
+
+#endif
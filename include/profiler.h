@@ -0,0 +1,135 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Events kept for the trace. Older events are dropped once the buffer is full, the counters keep counting
+#define PROFILER_MAX_EVENTS		1000000
+// How often the window prints its profile summary
+#define PROFILER_SUMMARY_SECONDS	2.0
+
+/* @brief Collects CPU and GPU timings of named sections, aggregated per section and layer into counters.
+ * The counters can be printed as a one line summary, and the individual events written as Chrome trace_event JSON (chrome://tracing, Perfetto).
+ * Everything is off until enable() is called, and a disabled ProfileScope is a single branch.
+*/
+class Profiler {
+public:
+	/* @brief Start collecting timings
+	 * @return True if the profiler was enabled
+	*/
+	static bool enable();
+
+	/* @brief Stop collecting timings. Collected counters and events are kept
+	*/
+	static void disable();
+
+	/* @brief Check if timings are being collected
+	 * @return True if enabled
+	*/
+	static bool isEnabled() {
+		return enabled;
+	}
+
+	/* @brief Count samples trained, for the samples/s of the summary
+	 * @param[in] count	The number of samples
+	*/
+	static void addSamples(uint64_t count) {
+		if (enabled) {
+			samples += count;
+		}
+	}
+
+	/* @brief Read back any GPU timestamp queries whose results are ready
+	 * @param[in] wait	True to wait for every outstanding query instead
+	*/
+	static void collect(bool wait = false);
+
+	/* @brief Build a one line summary of the counters since the last summary, then start a new summary window
+	 * @return The summary, or an empty string if nothing was recorded
+	*/
+	static std::string summary();
+
+	/* @brief Write every recorded event as Chrome trace_event JSON. Waits for outstanding GPU queries first
+	 * @param[in] path	The file to write
+	 * @return			0 on success, -1 on failure
+	*/
+	static int writeTrace(std::string const& path);
+
+	/* @brief Record a finished CPU section. Used by ProfileScope
+	 * @param[in] name	The section name, a string literal
+	 * @param[in] layer	The layer index, or -1 if the section is not about one layer
+	 * @param[in] start	When the section started
+	 * @param[in] end	When the section ended
+	 * @param[in] bytes	Bytes the section moved between host and device or disk
+	*/
+	static void recordCPU(char const* name, int layer, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, uint64_t bytes);
+
+	/* @brief Issue a GPU timestamp query. Used by ProfileScope
+	 * @return The query object
+	*/
+	static uint32_t beginGPU();
+
+	/* @brief Issue the closing GPU timestamp query of a section. The result is read back later by collect(). Used by ProfileScope
+	 * @param[in] name	The section name, a string literal
+	 * @param[in] layer	The layer index, or -1
+	 * @param[in] begin	The query returned by beginGPU()
+	*/
+	static void endGPU(char const* name, int layer, uint32_t begin);
+
+private:
+	static inline bool enabled = false;
+	static inline uint64_t samples = 0;
+};
+
+/* @brief Times the enclosing scope on the CPU, and optionally on the GPU with timestamp queries around the commands issued inside it.
+ * Does nothing but check Profiler::isEnabled() when the profiler is off
+*/
+class ProfileScope {
+public:
+	/* @brief Start timing
+	 * @param[in] name	The section name. Must be a string literal, or live for the rest of the program
+	 * @param[in] layer	The layer index the section works on, or -1
+	 * @param[in] gpu	True to also time the GPU commands issued in the scope. Requires an OpenGL context
+	*/
+	ProfileScope(char const* name, int layer = -1, bool gpu = false) {
+		if (Profiler::isEnabled()) {
+			this->name = name;
+			this->layer = layer;
+			this->query = gpu ? Profiler::beginGPU() : 0;
+			this->start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~ProfileScope() {
+		if (this->name != nullptr) {
+			Profiler::recordCPU(this->name, this->layer, this->start, std::chrono::steady_clock::now(), this->bytes);
+			if (this->query != 0) {
+				Profiler::endGPU(this->name, this->layer, this->query);
+			}
+		}
+	}
+
+	ProfileScope(ProfileScope const&) = delete;
+	ProfileScope& operator=(ProfileScope const&) = delete;
+
+	/* @brief Count bytes moved by the section
+	 * @param[in] bytes	The byte count
+	 * @return			A reference to this scope
+	*/
+	ProfileScope& addBytes(uint64_t bytes) {
+		this->bytes += bytes;
+		return *this;
+	}
+
+private:
+	char const* name = nullptr;
+	int layer = -1;
+	uint32_t query = 0;
+	uint64_t bytes = 0;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif
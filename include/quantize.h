@@ -0,0 +1,94 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "network.h"
+#include "dataset.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Samples run through the fp32 network to find the range of the values feeding every layer
+#define QUANT_CALIBRATION_SAMPLES	512
+// Samples the quantized network is compared with the fp32 network on. They sit between the calibration samples in the dataset
+#define QUANT_EVALUATION_SAMPLES	512
+
+/* How far a quantized network strays from the fp32 network it was made from
+*/
+struct QuantizationReport {
+	size_t samples = 0;			// Samples compared
+	double fp32Loss = 0.0;		// Mean squared reconstruction error of the fp32 network
+	double int8Loss = 0.0;		// Mean squared reconstruction error of the quantized network
+	double outputError = 0.0;	// Mean squared difference between the quantized and fp32 outputs
+	double maxError = 0.0;		// Largest absolute difference between a quantized and an fp32 output
+	uint64_t fp32Bytes = 0;		// Weight bytes before quantizing
+	uint64_t int8Bytes = 0;		// Weight and scale bytes after quantizing, including any pruned layers left in fp32
+};
+
+/* @brief Post training quantization of a CPU network to int8 weights with one scale per neuron. calibrate() runs samples through the fp32 network to
+ * find the range of the values feeding every layer and keeps its outputs, apply() quantizes every layer with those ranges, and evaluate() runs the same
+ * samples through the quantized network to report how far its outputs moved
+*/
+class Quantizer {
+public:
+	/* @brief Prepare to quantize a network
+	 * @param[in] network	The network to quantize. Must be on the CPU backend
+	*/
+	Quantizer(Network& network);
+
+	/* @brief Run samples through the fp32 network, recording the range of the values feeding every layer, and the outputs evaluate() compares with
+	 * @param[in] dataset				The samples
+	 * @param[in] calibrationSamples	The number of samples to take the ranges from, spread over the dataset
+	 * @param[in] evaluationSamples		The number of samples to keep the outputs of, spread over the dataset between the calibration samples
+	 * @return							A reference to this quantizer object
+	*/
+	Quantizer& calibrate(Dataset& dataset, size_t calibrationSamples = QUANT_CALIBRATION_SAMPLES, size_t evaluationSamples = QUANT_EVALUATION_SAMPLES);
+
+	/* @brief Quantize every layer of the network with the calibrated ranges
+	 * @return A reference to this quantizer object
+	*/
+	Quantizer& apply();
+
+	/* @brief Run the evaluation samples through the quantized network and compare with the fp32 outputs kept by calibrate()
+	 * @param[in] dataset	The dataset given to calibrate()
+	 * @return				The report
+	*/
+	QuantizationReport evaluate(Dataset& dataset);
+
+	/* @brief True if the network could not be quantized, false otherwise
+	 * @return True if error, false otherwise
+	*/
+	bool getError();
+
+private:
+	/* @brief Run samples through the network a batch at a time
+	 * @param[in] dataset	The samples
+	 * @param[in] indices	The samples to run
+	 * @param[in] visit		Called after every batch with the index of its first sample in 'indices' and the number of samples in it
+	*/
+	void run(Dataset& dataset, std::vector<uint64_t> const& indices, std::function<void(size_t first, size_t count)> const& visit);
+
+	/* @brief Pick samples spread evenly over a dataset
+	 * @param[in] size		The number of samples in the dataset
+	 * @param[in] count		The number of samples to pick
+	 * @param[in] offset	Where in each gap between picks to pick from, between 0 and 1
+	 * @return				The sample indices
+	*/
+	static std::vector<uint64_t> spread(uint64_t size, size_t count, double offset);
+
+	Network& network;
+	bool error = false;
+
+	// Range of the values feeding each layer, indexed by the layer they feed
+	std::vector<float> inputMin;
+	std::vector<float> inputMax;
+
+	// fp32 outputs of the evaluation samples
+	std::vector<uint64_t> evaluationIndices;
+	std::vector<float> reference;
+	double fp32Loss = 0.0;
+	uint64_t fp32Bytes = 0;
+};
+
+#endif
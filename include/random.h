@@ -0,0 +1,78 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+/* @brief xoshiro256** pseudo random generator. A few cycles per number, with a period of 2^256 - 1, and the same sequence on every platform for a seed,
+ * unlike rand(). Only meant for shuffling, not for anything that has to be unpredictable
+*/
+class Random {
+public:
+	/* @brief Seed the generator. The state is filled from the seed with splitmix64, so nearby seeds still give unrelated sequences
+	 * @param[in] seed	Any value, including 0
+	*/
+	Random(uint64_t seed = 0) {
+		for (uint64_t& word : this->state) {
+			seed += 0x9E3779B97F4A7C15ull;
+			uint64_t mixed = seed;
+			mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ull;
+			mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBull;
+			word = mixed ^ (mixed >> 31);
+		}
+	}
+
+	/* @brief Get the next number
+	 * @return 64 random bits
+	*/
+	uint64_t next() {
+		uint64_t result = rotate(this->state[1] * 5, 7) * 9;
+		uint64_t shifted = this->state[1] << 17;
+
+		this->state[2] ^= this->state[0];
+		this->state[3] ^= this->state[1];
+		this->state[1] ^= this->state[2];
+		this->state[0] ^= this->state[3];
+		this->state[2] ^= shifted;
+		this->state[3] = rotate(this->state[3], 45);
+
+		return result;
+	}
+
+	/* @brief Get a number below a bound, every value equally likely. Multiplies instead of taking a remainder, and only draws again for the few
+	 * numbers that would make the low values more likely (Lemire's method)
+	 * @param[in] bound	One past the largest value, above 0
+	 * @return			A number from 0 to bound - 1
+	*/
+	uint32_t below(uint32_t bound) {
+		uint64_t product = (this->next() >> 32) * bound;
+		if (static_cast<uint32_t>(product) < bound) {
+			uint32_t threshold = static_cast<uint32_t>(-bound) % bound;
+			while (static_cast<uint32_t>(product) < threshold) {
+				product = (this->next() >> 32) * bound;
+			}
+		}
+		return static_cast<uint32_t>(product >> 32);
+	}
+
+	/* @brief Shuffle values in place with Fisher-Yates, every order equally likely
+	 * @param[in,out] values	The values to shuffle
+	 * @param[in] count			The number of values, below 2^32
+	*/
+	template <typename T>
+	void shuffle(T* values, size_t count) {
+		for (size_t i=count;i>1;i--) {
+			std::swap(values[i-1], values[this->below(static_cast<uint32_t>(i))]);
+		}
+	}
+
+private:
+	static uint64_t rotate(uint64_t value, int bits) {
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	uint64_t state[4];
+};
+
+#endif
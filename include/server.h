@@ -0,0 +1,160 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "network.h"
+#include "aligned.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Request operations
+#define SERVER_OP_ENCODE		1	// Input layer floats in, bottleneck floats out
+#define SERVER_OP_DECODE		2	// Bottleneck floats in, output layer floats out
+#define SERVER_OP_RECONSTRUCT	3	// Input layer floats in, output layer floats out
+#define SERVER_OP_STATS			4	// No floats in, SERVER_STATS_COUNT floats out
+#define SERVER_OP_COUNT			5
+
+// Response statuses
+#define SERVER_STATUS_OK			0
+#define SERVER_STATUS_BAD_REQUEST	1
+
+// Floats of a stats response: requests/s, p50 ms, p99 ms and the mean batch size of the last report window
+#define SERVER_STATS_COUNT		4
+
+// How long the oldest request may wait for others to share its batch
+#define SERVER_BATCH_DELAY_US	500
+// How often the server prints its throughput and latency
+#define SERVER_REPORT_SECONDS	5.0
+
+/* Sent before the floats of every request. Requests may be pipelined on one connection, and the responses come back in the same order,
+ * except for stats requests which are answered as soon as they are read
+*/
+struct ServerRequest {
+	uint32_t op;	// SERVER_OP_*
+	uint32_t count;	// Floats following the header
+};
+
+/* Sent before the floats of every response
+*/
+struct ServerResponse {
+	uint32_t status;	// SERVER_STATUS_*
+	uint32_t count;		// Floats following the header
+};
+
+struct ServerClient;
+
+/* A request waiting for a batch
+*/
+struct ServerPending {
+	std::shared_ptr<ServerClient> client;
+	std::vector<float> input;
+	std::chrono::steady_clock::time_point arrival;
+};
+
+/* @brief Serves a network over a Unix domain socket. A thread reads requests from every connection, and the thread calling run()
+ * coalesces them into batches of the network's batch size and runs them through the batched forward pass. The network is only touched by the
+ * thread calling run(), so a GPU network works as long as that thread owns the OpenGL context.
+*/
+class Server {
+public:
+	/* @brief Listen on a socket, replacing any socket file already at the path
+	 * @param[in] network		The network to serve. Its batch size is the largest batch the server forms, smaller batches shrink it
+	 * @param[in] socketPath	The path of the socket
+	 * @param[in] batchDelay	How long the oldest request may wait for others to share its batch, in microseconds
+	*/
+	Server(Network& network, std::string const& socketPath, uint32_t batchDelay = SERVER_BATCH_DELAY_US);
+	Server(Server const&) = delete;
+	Server& operator=(Server const&) = delete;
+	~Server();
+
+	/* @brief True if the socket could not be opened, false otherwise
+	 * @return True if error, false otherwise
+	*/
+	bool getError();
+
+	/* @brief Serve requests until stop() is called
+	 * @return 0 on a clean stop, 1 on error
+	*/
+	int run();
+
+	/* @brief Ask run() to return. Safe to call from a signal handler
+	*/
+	static void stop();
+
+private:
+	/* @brief Accept connections and read requests into the queues, on the reader thread
+	*/
+	void readLoop();
+
+	/* @brief Parse every complete request in a connection's input buffer
+	 * @param[in] client	The connection
+	 * @return				False if the connection sent a bad request and must be closed
+	*/
+	bool parse(std::shared_ptr<ServerClient> const& client);
+
+	/* @brief Wait for a batch of requests of one operation. Waits up to batchDelay after the oldest request for the batch to fill
+	 * @param[out] batch	The requests, oldest first
+	 * @return				The operation, or 0 if the server is stopping
+	*/
+	uint32_t gather(std::vector<ServerPending>& batch);
+
+	/* @brief Run a batch of requests through the network and send the responses
+	 * @param[in] op	The operation of every request in the batch
+	 * @param[in] batch	The requests
+	*/
+	void execute(uint32_t op, std::vector<ServerPending>& batch);
+
+	/* @brief Send a response to a connection
+	 * @param[in] client	The connection
+	 * @param[in] status	SERVER_STATUS_*
+	 * @param[in] data		The floats to send
+	 * @param[in] count		The number of floats
+	*/
+	static void respond(ServerClient& client, uint32_t status, float const* data, uint32_t count);
+
+	/* @brief Print the throughput and latency since the last report, and keep them for stats requests
+	*/
+	void report();
+
+	/* @brief Get the number of floats a request of some operation must carry
+	 * @param[in] op	The operation
+	 * @return			The float count
+	*/
+	uint32_t getInputCount(uint32_t op);
+
+	Network& network;
+	std::string socketPath;
+	uint32_t batchDelay;
+	int listener = -1;
+	bool error = false;
+
+	size_t bottleneck;
+	uint32_t maxBatch;
+	// The batch handed to the network, zero padded past the requests that filled it
+	AlignedVector<float> staging;
+
+	// One queue per operation, since a batch runs a single operation
+	std::deque<ServerPending> queues[SERVER_OP_COUNT];
+	std::mutex queueLock;
+	std::condition_variable queued;
+	std::thread reader;
+
+	// Report window, only touched by run()
+	std::vector<double> latencies;
+	size_t batches = 0;
+	std::chrono::steady_clock::time_point windowStart;
+
+	// Last report, read by the reader thread for stats requests
+	float stats[SERVER_STATS_COUNT] = {};
+	std::mutex statsLock;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef SHADERVARIANTS_H
+#define SHADERVARIANTS_H
+
+#include "oglopp/compute.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// Passes of the compute shader. Each variant runs exactly one of them
+#define SHADER_PASS_LOAD		0
+#define SHADER_PASS_FORWARD		1
+#define SHADER_PASS_BACKWARD	2
+
+// First word of a cached program binary
+#define SHADER_CACHE_MAGIC		0x48534B53 // "SKSH"
+
+/* Everything a variant of shaders/compute.glsl bakes in as constants: the pass, and the shape of the layer it runs on.
+ * What changes from batch to batch (the learning rate, optimizer rates and staging offset) stays a uniform
+*/
+struct ShaderVariant {
+	uint32_t pass = SHADER_PASS_FORWARD;
+	uint32_t lastCount = 0;
+	uint32_t thisCount = 0;
+	uint32_t batchSize = 0;
+	bool isLastLayer = false;
+	bool sparse = false;
+	uint32_t activation = 0;		// ACTIVATION_*
+	uint32_t convolution = 0;		// MODEL_LAYER_*
+	uint32_t kernelSize = 0;
+	uint32_t kernelStride = 0;
+	uint32_t kernelPadding = 0;
+	uint32_t smallSize = 0;
+	uint32_t smallChannels = 0;
+	uint32_t bigSize = 0;
+	uint32_t bigChannels = 0;
+	uint32_t backPropPass = 0;		// Convolutions backprop in two passes
+	uint32_t optimizer = 0;			// OPTIMIZER_*
+	uint32_t storedWeights = 0;
+	uint32_t weightFormat = 0;		// MODEL_FORMAT_* of the weights buffer. Only dense forward passes read fp16 or bf16
+	// Forward passes fused with the small layer before them (see GPUBackend::setFusion()), which is fed fusedInputs values. 0 when not fused
+	uint32_t fusedInputs = 0;
+	uint32_t fusedActivation = 0;	// ACTIVATION_* of the small layer
+
+	/* @brief Get the GLSL declaring this variant's constants, inserted after the #version line of the shader
+	 * @return The declarations, which also identify the variant
+	*/
+	std::string getDeclarations() const;
+};
+
+/* @brief Compiles variants of shaders/compute.glsl specialized on the pass and layer shape, so the shader's branches on them fold away and its loops get
+ * constant bounds. Linked programs are kept for the life of the object, and their binaries cached on disk keyed by the source, the variant and the
+ * driver, so later launches skip compiling. Requires an OpenGL context.
+*/
+class ShaderVariants {
+public:
+	/* @brief Read the shader source and open the cache. Check getError() after
+	 * @param[in] sourcePath		The path to shaders/compute.glsl
+	 * @param[in] cacheDirectory	Where program binaries are cached, created if missing. Empty to always compile
+	*/
+	ShaderVariants(std::string const& sourcePath, std::string const& cacheDirectory);
+	ShaderVariants(ShaderVariants const&) = delete;
+	ShaderVariants& operator=(ShaderVariants const&) = delete;
+	~ShaderVariants();
+
+	/* @brief Get the program of a variant, loading it from the cache or compiling it on first use
+	 * @param[in] variant	The variant
+	 * @return				The linked program, or 0 if it failed to build, in which case the caller should fall back to the generic shader
+	*/
+	GLuint getProgram(ShaderVariant const& variant);
+
+	/* @brief Check if the shader source could not be read
+	 * @return True on error
+	*/
+	bool getError() const;
+
+private:
+	std::string version;		// The #version line the declarations go after
+	std::string source;			// The rest of the shader
+	std::string cacheDirectory;
+	std::string driver;			// Vendor, renderer and version, since binaries only load on the driver that made them
+	uint32_t sourceHash = 0;
+	bool binaries = false;		// The driver can hand out program binaries
+	bool error = false;
+
+	// Built programs by their declarations. Failed builds are kept as 0 so they are not retried every dispatch
+	std::unordered_map<std::string, GLuint> programs;
+
+	/* @brief Compile and link a variant
+	 * @param[in] declarations	The variant's declarations
+	 * @return					The program, or 0 on failure, printing the log
+	*/
+	GLuint compile(std::string const& declarations);
+
+	/* @brief Load a variant from its cached binary
+	 * @param[in] key	The cache key, which has to match the one the binary was saved with
+	 * @param[in] path	The cache file
+	 * @return			The program, or 0 if there is no valid binary for this driver
+	*/
+	GLuint loadBinary(std::string const& key, std::string const& path);
+
+	/* @brief Save the binary of a linked variant to the cache
+	 * @param[in] program	The program
+	 * @param[in] key		The cache key
+	 * @param[in] path		The cache file
+	*/
+	void saveBinary(GLuint program, std::string const& key, std::string const& path);
+};
+
+#endif
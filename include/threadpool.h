@@ -0,0 +1,90 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+
+/* @brief Fixed set of worker threads that run parallel loops. Every worker owns a queue of tasks and steals from the others once its own runs dry,
+ * so uneven tasks still keep every thread busy. The thread calling parallelFor() works on the loop too
+*/
+class ThreadPool {
+public:
+	/* @brief Start the workers
+	 * @param[in] threadCount	The number of threads working on each loop, including the caller. 0 uses one per physical core
+	*/
+	ThreadPool(size_t threadCount = 0);
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+	~ThreadPool();
+
+	/* @brief Get the number of threads working on each loop, including the caller
+	 * @return The thread count
+	*/
+	size_t size();
+
+	/* @brief Run task(0) through task(count - 1) across the pool and wait for all of them to finish
+	 * @param[in] count	The number of tasks
+	 * @param[in] task	The task to run, given its index
+	 * @return			A reference to this pool object
+	*/
+	ThreadPool& parallelFor(size_t count, std::function<void(size_t)> const& task);
+
+	/* @brief Count the physical cores of the machine. Hyperthreads share the SIMD units of their core, so they add little to the kernels
+	 * @return The number of physical cores, or the number of hardware threads if the topology cannot be read
+	*/
+	static size_t getPhysicalCoreCount();
+
+private:
+	struct Loop {
+		std::function<void(size_t)> const* task;
+		std::atomic<size_t> remaining;
+	};
+
+	struct Job {
+		Loop* loop;
+		size_t index;
+	};
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	/* @brief Worker loop, sleeping whenever there are no jobs left anywhere
+	 * @param[in] self	The index of this worker's queue
+	*/
+	void run(size_t self);
+
+	/* @brief Take a job from our own queue, or steal one from another
+	 * @param[in] self	The queue to look in first
+	 * @param[out] job	The job that was taken
+	 * @return			True if a job was taken
+	*/
+	bool take(size_t self, Job& job);
+
+	/* @brief Run a job and signal its loop if it was the last one
+	 * @param[in] job	The job to run
+	*/
+	void execute(Job const& job);
+
+	// One queue per thread. The last queue belongs to the caller of parallelFor()
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+
+	// Jobs queued but not yet taken, so idle workers know when to sleep
+	std::atomic<size_t> pending{0};
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+};
+
+#endif
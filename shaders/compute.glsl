@@ -1,43 +1,148 @@
 #version 460 core
 precision highp float;
-layout(local_size_x = 1) in;
+
+// Must match MAX_BATCH_SIZE in include/defines.h
+#define MAX_BATCH_SIZE 64
+
+// Workgroup layout. Must match the GPU_* defines in include/defines.h
+#define WORKGROUP_SIZE 64
+#define FORWARD_ROWS 8 // Neurons of this layer computed by one forward workgroup
+#define FORWARD_LANES (WORKGROUP_SIZE / FORWARD_ROWS) // Lanes splitting the inputs of each of those neurons
+#define FORWARD_SAMPLES 4 // Samples computed by one forward workgroup, so each weight load is reused
+#define BACKPROP_TILE 32 // Rows of deltas staged in shared memory at a time during backprop
+
+layout(local_size_x = WORKGROUP_SIZE) in;
 
 float E = 2.71828182846;
 
-struct Neuron {
-    float bias;
-    float value;
-    float expected; // For non-final-layers, this value represents the 'output_delta' for the training session (only in backprop 2)
+// The value and expected buffers hold batchSize rows of neurons, one row per sample
+layout(std430, binding = 0) buffer ThisValues {
+    float thisValues[];
+};
+
+// For non-final-layers, this holds the 'output_delta' for the training session (only in backprop 2)
+layout(std430, binding = 1) buffer ThisExpected {
+    float thisExpected[];
 };
 
-layout(std430, binding = 0) buffer ThisBuf {
-    Neuron neurons[];
+layout(std430, binding = 2) buffer OtherValues {
+    float otherValues[];
 };
 
-layout(std430, binding = 1) buffer OtherBuf {
-    Neuron otherNeurons[];
+layout(std430, binding = 3) buffer OtherExpected {
+    float otherExpected[];
 };
 
-layout(std430, binding = 2) buffer Weights {
+layout(std430, binding = 4) buffer Weights {
     float weights[];
 };
 
+// The same buffer for a dense layer stored in fp16 or bf16 without fp32 weights (see Layer::setPrecision()), two weights to a uint, the first in the low half
+layout(std430, binding = 4) readonly buffer PackedWeights {
+    uint packedWeights[];
+};
+
+// The biases are shared by every sample in the batch
+layout(std430, binding = 5) buffer Biases {
+    float biases[];
+};
+
+// Batches staged by the host, see doLoadBatch()
+layout(std430, binding = 6) readonly buffer Staging {
+    float staged[];
+};
+
+// Index of a pruned layer, whose weights buffer only holds the weights left (see Layer::prune()). The weights are listed both row by row and column by column:
+// [row offsets: thisCount + 1][columns: one per weight][column offsets: lastCount + 1][rows: one per weight][position of each weight in the weights buffer]
+layout(std430, binding = 7) readonly buffer SparseIndex {
+    uint sparseIndex[];
+};
+
+// Optimizer state of the layer, one row per moment holding the stored weights' moments then the biases' (see Layer::getHostMoments()). Unused by plain SGD
+layout(std430, binding = 8) buffer Moments {
+    float moments[];
+};
+
+// The pass and the shape of the layer. Specialized variants (see include/shadervariants.h) declare these as constants after the #version line
+// instead, along with ENTRY_POINT and BATCH_CAPACITY, so the branches on them fold away and the loops get constant bounds
+#ifndef SPECIALIZED
+uniform bool loadBatch;
+uniform bool backProp;
 uniform bool isLastLayer;
 uniform int lastCount;
 uniform int thisCount;
-uniform bool backProp;
-uniform float learningRate;
+uniform int batchSize;
+uniform bool sparse; // The layer is pruned, see SparseIndex
+uniform int activationType; // ACTIVATION_* in include/activation.h: 0 sigmoid, 1 ReLU, 2 tanh, 3 linear
+
+// Convolutional layers, see include/convolution.h. Images are stored [channel][y][x]
+uniform int convolution; // MODEL_LAYER_* in include/model.h: 0 dense, 1 convolution, 2 transposed convolution
+uniform int kernelSize;
+uniform int kernelStride;
+uniform int kernelPadding;
+uniform int smallSize;
+uniform int smallChannels;
+uniform int bigSize;
+uniform int bigChannels;
+uniform int backPropPass; // Convolutions backprop in two passes, carrying the deltas (0), then updating the weights (1)
+
+uniform int optimizer; // OPTIMIZER_* in include/optimizer.h: 0 SGD, 1 momentum, 2 Adam, 3 AdamW
+uniform int storedWeights; // Weights in the weights buffer, where the bias moments start
+uniform int weightFormat; // MODEL_FORMAT_* in include/model.h of the weights buffer: 0 fp32, 3 fp16 or 4 bf16, see PackedWeights
+#endif
+
+// Samples the per-sample arrays have room for
+#ifndef BATCH_CAPACITY
+#define BATCH_CAPACITY MAX_BATCH_SIZE
+#endif
+
+uniform float errorScale; // The learning rate for SGD and momentum, 1 for Adam, see Optimizer::getErrorScale()
+uniform int stagingOffset; // First float of the batch being loaded in staged[]
+
+// Fused optimizer update, see OptimizerUpdate in include/optimizer.h
+uniform float optimizerRate;
+uniform float momentum;
+uniform float beta2;
+uniform float epsilon;
+uniform float l2Decay;
+uniform float decoupledDecay;
+uniform float firstCorrection;
+uniform float secondCorrection;
+
+// An activation function, see the policies in include/activation.h. Sigmoid (soft step) by default
+float activationOf(int type, float x) {
+    switch (type) {
+        case 1:
+            return max(x, 0.0);
+        case 2:
+            // Some drivers build tanh out of exp(), which overflows to inf / inf long before tanh stops changing
+            return tanh(clamp(x, -15.0, 15.0));
+        case 3:
+            return x;
+        default:
+            //return 1.0 / (1 + pow(E, -x));
+            return 1.0 / (1 + exp(-x));
+    }
+}
 
-// Soft step activation function
+// The activation function of the layer
 float activation(float x) {
-    //return 1.0 / (1 + pow(E, -x));
-    return 1.0 / (1 + exp(-x));
+    return activationOf(activationType, x);
 }
 
-// The input to this is NOT 'x'. It is the result of sigmoid(x).
-float activationD(float sigmoid) {
-    // Force the network to always do a bit of learning by adding a bit of an offset to the activation derivitive (0.005)
-    return (sigmoid * (1.f - sigmoid)) + 0.005; //0.005; //0.005;
+// The input to this is NOT 'x'. It is the result of activation(x).
+float activationD(float y) {
+    switch (activationType) {
+        case 1:
+            return y > 0.0 ? 1.0 : 0.0;
+        case 2:
+            return 1.0 - y * y;
+        case 3:
+            return 1.0;
+        default:
+            // Force the network to always do a bit of learning by adding a bit of an offset to the activation derivitive (0.005)
+            return (y * (1.f - y)) + 0.005; //0.005; //0.005;
+    }
 }
 
 // calculate the cost of a value and its expected
@@ -49,21 +154,221 @@ float valCostD(float actual, float expected) {
     return 2.0 * (actual - expected);
 }
 
-float calcZ(uint index) {
-    uint weightIndex = 0; // Weight index
+// Kahan summation, so long fp32 dot products don't lose the small terms
+void compensatedAdd(inout float sum, inout float compensation, float value) {
+    precise float y = value - compensation;
+    precise float t = sum + y;
+    compensation = (t - sum) - y;
+    sum = t;
+}
 
-    double newValue = 0;
+shared float inputTile[FORWARD_SAMPLES][WORKGROUP_SIZE];
+shared float partialSums[FORWARD_SAMPLES][WORKGROUP_SIZE];
 
-    for (uint i = 0; i < lastCount; i++) {
-        weightIndex = index * lastCount + i; // Each larger block in weights is assocated with 'this' index
-        newValue += weights[weightIndex] * otherNeurons[i].value;
+// Reduce the lanes of each row of a forward workgroup, and store the activated sums. Every lane of the workgroup must call it
+void storeForward(uint lane, uint sub, uint index, uint firstSample, bool validRow, float sums[FORWARD_SAMPLES], float compensations[FORWARD_SAMPLES]) {
+    // Reduce the lanes of each row
+    for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+        partialSums[s][lane] = sums[s] - compensations[s];
+    }
+    barrier();
+
+    for (uint stride = FORWARD_LANES / 2; stride > 0; stride /= 2) {
+        if (sub < stride) {
+            for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+                partialSums[s][lane] += partialSums[s][lane + stride];
+            }
+        }
+        barrier();
     }
 
-    return float(newValue) + neurons[index].bias;
+    if (validRow && sub == 0) {
+        for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+            uint b = firstSample + s;
+            if (b < batchSize) {
+                thisValues[b * thisCount + index] = activation(partialSums[s][lane] + biases[index]);
+            }
+        }
+    }
 }
 
-void doForwardPass(uint index) {
-    neurons[index].value = activation(calcZ(index));
+// Weight w of a dense layer, widened to fp32 if the layer is stored in fp16 or bf16
+float denseWeight(uint w) {
+    if (weightFormat == 0) {
+        return weights[w];
+    }
+
+    uint pair = packedWeights[w / 2];
+    if (weightFormat == 3) {
+        return unpackHalf2x16(pair)[w % 2];
+    }
+    return uintBitsToFloat(w % 2 == 0 ? pair << 16 : pair & 0xFFFF0000u);
+}
+
+// Each workgroup computes FORWARD_ROWS neurons for FORWARD_SAMPLES samples. The inputs are staged through shared memory a tile at a time
+// and reused by every row, each weight is loaded once and applied to every sample, and the lanes of each row are reduced in shared memory
+void doForwardPass() {
+    uint lane = gl_LocalInvocationID.x;
+    uint row = lane / FORWARD_LANES; // Which neuron of the group this lane works on
+    uint sub = lane % FORWARD_LANES; // Which slice of the input tile this lane works on
+    uint index = gl_WorkGroupID.x * FORWARD_ROWS + row; // This neuron index
+    uint firstSample = gl_WorkGroupID.y * FORWARD_SAMPLES;
+    bool validRow = index < thisCount;
+
+    float sums[FORWARD_SAMPLES];
+    float compensations[FORWARD_SAMPLES];
+    for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+        sums[s] = 0.0;
+        compensations[s] = 0.0;
+    }
+
+    for (uint tile = 0; tile < lastCount; tile += WORKGROUP_SIZE) {
+        // Every lane loads one input of each sample
+        for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+            uint b = firstSample + s;
+            uint i = tile + lane;
+            inputTile[s][lane] = (b < batchSize && i < lastCount) ? otherValues[b * lastCount + i] : 0.0;
+        }
+        barrier();
+
+        if (validRow) {
+            for (uint k = sub; k < WORKGROUP_SIZE && tile + k < lastCount; k += FORWARD_LANES) {
+                float weight = denseWeight(index * lastCount + tile + k); // Each larger block in weights is assocated with 'this' index
+
+                for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+                    compensatedAdd(sums[s], compensations[s], weight * inputTile[s][k]);
+                }
+            }
+        }
+        barrier();
+    }
+
+    storeForward(lane, sub, index, firstSample, validRow, sums, compensations);
+}
+
+#ifdef FUSED_COUNT
+// The small layer of a fused forward pass, see doFusedForwardPass()
+layout(std430, binding = 9) readonly buffer FusedWeights {
+    float fusedWeights[];
+};
+
+layout(std430, binding = 10) readonly buffer FusedBiases {
+    float fusedBiases[];
+};
+
+layout(std430, binding = 11) writeonly buffer FusedValues {
+    float fusedValues[];
+};
+
+shared float fusedTile[FORWARD_SAMPLES][FUSED_COUNT];
+
+// A small layer and this layer in one dispatch, see GPUBackend::setFusion(). The small layer is fed FUSED_INPUTS values from otherValues, and feeds
+// its FUSED_COUNT (lastCount) values to this layer. Every workgroup computes the whole small layer for its samples into shared memory, one lane per
+// neuron and sample, then its rows of this layer from there like doForwardPass(). The first column of workgroups also stores the small layer's values
+void doFusedForwardPass() {
+    uint lane = gl_LocalInvocationID.x;
+    uint firstSample = gl_WorkGroupID.y * FORWARD_SAMPLES;
+
+    for (uint e = lane; e < FORWARD_SAMPLES * FUSED_COUNT; e += WORKGROUP_SIZE) {
+        uint s = e / FUSED_COUNT;
+        uint n = e % FUSED_COUNT;
+        uint b = firstSample + s;
+        float value = 0.0;
+        if (b < batchSize) {
+            float sum = 0.0;
+            float compensation = 0.0;
+            for (uint i = 0; i < FUSED_INPUTS; i++) {
+                compensatedAdd(sum, compensation, fusedWeights[n * FUSED_INPUTS + i] * otherValues[b * FUSED_INPUTS + i]);
+            }
+            value = activationOf(FUSED_ACTIVATION, sum - compensation + fusedBiases[n]);
+            if (gl_WorkGroupID.x == 0) {
+                fusedValues[b * FUSED_COUNT + n] = value;
+            }
+        }
+        fusedTile[s][n] = value;
+    }
+    barrier();
+
+    uint row = lane / FORWARD_LANES;
+    uint sub = lane % FORWARD_LANES;
+    uint index = gl_WorkGroupID.x * FORWARD_ROWS + row;
+    bool validRow = index < thisCount;
+
+    float sums[FORWARD_SAMPLES];
+    float compensations[FORWARD_SAMPLES];
+    for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+        sums[s] = 0.0;
+        compensations[s] = 0.0;
+    }
+
+    if (validRow) {
+        for (uint k = sub; k < FUSED_COUNT; k += FORWARD_LANES) {
+            float weight = denseWeight(index * FUSED_COUNT + k);
+            for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+                compensatedAdd(sums[s], compensations[s], weight * fusedTile[s][k]);
+            }
+        }
+    }
+
+    storeForward(lane, sub, index, firstSample, validRow, sums, compensations);
+}
+#endif
+
+// Same layout as doForwardPass() for a pruned layer. The lanes of each row split the weights it kept, and read the inputs they connect to straight from otherValues
+void doSparseForwardPass() {
+    uint lane = gl_LocalInvocationID.x;
+    uint row = lane / FORWARD_LANES;
+    uint sub = lane % FORWARD_LANES;
+    uint index = gl_WorkGroupID.x * FORWARD_ROWS + row;
+    uint firstSample = gl_WorkGroupID.y * FORWARD_SAMPLES;
+    bool validRow = index < thisCount;
+
+    float sums[FORWARD_SAMPLES];
+    float compensations[FORWARD_SAMPLES];
+    for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+        sums[s] = 0.0;
+        compensations[s] = 0.0;
+    }
+
+    if (validRow) {
+        uint columns = thisCount + 1;
+        for (uint j = sparseIndex[index] + sub; j < sparseIndex[index + 1]; j += FORWARD_LANES) {
+            float weight = weights[j];
+            uint k = sparseIndex[columns + j];
+
+            for (uint s = 0; s < FORWARD_SAMPLES; s++) {
+                uint b = firstSample + s;
+                if (b < batchSize) {
+                    compensatedAdd(sums[s], compensations[s], weight * otherValues[b * lastCount + k]);
+                }
+            }
+        }
+    }
+
+    storeForward(lane, sub, index, firstSample, validRow, sums, compensations);
+}
+
+// Apply the gradient of one parameter summed over the batch, returning its new value. 'slot' is the index of a weight, or storedWeights plus the index of a bias.
+// Every parameter has a single writer, so its moments are updated in place
+float optimize(float value, float gradient, uint slot, bool isWeight) {
+    gradient += (isWeight ? l2Decay : 0.0) * value;
+
+    if (optimizer == 1) {
+        float m = momentum * moments[slot] + gradient;
+        moments[slot] = m;
+        return value - m;
+    }
+
+    if (optimizer >= 2) {
+        uint row = uint(storedWeights + thisCount);
+        float m = momentum * moments[slot] + (1.0 - momentum) * gradient;
+        float v = beta2 * moments[row + slot] + (1.0 - beta2) * gradient * gradient;
+        moments[slot] = m;
+        moments[row + slot] = v;
+        return value - optimizerRate * (m * firstCorrection / (sqrt(v * secondCorrection) + epsilon) + (isWeight ? decoupledDecay : 0.0) * value);
+    }
+
+    return value - gradient;
 }
 
 uint windex(uint lastIndex, uint thisIndex) {
@@ -81,64 +386,340 @@ void doBackProp1(uint index) {
         // A 'block' is a list of listCount floats, in which there are thisCount number of blocks. Therefore this is how we iterate given 'index' and 'i'
         weightIndex = windex(index, i);
 
-        thisValCost = valCost(neurons[i].value, neurons[i].expected);
+        thisValCost = valCost(thisValues[i], thisExpected[i]);
         valueCost += thisValCost;
 
-        weights[weightIndex] -= learningRate * otherNeurons[index].value * thisValCost; // THIS WORKED WITH MOST NUMBERS ???
+        weights[weightIndex] -= errorScale * otherValues[index] * thisValCost; // THIS WORKED WITH MOST NUMBERS ???
     }
 
     valueCost /= thisCount;
 
-    neurons[index].bias -= learningRate * float(valueCost);
-    otherNeurons[index].expected = otherNeurons[index].value - float(valueCost) / 20.0; // dividing by 10 creates a batch of 10.. I think.. and it works? soo uhhh ? Why does everyone need calculus? It's just intuitive ratios. 5 is too low. 20 is good, 10 is good too.
+    biases[index] -= errorScale * float(valueCost);
+    otherExpected[index] = otherValues[index] - float(valueCost) / 20.0; // dividing by 10 creates a batch of 10.. I think.. and it works? soo uhhh ? Why does everyone need calculus? It's just intuitive ratios. 5 is too low. 20 is good, 10 is good too.
 
     // What?
 }
 
-void doBackProp2(uint index) {
+// Calculate the activation derividive delta of one neuron of this layer for one sample. We can use this for 3 things - adjusting weights, adjusting bias, and carrying backwards (using the derivitive of the last activation, which is the weight)
+float neuronDelta(uint neuronIndex) {
+    float error = 0.0;
+    if (isLastLayer) {
+        // Calculate error and delta for last layer
+        error = errorScale * valCostD(thisValues[neuronIndex], thisExpected[neuronIndex]);
+    } else {
+        // Calculate error and delta for hidden layer(s)
+        // In this case, 'expected' is actually the calculated activation cost sum from the next layer, calculated from the last backpropagation phase on that layer
+        error = thisExpected[neuronIndex];
+    }
+
+    return activationD(thisValues[neuronIndex]) * error;
+}
+
+shared float deltaTile[BATCH_CAPACITY][BACKPROP_TILE];
+shared float lastValueTile[BATCH_CAPACITY][WORKGROUP_SIZE];
+
+// Each lane owns one neuron of the last layer, so neighbouring lanes touch neighbouring weights.
+// The deltas of this layer are calculated cooperatively a tile at a time into shared memory and reused by every lane.
+// The gradient of each weight is summed over the batch and applied once
+void doBackProp2() {
+    uint lane = gl_LocalInvocationID.x;
+    uint index = gl_WorkGroupID.x * WORKGROUP_SIZE + lane; // The last layer neuron index
+    bool valid = index < lastCount;
+
     // Output
-    float thisActivationCost = 0.0;
+    float thisActivationCosts[BATCH_CAPACITY];
+    for (uint b = 0; b < batchSize; b++) {
+        thisActivationCosts[b] = 0.0;
+        lastValueTile[b][lane] = valid ? otherValues[b * lastCount + index] : 0.0;
+    }
 
     // Temp to be reused
-    float error = 0.0;
-    float delta = 0.0;
+    float weight = 0.0;
+    float gradient = 0.0;
     uint weightIndex = 0;
 
-    for (uint i = 0; i < thisCount; i++) {
-        weightIndex = windex(index, i);
-
-        if (isLastLayer) {
-            // Calculate error and delta for last layer
-            error = learningRate * valCostD(neurons[i].value, neurons[i].expected);
-        } else {
-            // Calculate error and delta for hidden layer(s)
-            // In this case, 'expected' is actually the calculated activation cost sum from the next layer, calculated from the last backpropagation phase on that layer
-            error = neurons[i].expected;
+    for (uint tile = 0; tile < thisCount; tile += BACKPROP_TILE) {
+        // Calculate the deltas of this tile for every sample
+        for (uint e = lane; e < BACKPROP_TILE * batchSize; e += WORKGROUP_SIZE) {
+            uint b = e / BACKPROP_TILE;
+            uint r = e % BACKPROP_TILE;
+            deltaTile[b][r] = tile + r < thisCount ? neuronDelta(b * thisCount + tile + r) : 0.0;
+        }
+        barrier();
+
+        // Only the first workgroup adjusts the biases. Every workgroup calculates the same deltas
+        if (gl_WorkGroupID.x == 0 && lane < BACKPROP_TILE && tile + lane < thisCount) {
+            float biasGradient = 0.0;
+            for (uint b = 0; b < batchSize; b++) {
+                biasGradient += deltaTile[b][lane];
+            }
+            biases[tile + lane] = optimize(biases[tile + lane], biasGradient, storedWeights + tile + lane, false); // The derivitive of z with respect to b is 1.0
         }
 
-        // Calculate the activation derividive delta. We can use this for 3 things - adjusting weights, adjusting bias, and carrying backwards (using the derivitive of the last activation, which is the weight)
-        delta = activationD(neurons[i].value) * error;
-        thisActivationCost += weights[weightIndex] * delta; // Carry over the weight before we adjust it
-        weights[weightIndex] -= otherNeurons[index].value * delta;
+        if (valid) {
+            for (uint r = 0; r < BACKPROP_TILE && tile + r < thisCount; r++) {
+                weightIndex = windex(index, tile + r);
+                weight = weights[weightIndex]; // Carry over the weight before we adjust it
+                gradient = 0.0;
+
+                for (uint b = 0; b < batchSize; b++) {
+                    thisActivationCosts[b] += weight * deltaTile[b][r];
+                    gradient += lastValueTile[b][lane] * deltaTile[b][r];
+                }
 
-        // Only adjust biases for the last layer if we're index 0. All threads have the same delta in theory.. so they will all set to the same
-        // I just want to syncrhonize so they don't corrupt or whatever
-        if (index == 0) {
-            neurons[i].bias -= delta; // The derivitive of z with respect to b is 1.0
+                weights[weightIndex] = optimize(weight, gradient, weightIndex, true);
+            }
         }
+        barrier();
     }
 
     // Carry the activation cost backwards
     // Carry 'output_delta' to the next (previous) layer
-    otherNeurons[index].expected = thisActivationCost;
+    if (valid) {
+        for (uint b = 0; b < batchSize; b++) {
+            otherExpected[b * lastCount + index] = thisActivationCosts[b];
+        }
+    }
 }
 
-void main() {
-    uint index = gl_WorkGroupID.x; // This neuron index
+// Same as doBackProp2() for a pruned layer. Each lane still owns one neuron of the last layer, and walks the weights it kept column by column,
+// so every weight has a single writer. The kept weights of a column connect to scattered rows, so the deltas are calculated where they are needed
+void doSparseBackProp() {
+    uint lane = gl_LocalInvocationID.x;
+    uint index = gl_WorkGroupID.x * WORKGROUP_SIZE + lane; // The last layer neuron index
+    uint weightCount = sparseIndex[thisCount];
+    uint columnOffsets = thisCount + 1 + weightCount;
+    uint rows = columnOffsets + lastCount + 1;
+    uint positions = rows + weightCount;
+
+    // Only the first workgroup adjusts the biases
+    if (gl_WorkGroupID.x == 0) {
+        for (uint i = lane; i < thisCount; i += WORKGROUP_SIZE) {
+            float biasGradient = 0.0;
+            for (uint b = 0; b < batchSize; b++) {
+                biasGradient += neuronDelta(b * thisCount + i);
+            }
+            biases[i] = optimize(biases[i], biasGradient, storedWeights + i, false); // The derivitive of z with respect to b is 1.0
+        }
+    }
+
+    if (index >= lastCount) {
+        return;
+    }
+
+    float thisActivationCosts[BATCH_CAPACITY];
+    for (uint b = 0; b < batchSize; b++) {
+        thisActivationCosts[b] = 0.0;
+    }
+
+    for (uint e = sparseIndex[columnOffsets + index]; e < sparseIndex[columnOffsets + index + 1]; e++) {
+        uint i = sparseIndex[rows + e];
+        uint weightIndex = sparseIndex[positions + e];
+        float weight = weights[weightIndex]; // Carry over the weight before we adjust it
+        float gradient = 0.0;
+
+        for (uint b = 0; b < batchSize; b++) {
+            float delta = neuronDelta(b * thisCount + i);
+            thisActivationCosts[b] += weight * delta;
+            gradient += otherValues[b * lastCount + index] * delta;
+        }
+
+        weights[weightIndex] = optimize(weight, gradient, weightIndex, true);
+    }
+
+    for (uint b = 0; b < batchSize; b++) {
+        otherExpected[b * lastCount + index] = thisActivationCosts[b];
+    }
+}
+
+// The small image of a convolution for one sample. For a convolution it holds this layer's deltas during backprop, for a transposed convolution the last layer's values
+float smallSource(uint b, uint i) {
+    return convolution == 1 ? neuronDelta(b * thisCount + i) : otherValues[b * lastCount + i];
+}
+
+// The big image of a convolution for one sample. For a convolution it holds the last layer's values, for a transposed convolution this layer's deltas during backprop
+float bigSource(uint b, uint i) {
+    return convolution == 1 ? otherValues[b * lastCount + i] : neuronDelta(b * thisCount + i);
+}
 
-    if (backProp) {
-        doBackProp2(index);
+uint convWeight(uint s, uint c, uint ky, uint kx) {
+    return ((s * bigChannels + c) * kernelSize + ky) * kernelSize + kx;
+}
+
+// Sum the big image pixels small image neuron 'index' connects to, times their weights
+float gatherBig(uint b, uint index) {
+    uint positions = smallSize * smallSize;
+    uint s = index / positions;
+    int y = int(index % positions) / smallSize;
+    int x = int(index % positions) % smallSize;
+    float sum = 0.0;
+
+    for (uint c = 0; c < bigChannels; c++) {
+        for (int ky = 0; ky < kernelSize; ky++) {
+            int iy = y * kernelStride - kernelPadding + ky;
+            if (iy < 0 || iy >= bigSize) {
+                continue;
+            }
+            for (int kx = 0; kx < kernelSize; kx++) {
+                int ix = x * kernelStride - kernelPadding + kx;
+                if (ix >= 0 && ix < bigSize) {
+                    sum += weights[convWeight(s, c, ky, kx)] * bigSource(b, (c * bigSize + iy) * bigSize + ix);
+                }
+            }
+        }
+    }
+
+    return sum;
+}
+
+// Sum the small image neurons big image pixel 'index' connects to, times their weights. Only the kernel offsets landing on a whole stride step connect
+float gatherSmall(uint b, uint index) {
+    uint pixels = bigSize * bigSize;
+    uint c = index / pixels;
+    int iy = int(index % pixels) / bigSize + kernelPadding;
+    int ix = int(index % pixels) % bigSize + kernelPadding;
+    float sum = 0.0;
+
+    for (int ky = iy % kernelStride; ky < kernelSize; ky += kernelStride) {
+        int y = (iy - ky) / kernelStride;
+        if (y < 0) {
+            break;
+        }
+        if (y >= smallSize) {
+            continue;
+        }
+        for (int kx = ix % kernelStride; kx < kernelSize; kx += kernelStride) {
+            int x = (ix - kx) / kernelStride;
+            if (x < 0) {
+                break;
+            }
+            if (x >= smallSize) {
+                continue;
+            }
+            for (uint s = 0; s < smallChannels; s++) {
+                sum += weights[convWeight(s, c, ky, kx)] * smallSource(b, (s * smallSize + y) * smallSize + x);
+            }
+        }
+    }
+
+    return sum;
+}
+
+// One lane per neuron of this layer, one row of workgroups per sample. The kernels are small, so every lane reads its own window of the last layer directly
+void doConvolutionForwardPass() {
+    uint index = gl_GlobalInvocationID.x;
+    uint b = gl_WorkGroupID.y;
+    if (index >= thisCount) {
+        return;
+    }
+
+    float z = convolution == 1 ? gatherBig(b, index) : gatherSmall(b, index);
+    thisValues[b * thisCount + index] = activation(z + biases[index]);
+}
+
+// Pass 0 carries the deltas into the last layer, one lane per neuron of the last layer and one row of workgroups per sample, before any weight changes.
+// Pass 1 runs one workgroup per weight, whose lanes sum its gradient over every position of every sample
+void doConvolutionBackProp() {
+    uint lane = gl_LocalInvocationID.x;
+
+    if (backPropPass == 0) {
+        // Only the first workgroup adjusts the biases, one per neuron
+        if (gl_WorkGroupID.x == 0 && gl_WorkGroupID.y == 0) {
+            for (uint i = lane; i < thisCount; i += WORKGROUP_SIZE) {
+                float biasGradient = 0.0;
+                for (uint b = 0; b < batchSize; b++) {
+                    biasGradient += neuronDelta(b * thisCount + i);
+                }
+                biases[i] = optimize(biases[i], biasGradient, storedWeights + i, false); // The derivitive of z with respect to b is 1.0
+            }
+        }
+
+        uint index = gl_GlobalInvocationID.x;
+        uint b = gl_WorkGroupID.y;
+        if (index < lastCount) {
+            // The last layer is the big image of a convolution and the small image of a transposed one
+            otherExpected[b * lastCount + index] = convolution == 1 ? gatherSmall(b, index) : gatherBig(b, index);
+        }
+        return;
+    }
+
+    uint w = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    if (w >= smallChannels * bigChannels * kernelSize * kernelSize) {
+        return; // The whole workgroup leaves together
+    }
+
+    int kx = int(w % kernelSize);
+    int ky = int(w / kernelSize % kernelSize);
+    uint c = w / (kernelSize * kernelSize) % bigChannels;
+    uint s = w / (kernelSize * kernelSize * bigChannels);
+    uint positions = smallSize * smallSize;
+
+    float gradient = 0.0;
+    for (uint e = lane; e < batchSize * positions; e += WORKGROUP_SIZE) {
+        uint b = e / positions;
+        uint p = e % positions;
+        int iy = int(p) / smallSize * kernelStride - kernelPadding + ky;
+        int ix = int(p) % smallSize * kernelStride - kernelPadding + kx;
+        if (iy >= 0 && iy < bigSize && ix >= 0 && ix < bigSize) {
+            gradient += smallSource(b, s * positions + p) * bigSource(b, (c * bigSize + iy) * bigSize + ix);
+        }
+    }
+
+    partialSums[0][lane] = gradient;
+    barrier();
+
+    for (uint width = WORKGROUP_SIZE / 2; width > 0; width /= 2) {
+        if (lane < width) {
+            partialSums[0][lane] += partialSums[0][lane + width];
+        }
+        barrier();
+    }
+
+    if (lane == 0) {
+        weights[w] = optimize(weights[w], partialSums[0][0], w, true);
+    }
+}
+
+// Copy a staged [batchSize x thisCount] batch into the values of the input layer (this), and the expected values of the output layer (other)
+// The network is an autoencoder, so each sample is also its own expected output
+void doLoadBatch() {
+    uint index = gl_GlobalInvocationID.x;
+    uint offset = uint(stagingOffset);
+
+    if (index < uint(batchSize * thisCount)) {
+        thisValues[index] = staged[offset + index];
+    }
+
+    if (index < uint(batchSize * lastCount)) {
+        uint sample = index / uint(lastCount);
+        uint neuron = index % uint(lastCount);
+        otherExpected[index] = neuron < uint(thisCount) ? staged[offset + sample * uint(thisCount) + neuron] : 0.0;
+    }
+}
+
+#ifdef ENTRY_POINT
+// A specialized variant runs a single pass
+void main() {
+    ENTRY_POINT();
+}
+#else
+void main() {
+    if (loadBatch) {
+        doLoadBatch();
+    } else if (backProp) {
+        if (convolution != 0) {
+            doConvolutionBackProp();
+        } else if (sparse) {
+            doSparseBackProp();
+        } else {
+            doBackProp2();
+        }
+    } else if (convolution != 0) {
+        doConvolutionForwardPass();
+    } else if (sparse) {
+        doSparseForwardPass();
     } else {
-        doForwardPass(index);
+        doForwardPass();
     }
 }
+#endif
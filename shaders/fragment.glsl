@@ -17,14 +17,13 @@ uniform float drawSize;
 uniform vec3 screenPos;
 uniform vec3 screenSize;
 
-struct Neuron {
-    float bias;
-    float value;
-    float expected;
+// Only the first sample of a batched layer is displayed
+layout(std430, binding = 0) buffer Values {
+    float values[];
 };
 
-layout(std430, binding = 0) buffer SSBO {
-    Neuron neurons[];
+layout(std430, binding = 1) buffer Expected {
+    float expected[];
 };
 
 void main() {
@@ -46,12 +45,12 @@ void main() {
 
     if (mouseRange) {
         if (lalt) {
-            val = neurons[index].expected;
+            val = expected[index];
             if (!lctrl) {
                 minV = -1.0;
             }
         } else {
-            val = neurons[index].value;
+            val = values[index];
         }
 
         if (leftClick) {
@@ -66,15 +65,14 @@ void main() {
         //val = min(max(val, minV), 1.0);
 
         if (lalt) {
-            neurons[index].expected = val;
+            expected[index] = val;
         } else {
-            neurons[index].value = val;
+            values[index] = val;
         }
     }
 
     // Draw
-    float cost = neurons[index].expected - neurons[index].value;
-    //FragColor = vec4(vec3(neurons[index].bias, 0, neurons[index].expected), 1.0);
+    float cost = expected[index] - values[index];
     //FragColor = vec4(vec3(abs(cost), 0, 0), 1.0);
-    FragColor = vec4(vec3(neurons[index].value) + vec3(-neurons[index].expected, 0.0, neurons[index].expected) * 0.3, 1.0);
+    FragColor = vec4(vec3(values[index]) + vec3(-expected[index], 0.0, expected[index]) * 0.3, 1.0);
 }
@@ -0,0 +1,33 @@
+#include "backend.h"
+#include "layer.h"
+
+/* @brief Feed forward a range of layers in order, each from the one before it. Runs feedForward() on every layer unless the backend can do better
+ * @param[in] layers	The layers of the network
+ * @param[in] first		The first layer to compute, at least 1
+ * @param[in] last		The last layer to compute
+*/
+void Backend::forwardPass(std::vector<Layer>& layers, size_t first, size_t last) {
+	for (size_t i=first;i<=last;i++) {
+		this->feedForward(layers[i], layers[i-1]);
+	}
+}
+
+/* @brief Back propagate every layer of a network, from the output layer down to the first hidden layer. Runs backPropagate() on every layer
+ * unless the backend can do better
+ * @param[in] layers	The layers of the network
+ * @param[in] step		The optimizer and learning rate to adjust every layer with
+*/
+void Backend::backwardPass(std::vector<Layer>& layers, OptimizerStep const& step) {
+	for (size_t i=layers.size()-1;i>0;i--) {
+		this->backPropagate(layers[i], layers[i-1], i == layers.size() - 1, step);
+	}
+}
+
+/* @brief Feed forward every layer of a network again after its input changed, recomputing only as much as the change reaches. Runs forwardPass() over
+ * the whole network unless the backend can do better
+ * @param[in] layers	The layers of the network
+ * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+*/
+void Backend::incrementalPass(std::vector<Layer>& layers, float tolerance) {
+	this->forwardPass(layers, 1, layers.size() - 1);
+}
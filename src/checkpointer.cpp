@@ -0,0 +1,86 @@
+#include "checkpointer.h"
+
+Checkpointer::Checkpointer() {
+	this->worker = std::thread(&Checkpointer::run, this);
+}
+
+Checkpointer::~Checkpointer() {
+	// Queued checkpoints are still written, the last one is the newest state
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+
+	if (this->worker.joinable()) {
+		this->worker.join();
+	}
+}
+
+/* @brief Copy layers into a free snapshot and queue it to be written
+ * @param[in] layers	The layers to save, starting with the input layer
+ * @param[in] training	The training state to save with the layers, or nullptr for none
+ * @param[in] path		The file to write
+ * @return				The size of the file that will be written, in bytes
+*/
+uint64_t Checkpointer::save(std::vector<Layer>& layers, ModelTrainingState const* training, std::string const& path) {
+	// Take back the queued snapshot if the writer has not started on it, otherwise use the one it is not writing
+	int slot = 0;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		slot = this->pending >= 0 ? this->pending : (this->writing == 0 ? 1 : 0);
+		this->pending = -1;
+	}
+
+	// The writer never touches a snapshot until it is queued, so capture it without holding the lock
+	this->snapshots[slot].capture(layers, training);
+	this->paths[slot] = path;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pending = slot;
+	}
+	this->changed.notify_all();
+
+	return this->snapshots[slot].getSize();
+}
+
+/* @brief Wait for every queued checkpoint to be written
+ * @return False if any write failed since the last wait
+*/
+bool Checkpointer::wait() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->changed.wait(lock, [this] { return this->pending < 0 && this->writing < 0; });
+
+	bool succeeded = !this->failed;
+	this->failed = false;
+	return succeeded;
+}
+
+/* @brief Writing loop of the background thread
+*/
+void Checkpointer::run() {
+	while (true) {
+		int slot = 0;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->changed.wait(lock, [this] { return this->stopping || this->pending >= 0; });
+			if (this->pending < 0) {
+				return;
+			}
+
+			slot = this->pending;
+			this->writing = slot;
+			this->pending = -1;
+		}
+
+		bool failed = this->snapshots[slot].write(this->paths[slot]) != 0;
+
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->writing = -1;
+			this->failed = this->failed || failed;
+		}
+		this->changed.notify_all();
+	}
+}
@@ -0,0 +1,68 @@
+#include "checksum.h"
+#include <immintrin.h>
+#include <cstring>
+
+// Reflected CRC-32C polynomial
+#define CRC32C_POLYNOMIAL	0x82F63B78u
+
+/* @brief Build the byte-at-a-time lookup table for the portable CRC
+ * @return A pointer to 256 table entries
+*/
+static uint32_t const* crcTable() {
+	static uint32_t table[256];
+	static bool built = false;
+
+	if (!built) {
+		for (uint32_t i=0;i<256;i++) {
+			uint32_t value = i;
+			for (int bit=0;bit<8;bit++) {
+				value = (value & 1) ? (value >> 1) ^ CRC32C_POLYNOMIAL : value >> 1;
+			}
+			table[i] = value;
+		}
+		built = true;
+	}
+
+	return table;
+}
+
+static uint32_t crcScalar(uint8_t const* data, size_t size, uint32_t crc) {
+	uint32_t const* table = crcTable();
+	for (size_t i=0;i<size;i++) {
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crcSSE42(uint8_t const* data, size_t size, uint32_t crc) {
+	uint64_t crc64 = crc;
+	size_t i = 0;
+
+	for (;i+8<=size;i+=8) {
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = static_cast<uint32_t>(crc64);
+	for (;i<size;i++) {
+		crc = _mm_crc32_u8(crc, data[i]);
+	}
+	return crc;
+}
+
+/* @brief Calculate the CRC-32C (Castagnoli) of a block of memory. Uses the SSE4.2 crc32 instruction when the host supports it
+ * @param[in] data	The memory to checksum
+ * @param[in] size	The number of bytes
+ * @param[in] crc	The checksum of any data before this block, to checksum a stream in pieces
+ * @return			The checksum
+*/
+uint32_t crc32c(void const* data, size_t size, uint32_t crc) {
+	static const bool hasSSE42 = __builtin_cpu_supports("sse4.2");
+	uint8_t const* bytes = static_cast<uint8_t const*>(data);
+
+	crc = ~crc;
+	crc = hasSSE42 ? crcSSE42(bytes, size, crc) : crcScalar(bytes, size, crc);
+	return ~crc;
+}
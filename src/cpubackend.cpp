@@ -0,0 +1,476 @@
+#include "cpubackend.h"
+#include "cpukernels.h"
+#include "defines.h"
+#include "layer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Number of weights per task when reducing and applying gradients
+#define CPU_REDUCE_CHUNK	65536
+// An incremental pass recomputes a layer in full once more than 1 in this many of its inputs moved
+#define CPU_INCREMENTAL_FRACTION	8
+// ...and after this many incremental updates, before the rounding error of adding the changes in builds up
+#define CPU_INCREMENTAL_REFRESH		1024
+// Dense layers only gather the weight columns their input uses while at most this fraction of the input columns are nonzero, see kernelCompact().
+// A gather costs more than a load, and the backward pass gathers and scatters
+#define CPU_COMPACT_FORWARD_DENSITY		0.5
+#define CPU_COMPACT_BACKWARD_DENSITY	0.25
+// Shards of fewer samples reuse each gathered column less, so they need inputs this many times sparser
+#define CPU_COMPACT_SMALL_BATCH			8
+#define CPU_COMPACT_SMALL_FACTOR		4
+// Layers of fewer neurons, or fed by fewer, are cheaper to multiply than to compact
+#define CPU_COMPACT_MIN_NEURONS			64
+
+/* @brief Get the most nonzero input columns a shard can have for the compact kernels to be faster than the dense ones
+ * @param[in] density	CPU_COMPACT_FORWARD_DENSITY or CPU_COMPACT_BACKWARD_DENSITY
+ * @param[in] batch		The number of samples in the shard
+ * @param[in] thisCount	The number of neurons in this layer
+ * @param[in] lastCount	The number of neurons in the last layer
+ * @return				The number of columns
+*/
+static uint32_t getCompactLimit(double density, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (thisCount < CPU_COMPACT_MIN_NEURONS || lastCount < CPU_COMPACT_MIN_NEURONS) {
+		return 0;
+	}
+	if (batch < CPU_COMPACT_SMALL_BATCH) {
+		density /= CPU_COMPACT_SMALL_FACTOR;
+	}
+	return static_cast<uint32_t>(lastCount * density);
+}
+
+/* @brief Start the backend's threads
+ * @param[in] threadCount	The number of threads to split each batch across. 0 uses one per physical core, see ThreadPool::getPhysicalCoreCount()
+ * @param[in] hogwild		True to let every thread update the weights as soon as its shard is done, racing the others
+*/
+CPUBackend::CPUBackend(size_t threadCount, bool hogwild) : pool(threadCount), hogwild(hogwild) {}
+
+/* @brief Get the type of this backend, which decides where the layers keep their neurons and weights
+ * @return The backend type
+*/
+Backend::Type CPUBackend::getType() const {
+	return Backend::CPU;
+}
+
+/* @brief Perform the feed forward algorithm on a layer using a reference to the previous layer. Performs on the host with SIMD kernels, one shard of the batch per thread.
+ * Quantized layers run on their int8 weights, pruned layers on their sparse weights, reduced layers on their fp16 or bf16 weights, convolutions one sample
+ * at a time on their unfolded last layer image
+ * @param[in] thisLayer	The layer to calculate the values for
+ * @param[in] lastLayer	A reference to the last layer to be fed into this layer
+ * @return				A reference to thisLayer
+*/
+Layer& CPUBackend::feedForward(Layer& thisLayer, Layer& lastLayer) {
+	thisLayer.invalidateIncremental();
+	this->forward(thisLayer, lastLayer, nullptr);
+	return thisLayer;
+}
+
+/* @brief Run the forward kernels of a layer, one shard of the batch per thread
+ * @param[in] thisLayer	The layer to calculate the values for
+ * @param[in] lastLayer	The layer fed into it
+ * @param[out] z		batch rows of thisCount values before activation, or nullptr if they are not needed
+*/
+void CPUBackend::forward(Layer& thisLayer, Layer& lastLayer, float* z) {
+	uint32_t thisCount = thisLayer.getNeuronCount();
+	uint32_t lastCount = lastLayer.getNeuronCount();
+	uint32_t batch = thisLayer.getBatchSize();
+	uint32_t shards = this->getShardCount(batch);
+	float* thisValues = thisLayer.getHostValues();
+	float const* lastValues = lastLayer.getHostValues();
+	QuantizedWeights const& quantized = thisLayer.getQuantized();
+
+	SparseWeights const& sparse = thisLayer.getSparse();
+
+	if (thisLayer.isQuantized()) {
+		this->quantizedInput.resize(static_cast<size_t>(batch) * quantized.stride);
+	} else {
+		this->reserveScratch(shards, thisLayer, lastCount);
+	}
+
+	// The values are already contiguous [batch x count] matrices, so the kernel reads and writes them in place
+	this->pool.parallelFor(shards, [&](size_t shard) {
+		uint32_t b0 = shard * batch / shards;
+		uint32_t b1 = (shard + 1) * batch / shards;
+		float* shardValues = thisValues + static_cast<size_t>(b0) * thisCount;
+
+		if (thisLayer.isQuantized()) {
+			// Each shard quantizes its own samples of the last layer, then runs them against the int8 weights
+			uint8_t* shardInput = this->quantizedInput.data() + static_cast<size_t>(b0) * quantized.stride;
+			kernelQuantize(lastValues + static_cast<size_t>(b0) * lastCount, shardInput, b1 - b0, lastCount, quantized.stride, quantized.inputScale, quantized.inputZero);
+			kernelForwardInt8(quantized.weights, quantized.scales.data(), quantized.rowSums.data(), quantized.stride, shardInput, quantized.inputScale, quantized.inputZero,
+				thisLayer.getHostBiases(), shardValues, b1 - b0, thisCount);
+		} else if (thisLayer.isSparse()) {
+			kernelForwardSparse(sparse.rowOffsets, sparse.columns, sparse.values, lastValues + static_cast<size_t>(b0) * lastCount, thisLayer.getHostBiases(), shardValues,
+				this->scratch[shard].data(), b1 - b0, thisCount, lastCount);
+		} else if (thisLayer.isConvolution()) {
+			kernelForwardConvolution(thisLayer.getConvolution(), thisLayer.getHostWeights(), lastValues + static_cast<size_t>(b0) * lastCount, thisLayer.getHostBiases(),
+				shardValues, this->scratch[shard].data(), b1 - b0);
+		} else if (thisLayer.isReduced()) {
+			// Reduced weights are widened as they stream in, which costs less than the memory they save. Gathering columns would lose that
+			float const* shardInput = lastValues + static_cast<size_t>(b0) * lastCount;
+			uint16_t const* reduced = thisLayer.getReduced().weights;
+			if (thisLayer.getPrecision() == MODEL_FORMAT_BF16) {
+				kernelForwardBF16(reduced, shardInput, thisLayer.getHostBiases(), shardValues, this->scratch[shard].data(), b1 - b0, thisCount, lastCount);
+			} else {
+				kernelForwardFP16(reduced, shardInput, thisLayer.getHostBiases(), shardValues, b1 - b0, thisCount, lastCount);
+			}
+		} else {
+			// Mostly blank drawings and the outputs of ReLU layers only need the weight columns of their nonzero values
+			float const* shardInput = lastValues + static_cast<size_t>(b0) * lastCount;
+			uint32_t* columns = this->compactColumns[shard].data();
+			float* packed = this->scratch[shard].data();
+			uint32_t limit = getCompactLimit(CPU_COMPACT_FORWARD_DENSITY, b1 - b0, thisCount, lastCount);
+			uint32_t used = kernelCompact(shardInput, columns, packed, b1 - b0, lastCount, limit);
+			if (used <= limit) {
+				kernelForwardCompact(thisLayer.getHostWeights(), columns, used, packed, thisLayer.getHostBiases(), shardValues, packed + static_cast<size_t>(b1 - b0) * lastCount,
+					b1 - b0, thisCount, lastCount);
+			} else {
+				kernelForward(thisLayer.getHostWeights(), shardInput, thisLayer.getHostBiases(), shardValues, b1 - b0, thisCount, lastCount);
+			}
+		}
+
+		if (z != nullptr) {
+			std::memcpy(z + static_cast<size_t>(b0) * thisCount, shardValues, sizeof(float) * (b1 - b0) * thisCount);
+		}
+		kernelActivate(thisLayer.getActivation(), shardValues, static_cast<size_t>(b1 - b0) * thisCount);
+	});
+}
+
+/* @brief Feed forward only what changed since the last incremental pass. Every layer keeps its pre-activations and the inputs they were computed from,
+ * and a dense layer adds (new input - old input) times the weight column of each input that moved by more than the tolerance, then activates again.
+ * Layers whose inputs all held still keep their values, so a few painted pixels only cost a few columns of the first layer. Layers are recomputed in full
+ * the first time, after anything else changed their weights or values, when too many inputs moved, and every so often to drop the rounding error
+ * @param[in] layers	The layers of the network
+ * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+*/
+void CPUBackend::incrementalPass(std::vector<Layer>& layers, float tolerance) {
+	// Every layer checks its own inputs, so a layer fed by one that held still costs one comparison per input
+	for (size_t i=1;i<layers.size();i++) {
+		this->updateIncremental(layers[i], layers[i-1], tolerance);
+	}
+}
+
+/* @brief Bring a layer up to date with the inputs that moved since its last incremental pass, see incrementalPass()
+ * @param[in] thisLayer	The layer to update
+ * @param[in] lastLayer	The layer fed into it
+ * @param[in] tolerance	How far an input has to move to count
+*/
+void CPUBackend::updateIncremental(Layer& thisLayer, Layer& lastLayer, float tolerance) {
+	uint32_t thisCount = thisLayer.getNeuronCount();
+	uint32_t lastCount = lastLayer.getNeuronCount();
+	uint32_t batch = thisLayer.getBatchSize();
+	size_t inputCount = static_cast<size_t>(batch) * lastCount;
+	size_t outputCount = static_cast<size_t>(batch) * thisCount;
+	float const* lastValues = lastLayer.getHostValues();
+	float* thisValues = thisLayer.getHostValues();
+	IncrementalCache& cache = thisLayer.getIncremental();
+
+	bool full = !cache.valid || cache.input.size() != inputCount || cache.z.size() != outputCount;
+	if (!full) {
+		// Collect the inputs that moved. The rest keep their cached value, so the pre-activations always match the cached inputs exactly
+		this->changedColumns.clear();
+		this->changedDeltas.clear();
+		this->changedStarts.assign(1, 0);
+		for (uint32_t b=0;b<batch;b++) {
+			float const* row = lastValues + static_cast<size_t>(b) * lastCount;
+			float* cached = cache.input.data() + static_cast<size_t>(b) * lastCount;
+			for (uint32_t k=0;k<lastCount;k++) {
+				float delta = row[k] - cached[k];
+				if (std::fabs(delta) > tolerance) {
+					this->changedColumns.push_back(k);
+					this->changedDeltas.push_back(delta);
+					cached[k] = row[k];
+				}
+			}
+			this->changedStarts.push_back(this->changedColumns.size());
+		}
+
+		if (this->changedColumns.empty()) {
+			return;
+		}
+
+		// Only fp32 dense weights can be added in by column. Past a few columns the full kernel is faster than the strided reads
+		bool dense = !thisLayer.isQuantized() && !thisLayer.isSparse() && !thisLayer.isConvolution() && !thisLayer.isReduced();
+		full = !dense || this->changedColumns.size() * CPU_INCREMENTAL_FRACTION > inputCount || ++cache.updates >= CPU_INCREMENTAL_REFRESH;
+	}
+
+	if (full) {
+		cache.input.assign(lastValues, lastValues + inputCount);
+		cache.z.resize(outputCount);
+		cache.updates = 0;
+		this->forward(thisLayer, lastLayer, cache.z.data());
+		cache.valid = true;
+		return;
+	}
+
+	// z[b][i] += sum over the moved inputs k of delta[b][k] * weights[i][k]
+	float const* weights = thisLayer.getHostWeights();
+	this->pool.parallelFor(this->pool.size(), [&](size_t task) {
+		uint32_t i0 = task * thisCount / this->pool.size();
+		uint32_t i1 = (task + 1) * thisCount / this->pool.size();
+
+		for (uint32_t b=0;b<batch;b++) {
+			float* z = cache.z.data() + static_cast<size_t>(b) * thisCount;
+			for (uint32_t i=i0;i<i1;i++) {
+				float const* row = weights + static_cast<size_t>(i) * lastCount;
+				float sum = 0.0;
+				for (size_t c=this->changedStarts[b];c<this->changedStarts[b+1];c++) {
+					sum += this->changedDeltas[c] * row[this->changedColumns[c]];
+				}
+				z[i] += sum;
+			}
+		}
+	});
+
+	std::memcpy(thisValues, cache.z.data(), sizeof(float) * outputCount);
+	kernelActivate(thisLayer.getActivation(), thisValues, outputCount);
+}
+
+/* @brief Perform back propagation on a layer, adjusting its weights and biases and carrying the deltas into the last layer.
+ * A single shard applies the optimizer's fused update to each weight as soon as its gradient over the batch is summed. Several shards sum their
+ * gradients and apply them once, unless hogwild updates are enabled for plain SGD
+ * @param[in] thisLayer		The layer to adjust
+ * @param[in] lastLayer		The layer before thisLayer, which receives the carried deltas in its expected values
+ * @param[in] isLastLayer	True if thisLayer is the output layer of the network
+ * @param[in] step			The optimizer and learning rate to adjust the weights and biases with
+ * @return					A reference to thisLayer
+*/
+Layer& CPUBackend::backPropagate(Layer& thisLayer, Layer& lastLayer, bool isLastLayer, OptimizerStep const& step) {
+	thisLayer.invalidateIncremental();
+	uint32_t thisCount = thisLayer.getNeuronCount();
+	uint32_t lastCount = lastLayer.getNeuronCount();
+	uint32_t batch = thisLayer.getBatchSize();
+	uint32_t shards = this->getShardCount(batch);
+	float const* thisValues = thisLayer.getHostValues();
+	float const* thisExpected = thisLayer.getHostExpected();
+	float const* lastValues = lastLayer.getHostValues();
+	float* lastExpected = lastLayer.getHostExpected();
+	float* weights = thisLayer.getHostWeights();
+	float* biases = thisLayer.getHostBiases();
+	// Pruned layers only have gradients for the weights they kept
+	SparseWeights const& sparse = thisLayer.getSparse();
+	size_t weightCount = thisLayer.getStoredWeightCount();
+
+	// The moments are one row of weights then biases per slot, see Layer::getHostMoments()
+	uint32_t slots = Optimizer::getMomentSlots(step.settings.optimizer);
+	OptimizerUpdate update = Optimizer::getUpdate(step, thisLayer.advanceMoments(slots));
+	size_t momentRow = weightCount + thisCount;
+	float* firstMoments = slots > 0 ? thisLayer.getHostMoments() : nullptr;
+	float* secondMoments = slots > 1 ? firstMoments + momentRow : nullptr;
+	float errorScale = Optimizer::getErrorScale(step);
+	bool plain = Optimizer::isPlainStep(step);
+
+	// A single shard, or hogwild, applies its gradient straight to the weights. Otherwise every shard gets its own gradient to be reduced.
+	// Every weight of a convolution is shared by every position of the image, so hogwild shards would all race on the same few weights. Convolutions always reduce.
+	// Hogwild only works for plain SGD, the other optimizers need the whole gradient of a weight at once to update its moments
+	bool convolution = thisLayer.isConvolution();
+	bool inPlace = !convolution && (shards == 1 || (this->hogwild && plain));
+	// The biases are summed over the whole batch before they are updated, unless plain SGD can add them up straight into the biases
+	bool biasInPlace = inPlace && plain;
+	// Inputs with unused columns can skip them when nothing needs their carried costs, because the last layer is the input or a ReLU layer whose
+	// derivative is 0 there, and skipping their update changes nothing, because their gradient is 0 and plain SGD applies nothing else
+	bool compactable = (lastLayer.getWeightCount() == 0 || lastLayer.getActivation() == ACTIVATION_RELU) && (!inPlace || plain);
+	if (!inPlace) {
+		this->weightGradients.resize(shards);
+		for (uint32_t s=0;s<shards;s++) {
+			this->weightGradients[s].resize(weightCount);
+		}
+	}
+	if (!biasInPlace) {
+		this->biasGradients.resize(shards);
+		for (uint32_t s=0;s<shards;s++) {
+			this->biasGradients[s].resize(thisCount);
+		}
+	}
+
+	this->reserveScratch(shards, thisLayer, lastCount);
+
+	// 'delta' is [batch x thisCount]. The carried costs are written straight into the last layer's expected values
+	this->delta.resize(static_cast<size_t>(batch) * thisCount);
+
+	this->pool.parallelFor(shards, [&](size_t shard) {
+		uint32_t b0 = shard * batch / shards;
+		uint32_t b1 = (shard + 1) * batch / shards;
+		float const* shardInput = lastValues + static_cast<size_t>(b0) * lastCount;
+		float* shardDelta = this->delta.data() + static_cast<size_t>(b0) * thisCount;
+		float* shardCarry = lastExpected + static_cast<size_t>(b0) * lastCount;
+		// Hogwild shards race each other on the shared biases
+		float* biasTarget = biasInPlace ? biases : this->biasGradients[shard].data();
+		float biasSign = biasInPlace ? -1.0 : 1.0;
+
+		if (!biasInPlace) {
+			std::fill(biasTarget, biasTarget + thisCount, 0.0f);
+		}
+
+		// For the output layer the error is the cost derivative, otherwise 'expected' is the activation cost carried back from the next layer
+		size_t offset = static_cast<size_t>(b0) * thisCount;
+		kernelDelta(thisLayer.getActivation(), isLastLayer, thisValues + offset, thisExpected + offset, errorScale, shardDelta, biasTarget, biasSign, b1 - b0, thisCount);
+
+		// Carry 'output_delta' to the next (previous) layer
+		if (convolution) {
+			kernelGradientConvolution(thisLayer.getConvolution(), weights, shardInput, shardDelta, shardCarry, this->weightGradients[shard].data(), this->scratch[shard].data(),
+				b1 - b0);
+		} else if (thisLayer.isSparse()) {
+			float* scratch = this->scratch[shard].data();
+			if (inPlace) {
+				kernelBackwardSparse(sparse.rowOffsets, sparse.columns, weights, shardInput, shardDelta, shardCarry, scratch, b1 - b0, thisCount, lastCount,
+					update, firstMoments, secondMoments);
+			} else {
+				kernelGradientSparse(sparse.rowOffsets, sparse.columns, weights, shardInput, shardDelta, shardCarry, this->weightGradients[shard].data(), scratch,
+					b1 - b0, thisCount, lastCount);
+			}
+		} else {
+			uint32_t* columns = this->compactColumns[shard].data();
+			float* packed = this->scratch[shard].data();
+			float* scratch = packed + static_cast<size_t>(b1 - b0) * lastCount;
+			uint32_t limit = getCompactLimit(CPU_COMPACT_BACKWARD_DENSITY, b1 - b0, thisCount, lastCount);
+			uint32_t used = compactable ? kernelCompact(shardInput, columns, packed, b1 - b0, lastCount, limit) : limit + 1;
+			bool compact = used <= limit;
+
+			if (compact && inPlace) {
+				kernelBackwardCompact(weights, columns, used, packed, shardDelta, shardCarry, scratch, b1 - b0, thisCount, lastCount, update);
+			} else if (compact) {
+				kernelGradientCompact(weights, columns, used, packed, shardDelta, shardCarry, this->weightGradients[shard].data(), scratch, b1 - b0, thisCount, lastCount);
+			} else if (inPlace) {
+				kernelBackward(weights, shardInput, shardDelta, shardCarry, b1 - b0, thisCount, lastCount, update, firstMoments, secondMoments);
+			} else {
+				kernelGradient(weights, shardInput, shardDelta, shardCarry, this->weightGradients[shard].data(), b1 - b0, thisCount, lastCount);
+			}
+		}
+	});
+
+	if (!inPlace) {
+		this->reduceGradients(shards, weightCount, thisCount);
+
+		// Apply the summed gradient once, split into chunks across the threads
+		size_t chunks = (weightCount + CPU_REDUCE_CHUNK - 1) / CPU_REDUCE_CHUNK;
+		this->pool.parallelFor(chunks, [&](size_t chunk) {
+			size_t first = chunk * CPU_REDUCE_CHUNK;
+			size_t count = std::min(static_cast<size_t>(CPU_REDUCE_CHUNK), weightCount - first);
+			kernelOptimize(update, weights + first, this->weightGradients[0].data() + first, firstMoments != nullptr ? firstMoments + first : nullptr,
+				secondMoments != nullptr ? secondMoments + first : nullptr, count);
+		});
+	}
+
+	if (!biasInPlace) {
+		// The biases are never decayed
+		update.l2Decay = 0.0;
+		update.decoupledDecay = 0.0;
+		kernelOptimize(update, biases, this->biasGradients[0].data(), firstMoments != nullptr ? firstMoments + weightCount : nullptr,
+			secondMoments != nullptr ? secondMoments + weightCount : nullptr, thisCount);
+	}
+
+	// Reduced layers train their fp32 master weights, so small updates are not lost to rounding, then run forward on them rounded again
+	thisLayer.roundWeights();
+	return thisLayer;
+}
+
+/* @brief Sum the gradients of every shard into the first shard, pairing shards up in log2(shards) rounds
+ * @param[in] shards		The number of shards to reduce
+ * @param[in] weightCount	The number of weight gradients per shard
+ * @param[in] thisCount		The number of bias gradients per shard
+*/
+void CPUBackend::reduceGradients(uint32_t shards, size_t weightCount, uint32_t thisCount) {
+	size_t chunks = (weightCount + CPU_REDUCE_CHUNK - 1) / CPU_REDUCE_CHUNK;
+
+	// Round 'stride' adds shard s + stride into shard s, for every s that is a multiple of 2 * stride
+	for (uint32_t stride=1;stride<shards;stride*=2) {
+		uint32_t pairs = (shards - stride + 2 * stride - 1) / (2 * stride);
+
+		// Each task is one chunk of one pair, so even two shards keep every thread busy
+		this->pool.parallelFor(static_cast<size_t>(pairs) * chunks, [&](size_t task) {
+			uint32_t target = task / chunks * 2 * stride;
+			size_t chunk = task % chunks;
+			size_t first = chunk * CPU_REDUCE_CHUNK;
+			size_t count = std::min(static_cast<size_t>(CPU_REDUCE_CHUNK), weightCount - first);
+
+			kernelAccumulate(this->weightGradients[target].data() + first, this->weightGradients[target + stride].data() + first, count, 1.0);
+			if (chunk == 0) {
+				kernelAccumulate(this->biasGradients[target].data(), this->biasGradients[target + stride].data(), thisCount, 1.0);
+			}
+		});
+	}
+}
+
+/* @brief Make sure every shard has the scratch space a layer's kernels need
+ * @param[in] shards	The number of shards
+ * @param[in] layer		The layer
+ * @param[in] lastCount	The number of neurons in the last layer
+*/
+void CPUBackend::reserveScratch(uint32_t shards, Layer& layer, uint32_t lastCount) {
+	// Shards differ by at most one sample, so every shard gets room for the largest. Never shrinks, so the hot path stops allocating after the first batch
+	size_t floats = 0;
+	size_t columns = 0;
+	uint32_t shardBatch = (layer.getBatchSize() + shards - 1) / shards;
+	if (layer.isSparse()) {
+		floats = kernelSparseScratch(shardBatch, layer.getNeuronCount(), lastCount);
+	} else if (layer.isConvolution()) {
+		floats = kernelConvolutionScratch(layer.getConvolution());
+	} else {
+		// The packed input, then the compact kernels' own scratch
+		floats = static_cast<size_t>(shardBatch) * lastCount + kernelCompactScratch(shardBatch, lastCount);
+		columns = lastCount;
+		if (layer.isReduced()) {
+			floats = std::max(floats, kernelBF16Scratch(shardBatch, lastCount));
+		}
+	}
+
+	this->scratch.resize(std::max<size_t>(this->scratch.size(), shards));
+	this->compactColumns.resize(std::max<size_t>(this->compactColumns.size(), shards));
+	for (uint32_t s=0;s<shards;s++) {
+		if (this->compactColumns[s].size() < columns) {
+			this->compactColumns[s].resize(columns);
+		}
+		if (this->scratch[s].size() < floats) {
+			this->scratch[s].resize(floats);
+		}
+	}
+}
+
+/* @brief Get the number of shards a batch is split into
+ * @param[in] batch	The number of samples in the batch
+ * @return			The shard count, at most one per thread and one per sample
+*/
+uint32_t CPUBackend::getShardCount(uint32_t batch) {
+	return static_cast<uint32_t>(std::min(static_cast<size_t>(batch), this->pool.size()));
+}
+
+/* @brief Get the number of threads each batch is split across
+ * @return The thread count
+*/
+size_t CPUBackend::getThreadCount() {
+	return this->pool.size();
+}
+
+/* @brief True if shards update the weights without a reduction
+ * @return True if hogwild updates are enabled
+*/
+bool CPUBackend::getHogwild() {
+	return this->hogwild;
+}
+
+/* @brief Load a batch of samples into the input layer, and into the expected values of the output layer. The network is an autoencoder, so each sample is its own expected output
+ * @param[in] inputLayer	The first layer of the network
+ * @param[in] outputLayer	The last layer of the network
+ * @param[in] batch			inputLayer.getBatchSize() rows of inputLayer.getNeuronCount() floats
+ * @return					A reference to inputLayer
+*/
+Layer& CPUBackend::loadBatch(Layer& inputLayer, Layer& outputLayer, float const* batch) {
+	uint32_t inputCount = inputLayer.getNeuronCount();
+	uint32_t outputCount = outputLayer.getNeuronCount();
+	uint32_t batchSize = inputLayer.getBatchSize();
+	float* outputExpected = outputLayer.getHostExpected();
+
+	std::memcpy(inputLayer.getHostValues(), batch, sizeof(float) * batchSize * inputCount);
+
+	for (uint32_t b=0;b<batchSize;b++) {
+		float const* sample = batch + static_cast<size_t>(b) * inputCount;
+		float* outputRow = outputExpected + static_cast<size_t>(b) * outputCount;
+		uint32_t copyCount = std::min(inputCount, outputCount);
+
+		std::memcpy(outputRow, sample, sizeof(float) * copyCount);
+		std::fill(outputRow + copyCount, outputRow + outputCount, 0.0f);
+	}
+
+	return inputLayer;
+}
@@ -0,0 +1,1728 @@
+#include "cpukernels.h"
+#include "half.h"
+#include <immintrin.h>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+// Number of last layer values processed per block. Keeps a tile of weight rows resident in L1 while every sample of the batch streams past it,
+// so each weight is read from memory once per batch instead of once per sample
+#define KERNEL_COL_BLOCK	1024
+// Number of last layer values per block in the backward pass. The inputs and carried costs of every sample for this many columns stay in L2
+#define KERNEL_BACKWARD_COL_BLOCK	1024
+// Number of weight rows processed together, so every input load is reused by each row in the tile
+#define KERNEL_ROW_TILE		4
+// The sparse kernels transpose the batch, so every weight meets this many samples per instruction. Rows of the transposed copies are padded to a multiple of it
+#define KERNEL_SPARSE_LANES	8
+// Below this many samples padding the batch out to 8 lanes wastes more than it saves, so the sparse kernels work on each sample in place instead
+#define KERNEL_SPARSE_GATHER_BATCH	4
+// The AVX-512 BF16 kernel rounds the samples to bf16 first, zero padding every row to a multiple of this many values
+#define KERNEL_BF16_LANES	32
+
+// How the dense forward kernels read their weights. Reduced precision weights are widened to fp32 as they are loaded, so the sums stay fp32
+struct FP32Weights {
+	using Type = float;
+};
+struct FP16Weights {
+	using Type = uint16_t;
+};
+struct BF16Weights {
+	using Type = uint16_t;
+};
+
+static inline float widen(FP32Weights, float weight) {
+	return weight;
+}
+
+static inline float widen(FP16Weights, uint16_t weight) {
+	return fp16ToFloat(weight);
+}
+
+static inline float widen(BF16Weights, uint16_t weight) {
+	return bf16ToFloat(weight);
+}
+
+/* ---------------- Portable kernels ---------------- */
+
+template <uint32_t Width, class Format = FP32Weights>
+static void forwardScalar(typename Format::Type const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (Width != 0) {
+		lastCount = Width;
+	}
+
+	for (uint32_t b=0;b<batch;b++) {
+		for (uint32_t i=0;i<thisCount;i++) {
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i];
+		}
+	}
+
+	for (uint32_t c0=0;c0<lastCount;c0+=KERNEL_COL_BLOCK) {
+		uint32_t c1 = c0 + KERNEL_COL_BLOCK < lastCount ? c0 + KERNEL_COL_BLOCK : lastCount;
+
+		for (uint32_t i=0;i<thisCount;i++) {
+			typename Format::Type const* row = weights + static_cast<size_t>(i) * lastCount;
+			for (uint32_t b=0;b<batch;b++) {
+				float const* x = input + static_cast<size_t>(b) * lastCount;
+				float sum = 0.0;
+				for (uint32_t k=c0;k<c1;k++) {
+					sum += widen(Format(), row[k]) * x[k];
+				}
+				z[static_cast<size_t>(b) * thisCount + i] += sum;
+			}
+		}
+	}
+}
+
+// One parameter of the fused update, see OptimizerUpdate. Also finishes the tails of the AVX2 kernel
+static inline void optimizeStep(OptimizerUpdate const& update, float& param, float gradient, float* first, float* second) {
+	gradient += update.l2Decay * param;
+
+	switch (update.optimizer) {
+		case OPTIMIZER_MOMENTUM:
+			*first = update.momentum * *first + gradient;
+			param -= *first;
+			break;
+		case OPTIMIZER_ADAM:
+		case OPTIMIZER_ADAMW:
+			*first = update.momentum * *first + (1.0f - update.momentum) * gradient;
+			*second = update.beta2 * *second + (1.0f - update.beta2) * gradient * gradient;
+			param -= update.rate * (*first * update.firstCorrection / (std::sqrt(*second * update.secondCorrection) + update.epsilon) + update.decoupledDecay * param);
+			break;
+		default:
+			param -= gradient;
+			break;
+	}
+}
+
+static void optimizeScalar(OptimizerUpdate const& update, float* params, float const* gradient, float* first, float* second, size_t count) {
+	for (size_t i=0;i<count;i++) {
+		optimizeStep(update, params[i], gradient[i], first != nullptr ? first + i : nullptr, second != nullptr ? second + i : nullptr);
+	}
+}
+
+// Store the gradient of out[index], or with InPlace apply it to out[index] with the fused update, 'out' being the parameters the moments belong to
+template <bool InPlace>
+static inline void storeGradient(OptimizerUpdate const& update, float* out, float* first, float* second, size_t index, float gradient) {
+	if (InPlace) {
+		optimizeStep(update, out[index], gradient, first != nullptr ? first + index : nullptr, second != nullptr ? second + index : nullptr);
+	} else {
+		out[index] = gradient;
+	}
+}
+
+// With InPlace the gradient is applied to the weights ('out' is the weights) with the fused update, otherwise it is written to 'out' and the weights are left alone
+template <bool InPlace, uint32_t Width>
+static void backwardScalar(float const* weights, float const* input, float const* delta, float* carry, float* out, uint32_t batch, uint32_t thisCount, uint32_t lastCount,
+	OptimizerUpdate const& update, float* first, float* second) {
+	if (Width != 0) {
+		lastCount = Width;
+	}
+
+	std::memset(carry, 0, sizeof(float) * batch * lastCount);
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		float const* row = weights + static_cast<size_t>(i) * lastCount;
+		for (uint32_t k=0;k<lastCount;k++) {
+			float w = row[k];
+			float gradient = 0.0;
+			for (uint32_t b=0;b<batch;b++) {
+				float d = delta[static_cast<size_t>(b) * thisCount + i];
+				carry[static_cast<size_t>(b) * lastCount + k] += w * d; // Carry over the weight before we adjust it
+				gradient += input[static_cast<size_t>(b) * lastCount + k] * d;
+			}
+			storeGradient<InPlace>(update, out, first, second, static_cast<size_t>(i) * lastCount + k, gradient);
+		}
+	}
+}
+
+template <class Activation>
+static void activateScalar(float* values, size_t count) {
+	for (size_t i=0;i<count;i++) {
+		values[i] = Activation::apply(values[i]);
+	}
+}
+
+// The output layer's error is the cost derivative, a hidden layer's is the activation cost carried back from the next layer
+template <class Activation, bool LastLayer>
+static void deltaScalar(float const* values, float const* expected, float errorScale, float* delta, float* bias, float biasScale, uint32_t batch, uint32_t thisCount) {
+	for (uint32_t b=0;b<batch;b++) {
+		size_t row = static_cast<size_t>(b) * thisCount;
+		for (uint32_t i=0;i<thisCount;i++) {
+			float error = LastLayer ? errorScale * valCostD(values[row + i], expected[row + i]) : expected[row + i];
+			delta[row + i] = Activation::derivative(values[row + i]) * error;
+			bias[i] += biasScale * delta[row + i]; // The derivitive of z with respect to b is 1.0
+		}
+	}
+}
+
+static void accumulateScalar(float* target, float const* source, size_t count, float scale) {
+	for (size_t i=0;i<count;i++) {
+		target[i] += scale * source[i];
+	}
+}
+
+// Rounds to nearest even like the AVX2 conversion, so both paths quantize identically
+static inline uint8_t quantizeStep(float x, float inverse, uint8_t zero) {
+	float step = std::nearbyint(x * inverse) + zero;
+	return static_cast<uint8_t>(step < 0.0f ? 0.0f : (step > 255.0f ? 255.0f : step));
+}
+
+// Turns the exact integer dot product of a row and a sample back into z
+static inline float dequantize(int32_t dot, float scale, int32_t rowSum, float inputScale, uint8_t inputZero, float bias) {
+	return bias + inputScale * scale * static_cast<float>(dot - static_cast<int32_t>(inputZero) * rowSum);
+}
+
+static void forwardInt8Scalar(int8_t const* weights, float const* scales, int32_t const* rowSums, uint32_t stride, uint8_t const* input, float inputScale, uint8_t inputZero,
+	float const* bias, float* z, uint32_t batch, uint32_t thisCount) {
+	for (uint32_t b=0;b<batch;b++) {
+		uint8_t const* x = input + static_cast<size_t>(b) * stride;
+		for (uint32_t i=0;i<thisCount;i++) {
+			int8_t const* row = weights + static_cast<size_t>(i) * stride;
+			int32_t dot = 0;
+			for (uint32_t k=0;k<stride;k++) {
+				dot += static_cast<int32_t>(row[k]) * x[k];
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = dequantize(dot, scales[i], rowSums[i], inputScale, inputZero, bias[i]);
+		}
+	}
+}
+
+static void forwardSparseScalar(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* bias, float* z,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + static_cast<size_t>(b) * lastCount;
+		for (uint32_t i=0;i<thisCount;i++) {
+			float sum = 0.0;
+			for (uint32_t j=rowOffsets[i];j<rowOffsets[i+1];j++) {
+				sum += values[j] * x[columns[j]];
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i] + sum;
+		}
+	}
+}
+
+// With InPlace the gradient is applied to the weights ('out' is the values) with the fused update, otherwise it is written to 'out' and the weights are left alone
+template <bool InPlace>
+static void backwardSparseScalar(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* delta, float* carry, float* out,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update, float* first, float* second) {
+	std::memset(carry, 0, sizeof(float) * batch * lastCount);
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		for (uint32_t j=rowOffsets[i];j<rowOffsets[i+1];j++) {
+			uint32_t k = columns[j];
+			float w = values[j];
+			float gradient = 0.0;
+			for (uint32_t b=0;b<batch;b++) {
+				float d = delta[static_cast<size_t>(b) * thisCount + i];
+				carry[static_cast<size_t>(b) * lastCount + k] += w * d;
+				gradient += input[static_cast<size_t>(b) * lastCount + k] * d;
+			}
+			storeGradient<InPlace>(update, out, first, second, j, gradient);
+		}
+	}
+}
+
+static void forwardCompactScalar(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* bias, float* z,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	for (uint32_t i=0;i<thisCount;i++) {
+		float const* row = weights + static_cast<size_t>(i) * lastCount;
+		for (uint32_t b=0;b<batch;b++) {
+			float const* x = packed + static_cast<size_t>(b) * count;
+			float sum = 0.0;
+			for (uint32_t c=0;c<count;c++) {
+				sum += row[columns[c]] * x[c];
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i] + sum;
+		}
+	}
+}
+
+// With InPlace the gradient is applied to the weights ('out' is the weights), otherwise it is written to 'out' and the weights are left alone
+template <bool InPlace>
+static void backwardCompactScalar(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* out,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update) {
+	std::memset(carry, 0, sizeof(float) * batch * lastCount);
+	if (!InPlace) {
+		std::memset(out, 0, sizeof(float) * thisCount * lastCount);
+	}
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		size_t row = static_cast<size_t>(i) * lastCount;
+		for (uint32_t c=0;c<count;c++) {
+			uint32_t k = columns[c];
+			float w = weights[row + k];
+			float gradient = 0.0;
+			for (uint32_t b=0;b<batch;b++) {
+				float d = delta[static_cast<size_t>(b) * thisCount + i];
+				carry[static_cast<size_t>(b) * lastCount + k] += w * d;
+				gradient += packed[static_cast<size_t>(b) * count + c] * d;
+			}
+			storeGradient<InPlace>(update, out, nullptr, nullptr, row + k, gradient);
+		}
+	}
+}
+
+// Samples per row of the transposed copies the sparse kernels work on
+static inline uint32_t sparseStride(uint32_t batch) {
+	return (batch + KERNEL_SPARSE_LANES - 1) / KERNEL_SPARSE_LANES * KERNEL_SPARSE_LANES;
+}
+
+// Unfold a big image into one column per small image position: col[(c * kernel + ky) * kernel + kx][y * smallSize + x] is the big image value weight [s][c][ky][kx]
+// meets at small image position (y, x), or 0 past the edges
+static void im2col(ConvolutionShape const& shape, float const* image, float* col) {
+	uint32_t k = shape.kernel;
+	uint32_t positions = shape.smallSize * shape.smallSize;
+	for (uint32_t c=0;c<shape.bigChannels;c++) {
+		float const* channel = image + static_cast<size_t>(c) * shape.bigSize * shape.bigSize;
+		for (uint32_t ky=0;ky<k;ky++) {
+			for (uint32_t kx=0;kx<k;kx++) {
+				float* row = col + static_cast<size_t>((c * k + ky) * k + kx) * positions;
+				for (uint32_t y=0;y<shape.smallSize;y++) {
+					int64_t iy = static_cast<int64_t>(y) * shape.stride - shape.padding + ky;
+					float* out = row + static_cast<size_t>(y) * shape.smallSize;
+					if (iy < 0 || iy >= shape.bigSize) {
+						std::fill(out, out + shape.smallSize, 0.0f);
+						continue;
+					}
+					float const* line = channel + static_cast<size_t>(iy) * shape.bigSize;
+					for (uint32_t x=0;x<shape.smallSize;x++) {
+						int64_t ix = static_cast<int64_t>(x) * shape.stride - shape.padding + kx;
+						out[x] = ix >= 0 && ix < shape.bigSize ? line[ix] : 0.0f;
+					}
+				}
+			}
+		}
+	}
+}
+
+// The reverse of im2col(), adding every column back into the big image position it came from. The image must be zeroed first
+static void col2im(ConvolutionShape const& shape, float const* col, float* image) {
+	uint32_t k = shape.kernel;
+	uint32_t positions = shape.smallSize * shape.smallSize;
+	for (uint32_t c=0;c<shape.bigChannels;c++) {
+		float* channel = image + static_cast<size_t>(c) * shape.bigSize * shape.bigSize;
+		for (uint32_t ky=0;ky<k;ky++) {
+			for (uint32_t kx=0;kx<k;kx++) {
+				float const* row = col + static_cast<size_t>((c * k + ky) * k + kx) * positions;
+				for (uint32_t y=0;y<shape.smallSize;y++) {
+					int64_t iy = static_cast<int64_t>(y) * shape.stride - shape.padding + ky;
+					if (iy < 0 || iy >= shape.bigSize) {
+						continue;
+					}
+					float const* in = row + static_cast<size_t>(y) * shape.smallSize;
+					float* line = channel + static_cast<size_t>(iy) * shape.bigSize;
+					for (uint32_t x=0;x<shape.smallSize;x++) {
+						int64_t ix = static_cast<int64_t>(x) * shape.stride - shape.padding + kx;
+						if (ix >= 0 && ix < shape.bigSize) {
+							line[ix] += in[x];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// c[i][j] += sum_l(a[i * aRow + l * aColumn] * b[l][j]) for m rows and n columns of c. The strides of 'a' let the weights be used as they are or transposed
+static void gemmScalar(float const* a, size_t aRow, size_t aColumn, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	for (uint32_t i=0;i<m;i++) {
+		float* out = c + static_cast<size_t>(i) * n;
+		for (uint32_t l=0;l<k;l++) {
+			float w = a[i * aRow + l * aColumn];
+			float const* in = b + static_cast<size_t>(l) * n;
+			for (uint32_t j=0;j<n;j++) {
+				out[j] += w * in[j];
+			}
+		}
+	}
+}
+
+// c[i][j] += dot(a[i], b[j]) for m rows and n columns of c, with rows of k values in both 'a' and 'b'
+static void gemmTransposedScalar(float const* a, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	for (uint32_t i=0;i<m;i++) {
+		float const* row = a + static_cast<size_t>(i) * k;
+		for (uint32_t j=0;j<n;j++) {
+			float const* column = b + static_cast<size_t>(j) * k;
+			float sum = 0.0;
+			for (uint32_t l=0;l<k;l++) {
+				sum += row[l] * column[l];
+			}
+			c[static_cast<size_t>(i) * n + j] += sum;
+		}
+	}
+}
+
+// Copy batch rows of count values to count rows of stride values, zero padding every row past the batch
+static void transposeBatch(float const* source, float* target, uint32_t batch, uint32_t count, uint32_t stride) {
+	for (uint32_t k=0;k<count;k++) {
+		float* row = target + static_cast<size_t>(k) * stride;
+		for (uint32_t b=0;b<batch;b++) {
+			row[b] = source[static_cast<size_t>(b) * count + k];
+		}
+		for (uint32_t b=batch;b<stride;b++) {
+			row[b] = 0.0;
+		}
+	}
+}
+
+/* ---------------- AVX2 + FMA kernels ---------------- */
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v) {
+	__m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+	lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+	return _mm_cvtss_f32(lo);
+}
+
+// The sums of 4 vectors at once, in order. A third of the shuffles of 4 hsum256() calls, which dominate the rows of narrow layers
+__attribute__((target("avx2,fma")))
+static inline __m128 hsum4x256(__m256 a, __m256 b, __m256 c, __m256 d) {
+	__m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(a, b), _mm256_hadd_ps(c, d));
+	return _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1));
+}
+
+// Loads 8 weights as fp32
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load8(FP32Weights, float const* weights) {
+	return _mm256_loadu_ps(weights);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load8(FP16Weights, uint16_t const* weights) {
+	return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(weights)));
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load8(BF16Weights, uint16_t const* weights) {
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(weights))), 16));
+}
+
+template <uint32_t Width, class Format = FP32Weights>
+__attribute__((target("avx2,fma,f16c")))
+static void forwardAVX2(typename Format::Type const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (Width != 0) {
+		lastCount = Width;
+	}
+
+	for (uint32_t b=0;b<batch;b++) {
+		for (uint32_t i=0;i<thisCount;i++) {
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i];
+		}
+	}
+
+	for (uint32_t c0=0;c0<lastCount;c0+=KERNEL_COL_BLOCK) {
+		uint32_t c1 = c0 + KERNEL_COL_BLOCK < lastCount ? c0 + KERNEL_COL_BLOCK : lastCount;
+		uint32_t vecEnd = c0 + ((c1 - c0) & ~7u);
+
+		uint32_t i = 0;
+		// Tiles of 4 rows by 2 samples. The rows stay in L1 for the whole batch
+		for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+			typename Format::Type const* r0 = weights + static_cast<size_t>(i) * lastCount;
+			typename Format::Type const* r1 = r0 + lastCount;
+			typename Format::Type const* r2 = r1 + lastCount;
+			typename Format::Type const* r3 = r2 + lastCount;
+
+			uint32_t b = 0;
+			for (;b+2<=batch;b+=2) {
+				float const* x0 = input + static_cast<size_t>(b) * lastCount;
+				float const* x1 = x0 + lastCount;
+				__m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps(), a02 = _mm256_setzero_ps(), a03 = _mm256_setzero_ps();
+				__m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps(), a12 = _mm256_setzero_ps(), a13 = _mm256_setzero_ps();
+
+				uint32_t k = c0;
+				for (;k<vecEnd;k+=8) {
+					__m256 v0 = _mm256_loadu_ps(x0 + k);
+					__m256 v1 = _mm256_loadu_ps(x1 + k);
+					__m256 w0 = load8(Format(), r0 + k);
+					__m256 w1 = load8(Format(), r1 + k);
+					__m256 w2 = load8(Format(), r2 + k);
+					__m256 w3 = load8(Format(), r3 + k);
+					a00 = _mm256_fmadd_ps(w0, v0, a00);
+					a01 = _mm256_fmadd_ps(w1, v0, a01);
+					a02 = _mm256_fmadd_ps(w2, v0, a02);
+					a03 = _mm256_fmadd_ps(w3, v0, a03);
+					a10 = _mm256_fmadd_ps(w0, v1, a10);
+					a11 = _mm256_fmadd_ps(w1, v1, a11);
+					a12 = _mm256_fmadd_ps(w2, v1, a12);
+					a13 = _mm256_fmadd_ps(w3, v1, a13);
+				}
+
+				float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+				float* z1 = z0 + thisCount;
+				_mm_storeu_ps(z0, _mm_add_ps(_mm_loadu_ps(z0), hsum4x256(a00, a01, a02, a03)));
+				_mm_storeu_ps(z1, _mm_add_ps(_mm_loadu_ps(z1), hsum4x256(a10, a11, a12, a13)));
+				for (;k<c1;k++) {
+					float w0 = widen(Format(), r0[k]), w1 = widen(Format(), r1[k]), w2 = widen(Format(), r2[k]), w3 = widen(Format(), r3[k]);
+					z0[0] += w0 * x0[k]; z0[1] += w1 * x0[k]; z0[2] += w2 * x0[k]; z0[3] += w3 * x0[k];
+					z1[0] += w0 * x1[k]; z1[1] += w1 * x1[k]; z1[2] += w2 * x1[k]; z1[3] += w3 * x1[k];
+				}
+			}
+
+			// Leftover sample
+			for (;b<batch;b++) {
+				float const* x0 = input + static_cast<size_t>(b) * lastCount;
+				__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+
+				uint32_t k = c0;
+				for (;k<vecEnd;k+=8) {
+					__m256 v0 = _mm256_loadu_ps(x0 + k);
+					a0 = _mm256_fmadd_ps(load8(Format(), r0 + k), v0, a0);
+					a1 = _mm256_fmadd_ps(load8(Format(), r1 + k), v0, a1);
+					a2 = _mm256_fmadd_ps(load8(Format(), r2 + k), v0, a2);
+					a3 = _mm256_fmadd_ps(load8(Format(), r3 + k), v0, a3);
+				}
+
+				float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+				_mm_storeu_ps(z0, _mm_add_ps(_mm_loadu_ps(z0), hsum4x256(a0, a1, a2, a3)));
+				for (;k<c1;k++) {
+					float w0 = widen(Format(), r0[k]), w1 = widen(Format(), r1[k]), w2 = widen(Format(), r2[k]), w3 = widen(Format(), r3[k]);
+					z0[0] += w0 * x0[k]; z0[1] += w1 * x0[k]; z0[2] += w2 * x0[k]; z0[3] += w3 * x0[k];
+				}
+			}
+		}
+
+		// Leftover rows
+		for (;i<thisCount;i++) {
+			typename Format::Type const* row = weights + static_cast<size_t>(i) * lastCount;
+			for (uint32_t b=0;b<batch;b++) {
+				float const* x0 = input + static_cast<size_t>(b) * lastCount;
+				__m256 acc = _mm256_setzero_ps();
+				uint32_t k = c0;
+				for (;k<vecEnd;k+=8) {
+					acc = _mm256_fmadd_ps(load8(Format(), row + k), _mm256_loadu_ps(x0 + k), acc);
+				}
+
+				float sum = hsum256(acc);
+				for (;k<c1;k++) {
+					sum += widen(Format(), row[k]) * x0[k];
+				}
+				z[static_cast<size_t>(b) * thisCount + i] += sum;
+			}
+		}
+	}
+}
+
+// One 8 wide slice of the fused update, see optimizeStep(). Returns the new parameters
+__attribute__((target("avx2,fma")))
+static inline __m256 optimizeSliceAVX2(OptimizerUpdate const& update, __m256 p, __m256 g, float* first, float* second) {
+	g = _mm256_fmadd_ps(_mm256_set1_ps(update.l2Decay), p, g);
+
+	switch (update.optimizer) {
+		case OPTIMIZER_MOMENTUM: {
+			__m256 m = _mm256_fmadd_ps(_mm256_set1_ps(update.momentum), _mm256_loadu_ps(first), g);
+			_mm256_storeu_ps(first, m);
+			return _mm256_sub_ps(p, m);
+		}
+		case OPTIMIZER_ADAM:
+		case OPTIMIZER_ADAMW: {
+			__m256 m = _mm256_fmadd_ps(_mm256_set1_ps(update.momentum), _mm256_loadu_ps(first), _mm256_mul_ps(_mm256_set1_ps(1.0f - update.momentum), g));
+			__m256 v = _mm256_fmadd_ps(_mm256_set1_ps(update.beta2), _mm256_loadu_ps(second), _mm256_mul_ps(_mm256_set1_ps(1.0f - update.beta2), _mm256_mul_ps(g, g)));
+			_mm256_storeu_ps(first, m);
+			_mm256_storeu_ps(second, v);
+
+			__m256 denominator = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(v, _mm256_set1_ps(update.secondCorrection))), _mm256_set1_ps(update.epsilon));
+			__m256 step = _mm256_fmadd_ps(_mm256_set1_ps(update.decoupledDecay), p, _mm256_div_ps(_mm256_mul_ps(m, _mm256_set1_ps(update.firstCorrection)), denominator));
+			return _mm256_fnmadd_ps(_mm256_set1_ps(update.rate), step, p);
+		}
+		default:
+			return _mm256_sub_ps(p, g);
+	}
+}
+
+// Vector version of storeGradient(). 'w' holds the parameters at out[index] before the update
+template <bool InPlace>
+__attribute__((target("avx2,fma")))
+static inline void storeGradientAVX2(OptimizerUpdate const& update, float* out, float* first, float* second, size_t index, __m256 w, __m256 g) {
+	if (InPlace) {
+		g = optimizeSliceAVX2(update, w, g, first != nullptr ? first + index : nullptr, second != nullptr ? second + index : nullptr);
+	}
+	_mm256_storeu_ps(out + index, g);
+}
+
+template <bool InPlace, uint32_t Width>
+__attribute__((target("avx2,fma")))
+static void backwardAVX2(float const* weights, float const* input, float const* delta, float* carry, float* out, uint32_t batch, uint32_t thisCount, uint32_t lastCount,
+	OptimizerUpdate const& update, float* first, float* second) {
+	if (Width != 0) {
+		lastCount = Width;
+	}
+
+	std::memset(carry, 0, sizeof(float) * batch * lastCount);
+
+	// The inputs and carried costs of the whole batch are revisited for every tile of rows, so block the columns to keep that slice cache resident
+	for (uint32_t c0=0;c0<lastCount;c0+=KERNEL_BACKWARD_COL_BLOCK) {
+		uint32_t c1 = c0 + KERNEL_BACKWARD_COL_BLOCK < lastCount ? c0 + KERNEL_BACKWARD_COL_BLOCK : lastCount;
+		uint32_t vecEnd = c0 + ((c1 - c0) & ~7u);
+
+		uint32_t i = 0;
+		// Tiles of 4 rows. Each 8 wide slice of the rows is held in registers while the gradient for it is accumulated over the whole batch,
+		// so the weights are loaded and stored once per batch
+		for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+			float const* r0 = weights + static_cast<size_t>(i) * lastCount;
+			float const* r1 = r0 + lastCount;
+			float const* r2 = r1 + lastCount;
+			float const* r3 = r2 + lastCount;
+			size_t row = static_cast<size_t>(i) * lastCount;
+
+			uint32_t k = c0;
+			for (;k<vecEnd;k+=8) {
+				__m256 w0 = _mm256_loadu_ps(r0 + k);
+				__m256 w1 = _mm256_loadu_ps(r1 + k);
+				__m256 w2 = _mm256_loadu_ps(r2 + k);
+				__m256 w3 = _mm256_loadu_ps(r3 + k);
+				__m256 g0 = _mm256_setzero_ps(), g1 = _mm256_setzero_ps(), g2 = _mm256_setzero_ps(), g3 = _mm256_setzero_ps();
+
+				for (uint32_t b=0;b<batch;b++) {
+					float const* d = delta + static_cast<size_t>(b) * thisCount + i;
+					float* c = carry + static_cast<size_t>(b) * lastCount + k;
+					__m256 x = _mm256_loadu_ps(input + static_cast<size_t>(b) * lastCount + k);
+					__m256 d0 = _mm256_broadcast_ss(d);
+					__m256 d1 = _mm256_broadcast_ss(d + 1);
+					__m256 d2 = _mm256_broadcast_ss(d + 2);
+					__m256 d3 = _mm256_broadcast_ss(d + 3);
+
+					__m256 sum = _mm256_loadu_ps(c);
+					sum = _mm256_fmadd_ps(w0, d0, sum);
+					sum = _mm256_fmadd_ps(w1, d1, sum);
+					sum = _mm256_fmadd_ps(w2, d2, sum);
+					sum = _mm256_fmadd_ps(w3, d3, sum);
+					_mm256_storeu_ps(c, sum);
+
+					g0 = _mm256_fmadd_ps(x, d0, g0);
+					g1 = _mm256_fmadd_ps(x, d1, g1);
+					g2 = _mm256_fmadd_ps(x, d2, g2);
+					g3 = _mm256_fmadd_ps(x, d3, g3);
+				}
+
+				storeGradientAVX2<InPlace>(update, out, first, second, row + k, w0, g0);
+				storeGradientAVX2<InPlace>(update, out, first, second, row + lastCount + k, w1, g1);
+				storeGradientAVX2<InPlace>(update, out, first, second, row + 2 * lastCount + k, w2, g2);
+				storeGradientAVX2<InPlace>(update, out, first, second, row + 3 * lastCount + k, w3, g3);
+			}
+
+			// Leftover columns
+			for (;k<c1;k++) {
+				float const* rows[KERNEL_ROW_TILE] = {r0, r1, r2, r3};
+				for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+					float w = rows[t][k];
+					float gradient = 0.0;
+					for (uint32_t b=0;b<batch;b++) {
+						float d = delta[static_cast<size_t>(b) * thisCount + i + t];
+						carry[static_cast<size_t>(b) * lastCount + k] += w * d;
+						gradient += input[static_cast<size_t>(b) * lastCount + k] * d;
+					}
+					storeGradient<InPlace>(update, out, first, second, row + t * lastCount + k, gradient);
+				}
+			}
+		}
+
+		// Leftover rows
+		for (;i<thisCount;i++) {
+			float const* row = weights + static_cast<size_t>(i) * lastCount;
+			size_t offset = static_cast<size_t>(i) * lastCount;
+			uint32_t k = c0;
+			for (;k<vecEnd;k+=8) {
+				__m256 w = _mm256_loadu_ps(row + k);
+				__m256 g = _mm256_setzero_ps();
+				for (uint32_t b=0;b<batch;b++) {
+					__m256 d = _mm256_broadcast_ss(delta + static_cast<size_t>(b) * thisCount + i);
+					float* c = carry + static_cast<size_t>(b) * lastCount + k;
+					_mm256_storeu_ps(c, _mm256_fmadd_ps(w, d, _mm256_loadu_ps(c)));
+					g = _mm256_fmadd_ps(_mm256_loadu_ps(input + static_cast<size_t>(b) * lastCount + k), d, g);
+				}
+				storeGradientAVX2<InPlace>(update, out, first, second, offset + k, w, g);
+			}
+
+			for (;k<c1;k++) {
+				float w = row[k];
+				float gradient = 0.0;
+				for (uint32_t b=0;b<batch;b++) {
+					float d = delta[static_cast<size_t>(b) * thisCount + i];
+					carry[static_cast<size_t>(b) * lastCount + k] += w * d;
+					gradient += input[static_cast<size_t>(b) * lastCount + k] * d;
+				}
+				storeGradient<InPlace>(update, out, first, second, offset + k, gradient);
+			}
+		}
+	}
+}
+
+// One row of a sparse layer for Chunks * 8 samples of the transposed batch, starting at 'x'. Each weight is broadcast once and multiplied with
+// a contiguous run of samples, one independent sum per 8 of them, so the FMAs never wait on each other once there are 4 or more chunks.
+// Sample 'first' + s of the row lands in z[s * thisCount], the padding samples past 'batch' are dropped
+template <uint32_t Chunks>
+__attribute__((target("avx2,fma")))
+static inline void sparseRowAVX2(uint32_t start, uint32_t end, uint16_t const* columns, float const* values, float const* x, uint32_t stride, float bias, float* z,
+	uint32_t first, uint32_t batch, uint32_t thisCount) {
+	__m256 acc[Chunks];
+	for (uint32_t t=0;t<Chunks;t++) {
+		acc[t] = _mm256_set1_ps(bias);
+	}
+
+	for (uint32_t j=start;j<end;j++) {
+		__m256 weight = _mm256_broadcast_ss(values + j);
+		float const* column = x + static_cast<size_t>(columns[j]) * stride;
+		for (uint32_t t=0;t<Chunks;t++) {
+			acc[t] = _mm256_fmadd_ps(weight, _mm256_loadu_ps(column + t * KERNEL_SPARSE_LANES), acc[t]);
+		}
+	}
+
+	alignas(32) float sums[Chunks * KERNEL_SPARSE_LANES];
+	for (uint32_t t=0;t<Chunks;t++) {
+		_mm256_store_ps(sums + t * KERNEL_SPARSE_LANES, acc[t]);
+	}
+
+	uint32_t count = std::min(Chunks * KERNEL_SPARSE_LANES, batch - first);
+	for (uint32_t s=0;s<count;s++) {
+		z[static_cast<size_t>(s) * thisCount] = sums[s];
+	}
+}
+
+// Small batches gather the inputs of each sample. Larger ones work on a transposed copy of the batch, see sparseRowAVX2()
+__attribute__((target("avx2,fma")))
+static void forwardSparseAVX2(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (batch < KERNEL_SPARSE_GATHER_BATCH) {
+		for (uint32_t b=0;b<batch;b++) {
+			float const* x = input + static_cast<size_t>(b) * lastCount;
+			for (uint32_t i=0;i<thisCount;i++) {
+				uint32_t j = rowOffsets[i];
+				uint32_t end = rowOffsets[i+1];
+				__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+				for (;j+16<=end;j+=16) {
+					__m256i k0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(columns + j)));
+					__m256i k1 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(columns + j + 8)));
+					a0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + j), _mm256_i32gather_ps(x, k0, 4), a0);
+					a1 = _mm256_fmadd_ps(_mm256_loadu_ps(values + j + 8), _mm256_i32gather_ps(x, k1, 4), a1);
+				}
+				for (;j+8<=end;j+=8) {
+					__m256i k0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(columns + j)));
+					a0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + j), _mm256_i32gather_ps(x, k0, 4), a0);
+				}
+
+				float sum = hsum256(_mm256_add_ps(a0, a1));
+				for (;j<end;j++) {
+					sum += values[j] * x[columns[j]];
+				}
+				z[static_cast<size_t>(b) * thisCount + i] = bias[i] + sum;
+			}
+		}
+		return;
+	}
+
+	uint32_t stride = sparseStride(batch);
+	transposeBatch(input, scratch, batch, lastCount, stride);
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		uint32_t start = rowOffsets[i];
+		uint32_t end = rowOffsets[i+1];
+		uint32_t c = 0;
+		for (;c+8*KERNEL_SPARSE_LANES<=stride;c+=8*KERNEL_SPARSE_LANES) {
+			sparseRowAVX2<8>(start, end, columns, values, scratch + c, stride, bias[i], z + static_cast<size_t>(c) * thisCount + i, c, batch, thisCount);
+		}
+		for (;c+4*KERNEL_SPARSE_LANES<=stride;c+=4*KERNEL_SPARSE_LANES) {
+			sparseRowAVX2<4>(start, end, columns, values, scratch + c, stride, bias[i], z + static_cast<size_t>(c) * thisCount + i, c, batch, thisCount);
+		}
+		for (;c<stride;c+=KERNEL_SPARSE_LANES) {
+			sparseRowAVX2<1>(start, end, columns, values, scratch + c, stride, bias[i], z + static_cast<size_t>(c) * thisCount + i, c, batch, thisCount);
+		}
+	}
+}
+
+// Works on transposed copies of the inputs, deltas and carried costs, so each weight updates the carried costs and sums its gradient 8 samples at a time
+template <bool InPlace>
+__attribute__((target("avx2,fma")))
+static void backwardSparseAVX2(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* delta, float* carry, float* out,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update, float* first, float* second) {
+	uint32_t stride = sparseStride(batch);
+	float* inputT = scratch;
+	float* deltaT = inputT + static_cast<size_t>(lastCount) * stride;
+	float* carryT = deltaT + static_cast<size_t>(thisCount) * stride;
+	transposeBatch(input, inputT, batch, lastCount, stride);
+	transposeBatch(delta, deltaT, batch, thisCount, stride);
+	std::memset(carryT, 0, sizeof(float) * lastCount * stride);
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		float const* d = deltaT + static_cast<size_t>(i) * stride;
+		for (uint32_t j=rowOffsets[i];j<rowOffsets[i+1];j++) {
+			float w = values[j];
+			__m256 weight = _mm256_set1_ps(w);
+			float const* x = inputT + static_cast<size_t>(columns[j]) * stride;
+			float* c = carryT + static_cast<size_t>(columns[j]) * stride;
+			__m256 g = _mm256_setzero_ps();
+			for (uint32_t b=0;b<stride;b+=KERNEL_SPARSE_LANES) {
+				__m256 dv = _mm256_loadu_ps(d + b);
+				_mm256_storeu_ps(c + b, _mm256_fmadd_ps(weight, dv, _mm256_loadu_ps(c + b))); // Carry over the weight before we adjust it
+				g = _mm256_fmadd_ps(_mm256_loadu_ps(x + b), dv, g);
+			}
+			float gradient = hsum256(g);
+			storeGradient<InPlace>(update, out, first, second, j, gradient);
+		}
+	}
+
+	for (uint32_t b=0;b<batch;b++) {
+		float* row = carry + static_cast<size_t>(b) * lastCount;
+		for (uint32_t k=0;k<lastCount;k++) {
+			row[k] = carryT[static_cast<size_t>(k) * stride + b];
+		}
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static inline int32_t hsum256i(__m256i v) {
+	__m128i lo = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	lo = _mm_add_epi32(lo, _mm_unpackhi_epi64(lo, lo));
+	lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, 1));
+	return _mm_cvtsi128_si32(lo);
+}
+
+// Widens both sides to 16 bits and multiplies with madd, which cannot saturate, unlike maddubs on a full range uint8 x int8 pair
+__attribute__((target("avx2,fma")))
+static inline __m256i dotAVX2(__m256i sum, __m128i weights, __m256i x) {
+	return _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_cvtepi8_epi16(weights), x));
+}
+
+__attribute__((target("avx2,fma")))
+static void forwardInt8AVX2(int8_t const* weights, float const* scales, int32_t const* rowSums, uint32_t stride, uint8_t const* input, float inputScale, uint8_t inputZero,
+	float const* bias, float* z, uint32_t batch, uint32_t thisCount) {
+	uint32_t i = 0;
+	// Tiles of 4 rows by 2 samples, as in forwardAVX2. A whole int8 row tile fits in L1, so there is no column blocking
+	for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+		int8_t const* r0 = weights + static_cast<size_t>(i) * stride;
+		int8_t const* r1 = r0 + stride;
+		int8_t const* r2 = r1 + stride;
+		int8_t const* r3 = r2 + stride;
+
+		uint32_t b = 0;
+		for (;b+2<=batch;b+=2) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			uint8_t const* x1 = x0 + stride;
+			__m256i a00 = _mm256_setzero_si256(), a01 = _mm256_setzero_si256(), a02 = _mm256_setzero_si256(), a03 = _mm256_setzero_si256();
+			__m256i a10 = _mm256_setzero_si256(), a11 = _mm256_setzero_si256(), a12 = _mm256_setzero_si256(), a13 = _mm256_setzero_si256();
+
+			for (uint32_t k=0;k<stride;k+=16) {
+				__m256i v0 = _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<__m128i const*>(x0 + k)));
+				__m256i v1 = _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<__m128i const*>(x1 + k)));
+				__m128i w0 = _mm_load_si128(reinterpret_cast<__m128i const*>(r0 + k));
+				__m128i w1 = _mm_load_si128(reinterpret_cast<__m128i const*>(r1 + k));
+				__m128i w2 = _mm_load_si128(reinterpret_cast<__m128i const*>(r2 + k));
+				__m128i w3 = _mm_load_si128(reinterpret_cast<__m128i const*>(r3 + k));
+				a00 = dotAVX2(a00, w0, v0); a01 = dotAVX2(a01, w1, v0); a02 = dotAVX2(a02, w2, v0); a03 = dotAVX2(a03, w3, v0);
+				a10 = dotAVX2(a10, w0, v1); a11 = dotAVX2(a11, w1, v1); a12 = dotAVX2(a12, w2, v1); a13 = dotAVX2(a13, w3, v1);
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			float* z1 = z0 + thisCount;
+			int32_t dots[2][KERNEL_ROW_TILE] = {{hsum256i(a00), hsum256i(a01), hsum256i(a02), hsum256i(a03)}, {hsum256i(a10), hsum256i(a11), hsum256i(a12), hsum256i(a13)}};
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				z0[t] = dequantize(dots[0][t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+				z1[t] = dequantize(dots[1][t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+			}
+		}
+
+		// Leftover sample
+		for (;b<batch;b++) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			__m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256(), a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+
+			for (uint32_t k=0;k<stride;k+=16) {
+				__m256i v0 = _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<__m128i const*>(x0 + k)));
+				a0 = dotAVX2(a0, _mm_load_si128(reinterpret_cast<__m128i const*>(r0 + k)), v0);
+				a1 = dotAVX2(a1, _mm_load_si128(reinterpret_cast<__m128i const*>(r1 + k)), v0);
+				a2 = dotAVX2(a2, _mm_load_si128(reinterpret_cast<__m128i const*>(r2 + k)), v0);
+				a3 = dotAVX2(a3, _mm_load_si128(reinterpret_cast<__m128i const*>(r3 + k)), v0);
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			int32_t dots[KERNEL_ROW_TILE] = {hsum256i(a0), hsum256i(a1), hsum256i(a2), hsum256i(a3)};
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				z0[t] = dequantize(dots[t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+			}
+		}
+	}
+
+	// Leftover rows
+	for (;i<thisCount;i++) {
+		int8_t const* row = weights + static_cast<size_t>(i) * stride;
+		for (uint32_t b=0;b<batch;b++) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			__m256i acc = _mm256_setzero_si256();
+			for (uint32_t k=0;k<stride;k+=16) {
+				acc = dotAVX2(acc, _mm_load_si128(reinterpret_cast<__m128i const*>(row + k)), _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<__m128i const*>(x0 + k))));
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = dequantize(hsum256i(acc), scales[i], rowSums[i], inputScale, inputZero, bias[i]);
+		}
+	}
+}
+
+// Scales and rounds 8 values, clamped first so values far out of range saturate instead of converting to INT_MIN
+__attribute__((target("avx2,fma")))
+static inline __m256i quantizeStepAVX2(float const* x, __m256 factor, __m256i offset) {
+	__m256 step = _mm256_mul_ps(_mm256_loadu_ps(x), factor);
+	step = _mm256_min_ps(_mm256_max_ps(step, _mm256_set1_ps(-512.0f)), _mm256_set1_ps(512.0f));
+	return _mm256_add_epi32(_mm256_cvtps_epi32(step), offset);
+}
+
+// Quantizes 32 values at a time, returning how many were done. The saturating packs interleave the lanes, which the permute puts back in order
+__attribute__((target("avx2,fma")))
+static uint32_t quantizeAVX2(float const* x, uint8_t* q, uint32_t count, float inverse, uint8_t zero) {
+	__m256 factor = _mm256_set1_ps(inverse);
+	__m256i offset = _mm256_set1_epi32(zero);
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	uint32_t k = 0;
+	for (;k+32<=count;k+=32) {
+		__m256i a = quantizeStepAVX2(x + k, factor, offset);
+		__m256i b = quantizeStepAVX2(x + k + 8, factor, offset);
+		__m256i c = quantizeStepAVX2(x + k + 16, factor, offset);
+		__m256i d = quantizeStepAVX2(x + k + 24, factor, offset);
+		__m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(q + k), _mm256_permutevar8x32_epi32(bytes, order));
+	}
+	return k;
+}
+
+// Rounds to nearest even like floatToFP16(), returning how many values were done
+__attribute__((target("avx2,fma,f16c")))
+static size_t roundFP16AVX2(float const* values, uint16_t* rounded, size_t count) {
+	size_t i = 0;
+	for (;i+8<=count;i+=8) {
+		__m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(values + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(rounded + i), halves);
+	}
+	return i;
+}
+
+// Rounds 8 values like floatToBF16(), quieting NaNs, leaving the halves in the low bits of each lane
+__attribute__((target("avx2,fma")))
+static inline __m256i roundBF16StepAVX2(float const* x) {
+	__m256i bits = _mm256_castps_si256(_mm256_loadu_ps(x));
+	__m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0x7FFFFFFF)), _mm256_set1_epi32(0x7F800000));
+	__m256i even = _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7FFF), _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1))));
+	return _mm256_srli_epi32(_mm256_blendv_epi8(even, _mm256_or_si256(bits, _mm256_set1_epi32(0x400000)), nan), 16);
+}
+
+// Rounds 16 values at a time, returning how many were done. The pack interleaves the lanes, which the permute puts back in order
+__attribute__((target("avx2,fma")))
+static size_t roundBF16AVX2(float const* values, uint16_t* rounded, size_t count) {
+	size_t i = 0;
+	for (;i+16<=count;i+=16) {
+		__m256i packed = _mm256_packus_epi32(roundBF16StepAVX2(values + i), roundBF16StepAVX2(values + i + 8));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(rounded + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	return i;
+}
+
+__attribute__((target("avx2,fma")))
+static void accumulateAVX2(float* target, float const* source, size_t count, float scale) {
+	__m256 factor = _mm256_set1_ps(scale);
+	size_t i = 0;
+	for (;i+8<=count;i+=8) {
+		_mm256_storeu_ps(target + i, _mm256_fmadd_ps(factor, _mm256_loadu_ps(source + i), _mm256_loadu_ps(target + i)));
+	}
+
+	for (;i<count;i++) {
+		target[i] += scale * source[i];
+	}
+}
+
+// Loads every parameter, gradient and moment once, so the whole update is a single pass
+__attribute__((target("avx2,fma")))
+static void optimizeAVX2(OptimizerUpdate const& update, float* params, float const* gradient, float* first, float* second, size_t count) {
+	size_t i = 0;
+	for (;i+8<=count;i+=8) {
+		storeGradientAVX2<true>(update, params, first, second, i, _mm256_loadu_ps(params + i), _mm256_loadu_ps(gradient + i));
+	}
+
+	optimizeScalar(update, params + i, gradient + i, first != nullptr ? first + i : nullptr, second != nullptr ? second + i : nullptr, count - i);
+}
+
+// Rows rows of c += a * b, see gemmScalar(). Every value loaded from 'b' meets each of the rows, 16 columns at a time held in registers for the whole sum
+template <uint32_t Rows>
+__attribute__((target("avx2,fma")))
+static inline void gemmRowsAVX2(float const* a, size_t aRow, size_t aColumn, float const* b, float* c, uint32_t n, uint32_t k) {
+	uint32_t j = 0;
+	for (;j+16<=n;j+=16) {
+		__m256 sum[Rows][2];
+		for (uint32_t r=0;r<Rows;r++) {
+			sum[r][0] = _mm256_loadu_ps(c + static_cast<size_t>(r) * n + j);
+			sum[r][1] = _mm256_loadu_ps(c + static_cast<size_t>(r) * n + j + 8);
+		}
+		for (uint32_t l=0;l<k;l++) {
+			float const* in = b + static_cast<size_t>(l) * n + j;
+			__m256 b0 = _mm256_loadu_ps(in);
+			__m256 b1 = _mm256_loadu_ps(in + 8);
+			for (uint32_t r=0;r<Rows;r++) {
+				__m256 w = _mm256_broadcast_ss(a + r * aRow + l * aColumn);
+				sum[r][0] = _mm256_fmadd_ps(w, b0, sum[r][0]);
+				sum[r][1] = _mm256_fmadd_ps(w, b1, sum[r][1]);
+			}
+		}
+		for (uint32_t r=0;r<Rows;r++) {
+			_mm256_storeu_ps(c + static_cast<size_t>(r) * n + j, sum[r][0]);
+			_mm256_storeu_ps(c + static_cast<size_t>(r) * n + j + 8, sum[r][1]);
+		}
+	}
+
+	for (;j+8<=n;j+=8) {
+		__m256 sum[Rows];
+		for (uint32_t r=0;r<Rows;r++) {
+			sum[r] = _mm256_loadu_ps(c + static_cast<size_t>(r) * n + j);
+		}
+		for (uint32_t l=0;l<k;l++) {
+			__m256 in = _mm256_loadu_ps(b + static_cast<size_t>(l) * n + j);
+			for (uint32_t r=0;r<Rows;r++) {
+				sum[r] = _mm256_fmadd_ps(_mm256_broadcast_ss(a + r * aRow + l * aColumn), in, sum[r]);
+			}
+		}
+		for (uint32_t r=0;r<Rows;r++) {
+			_mm256_storeu_ps(c + static_cast<size_t>(r) * n + j, sum[r]);
+		}
+	}
+
+	for (;j<n;j++) {
+		for (uint32_t r=0;r<Rows;r++) {
+			float sum = c[static_cast<size_t>(r) * n + j];
+			for (uint32_t l=0;l<k;l++) {
+				sum += a[r * aRow + l * aColumn] * b[static_cast<size_t>(l) * n + j];
+			}
+			c[static_cast<size_t>(r) * n + j] = sum;
+		}
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void gemmAVX2(float const* a, size_t aRow, size_t aColumn, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	uint32_t i = 0;
+	for (;i+KERNEL_ROW_TILE<=m;i+=KERNEL_ROW_TILE) {
+		gemmRowsAVX2<KERNEL_ROW_TILE>(a + i * aRow, aRow, aColumn, b, c + static_cast<size_t>(i) * n, n, k);
+	}
+	for (;i<m;i++) {
+		gemmRowsAVX2<1>(a + i * aRow, aRow, aColumn, b, c + static_cast<size_t>(i) * n, n, k);
+	}
+}
+
+// See gemmTransposedScalar(). Each row of 'a' is loaded once for KERNEL_ROW_TILE rows of 'b'
+__attribute__((target("avx2,fma")))
+static void gemmTransposedAVX2(float const* a, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	for (uint32_t i=0;i<m;i++) {
+		float const* row = a + static_cast<size_t>(i) * k;
+		float* out = c + static_cast<size_t>(i) * n;
+		uint32_t j = 0;
+		for (;j+KERNEL_ROW_TILE<=n;j+=KERNEL_ROW_TILE) {
+			float const* column = b + static_cast<size_t>(j) * k;
+			__m256 sum[KERNEL_ROW_TILE];
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				sum[t] = _mm256_setzero_ps();
+			}
+			uint32_t l = 0;
+			for (;l+8<=k;l+=8) {
+				__m256 x = _mm256_loadu_ps(row + l);
+				for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+					sum[t] = _mm256_fmadd_ps(x, _mm256_loadu_ps(column + static_cast<size_t>(t) * k + l), sum[t]);
+				}
+			}
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				float total = hsum256(sum[t]);
+				for (uint32_t r=l;r<k;r++) {
+					total += row[r] * column[static_cast<size_t>(t) * k + r];
+				}
+				out[j + t] += total;
+			}
+		}
+
+		for (;j<n;j++) {
+			float const* column = b + static_cast<size_t>(j) * k;
+			__m256 sum = _mm256_setzero_ps();
+			uint32_t l = 0;
+			for (;l+8<=k;l+=8) {
+				sum = _mm256_fmadd_ps(_mm256_loadu_ps(row + l), _mm256_loadu_ps(column + l), sum);
+			}
+			float total = hsum256(sum);
+			for (;l<k;l++) {
+				total += row[l] * column[l];
+			}
+			out[j] += total;
+		}
+	}
+}
+
+/* ---------------- AVX-512 VNNI kernels ---------------- */
+
+// vpdpbusd multiplies unsigned by signed bytes and sums each group of 4 straight into 32 bits, 64 weights per instruction
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void forwardInt8VNNI(int8_t const* weights, float const* scales, int32_t const* rowSums, uint32_t stride, uint8_t const* input, float inputScale, uint8_t inputZero,
+	float const* bias, float* z, uint32_t batch, uint32_t thisCount) {
+	uint32_t i = 0;
+	for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+		int8_t const* r0 = weights + static_cast<size_t>(i) * stride;
+		int8_t const* r1 = r0 + stride;
+		int8_t const* r2 = r1 + stride;
+		int8_t const* r3 = r2 + stride;
+
+		uint32_t b = 0;
+		for (;b+2<=batch;b+=2) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			uint8_t const* x1 = x0 + stride;
+			__m512i a00 = _mm512_setzero_si512(), a01 = _mm512_setzero_si512(), a02 = _mm512_setzero_si512(), a03 = _mm512_setzero_si512();
+			__m512i a10 = _mm512_setzero_si512(), a11 = _mm512_setzero_si512(), a12 = _mm512_setzero_si512(), a13 = _mm512_setzero_si512();
+
+			for (uint32_t k=0;k<stride;k+=64) {
+				__m512i v0 = _mm512_load_si512(x0 + k);
+				__m512i v1 = _mm512_load_si512(x1 + k);
+				__m512i w0 = _mm512_load_si512(r0 + k);
+				__m512i w1 = _mm512_load_si512(r1 + k);
+				__m512i w2 = _mm512_load_si512(r2 + k);
+				__m512i w3 = _mm512_load_si512(r3 + k);
+				a00 = _mm512_dpbusd_epi32(a00, v0, w0); a01 = _mm512_dpbusd_epi32(a01, v0, w1); a02 = _mm512_dpbusd_epi32(a02, v0, w2); a03 = _mm512_dpbusd_epi32(a03, v0, w3);
+				a10 = _mm512_dpbusd_epi32(a10, v1, w0); a11 = _mm512_dpbusd_epi32(a11, v1, w1); a12 = _mm512_dpbusd_epi32(a12, v1, w2); a13 = _mm512_dpbusd_epi32(a13, v1, w3);
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			float* z1 = z0 + thisCount;
+			int32_t dots[2][KERNEL_ROW_TILE] = {{_mm512_reduce_add_epi32(a00), _mm512_reduce_add_epi32(a01), _mm512_reduce_add_epi32(a02), _mm512_reduce_add_epi32(a03)},
+				{_mm512_reduce_add_epi32(a10), _mm512_reduce_add_epi32(a11), _mm512_reduce_add_epi32(a12), _mm512_reduce_add_epi32(a13)}};
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				z0[t] = dequantize(dots[0][t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+				z1[t] = dequantize(dots[1][t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+			}
+		}
+
+		// Leftover sample
+		for (;b<batch;b++) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			__m512i a0 = _mm512_setzero_si512(), a1 = _mm512_setzero_si512(), a2 = _mm512_setzero_si512(), a3 = _mm512_setzero_si512();
+
+			for (uint32_t k=0;k<stride;k+=64) {
+				__m512i v0 = _mm512_load_si512(x0 + k);
+				a0 = _mm512_dpbusd_epi32(a0, v0, _mm512_load_si512(r0 + k));
+				a1 = _mm512_dpbusd_epi32(a1, v0, _mm512_load_si512(r1 + k));
+				a2 = _mm512_dpbusd_epi32(a2, v0, _mm512_load_si512(r2 + k));
+				a3 = _mm512_dpbusd_epi32(a3, v0, _mm512_load_si512(r3 + k));
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			int32_t dots[KERNEL_ROW_TILE] = {_mm512_reduce_add_epi32(a0), _mm512_reduce_add_epi32(a1), _mm512_reduce_add_epi32(a2), _mm512_reduce_add_epi32(a3)};
+			for (uint32_t t=0;t<KERNEL_ROW_TILE;t++) {
+				z0[t] = dequantize(dots[t], scales[i + t], rowSums[i + t], inputScale, inputZero, bias[i + t]);
+			}
+		}
+	}
+
+	// Leftover rows
+	for (;i<thisCount;i++) {
+		int8_t const* row = weights + static_cast<size_t>(i) * stride;
+		for (uint32_t b=0;b<batch;b++) {
+			uint8_t const* x0 = input + static_cast<size_t>(b) * stride;
+			__m512i acc = _mm512_setzero_si512();
+			for (uint32_t k=0;k<stride;k+=64) {
+				acc = _mm512_dpbusd_epi32(acc, _mm512_load_si512(x0 + k), _mm512_load_si512(row + k));
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = dequantize(_mm512_reduce_add_epi32(acc), scales[i], rowSums[i], inputScale, inputZero, bias[i]);
+		}
+	}
+}
+
+/* ---------------- AVX-512 BF16 kernels ---------------- */
+
+static inline uint32_t bf16Stride(uint32_t lastCount) {
+	return (lastCount + KERNEL_BF16_LANES - 1) / KERNEL_BF16_LANES * KERNEL_BF16_LANES;
+}
+
+// The lanes of a 16 wide load at k that are still below count
+static inline uint32_t tailMask16(uint32_t k, uint32_t count) {
+	return k >= count ? 0 : (count - k >= 16 ? 0xFFFF : (1u << (count - k)) - 1);
+}
+
+// The same for a 32 wide load at k < count
+static inline uint32_t tailMask32(uint32_t k, uint32_t count) {
+	return count - k >= 32 ? ~0u : (1u << (count - k)) - 1;
+}
+
+// vdpbf16ps multiplies pairs of bf16 values and sums both products straight into an fp32 lane, 32 weights per instruction. The samples are rounded
+// to bf16 into 'scratch' first, zero padded to whole instructions. The weight rows are not padded, so their last load is masked
+__attribute__((target("avx512f,avx512bw,avx512bf16")))
+static void forwardBF16AVX512(uint16_t const* weights, float const* input, float const* bias, float* z, uint16_t* scratch, uint32_t batch, uint32_t thisCount,
+	uint32_t lastCount) {
+	uint32_t stride = bf16Stride(lastCount);
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + static_cast<size_t>(b) * lastCount;
+		uint16_t* q = scratch + static_cast<size_t>(b) * stride;
+		for (uint32_t k=0;k<stride;k+=KERNEL_BF16_LANES) {
+			__m512 lo = _mm512_maskz_loadu_ps(tailMask16(k, lastCount), x + k);
+			__m512 hi = _mm512_maskz_loadu_ps(tailMask16(k + 16, lastCount), x + k + 16);
+			_mm512_storeu_si512(q + k, (__m512i)_mm512_cvtne2ps_pbh(hi, lo));
+		}
+	}
+
+	uint32_t i = 0;
+	for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+		uint16_t const* r0 = weights + static_cast<size_t>(i) * lastCount;
+		uint16_t const* r1 = r0 + lastCount;
+		uint16_t const* r2 = r1 + lastCount;
+		uint16_t const* r3 = r2 + lastCount;
+
+		uint32_t b = 0;
+		for (;b+2<=batch;b+=2) {
+			uint16_t const* x0 = scratch + static_cast<size_t>(b) * stride;
+			uint16_t const* x1 = x0 + stride;
+			__m512 a00 = _mm512_setzero_ps(), a01 = _mm512_setzero_ps(), a02 = _mm512_setzero_ps(), a03 = _mm512_setzero_ps();
+			__m512 a10 = _mm512_setzero_ps(), a11 = _mm512_setzero_ps(), a12 = _mm512_setzero_ps(), a13 = _mm512_setzero_ps();
+
+			for (uint32_t k=0;k<lastCount;k+=KERNEL_BF16_LANES) {
+				__mmask32 mask = tailMask32(k, lastCount);
+				__m512bh v0 = (__m512bh)_mm512_loadu_si512(x0 + k);
+				__m512bh v1 = (__m512bh)_mm512_loadu_si512(x1 + k);
+				__m512bh w0 = (__m512bh)_mm512_maskz_loadu_epi16(mask, r0 + k);
+				__m512bh w1 = (__m512bh)_mm512_maskz_loadu_epi16(mask, r1 + k);
+				__m512bh w2 = (__m512bh)_mm512_maskz_loadu_epi16(mask, r2 + k);
+				__m512bh w3 = (__m512bh)_mm512_maskz_loadu_epi16(mask, r3 + k);
+				a00 = _mm512_dpbf16_ps(a00, w0, v0); a01 = _mm512_dpbf16_ps(a01, w1, v0); a02 = _mm512_dpbf16_ps(a02, w2, v0); a03 = _mm512_dpbf16_ps(a03, w3, v0);
+				a10 = _mm512_dpbf16_ps(a10, w0, v1); a11 = _mm512_dpbf16_ps(a11, w1, v1); a12 = _mm512_dpbf16_ps(a12, w2, v1); a13 = _mm512_dpbf16_ps(a13, w3, v1);
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			float* z1 = z0 + thisCount;
+			z0[0] = bias[i] + _mm512_reduce_add_ps(a00); z0[1] = bias[i + 1] + _mm512_reduce_add_ps(a01);
+			z0[2] = bias[i + 2] + _mm512_reduce_add_ps(a02); z0[3] = bias[i + 3] + _mm512_reduce_add_ps(a03);
+			z1[0] = bias[i] + _mm512_reduce_add_ps(a10); z1[1] = bias[i + 1] + _mm512_reduce_add_ps(a11);
+			z1[2] = bias[i + 2] + _mm512_reduce_add_ps(a12); z1[3] = bias[i + 3] + _mm512_reduce_add_ps(a13);
+		}
+
+		// Leftover sample
+		for (;b<batch;b++) {
+			uint16_t const* x0 = scratch + static_cast<size_t>(b) * stride;
+			__m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+
+			for (uint32_t k=0;k<lastCount;k+=KERNEL_BF16_LANES) {
+				__mmask32 mask = tailMask32(k, lastCount);
+				__m512bh v0 = (__m512bh)_mm512_loadu_si512(x0 + k);
+				a0 = _mm512_dpbf16_ps(a0, (__m512bh)_mm512_maskz_loadu_epi16(mask, r0 + k), v0);
+				a1 = _mm512_dpbf16_ps(a1, (__m512bh)_mm512_maskz_loadu_epi16(mask, r1 + k), v0);
+				a2 = _mm512_dpbf16_ps(a2, (__m512bh)_mm512_maskz_loadu_epi16(mask, r2 + k), v0);
+				a3 = _mm512_dpbf16_ps(a3, (__m512bh)_mm512_maskz_loadu_epi16(mask, r3 + k), v0);
+			}
+
+			float* z0 = z + static_cast<size_t>(b) * thisCount + i;
+			z0[0] = bias[i] + _mm512_reduce_add_ps(a0); z0[1] = bias[i + 1] + _mm512_reduce_add_ps(a1);
+			z0[2] = bias[i + 2] + _mm512_reduce_add_ps(a2); z0[3] = bias[i + 3] + _mm512_reduce_add_ps(a3);
+		}
+	}
+
+	// Leftover rows
+	for (;i<thisCount;i++) {
+		uint16_t const* row = weights + static_cast<size_t>(i) * lastCount;
+		for (uint32_t b=0;b<batch;b++) {
+			uint16_t const* x0 = scratch + static_cast<size_t>(b) * stride;
+			__m512 acc = _mm512_setzero_ps();
+			for (uint32_t k=0;k<lastCount;k+=KERNEL_BF16_LANES) {
+				acc = _mm512_dpbf16_ps(acc, (__m512bh)_mm512_maskz_loadu_epi16(tailMask32(k, lastCount), row + k), (__m512bh)_mm512_loadu_si512(x0 + k));
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i] + _mm512_reduce_add_ps(acc);
+		}
+	}
+}
+
+// Copies the used columns of a row of weights next to each other
+__attribute__((target("avx2,fma")))
+static inline void gatherAVX2(float const* row, uint32_t const* columns, uint32_t count, float* out) {
+	uint32_t c = 0;
+	for (;c+8<=count;c+=8) {
+		__m256i index = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(columns + c));
+		_mm256_storeu_ps(out + c, _mm256_i32gather_ps(row, index, 4));
+	}
+	for (;c<count;c++) {
+		out[c] = row[columns[c]];
+	}
+}
+
+// Gathers a tile of rows into 'scratch', then runs the packed samples past them like forwardAVX2() does with a whole row
+__attribute__((target("avx2,fma")))
+static void forwardCompactAVX2(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	uint32_t vecEnd = count & ~7u;
+
+	uint32_t i = 0;
+	for (;i+KERNEL_ROW_TILE<=thisCount;i+=KERNEL_ROW_TILE) {
+		float* r0 = scratch;
+		float* r1 = r0 + count;
+		float* r2 = r1 + count;
+		float* r3 = r2 + count;
+		gatherAVX2(weights + static_cast<size_t>(i) * lastCount, columns, count, r0);
+		gatherAVX2(weights + static_cast<size_t>(i + 1) * lastCount, columns, count, r1);
+		gatherAVX2(weights + static_cast<size_t>(i + 2) * lastCount, columns, count, r2);
+		gatherAVX2(weights + static_cast<size_t>(i + 3) * lastCount, columns, count, r3);
+
+		for (uint32_t b=0;b<batch;b++) {
+			float const* x = packed + static_cast<size_t>(b) * count;
+			__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+
+			uint32_t c = 0;
+			for (;c<vecEnd;c+=8) {
+				__m256 v = _mm256_loadu_ps(x + c);
+				a0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + c), v, a0);
+				a1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + c), v, a1);
+				a2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + c), v, a2);
+				a3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + c), v, a3);
+			}
+
+			float* out = z + static_cast<size_t>(b) * thisCount + i;
+			_mm_storeu_ps(out, _mm_add_ps(_mm_loadu_ps(bias + i), hsum4x256(a0, a1, a2, a3)));
+			for (;c<count;c++) {
+				out[0] += r0[c] * x[c]; out[1] += r1[c] * x[c]; out[2] += r2[c] * x[c]; out[3] += r3[c] * x[c];
+			}
+		}
+	}
+
+	// Leftover rows
+	for (;i<thisCount;i++) {
+		gatherAVX2(weights + static_cast<size_t>(i) * lastCount, columns, count, scratch);
+		for (uint32_t b=0;b<batch;b++) {
+			float const* x = packed + static_cast<size_t>(b) * count;
+			__m256 acc = _mm256_setzero_ps();
+			uint32_t c = 0;
+			for (;c<vecEnd;c+=8) {
+				acc = _mm256_fmadd_ps(_mm256_loadu_ps(scratch + c), _mm256_loadu_ps(x + c), acc);
+			}
+
+			float sum = hsum256(acc);
+			for (;c<count;c++) {
+				sum += scratch[c] * x[c];
+			}
+			z[static_cast<size_t>(b) * thisCount + i] = bias[i] + sum;
+		}
+	}
+}
+
+// The carried costs are summed into a packed copy in 'scratch', and scattered into their columns at the end
+template <bool InPlace>
+__attribute__((target("avx2,fma")))
+static void backwardCompactAVX2(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* out,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update) {
+	uint32_t vecEnd = count & ~7u;
+	float* packedCarry = scratch;
+	float* row = packedCarry + static_cast<size_t>(batch) * count;
+	float* gradient = row + count;
+
+	std::memset(packedCarry, 0, sizeof(float) * batch * count);
+	if (!InPlace) {
+		std::memset(out, 0, sizeof(float) * thisCount * lastCount);
+	}
+
+	for (uint32_t i=0;i<thisCount;i++) {
+		size_t offset = static_cast<size_t>(i) * lastCount;
+		gatherAVX2(weights + offset, columns, count, row);
+
+		uint32_t c = 0;
+		for (;c<vecEnd;c+=8) {
+			__m256 w = _mm256_loadu_ps(row + c);
+			__m256 g = _mm256_setzero_ps();
+			for (uint32_t b=0;b<batch;b++) {
+				__m256 d = _mm256_broadcast_ss(delta + static_cast<size_t>(b) * thisCount + i);
+				float* pc = packedCarry + static_cast<size_t>(b) * count + c;
+				_mm256_storeu_ps(pc, _mm256_fmadd_ps(w, d, _mm256_loadu_ps(pc)));
+				g = _mm256_fmadd_ps(_mm256_loadu_ps(packed + static_cast<size_t>(b) * count + c), d, g);
+			}
+			_mm256_storeu_ps(gradient + c, g);
+		}
+		for (;c<count;c++) {
+			float g = 0.0;
+			for (uint32_t b=0;b<batch;b++) {
+				float d = delta[static_cast<size_t>(b) * thisCount + i];
+				packedCarry[static_cast<size_t>(b) * count + c] += row[c] * d;
+				g += packed[static_cast<size_t>(b) * count + c] * d;
+			}
+			gradient[c] = g;
+		}
+
+		for (c=0;c<count;c++) {
+			storeGradient<InPlace>(update, out, nullptr, nullptr, offset + columns[c], gradient[c]);
+		}
+	}
+
+	std::memset(carry, 0, sizeof(float) * batch * lastCount);
+	for (uint32_t b=0;b<batch;b++) {
+		float const* source = packedCarry + static_cast<size_t>(b) * count;
+		float* target = carry + static_cast<size_t>(b) * lastCount;
+		for (uint32_t c=0;c<count;c++) {
+			target[columns[c]] = source[c];
+		}
+	}
+}
+
+
+/* ---------------- Dispatch ---------------- */
+
+// F16C came before AVX2 on every processor that has both, so the AVX2 kernels also widen fp16 weights with it
+static bool hasAVX2() {
+	static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+	return supported;
+}
+
+static bool hasVNNI() {
+	static const bool supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni");
+	return supported;
+}
+
+static bool hasBF16() {
+	static const bool supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512bf16");
+	return supported;
+}
+
+// Calls 'kernel' with a std::integral_constant holding the width of the last layer when the dense kernels are instantiated for it, otherwise 0 for the
+// generic instantiation. The widths are the layer sizes of the default autoencoder. A fixed width replaces the runtime one in the kernels, so the loops
+// over the columns have trip counts known at compile time
+template <class Kernel>
+static inline void dispatchWidth(uint32_t lastCount, Kernel const& kernel) {
+	switch (lastCount) {
+		case 16:
+			kernel(std::integral_constant<uint32_t, 16>());
+			break;
+		case 400:
+			kernel(std::integral_constant<uint32_t, 400>());
+			break;
+		case 1024:
+			kernel(std::integral_constant<uint32_t, 1024>());
+			break;
+		case 2500:
+			kernel(std::integral_constant<uint32_t, 2500>());
+			break;
+		default:
+			kernel(std::integral_constant<uint32_t, 0>());
+			break;
+	}
+}
+
+// Calls 'kernel' with the policy of an activation function, see activation.h
+template <class Kernel>
+static inline void dispatchActivation(uint32_t activation, Kernel const& kernel) {
+	switch (activation) {
+		case ACTIVATION_RELU:
+			kernel(ReLUActivation());
+			break;
+		case ACTIVATION_TANH:
+			kernel(TanhActivation());
+			break;
+		case ACTIVATION_LINEAR:
+			kernel(LinearActivation());
+			break;
+		default:
+			kernel(SigmoidActivation());
+			break;
+	}
+}
+
+void kernelActivate(uint32_t activation, float* values, size_t count) {
+	dispatchActivation(activation, [&](auto policy) {
+		activateScalar<decltype(policy)>(values, count);
+	});
+}
+
+void kernelDelta(uint32_t activation, bool isLastLayer, float const* values, float const* expected, float errorScale, float* delta, float* bias, float biasScale,
+	uint32_t batch, uint32_t thisCount) {
+	dispatchActivation(activation, [&](auto policy) {
+		if (isLastLayer) {
+			deltaScalar<decltype(policy), true>(values, expected, errorScale, delta, bias, biasScale, batch, thisCount);
+		} else {
+			deltaScalar<decltype(policy), false>(values, expected, errorScale, delta, bias, biasScale, batch, thisCount);
+		}
+	});
+}
+
+void kernelForward(float const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	bool avx2 = hasAVX2();
+	dispatchWidth(lastCount, [&](auto width) {
+		if (avx2) {
+			forwardAVX2<decltype(width)::value>(weights, input, bias, z, batch, thisCount, lastCount);
+		} else {
+			forwardScalar<decltype(width)::value>(weights, input, bias, z, batch, thisCount, lastCount);
+		}
+	});
+}
+
+void kernelBackward(float* weights, float const* input, float const* delta, float* carry, uint32_t batch, uint32_t thisCount, uint32_t lastCount,
+	OptimizerUpdate const& update, float* first, float* second) {
+	bool avx2 = hasAVX2();
+	dispatchWidth(lastCount, [&](auto width) {
+		if (avx2) {
+			backwardAVX2<true, decltype(width)::value>(weights, input, delta, carry, weights, batch, thisCount, lastCount, update, first, second);
+		} else {
+			backwardScalar<true, decltype(width)::value>(weights, input, delta, carry, weights, batch, thisCount, lastCount, update, first, second);
+		}
+	});
+}
+
+void kernelGradient(float const* weights, float const* input, float const* delta, float* carry, float* gradient, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	bool avx2 = hasAVX2();
+	dispatchWidth(lastCount, [&](auto width) {
+		if (avx2) {
+			backwardAVX2<false, decltype(width)::value>(weights, input, delta, carry, gradient, batch, thisCount, lastCount, OptimizerUpdate(), nullptr, nullptr);
+		} else {
+			backwardScalar<false, decltype(width)::value>(weights, input, delta, carry, gradient, batch, thisCount, lastCount, OptimizerUpdate(), nullptr, nullptr);
+		}
+	});
+}
+
+size_t kernelSparseScratch(uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	return (2 * static_cast<size_t>(lastCount) + thisCount) * sparseStride(batch);
+}
+
+void kernelForwardSparse(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (hasAVX2()) {
+		forwardSparseAVX2(rowOffsets, columns, values, input, bias, z, scratch, batch, thisCount, lastCount);
+	} else {
+		forwardSparseScalar(rowOffsets, columns, values, input, bias, z, batch, thisCount, lastCount);
+	}
+}
+
+void kernelBackwardSparse(uint32_t const* rowOffsets, uint16_t const* columns, float* values, float const* input, float const* delta, float* carry, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update, float* first, float* second) {
+	if (hasAVX2() && batch >= KERNEL_SPARSE_GATHER_BATCH) {
+		backwardSparseAVX2<true>(rowOffsets, columns, values, input, delta, carry, values, scratch, batch, thisCount, lastCount, update, first, second);
+	} else {
+		backwardSparseScalar<true>(rowOffsets, columns, values, input, delta, carry, values, batch, thisCount, lastCount, update, first, second);
+	}
+}
+
+void kernelGradientSparse(uint32_t const* rowOffsets, uint16_t const* columns, float const* values, float const* input, float const* delta, float* carry, float* gradient,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (hasAVX2() && batch >= KERNEL_SPARSE_GATHER_BATCH) {
+		backwardSparseAVX2<false>(rowOffsets, columns, values, input, delta, carry, gradient, scratch, batch, thisCount, lastCount, OptimizerUpdate(), nullptr, nullptr);
+	} else {
+		backwardSparseScalar<false>(rowOffsets, columns, values, input, delta, carry, gradient, batch, thisCount, lastCount, OptimizerUpdate(), nullptr, nullptr);
+	}
+}
+
+size_t kernelCompactScratch(uint32_t batch, uint32_t lastCount) {
+	// The gathered rows of the forward pass, or the packed carried costs and one gathered row and its gradients in the backward pass
+	return (static_cast<size_t>(std::max<uint32_t>(batch, KERNEL_ROW_TILE)) + 2) * lastCount;
+}
+
+uint32_t kernelCompact(float const* input, uint32_t* columns, float* packed, uint32_t batch, uint32_t lastCount, uint32_t limit) {
+	// Flag the used columns sample by sample, so the input is read in order
+	std::fill(columns, columns + lastCount, 0u);
+	uint32_t count = 0;
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + static_cast<size_t>(b) * lastCount;
+		for (uint32_t k=0;k<lastCount;k++) {
+			if (x[k] != 0.0f && columns[k] == 0) {
+				columns[k] = 1;
+				if (++count > limit) {
+					return count;
+				}
+			}
+		}
+	}
+
+	// Then list them in place. Column k is never written before its flag has been read
+	uint32_t listed = 0;
+	for (uint32_t k=0;k<lastCount;k++) {
+		if (columns[k] != 0) {
+			columns[listed++] = k;
+		}
+	}
+
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + static_cast<size_t>(b) * lastCount;
+		float* target = packed + static_cast<size_t>(b) * count;
+		for (uint32_t c=0;c<count;c++) {
+			target[c] = x[columns[c]];
+		}
+	}
+	return count;
+}
+
+void kernelForwardCompact(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* bias, float* z, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (hasAVX2()) {
+		forwardCompactAVX2(weights, columns, count, packed, bias, z, scratch, batch, thisCount, lastCount);
+	} else {
+		forwardCompactScalar(weights, columns, count, packed, bias, z, batch, thisCount, lastCount);
+	}
+}
+
+void kernelBackwardCompact(float* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* scratch,
+	uint32_t batch, uint32_t thisCount, uint32_t lastCount, OptimizerUpdate const& update) {
+	if (hasAVX2()) {
+		backwardCompactAVX2<true>(weights, columns, count, packed, delta, carry, weights, scratch, batch, thisCount, lastCount, update);
+	} else {
+		backwardCompactScalar<true>(weights, columns, count, packed, delta, carry, weights, batch, thisCount, lastCount, update);
+	}
+}
+
+void kernelGradientCompact(float const* weights, uint32_t const* columns, uint32_t count, float const* packed, float const* delta, float* carry, float* gradient,
+	float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (hasAVX2()) {
+		backwardCompactAVX2<false>(weights, columns, count, packed, delta, carry, gradient, scratch, batch, thisCount, lastCount, OptimizerUpdate());
+	} else {
+		backwardCompactScalar<false>(weights, columns, count, packed, delta, carry, gradient, batch, thisCount, lastCount, OptimizerUpdate());
+	}
+}
+
+static void gemm(float const* a, size_t aRow, size_t aColumn, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	if (hasAVX2()) {
+		gemmAVX2(a, aRow, aColumn, b, c, m, n, k);
+	} else {
+		gemmScalar(a, aRow, aColumn, b, c, m, n, k);
+	}
+}
+
+static void gemmTransposed(float const* a, float const* b, float* c, uint32_t m, uint32_t n, uint32_t k) {
+	if (hasAVX2()) {
+		gemmTransposedAVX2(a, b, c, m, n, k);
+	} else {
+		gemmTransposedScalar(a, b, c, m, n, k);
+	}
+}
+
+size_t kernelConvolutionScratch(ConvolutionShape const& shape) {
+	// The unfolded image, and the unfolded gradient carried back through it
+	return 2 * static_cast<size_t>(shape.bigChannels) * shape.kernel * shape.kernel * shape.smallSize * shape.smallSize;
+}
+
+void kernelForwardConvolution(ConvolutionShape const& shape, float const* weights, float const* input, float const* bias, float* z, float* scratch, uint32_t batch) {
+	uint32_t depth = shape.bigChannels * shape.kernel * shape.kernel;
+	uint32_t positions = shape.smallSize * shape.smallSize;
+	size_t smallCount = static_cast<size_t>(positions) * shape.smallChannels;
+	size_t bigCount = static_cast<size_t>(shape.bigSize) * shape.bigSize * shape.bigChannels;
+	size_t thisCount = shape.transposed ? bigCount : smallCount;
+	size_t lastCount = shape.transposed ? smallCount : bigCount;
+
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + b * lastCount;
+		float* out = z + b * thisCount;
+		std::copy(bias, bias + thisCount, out);
+
+		if (shape.transposed) {
+			// Every small image value is spread over the big image through the weights, col = weights^T * x
+			std::fill(scratch, scratch + static_cast<size_t>(depth) * positions, 0.0f);
+			gemm(weights, 1, depth, x, scratch, depth, positions, shape.smallChannels);
+			col2im(shape, scratch, out);
+		} else {
+			im2col(shape, x, scratch);
+			gemm(weights, depth, 1, scratch, out, shape.smallChannels, positions, depth);
+		}
+	}
+}
+
+void kernelGradientConvolution(ConvolutionShape const& shape, float const* weights, float const* input, float const* delta, float* carry, float* gradient, float* scratch,
+	uint32_t batch) {
+	uint32_t depth = shape.bigChannels * shape.kernel * shape.kernel;
+	uint32_t positions = shape.smallSize * shape.smallSize;
+	size_t smallCount = static_cast<size_t>(positions) * shape.smallChannels;
+	size_t bigCount = static_cast<size_t>(shape.bigSize) * shape.bigSize * shape.bigChannels;
+	size_t thisCount = shape.transposed ? bigCount : smallCount;
+	size_t lastCount = shape.transposed ? smallCount : bigCount;
+	float* col = scratch;
+	float* carryCol = scratch + static_cast<size_t>(depth) * positions;
+
+	std::fill(gradient, gradient + static_cast<size_t>(shape.smallChannels) * depth, 0.0f);
+
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + b * lastCount;
+		float const* d = delta + b * thisCount;
+		float* out = carry + b * lastCount;
+		std::fill(out, out + lastCount, 0.0f);
+
+		if (shape.transposed) {
+			// The deltas live on the big image, so they are the ones unfolded
+			im2col(shape, d, col);
+			gemmTransposed(x, col, gradient, shape.smallChannels, depth, positions);
+			gemm(weights, depth, 1, col, out, shape.smallChannels, positions, depth);
+		} else {
+			im2col(shape, x, col);
+			gemmTransposed(d, col, gradient, shape.smallChannels, depth, positions);
+			std::fill(carryCol, carryCol + static_cast<size_t>(depth) * positions, 0.0f);
+			gemm(weights, 1, depth, d, carryCol, depth, positions, shape.smallChannels);
+			col2im(shape, carryCol, out);
+		}
+	}
+}
+
+void kernelAccumulate(float* target, float const* source, size_t count, float scale) {
+	if (hasAVX2()) {
+		accumulateAVX2(target, source, count, scale);
+	} else {
+		accumulateScalar(target, source, count, scale);
+	}
+}
+
+void kernelOptimize(OptimizerUpdate const& update, float* params, float const* gradient, float* first, float* second, size_t count) {
+	if (hasAVX2()) {
+		optimizeAVX2(update, params, gradient, first, second, count);
+	} else {
+		optimizeScalar(update, params, gradient, first, second, count);
+	}
+}
+
+void kernelQuantize(float const* input, uint8_t* output, uint32_t batch, uint32_t count, uint32_t stride, float scale, uint8_t zero) {
+	float inverse = 1.0f / scale;
+	for (uint32_t b=0;b<batch;b++) {
+		float const* x = input + static_cast<size_t>(b) * count;
+		uint8_t* q = output + static_cast<size_t>(b) * stride;
+		uint32_t k = hasAVX2() ? quantizeAVX2(x, q, count, inverse, zero) : 0;
+		for (;k<count;k++) {
+			q[k] = quantizeStep(x[k], inverse, zero);
+		}
+		std::memset(q + count, 0, stride - count);
+	}
+}
+
+void kernelForwardInt8(int8_t const* weights, float const* scales, int32_t const* rowSums, uint32_t stride, uint8_t const* input, float inputScale, uint8_t inputZero,
+	float const* bias, float* z, uint32_t batch, uint32_t thisCount) {
+	if (hasVNNI()) {
+		forwardInt8VNNI(weights, scales, rowSums, stride, input, inputScale, inputZero, bias, z, batch, thisCount);
+	} else if (hasAVX2()) {
+		forwardInt8AVX2(weights, scales, rowSums, stride, input, inputScale, inputZero, bias, z, batch, thisCount);
+	} else {
+		forwardInt8Scalar(weights, scales, rowSums, stride, input, inputScale, inputZero, bias, z, batch, thisCount);
+	}
+}
+
+void kernelRoundFP16(float const* values, uint16_t* rounded, size_t count) {
+	size_t i = hasAVX2() ? roundFP16AVX2(values, rounded, count) : 0;
+	for (;i<count;i++) {
+		rounded[i] = floatToFP16(values[i]);
+	}
+}
+
+void kernelRoundBF16(float const* values, uint16_t* rounded, size_t count) {
+	size_t i = hasAVX2() ? roundBF16AVX2(values, rounded, count) : 0;
+	for (;i<count;i++) {
+		rounded[i] = floatToBF16(values[i]);
+	}
+}
+
+void kernelForwardFP16(uint16_t const* weights, float const* input, float const* bias, float* z, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	bool avx2 = hasAVX2();
+	dispatchWidth(lastCount, [&](auto width) {
+		if (avx2) {
+			forwardAVX2<decltype(width)::value, FP16Weights>(weights, input, bias, z, batch, thisCount, lastCount);
+		} else {
+			forwardScalar<decltype(width)::value, FP16Weights>(weights, input, bias, z, batch, thisCount, lastCount);
+		}
+	});
+}
+
+size_t kernelBF16Scratch(uint32_t batch, uint32_t lastCount) {
+	// bf16 samples, counted in floats
+	return hasBF16() ? (static_cast<size_t>(batch) * bf16Stride(lastCount) + 1) / 2 : 0;
+}
+
+void kernelForwardBF16(uint16_t const* weights, float const* input, float const* bias, float* z, float* scratch, uint32_t batch, uint32_t thisCount, uint32_t lastCount) {
+	if (hasBF16()) {
+		forwardBF16AVX512(weights, input, bias, z, reinterpret_cast<uint16_t*>(scratch), batch, thisCount, lastCount);
+		return;
+	}
+
+	bool avx2 = hasAVX2();
+	dispatchWidth(lastCount, [&](auto width) {
+		if (avx2) {
+			forwardAVX2<decltype(width)::value, BF16Weights>(weights, input, bias, z, batch, thisCount, lastCount);
+		} else {
+			forwardScalar<decltype(width)::value, BF16Weights>(weights, input, bias, z, batch, thisCount, lastCount);
+		}
+	});
+}
@@ -0,0 +1,392 @@
+#include "dataset.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* @brief Round a byte count up to the dataset alignment
+ * @param[in] bytes	The byte count
+ * @return			The aligned byte count
+*/
+static uint64_t alignUp(uint64_t bytes) {
+	return (bytes + DATASET_ALIGNMENT - 1) / DATASET_ALIGNMENT * DATASET_ALIGNMENT;
+}
+
+Dataset::Dataset(std::string const& path) {
+	this->open(path);
+}
+
+Dataset::~Dataset() {
+	this->close();
+}
+
+/* @brief Open a dataset, replacing any dataset already open
+ * @param[in] path	A packed .skd file, or a directory of .raw samples
+ * @return			A reference to this dataset object
+*/
+Dataset& Dataset::open(std::string const& path) {
+	this->close();
+
+	if (std::filesystem::is_directory(path)) {
+		return this->openDirectory(path);
+	}
+
+	return this->openPack(path);
+}
+
+/* @brief Release the mapping or arena
+ * @return A reference to this dataset object
+*/
+Dataset& Dataset::close() {
+	if (this->mapping != nullptr) {
+		munmap(this->mapping, this->mappingSize);
+	}
+
+	this->mapping = nullptr;
+	this->mappingSize = 0;
+	this->arena.clear();
+	this->arena.shrink_to_fit();
+	this->records = nullptr;
+	this->sampleCount = 0;
+	this->sampleSize = 0;
+	this->recordSize = 0;
+	this->error = false;
+
+	return *this;
+}
+
+/* @brief True if there was an error opening the dataset, false otherwise
+ * @return True if error, false otherwise
+*/
+bool Dataset::getError() {
+	return this->error;
+}
+
+/* @brief Get the number of samples in the dataset
+ * @return The sample count
+*/
+uint64_t Dataset::size() {
+	return this->sampleCount;
+}
+
+/* @brief Get the number of floats in each sample
+ * @return The sample size
+*/
+uint32_t Dataset::getSampleSize() {
+	return this->sampleSize;
+}
+
+/* @brief Get a pointer to a sample. Points straight into the mapping, so it is only valid while the dataset is open
+ * @param[in] index	The sample index
+ * @return			A pointer to getSampleSize() floats, aligned to DATASET_ALIGNMENT
+*/
+float const* Dataset::getSample(uint64_t index) {
+	return reinterpret_cast<float const*>(this->records + index * this->recordSize);
+}
+
+/* @brief Get the label of a sample, which is the key that was pressed when it was saved
+ * @param[in] index	The sample index
+ * @return			The label byte
+*/
+uint8_t Dataset::getLabel(uint64_t index) {
+	return this->records[index * this->recordSize + static_cast<size_t>(this->sampleSize) * sizeof(float)];
+}
+
+/* @brief Tell the kernel a mapped pack will be read from start to end rather than all over, so it reads ahead and drops pages behind the reader
+ * instead of keeping the whole pack resident. Does nothing for directories, which are already in memory
+ * @return A reference to this dataset object
+*/
+Dataset& Dataset::adviseSequential() {
+	if (this->mapping != nullptr) {
+		madvise(this->mapping, this->mappingSize, MADV_SEQUENTIAL);
+	}
+	return *this;
+}
+
+/* @brief Fill in a header for some number of samples
+ * @param[out] header		The header to fill in
+ * @param[in] sampleSize	The number of floats in each sample
+ * @param[in] sampleCount	The number of samples
+*/
+void Dataset::makeHeader(DatasetHeader& header, uint32_t sampleSize, uint64_t sampleCount) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+	header.version = DATASET_VERSION;
+	header.sampleCount = sampleCount;
+	header.sampleSize = sampleSize;
+	// The label byte follows the sample, and every record starts on its own cache line
+	header.recordSize = alignUp(static_cast<uint64_t>(sampleSize) * sizeof(float) + sizeof(uint8_t));
+	header.dataOffset = alignUp(sizeof(DatasetHeader));
+}
+
+/* @brief Memory map a packed .skd file
+ * @param[in] path	The file to map
+ * @return			A reference to this dataset object
+*/
+Dataset& Dataset::openPack(std::string const& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Failed to open dataset " << path << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(DatasetHeader)) {
+		std::cerr << "Dataset " << path << " is too small to hold a header" << std::endl;
+		::close(fd);
+		this->error = true;
+		return *this;
+	}
+
+	void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file alive
+	::close(fd);
+	if (map == MAP_FAILED) {
+		std::cerr << "Failed to map dataset " << path << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	this->mapping = map;
+	this->mappingSize = info.st_size;
+
+	DatasetHeader const* header = static_cast<DatasetHeader const*>(map);
+	DatasetHeader expected;
+	makeHeader(expected, header->sampleSize, header->sampleCount);
+
+	if (memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0 || header->version != DATASET_VERSION) {
+		std::cerr << "Dataset " << path << " is not a version " << DATASET_VERSION << " sample pack" << std::endl;
+		this->close();
+		this->error = true;
+		return *this;
+	}
+
+	// The count comes straight from the file, so bound it by division rather than multiplying it out, which could wrap
+	if (header->recordSize != expected.recordSize || header->dataOffset != expected.dataOffset || header->dataOffset > this->mappingSize
+		|| header->sampleCount > (this->mappingSize - header->dataOffset) / header->recordSize) {
+		std::cerr << "Dataset " << path << " has a corrupt header" << std::endl;
+		this->close();
+		this->error = true;
+		return *this;
+	}
+
+	this->records = static_cast<uint8_t const*>(map) + header->dataOffset;
+	this->sampleCount = header->sampleCount;
+	this->sampleSize = header->sampleSize;
+	this->recordSize = header->recordSize;
+
+	// Samples are visited in a shuffled order, so read ahead the whole file rather than sequentially
+	madvise(map, this->mappingSize, MADV_WILLNEED);
+
+	return *this;
+}
+
+/* @brief Read a directory of .raw samples into the arena, one file per task of a thread pool. Samples of the wrong size, or holding values that are
+ * not finite, are skipped
+ * @param[in] path	The directory to read
+ * @return			A reference to this dataset object
+*/
+Dataset& Dataset::openDirectory(std::string const& path) {
+	std::vector<std::pair<std::filesystem::path, uint64_t>> candidates;
+	std::map<uint64_t, size_t> sizeCounts;
+
+	for (auto const& entry : std::filesystem::directory_iterator(path)) {
+		if (entry.is_regular_file() && entry.path().extension() == ".raw") {
+			candidates.push_back({entry.path(), entry.file_size()});
+			sizeCounts[candidates.back().second]++;
+		}
+	}
+
+	// Every sample must be the same size. Go with the most common size, and skip anything else
+	uint64_t fileSize = 0;
+	size_t mostCommon = 0;
+	for (auto const& [size, count] : sizeCounts) {
+		if (count > mostCommon) {
+			fileSize = size;
+			mostCommon = count;
+		}
+	}
+
+	std::vector<std::filesystem::path> files;
+	for (auto const& [file, size] : candidates) {
+		if (size != fileSize) {
+			std::cerr << "Skipping sample " << file << ", expected " << fileSize << " bytes but found " << size << std::endl;
+			continue;
+		}
+
+		files.push_back(file);
+	}
+
+	DatasetHeader header;
+	makeHeader(header, fileSize / sizeof(float), files.size());
+
+	this->sampleSize = header.sampleSize;
+	this->recordSize = header.recordSize;
+	this->arena.assign(files.size() * this->recordSize, 0);
+
+	// Read each file straight into its record. Records are laid out in the order of the files, so the workers never share one
+	size_t const sampleBytes = static_cast<size_t>(this->sampleSize) * sizeof(float);
+	std::vector<uint8_t> valid(files.size(), 0);
+	ThreadPool pool;
+	pool.parallelFor(files.size(), [&](size_t i) {
+		uint8_t* record = this->arena.data() + i * this->recordSize;
+
+		int fd = ::open(files[i].c_str(), O_RDONLY);
+		size_t read = 0;
+		while (fd >= 0 && read < sampleBytes) {
+			ssize_t result = ::read(fd, record + read, sampleBytes - read);
+			if (result <= 0) {
+				break;
+			}
+			read += result;
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+
+		float const* values = reinterpret_cast<float const*>(record);
+		valid[i] = read == sampleBytes && std::all_of(values, values + this->sampleSize, [](float value) { return std::isfinite(value); });
+
+		// Samples are named after the key that was pressed when they were saved
+		record[sampleBytes] = files[i].filename().string()[0];
+	});
+
+	// Close the gaps left by the samples that failed, keeping the rest in order
+	for (size_t i=0;i<files.size();i++) {
+		if (!valid[i]) {
+			std::cerr << "Failed to read sample " << files[i] << ", or it holds values that are not finite" << std::endl;
+			continue;
+		}
+
+		if (i != this->sampleCount) {
+			memcpy(this->arena.data() + this->sampleCount * this->recordSize, this->arena.data() + i * this->recordSize, this->recordSize);
+		}
+		this->sampleCount++;
+	}
+
+	this->records = this->arena.data();
+	return *this;
+}
+
+/* @brief Write the dataset as a packed .skd file
+ * @param[in] path	The file to write
+ * @return			0 on success, -1 on failure
+*/
+int Dataset::save(std::string const& path) {
+	DatasetHeader header;
+	makeHeader(header, this->sampleSize, this->sampleCount);
+
+	std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (stream.fail()) {
+		std::cerr << "Failed to open " << path << " for writing" << std::endl;
+		return -1;
+	}
+
+	// Pad the header out to the first record
+	std::vector<char> headerBlock(header.dataOffset, 0);
+	memcpy(headerBlock.data(), &header, sizeof(header));
+	stream.write(headerBlock.data(), headerBlock.size());
+
+	// Records are already laid out exactly as they are stored
+	stream.write(reinterpret_cast<char const*>(this->records), static_cast<std::streamsize>(this->sampleCount * this->recordSize));
+
+	if (stream.fail()) {
+		std::cerr << "Failed to write dataset " << path << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* @brief Append one sample to a packed .skd file, creating the file if it does not exist
+ * @param[in] path			The file to append to
+ * @param[in] sample		sampleSize floats
+ * @param[in] sampleSize	The number of floats in the sample. Must match the samples already in the file
+ * @param[in] label			The label byte to store with the sample
+ * @return					0 on success, -1 on failure
+*/
+int Dataset::append(std::string const& path, float const* sample, uint32_t sampleSize, uint8_t label) {
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		std::cerr << "Failed to open dataset " << path << " for appending" << std::endl;
+		return -1;
+	}
+
+	DatasetHeader header;
+	ssize_t headerBytes = pread(fd, &header, sizeof(header), 0);
+
+	if (headerBytes == 0) {
+		// A new pack. Write the header padded out to the first record
+		makeHeader(header, sampleSize, 0);
+		std::vector<char> headerBlock(header.dataOffset, 0);
+		memcpy(headerBlock.data(), &header, sizeof(header));
+		if (pwrite(fd, headerBlock.data(), headerBlock.size(), 0) != static_cast<ssize_t>(headerBlock.size())) {
+			std::cerr << "Failed to write the header of dataset " << path << std::endl;
+			::close(fd);
+			return -1;
+		}
+	} else if (headerBytes != sizeof(header) || memcmp(header.magic, DATASET_MAGIC, sizeof(header.magic)) != 0 || header.version != DATASET_VERSION) {
+		std::cerr << "Dataset " << path << " is not a version " << DATASET_VERSION << " sample pack" << std::endl;
+		::close(fd);
+		return -1;
+	} else if (header.sampleSize != sampleSize) {
+		std::cerr << "Dataset " << path << " holds samples of " << header.sampleSize << " floats, not " << sampleSize << std::endl;
+		::close(fd);
+		return -1;
+	}
+
+	// Write the record first, then publish it by bumping the count, so a reader never sees a partial record
+	std::vector<uint8_t> record(header.recordSize, 0);
+	memcpy(record.data(), sample, static_cast<size_t>(sampleSize) * sizeof(float));
+	record[static_cast<size_t>(sampleSize) * sizeof(float)] = label;
+
+	off_t recordOffset = header.dataOffset + header.sampleCount * header.recordSize;
+	if (pwrite(fd, record.data(), record.size(), recordOffset) != static_cast<ssize_t>(record.size())) {
+		std::cerr << "Failed to append to dataset " << path << std::endl;
+		::close(fd);
+		return -1;
+	}
+
+	header.sampleCount++;
+	if (pwrite(fd, &header.sampleCount, sizeof(header.sampleCount), offsetof(DatasetHeader, sampleCount)) != sizeof(header.sampleCount)) {
+		std::cerr << "Failed to update the sample count of dataset " << path << std::endl;
+		::close(fd);
+		return -1;
+	}
+
+	::close(fd);
+	return 0;
+}
+
+/* @brief Convert a directory of .raw samples into a packed .skd file
+ * @param[in] sampleDir	The directory of .raw samples
+ * @param[in] path		The file to write
+ * @return				0 on success, -1 on failure
+*/
+int Dataset::convert(std::string const& sampleDir, std::string const& path) {
+	if (!std::filesystem::is_directory(sampleDir)) {
+		std::cerr << sampleDir << " is not a directory of samples" << std::endl;
+		return -1;
+	}
+
+	Dataset dataset(sampleDir);
+
+	if (dataset.size() == 0) {
+		std::cerr << "No .raw samples found in " << sampleDir << std::endl;
+		return -1;
+	}
+
+	std::cout << "Packing " << dataset.size() << " samples of " << dataset.getSampleSize() << " floats into " << path << std::endl;
+	return dataset.save(path);
+}
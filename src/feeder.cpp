@@ -0,0 +1,140 @@
+#include "feeder.h"
+
+#include <algorithm>
+#include <cstring>
+
+/* @brief Start staging batches
+ * @param[in] dataset		The dataset to read samples from. Must stay open for the lifetime of the feeder
+ * @param[in] sampleIndices	The order to visit the samples in
+ * @param[in] batchSize		The number of samples in each batch
+ * @param[in] inputCount	The number of floats in each row of a batch. Samples are truncated or zero padded to fit
+ * @param[in] shuffle		How to order the samples
+*/
+Feeder::Feeder(Dataset& dataset, std::vector<uint32_t> const& sampleIndices, uint32_t batchSize, uint32_t inputCount, ShuffleSettings const& shuffle) :
+	dataset(dataset), sampleIndices(sampleIndices), batchSize(batchSize), inputCount(inputCount), random(shuffle.seed) {
+	// Round each slot up to a cache line so slots never share one between threads
+	this->slotSize = (static_cast<size_t>(batchSize) * inputCount * sizeof(float) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE / sizeof(float);
+	this->slots.assign(this->slotSize * FEEDER_DEPTH, 0.0);
+
+	// A buffer holding every sample would only be a slower full shuffle
+	this->bufferCount = std::min<size_t>(shuffle.bufferSize, this->sampleIndices.size());
+	this->shuffled = this->bufferCount == 0;
+	if (!this->shuffled) {
+		this->buffer.assign(this->bufferCount * dataset.getSampleSize(), 0.0);
+		dataset.adviseSequential();
+	}
+
+	if (!this->sampleIndices.empty()) {
+		this->worker = std::thread(&Feeder::run, this);
+	}
+}
+
+Feeder::~Feeder() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+
+	if (this->worker.joinable()) {
+		this->worker.join();
+	}
+}
+
+/* @brief Wait for the next batch to be staged. Must be followed by release() once the batch has been consumed
+ * @return batchSize rows of inputCount floats
+*/
+float const* Feeder::acquire() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->changed.wait(lock, [this] { return this->staged > this->consumed; });
+
+	return this->slots.data() + (this->consumed % FEEDER_DEPTH) * this->slotSize;
+}
+
+/* @brief Hand the batch from acquire() back to be refilled
+ * @return A reference to this feeder object
+*/
+Feeder& Feeder::release() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->consumed++;
+	}
+	this->changed.notify_all();
+
+	return *this;
+}
+
+/* @brief Get the number of samples being fed
+ * @return The sample count
+*/
+size_t Feeder::size() {
+	return this->sampleIndices.size();
+}
+
+/* @brief Staging loop of the background thread
+*/
+void Feeder::run() {
+	size_t batch = 0;
+
+	// Fill the shuffle buffer with the first samples
+	for (size_t i=0;i<this->bufferCount;i++) {
+		memcpy(this->buffer.data() + i * this->dataset.getSampleSize(), this->nextSample(), this->dataset.getSampleSize() * sizeof(float));
+	}
+
+	while (true) {
+		// Wait for a free slot
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->changed.wait(lock, [this, batch] { return this->stopping || batch - this->consumed < FEEDER_DEPTH; });
+			if (this->stopping) {
+				return;
+			}
+		}
+
+		// The slot is not visible to the consumer until 'staged' moves past it, so fill it without holding the lock
+		this->stage(this->slots.data() + (batch % FEEDER_DEPTH) * this->slotSize);
+		batch++;
+
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->staged = batch;
+		}
+		this->changed.notify_all();
+	}
+}
+
+/* @brief Gather the next batch of samples into a slot
+ * @param[out] slot	batchSize rows of inputCount floats
+*/
+void Feeder::stage(float* slot) {
+	uint32_t sampleSize = this->dataset.getSampleSize();
+	size_t copyCount = std::min(sampleSize, this->inputCount);
+
+	for (uint32_t b=0;b<this->batchSize;b++) {
+		float* row = slot + static_cast<size_t>(b) * this->inputCount;
+
+		if (this->bufferCount == 0) {
+			memcpy(row, this->nextSample(), copyCount * sizeof(float));
+		} else {
+			// Draw a buffered sample and read the next one in its place
+			float* buffered = this->buffer.data() + static_cast<size_t>(this->random.below(this->bufferCount)) * sampleSize;
+			memcpy(row, buffered, copyCount * sizeof(float));
+			memcpy(buffered, this->nextSample(), sampleSize * sizeof(float));
+		}
+		std::fill(row + copyCount, row + this->inputCount, 0.0f);
+	}
+}
+
+/* @brief Get the next sample in the order of the sample indices, shuffling them at the start of every epoch unless there is a shuffle buffer
+ * @return The sample
+*/
+float const* Feeder::nextSample() {
+	if (this->position == this->sampleIndices.size()) {
+		this->position = 0;
+	}
+	if (this->position == 0 && this->shuffled) {
+		this->random.shuffle(this->sampleIndices.data(), this->sampleIndices.size());
+	}
+
+	return this->dataset.getSample(this->sampleIndices[this->position++]);
+}
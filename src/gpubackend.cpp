@@ -0,0 +1,557 @@
+#include "gpubackend.h"
+#include "defines.h"
+#include "layer.h"
+#include "model.h"
+#include "oglopp/ssbo.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+// Names of the optimizer uniforms, in the order of PlanStep::updateLocations
+static char const* const updateUniforms[GPU_UPDATE_UNIFORMS] = {"errorScale", "optimizerRate", "momentum", "beta2", "epsilon", "l2Decay", "decoupledDecay",
+	"firstCorrection", "secondCorrection"};
+
+GPUBackend::GPUBackend(oglopp::Compute& compute, ShaderVariants* variants) : compute(compute), variants(variants) {}
+
+GPUBackend::~GPUBackend() {
+	this->reserveStaging(0);
+}
+
+/* @brief Get the type of this backend, which decides where the layers keep their neurons and weights
+ * @return The backend type
+*/
+Backend::Type GPUBackend::getType() const {
+	return Backend::GPU;
+}
+
+/* @brief Perform the feed forward algorithm on a layer using a reference to the previous layer. Performs on the GPU with oglopp compute shaders.
+ * Pruned layers run the sparse passes of the shader, with the same workgroup layout. Convolutions run the direct convolution pass, one lane per neuron
+ * @param[in] thisLayer	The layer to calculate the values for
+ * @param[in] lastLayer	A reference to the last layer to be fed into this layer
+ * @return				A reference to thisLayer
+*/
+Layer& GPUBackend::feedForward(Layer& thisLayer, Layer& lastLayer) {
+	std::vector<PlanStep> steps;
+	this->recordForward(steps, thisLayer, lastLayer);
+	this->replay(steps, nullptr);
+	return thisLayer;
+}
+
+/* @brief Perform back propagation on a layer, adjusting its weights and biases and carrying the deltas into the last layer.
+ * The gradients of every sample in the batch are summed and applied once, by the optimizer update fused into the pass that sums them
+ * @param[in] thisLayer		The layer to adjust
+ * @param[in] lastLayer		The layer before thisLayer, which receives the carried deltas in its expected values
+ * @param[in] isLastLayer	True if thisLayer is the output layer of the network
+ * @param[in] step			The optimizer and learning rate to adjust the weights and biases with
+ * @return					A reference to thisLayer
+*/
+Layer& GPUBackend::backPropagate(Layer& thisLayer, Layer& lastLayer, bool isLastLayer, OptimizerStep const& step) {
+	std::vector<PlanStep> steps;
+	this->recordBackward(steps, thisLayer, lastLayer, isLastLayer, step.settings.optimizer);
+	this->replay(steps, &step);
+	return thisLayer;
+}
+
+/* @brief Feed forward a range of layers in order, each from the one before it. The dispatches are recorded into a plan the first time the range
+ * is run on this topology, and the plan is replayed from then on
+ * @param[in] layers	The layers of the network
+ * @param[in] first		The first layer to compute, at least 1
+ * @param[in] last		The last layer to compute
+*/
+void GPUBackend::forwardPass(std::vector<Layer>& layers, size_t first, size_t last) {
+	std::vector<uintptr_t> key = this->getPlanKey(layers, first, last, SHADER_PASS_FORWARD, 0);
+	auto found = this->plans.find(key);
+	if (found == this->plans.end()) {
+		std::vector<PlanStep> steps;
+		for (size_t i=first;i<=last;i++) {
+			// A small layer and the one after it in one dispatch
+			if (this->fuse && i < last && this->recordFused(steps, layers[i + 1], layers[i], layers[i - 1])) {
+				i++;
+				continue;
+			}
+			this->recordForward(steps, layers[i], layers[i - 1]);
+		}
+
+		if (this->plans.size() >= GPU_MAX_PLANS) {
+			this->plans.clear();
+		}
+		found = this->plans.emplace(std::move(key), std::move(steps)).first;
+	}
+
+	this->replay(found->second, nullptr);
+}
+
+/* @brief Back propagate every layer of a network, from the output layer down to the first hidden layer. The dispatches are recorded into a plan
+ * the first time it is run on this topology and optimizer, and the plan is replayed from then on
+ * @param[in] layers	The layers of the network
+ * @param[in] step		The optimizer and learning rate to adjust every layer with
+*/
+void GPUBackend::backwardPass(std::vector<Layer>& layers, OptimizerStep const& step) {
+	std::vector<uintptr_t> key = this->getPlanKey(layers, 1, layers.size() - 1, SHADER_PASS_BACKWARD, step.settings.optimizer);
+	auto found = this->plans.find(key);
+	if (found == this->plans.end()) {
+		std::vector<PlanStep> steps;
+		for (size_t i=layers.size()-1;i>0;i--) {
+			this->recordBackward(steps, layers[i], layers[i - 1], i == layers.size() - 1, step.settings.optimizer);
+		}
+
+		if (this->plans.size() >= GPU_MAX_PLANS) {
+			this->plans.clear();
+		}
+		found = this->plans.emplace(std::move(key), std::move(steps)).first;
+	}
+
+	this->replay(found->second, &step);
+}
+
+/* @brief Fuse the forward pass of every dense layer of at most GPU_FUSE_NEURONS neurons into the dispatch of the dense layer after it, like the
+ * bottleneck of an autoencoder. Every workgroup of the fused dispatch computes the whole small layer, which costs less than a dispatch and barrier
+ * when it is that small. Only applies to forwardPass(), and needs shader variants
+ * @param[in] fuse	True to fuse
+ * @return			A reference to this backend
+*/
+GPUBackend& GPUBackend::setFusion(bool fuse) {
+	this->fuse = fuse;
+	this->plans.clear();
+	return *this;
+}
+
+/* @brief Load a batch of samples into the input layer, and into the expected values of the output layer.
+ * The batch is copied into the next slot of the staging ring and a load pass copies it into both layers on the GPU, so neither layer is mapped and
+ * the host only waits if the GPU is still GPU_STAGING_SLOTS batches behind
+ * @param[in] inputLayer	The first layer of the network
+ * @param[in] outputLayer	The last layer of the network
+ * @param[in] batch			inputLayer.getBatchSize() rows of inputLayer.getNeuronCount() floats
+ * @return					A reference to inputLayer
+*/
+Layer& GPUBackend::loadBatch(Layer& inputLayer, Layer& outputLayer, float const* batch) {
+	size_t batchSize = static_cast<size_t>(inputLayer.getBatchSize()) * inputLayer.getNeuronCount();
+	this->reserveStaging(batchSize);
+
+	// Wait until the load pass that last read this slot is done with it
+	GLsync& fence = this->stagingFences[this->stagingSlot];
+	if (fence != nullptr) {
+		if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED) == GL_WAIT_FAILED) {
+			std::cerr << "Failed waiting for staging slot " << this->stagingSlot << std::endl;
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	size_t offset = this->stagingSlot * this->stagingSlotSize;
+	if (this->stagingMap != nullptr) {
+		// Coherent mapping, visible to the next dispatch without a flush
+		memcpy(this->stagingMap + offset, batch, batchSize * sizeof(float));
+	} else {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->stagingBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(float), batchSize * sizeof(float), batch);
+	}
+
+	inputLayer.getValues().bind(0);
+	inputLayer.getExpected().bind(1);
+	outputLayer.getValues().bind(2);
+	outputLayer.getExpected().bind(3);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, this->stagingBuffer);
+
+	ShaderVariant variant;
+	variant.pass = SHADER_PASS_LOAD;
+	variant.thisCount = inputLayer.getNeuronCount();
+	variant.lastCount = outputLayer.getNeuronCount();
+	variant.batchSize = inputLayer.getBatchSize();
+	this->useProgram(this->getProgram(variant), variant);
+	this->setInt("stagingOffset", offset);
+	// One lane per neuron of whichever layer is larger
+	size_t lanes = static_cast<size_t>(inputLayer.getBatchSize()) * std::max(inputLayer.getNeuronCount(), outputLayer.getNeuronCount());
+	this->dispatch((lanes + GPU_WORKGROUP_SIZE - 1) / GPU_WORKGROUP_SIZE, 1);
+
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	this->stagingSlot = (this->stagingSlot + 1) % GPU_STAGING_SLOTS;
+
+	oglopp::SSBO::unbind();
+
+	return inputLayer;
+}
+
+/* @brief Record the forward pass of a layer
+ * @param[in] steps		The steps to add to
+ * @param[in] thisLayer	The layer to calculate the values for
+ * @param[in] lastLayer	The layer fed into it
+*/
+void GPUBackend::recordForward(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& lastLayer) {
+	PlanStep step;
+	step.variant = this->getVariant(SHADER_PASS_FORWARD, thisLayer, lastLayer);
+	step.program = this->getProgram(step.variant);
+	this->bindLayers(step, thisLayer, lastLayer);
+	step.bindings[4] = &thisLayer.getWeights();
+	step.bindings[5] = &thisLayer.getBiases();
+	if (thisLayer.isSparse()) {
+		step.bindings[7] = &thisLayer.getSparseIndex();
+	}
+
+	if (thisLayer.isConvolution()) {
+		// One lane per neuron, one row of workgroups per sample
+		step.x = (thisLayer.getNeuronCount() + GPU_WORKGROUP_SIZE - 1) / GPU_WORKGROUP_SIZE;
+		step.y = thisLayer.getBatchSize();
+	} else {
+		// Each workgroup computes GPU_FORWARD_ROWS neurons for GPU_FORWARD_SAMPLES samples
+		step.x = (thisLayer.getNeuronCount() + GPU_FORWARD_ROWS - 1) / GPU_FORWARD_ROWS;
+		step.y = (thisLayer.getBatchSize() + GPU_FORWARD_SAMPLES - 1) / GPU_FORWARD_SAMPLES;
+	}
+
+	steps.push_back(step);
+}
+
+/* @brief Record the forward pass of a small layer and the layer after it as one dispatch, see setFusion()
+ * @param[in] steps			The steps to add to
+ * @param[in] thisLayer		The layer after the small one
+ * @param[in] smallLayer	The small layer
+ * @param[in] lastLayer		The layer fed into the small one
+ * @return					False if the pair can not be fused, recording nothing
+*/
+bool GPUBackend::recordFused(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& smallLayer, Layer& lastLayer) {
+	// Both have to be plain dense layers, and the fused pass only exists in the variants. The small layer's weights are read as fp32
+	if (this->variants == nullptr || smallLayer.getNeuronCount() > GPU_FUSE_NEURONS || smallLayer.isSparse() || smallLayer.isConvolution()
+		|| !smallLayer.hasMasterWeights() || thisLayer.isSparse() || thisLayer.isConvolution()) {
+		return false;
+	}
+
+	PlanStep step;
+	step.variant = this->getVariant(SHADER_PASS_FORWARD, thisLayer, smallLayer);
+	step.variant.fusedInputs = lastLayer.getNeuronCount();
+	step.variant.fusedActivation = smallLayer.getActivation();
+	step.program = this->getProgram(step.variant);
+	if (step.program == 0) {
+		return false;
+	}
+
+	// The small layer is fed from otherValues, and keeps its values as if it had been dispatched on its own
+	this->bindLayers(step, thisLayer, lastLayer);
+	step.bindings[4] = &thisLayer.getWeights();
+	step.bindings[5] = &thisLayer.getBiases();
+	step.bindings[9] = &smallLayer.getWeights();
+	step.bindings[10] = &smallLayer.getBiases();
+	step.bindings[11] = &smallLayer.getValues();
+	step.x = (thisLayer.getNeuronCount() + GPU_FORWARD_ROWS - 1) / GPU_FORWARD_ROWS;
+	step.y = (thisLayer.getBatchSize() + GPU_FORWARD_SAMPLES - 1) / GPU_FORWARD_SAMPLES;
+
+	steps.push_back(step);
+	return true;
+}
+
+/* @brief Look up the optimizer uniforms of a backward step's specialized program
+ * @param[in] step	The step
+*/
+static void findUpdateUniforms(PlanStep& step) {
+	for (uint32_t i=0;i<GPU_UPDATE_UNIFORMS;i++) {
+		step.updateLocations[i] = step.program != 0 ? glGetUniformLocation(step.program, updateUniforms[i]) : -1;
+	}
+}
+
+/* @brief Record the back propagation of a layer
+ * @param[in] steps			The steps to add to
+ * @param[in] thisLayer		The layer to adjust
+ * @param[in] lastLayer		The layer before it, which receives the carried deltas
+ * @param[in] isLastLayer	True if thisLayer is the output layer of the network
+ * @param[in] optimizer		OPTIMIZER_*
+*/
+void GPUBackend::recordBackward(std::vector<PlanStep>& steps, Layer& thisLayer, Layer& lastLayer, bool isLastLayer, uint32_t optimizer) {
+	PlanStep step;
+	step.variant = this->getVariant(SHADER_PASS_BACKWARD, thisLayer, lastLayer);
+	step.variant.isLastLayer = isLastLayer;
+	step.variant.optimizer = optimizer;
+	step.updated = &thisLayer;
+	this->bindLayers(step, thisLayer, lastLayer);
+	step.bindings[4] = &thisLayer.getWeights();
+	step.bindings[5] = &thisLayer.getBiases();
+	if (thisLayer.isSparse()) {
+		step.bindings[7] = &thisLayer.getSparseIndex();
+	}
+
+	// Each lane of a workgroup owns one neuron of the last layer
+	step.x = (lastLayer.getNeuronCount() + GPU_WORKGROUP_SIZE - 1) / GPU_WORKGROUP_SIZE;
+	if (thisLayer.isConvolution()) {
+		// Carry the deltas with the weights before the update, one row of workgroups per sample
+		step.y = thisLayer.getBatchSize();
+		step.variant.backPropPass = 0;
+		step.program = this->getProgram(step.variant);
+		findUpdateUniforms(step);
+		steps.push_back(step);
+
+		// Then one workgroup per weight, wrapped into rows to stay under the workgroup count limit. The barrier between them keeps the update
+		// from overwriting weights the first pass is still reading
+		uint64_t weightCount = thisLayer.getWeightCount();
+		uint64_t columns = std::min<uint64_t>(weightCount, GPU_MAX_WORKGROUPS);
+		step.x = columns;
+		step.y = (weightCount + columns - 1) / columns;
+		step.variant.backPropPass = 1;
+	}
+	step.program = this->getProgram(step.variant);
+	findUpdateUniforms(step);
+	steps.push_back(step);
+}
+
+/* @brief Run recorded steps. Buffers the step before already bound are not bound again, and the last step makes its writes visible to the host
+ * @param[in] steps	The steps
+ * @param[in] step	The optimizer step backward steps update their layers with, or nullptr for forward steps
+*/
+void GPUBackend::replay(std::vector<PlanStep> const& steps, OptimizerStep const* step) {
+	// Anything may have been bound since the last replay
+	oglopp::SSBO* bound[GPU_PLAN_BINDINGS] = {};
+	GLuint current = 0;
+	Layer* updated = nullptr;
+	OptimizerUpdate update;
+
+	for (size_t i=0;i<steps.size();i++) {
+		PlanStep const& planStep = steps[i];
+		for (uint32_t b=0;b<GPU_PLAN_BINDINGS;b++) {
+			if (planStep.bindings[b] != nullptr && planStep.bindings[b] != bound[b]) {
+				planStep.bindings[b]->bind(b);
+				bound[b] = planStep.bindings[b];
+			}
+		}
+
+		// The generic shader needs its uniforms set for every step
+		if (planStep.program == 0 || planStep.program != current) {
+			this->useProgram(planStep.program, planStep.variant);
+			current = planStep.program;
+		}
+
+		if (planStep.updated != nullptr && step != nullptr) {
+			// Once per layer, even if it takes several dispatches
+			if (planStep.updated != updated) {
+				update = this->startUpdate(*planStep.updated, *step);
+				updated = planStep.updated;
+			}
+
+			this->setUpdate(update, *step, planStep.program != 0 ? planStep.updateLocations : nullptr);
+		}
+
+		if (planStep.program != 0) {
+			glDispatchCompute(planStep.x, planStep.y, 1);
+		} else {
+			this->compute.dispatch(planStep.x, planStep.y);
+		}
+
+		// Each layer reads what the one before it wrote. The host reads the last
+		glMemoryBarrier(i + 1 < steps.size() ? planStep.barrier : planStep.barrier | GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+
+	oglopp::SSBO::unbind();
+}
+
+/* @brief Describe everything a pass over a range of layers is recorded from, so a plan is only replayed on the topology it was recorded for
+ * @param[in] layers	The layers of the network
+ * @param[in] first		The first layer of the pass
+ * @param[in] last		The last layer of the pass
+ * @param[in] pass		SHADER_PASS_FORWARD or SHADER_PASS_BACKWARD
+ * @param[in] optimizer	OPTIMIZER_* for backward passes
+ * @return				The key
+*/
+std::vector<uintptr_t> GPUBackend::getPlanKey(std::vector<Layer>& layers, size_t first, size_t last, uint32_t pass, uint32_t optimizer) const {
+	std::vector<uintptr_t> key = {pass, optimizer, first, last, this->fuse};
+	for (size_t i=first-1;i<=last;i++) {
+		Layer& layer = layers[i];
+		key.insert(key.end(), {reinterpret_cast<uintptr_t>(&layer), layer.getNeuronCount(), layer.getBatchSize(), layer.isSparse(), layer.getKind(),
+			layer.getActivation(), layer.getStoredWeightCount(), layer.getPrecision(), layer.hasMasterWeights()});
+	}
+	return key;
+}
+
+/* @brief Describe the variant of a pass over a layer
+ * @param[in] pass		SHADER_PASS_FORWARD or SHADER_PASS_BACKWARD
+ * @param[in] thisLayer	The layer about to be dispatched
+ * @param[in] lastLayer	The layer before it
+ * @return				The variant, with no optimizer set
+*/
+ShaderVariant GPUBackend::getVariant(uint32_t pass, Layer& thisLayer, Layer& lastLayer) const {
+	ShaderVariant variant;
+	variant.pass = pass;
+	variant.lastCount = lastLayer.getNeuronCount();
+	variant.thisCount = thisLayer.getNeuronCount();
+	variant.batchSize = thisLayer.getBatchSize();
+	variant.sparse = thisLayer.isSparse();
+	variant.activation = thisLayer.getActivation();
+	variant.convolution = thisLayer.getKind();
+	variant.storedWeights = thisLayer.getStoredWeightCount();
+	// Layers with fp32 master weights keep them in the weights buffer, see Layer::setPrecision()
+	variant.weightFormat = thisLayer.hasMasterWeights() ? MODEL_FORMAT_FP32 : thisLayer.getPrecision();
+	if (thisLayer.isConvolution()) {
+		ConvolutionShape const& shape = thisLayer.getConvolution();
+		variant.kernelSize = shape.kernel;
+		variant.kernelStride = shape.stride;
+		variant.kernelPadding = shape.padding;
+		variant.smallSize = shape.smallSize;
+		variant.smallChannels = shape.smallChannels;
+		variant.bigSize = shape.bigSize;
+		variant.bigChannels = shape.bigChannels;
+	}
+	return variant;
+}
+
+/* @brief Get the specialized program of a variant
+ * @param[in] variant	The variant
+ * @return				The program, or 0 to run the generic shader
+*/
+GLuint GPUBackend::getProgram(ShaderVariant const& variant) {
+	return this->variants != nullptr ? this->variants->getProgram(variant) : 0;
+}
+
+/* @brief Use a specialized program, or the generic shader with a variant set as uniforms
+ * @param[in] program	The program from getProgram(), or 0
+ * @param[in] variant	The variant about to be dispatched
+*/
+void GPUBackend::useProgram(GLuint program, ShaderVariant const& variant) {
+	this->program = program;
+	if (program != 0) {
+		glUseProgram(program);
+		return;
+	}
+
+	this->compute.use();
+	this->compute.setBool("loadBatch", variant.pass == SHADER_PASS_LOAD);
+	this->compute.setBool("backProp", variant.pass == SHADER_PASS_BACKWARD);
+	this->compute.setBool("isLastLayer", variant.isLastLayer);
+	this->compute.setInt("lastCount", variant.lastCount);
+	this->compute.setInt("thisCount", variant.thisCount);
+	this->compute.setInt("batchSize", variant.batchSize);
+	if (variant.pass == SHADER_PASS_LOAD) {
+		return;
+	}
+
+	this->compute.setBool("sparse", variant.sparse);
+	this->compute.setInt("activationType", variant.activation);
+	this->compute.setInt("weightFormat", variant.weightFormat);
+	this->compute.setInt("convolution", variant.convolution);
+	if (variant.convolution != 0) {
+		this->compute.setInt("kernelSize", variant.kernelSize);
+		this->compute.setInt("kernelStride", variant.kernelStride);
+		this->compute.setInt("kernelPadding", variant.kernelPadding);
+		this->compute.setInt("smallSize", variant.smallSize);
+		this->compute.setInt("smallChannels", variant.smallChannels);
+		this->compute.setInt("bigSize", variant.bigSize);
+		this->compute.setInt("bigChannels", variant.bigChannels);
+		this->compute.setInt("backPropPass", variant.backPropPass);
+	}
+	if (variant.pass == SHADER_PASS_BACKWARD) {
+		this->compute.setInt("optimizer", variant.optimizer);
+		this->compute.setInt("storedWeights", variant.storedWeights);
+	}
+}
+
+/* @brief Set a uniform of the program in use. Uniforms a variant baked in as constants are ignored
+ * @param[in] name	The uniform name
+ * @param[in] value	The value
+*/
+void GPUBackend::setInt(char const* name, int value) {
+	if (this->program != 0) {
+		// A location of -1 is silently ignored
+		glUniform1i(glGetUniformLocation(this->program, name), value);
+	} else {
+		this->compute.setInt(name, value);
+	}
+}
+
+/* @brief Dispatch the program in use, with a barrier so the next pass and the host see what it wrote
+ * @param[in] x	Workgroups along x
+ * @param[in] y	Workgroups along y
+*/
+void GPUBackend::dispatch(uint32_t x, uint32_t y) {
+	if (this->program == 0) {
+		this->compute.dispatch(x, y);
+	} else {
+		glDispatchCompute(x, y, 1);
+	}
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+/* @brief Bind the moments of a layer and work out its optimizer update for one step, counting the update
+ * @param[in] layer	The layer about to be updated
+ * @param[in] step	The optimizer and learning rate to update it with
+ * @return			The update
+*/
+OptimizerUpdate GPUBackend::startUpdate(Layer& layer, OptimizerStep const& step) {
+	uint32_t slots = Optimizer::getMomentSlots(step.settings.optimizer);
+	OptimizerUpdate update = Optimizer::getUpdate(step, layer.advanceMoments(slots));
+
+	// Plain SGD never reads the moments, but the binding still has to point at a buffer
+	(slots > 0 ? layer.getMoments() : layer.getWeights()).bind(8);
+
+	return update;
+}
+
+/* @brief Set the optimizer uniforms of the program in use
+ * @param[in] update	The update from startUpdate()
+ * @param[in] step		The step it was worked out for
+ * @param[in] locations	The locations of the uniforms in the program, or nullptr to set them by name
+*/
+void GPUBackend::setUpdate(OptimizerUpdate const& update, OptimizerStep const& step, GLint const* locations) {
+	float values[GPU_UPDATE_UNIFORMS] = {static_cast<float>(Optimizer::getErrorScale(step)), update.rate, update.momentum, update.beta2, update.epsilon,
+		update.l2Decay, update.decoupledDecay, update.firstCorrection, update.secondCorrection};
+
+	for (uint32_t i=0;i<GPU_UPDATE_UNIFORMS;i++) {
+		if (locations != nullptr) {
+			glUniform1f(locations[i], values[i]);
+		} else {
+			this->compute.setFloat(updateUniforms[i], values[i]);
+		}
+	}
+}
+
+/* @brief Bind the value and expected buffers of two layers to the 'this' and 'other' bindings of a step
+ * @param[in] step			The step
+ * @param[in] thisLayer		The layer bound to thisValues and thisExpected
+ * @param[in] otherLayer	The layer bound to otherValues and otherExpected
+*/
+void GPUBackend::bindLayers(PlanStep& step, Layer& thisLayer, Layer& otherLayer) {
+	step.bindings[0] = &thisLayer.getValues();
+	step.bindings[1] = &thisLayer.getExpected();
+	step.bindings[2] = &otherLayer.getValues();
+	step.bindings[3] = &otherLayer.getExpected();
+}
+
+/* @brief (Re)create the staging ring if the slots are too small for a batch. A size of 0 releases the ring
+ * @param[in] slotSize	The number of floats in one batch
+*/
+void GPUBackend::reserveStaging(size_t slotSize) {
+	if (slotSize != 0 && slotSize <= this->stagingSlotSize) {
+		return;
+	}
+
+	// Nothing may still be reading the old ring
+	for (GLsync& fence : this->stagingFences) {
+		if (fence != nullptr) {
+			glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+	}
+
+	if (this->stagingBuffer != 0) {
+		glDeleteBuffers(1, &this->stagingBuffer);
+	}
+
+	this->stagingBuffer = 0;
+	this->stagingMap = nullptr;
+	this->stagingSlotSize = slotSize;
+	this->stagingSlot = 0;
+
+	if (slotSize == 0) {
+		return;
+	}
+
+	GLsizeiptr ringSize = slotSize * GPU_STAGING_SLOTS * sizeof(float);
+	glGenBuffers(1, &this->stagingBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->stagingBuffer);
+
+	// Persistent mappings need immutable storage from OpenGL 4.4
+	if (GLAD_GL_VERSION_4_4) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		// Dynamic storage keeps glBufferSubData() working if the mapping fails
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, ringSize, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
+		this->stagingMap = static_cast<float*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ringSize, flags));
+	} else {
+		glBufferData(GL_SHADER_STORAGE_BUFFER, ringSize, nullptr, GL_STREAM_DRAW);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
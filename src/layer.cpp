@@ -1,46 +1,83 @@
 #include "layer.h"
-#include "neuron.h"
+#include "cpukernels.h"
+#include "half.h"
+#include "model.h"
 #include "oglopp/compute.h"
 #include "oglopp/ssbo.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <cstring>
 
-/* @brief Setup the SSBO with some neurons
+/* @brief Setup the layer storage with some neurons
  * @param[in] neuronCount	The number of neurons to randomly initialize and prepare in the SSBO
  * @param[in] weightCount	The number of weights per neuron (the number of neurons in the last layer)
+ * @param[in] type			The backend the layer will be executed on. GPU layers live in SSBOs, CPU layers live in host memory
+ * @param[in] batchSize		The number of samples the layer holds values for at once
 */
-Layer& Layer::setup(uint32_t const neuronCount, uint32_t const weightCount) {
+Layer& Layer::setup(uint32_t const neuronCount, uint32_t const weightCount, Backend::Type type, uint32_t const batchSize) {
+	this->type = type;
+	this->neuronCount = neuronCount;
+	this->batchSize = batchSize;
+	this->weightCount = static_cast<uint64_t>(neuronCount) * weightCount;
+	this->convolution = ConvolutionShape();
+	this->activation = ACTIVATION_SIGMOID;
+
 	if (neuronCount == 0) {
 		return *this;
 	}
 
-	// Allocate some neurons
-	Neuron* pNeurons = new Neuron[neuronCount];
+	this->randomize();
+	return *this;
+}
 
-	for (uint32_t i=0;i<neuronCount;i++) {
-		pNeurons[i].bias 	= static_cast<float>(static_cast<double>(rand()) / RAND_MAX);
-		//neurons[i].weight 	= static_cast<float>(static_cast<double>(rand()) / RAND_MAX);
-		pNeurons[i].value 	= 0.0; //static_cast<float>(static_cast<double>(rand()) / RAND_MAX);
-		pNeurons[i].expected = 0.0; //= (static_cast<float>(static_cast<double>(rand()) / RAND_MAX) - 0.5) * 2.0;
-	}
+/* @brief Setup the layer storage as a convolution or a transposed convolution. Every neuron keeps its own bias
+ * @param[in] shape		The shape of the convolution, with every field filled in. See Network::shapeConvolutions()
+ * @param[in] type		The backend the layer will be executed on. GPU layers live in SSBOs, CPU layers live in host memory
+ * @param[in] batchSize	The number of samples the layer holds values for at once
+ * @return				A reference to this layer object
+*/
+Layer& Layer::setup(ConvolutionShape const& shape, Backend::Type type, uint32_t const batchSize) {
+	uint32_t smallCount = shape.smallSize * shape.smallSize * shape.smallChannels;
+	uint32_t bigCount = shape.bigSize * shape.bigSize * shape.bigChannels;
 
-	this->neurons.load(pNeurons, sizeof(Neuron) * neuronCount);
-	delete[] pNeurons;
+	this->type = type;
+	this->neuronCount = shape.transposed ? bigCount : smallCount;
+	this->batchSize = batchSize;
+	this->weightCount = static_cast<uint64_t>(shape.smallChannels) * shape.bigChannels * shape.kernel * shape.kernel;
+	this->convolution = shape;
+	this->activation = ACTIVATION_SIGMOID;
 
-	// Allocate the weights
-	if (weightCount == 0) {
-		return *this;
+	this->randomize();
+	return *this;
+}
+
+/* @brief Store random biases and weights, see store()
+*/
+void Layer::randomize() {
+	const uint32_t neuronCount = this->neuronCount;
+
+	// Allocate some biases
+	float* pBiases = new float[neuronCount];
+
+	for (uint32_t i=0;i<neuronCount;i++) {
+		pBiases[i] 	= static_cast<float>(static_cast<double>(rand()) / RAND_MAX);
 	}
 
-	const size_t NUM_WEIGHTS = neuronCount * weightCount;
-	float* pWeights = new float[NUM_WEIGHTS];// [weights for neuron 1][weights for neuron 2][weights for neuron 3][[weight 1][weight 2][weight 3] weights for neuron 4]
+	// Allocate the weights
+	const size_t NUM_WEIGHTS = this->weightCount;
+	float* pWeights = nullptr;// [weights for neuron 1][weights for neuron 2][weights for neuron 3][[weight 1][weight 2][weight 3] weights for neuron 4]
 
-	for (uint32_t i=0;i<NUM_WEIGHTS;i++) {
-		pWeights[i] = (static_cast<float>(static_cast<double>(rand()) / RAND_MAX) - 0.5) * 2.0;
+	if (NUM_WEIGHTS > 0) {
+		pWeights = new float[NUM_WEIGHTS];
+		for (size_t i=0;i<NUM_WEIGHTS;i++) {
+			pWeights[i] = (static_cast<float>(static_cast<double>(rand()) / RAND_MAX) - 0.5) * 2.0;
+		}
 	}
 
-	this->weights.load(pWeights, sizeof(float) * NUM_WEIGHTS);
+	this->store(pBiases, pWeights);
+	delete[] pBiases;
 	delete[] pWeights;
-	return *this;
 }
 
 /* @brief Setup the layer using an SSBO
@@ -51,100 +88,840 @@ Layer& Layer::setup(oglopp::SSBO const& neuronCopy) {
 	return *this;
 }
 
-/* @brief Perform the feed forward algorithm on this layer using a reference to the previous layer. Performs on the GPU with oglopp compute shaders
+/* @brief Store zeroed values and expected values for every sample in the batch, along with the biases and weights, in the storage for this layer's backend
+ * @param[in] pBiases	neuronCount biases, may be nullptr to keep the current biases
+ * @param[in] pWeights	weightCount weights, may be nullptr if there are no weights or to keep the current weights. Replaces any mapped, quantized or sparse weights
+*/
+void Layer::store(float const* pBiases, float const* pWeights) {
+	const size_t NUM_NEURONS = static_cast<size_t>(this->neuronCount) * this->batchSize;
+	this->invalidateIncremental();
+
+	// The moments belong to the parameters they were accumulated for
+	if (pBiases != nullptr || pWeights != nullptr) {
+		this->resetMoments();
+	}
+
+	if (this->type == Backend::CPU) {
+		this->hostValues.assign(NUM_NEURONS, 0.0);
+		this->hostExpected.assign(NUM_NEURONS, 0.0);
+		if (pBiases != nullptr) {
+			this->hostBiases.assign(pBiases, pBiases + this->neuronCount);
+		}
+		if (pWeights != nullptr) {
+			this->hostWeights.assign(pWeights, pWeights + this->weightCount);
+			this->modelWeights = nullptr;
+			this->model.reset();
+			this->quantized = QuantizedWeights();
+			this->sparse = SparseWeights();
+			this->reduced = ReducedWeights();
+			this->precision = MODEL_FORMAT_FP32;
+		}
+		return;
+	}
+
+	std::vector<float> zeroed(NUM_NEURONS, 0.0);
+	this->getValues().load(zeroed.data(), sizeof(float) * NUM_NEURONS);
+	this->getExpected().load(zeroed.data(), sizeof(float) * NUM_NEURONS);
+
+	if (pBiases != nullptr) {
+		this->getBiases().load(const_cast<float*>(pBiases), sizeof(float) * this->neuronCount);
+	}
+
+	if (pWeights != nullptr) {
+		this->getWeights().load(const_cast<float*>(pWeights), sizeof(float) * this->weightCount);
+		this->sparse = SparseWeights();
+		this->reduced = ReducedWeights();
+		this->precision = MODEL_FORMAT_FP32;
+	}
+}
+
+/* @brief Perform the feed forward algorithm on this layer using a reference to the previous layer
  * @param[in] lastLayer	A reference to the last layer to be fed into this layer
+ * @param[in] backend	The backend to perform the computation with
  * @return				A reference to this layer
 */
-Layer& Layer::feedForward(Layer& lastLayer, oglopp::Compute& compute) {
-	this->getNeurons().bind(0);
-	lastLayer.getNeurons().bind(1);
-	this->getWeights().bind(2);
+Layer& Layer::feedForward(Layer& lastLayer, Backend& backend) {
+	return backend.feedForward(*this, lastLayer);
+}
 
-	//std::cout << "last count is " << lastLayer.getNeurons().getSize() / sizeof(Neuron) << " while this is " << this->getNeurons().getSize() / sizeof(Neuron) << std::endl;
-	compute.use();
-	compute.setInt("lastCount", lastLayer.getNeurons().getSize() / sizeof(Neuron));
-	compute.setInt("thisCount", this->getNeurons().getSize() / sizeof(Neuron));
-	compute.setBool("backProp", false);
-	compute.dispatch(this->neurons.getSize() / sizeof(Neuron), 1);
+/* @brief Perform back propagation on this layer, carrying the deltas into the previous layer
+ * @param[in] lastLayer		A reference to the last layer that was fed into this layer
+ * @param[in] backend		The backend to perform the computation with
+ * @param[in] isLastLayer	True if this is the output layer
+ * @param[in] step			The optimizer and learning rate to adjust the weights and biases with. Defaults to plain SGD at LEARNING_RATE
+ * @return					A reference to this layer
+*/
+Layer& Layer::backPropagate(Layer& lastLayer, Backend& backend, bool isLastLayer, OptimizerStep const& step) {
+	return backend.backPropagate(*this, lastLayer, isLastLayer, step);
+}
+
+/* @brief Get the backend type this layer's storage was created for
+ * @return The backend type
+*/
+Backend::Type Layer::getType() {
+	return this->type;
+}
+
+/* @brief Get the number of neurons in this layer
+ * @return The neuron count
+*/
+uint32_t Layer::getNeuronCount() {
+	return this->neuronCount;
+}
+
+/* @brief Get the number of samples the layer holds values for at once
+ * @return The batch size
+*/
+uint32_t Layer::getBatchSize() {
+	return this->batchSize;
+}
 
-	oglopp::SSBO::unbind();
+/* @brief Resize the neurons to hold some number of samples. Values are reset, biases and weights are kept
+ * @param[in] batchSize	The number of samples
+ * @return				A reference to this layer object
+*/
+Layer& Layer::setBatchSize(uint32_t const batchSize) {
+	if (batchSize == 0 || batchSize == this->batchSize) {
+		return *this;
+	}
 
+	this->batchSize = batchSize;
+	if (this->neuronCount > 0) {
+		this->store(nullptr, nullptr);
+	}
 	return *this;
 }
 
-Layer& Layer::backPropagate(Layer& lastLayer, oglopp::Compute& compute, bool isLastLayer) {
-	this->getNeurons().bind(0);
-	lastLayer.getNeurons().bind(1);
-	this->getWeights().bind(2);
+/* @brief Get the number of weights connecting the last layer to this layer
+ * @return The weight count (neuron count * last layer neuron count)
+*/
+uint64_t Layer::getWeightCount() {
+	return this->weightCount;
+}
 
-	//std::cout << "last count is " << lastLayer.getNeurons().getSize() / sizeof(Neuron) << " while this is " << this->getNeurons().getSize() / sizeof(Neuron) << std::endl;
-	compute.use();
-	compute.setBool("isLastLayer", isLastLayer);
-	compute.setInt("lastCount", lastLayer.getNeurons().getSize() / sizeof(Neuron));
-	compute.setInt("thisCount", this->getNeurons().getSize() / sizeof(Neuron));
-	compute.setBool("backProp", true);
-	compute.setFloat("learningRate", 0.003);
-	compute.dispatch(lastLayer.getNeurons().getSize() / sizeof(Neuron), 1);
+/* @brief Get the number of weights actually stored. Less than getWeightCount() once pruned
+ * @return The stored weight count
+*/
+uint64_t Layer::getStoredWeightCount() {
+	return this->isSparse() ? this->sparse.nonzeroCount : this->weightCount;
+}
 
-	oglopp::SSBO::unbind();
+/* @brief Get the number of bytes the weights take, including the scales of quantized layers, the index of pruned layers and the master copy of reduced layers
+ * @return The weight bytes
+*/
+uint64_t Layer::getWeightBytes() {
+	if (this->isQuantized()) {
+		return static_cast<uint64_t>(this->neuronCount) * (this->quantized.stride + sizeof(float));
+	}
+	if (this->isSparse()) {
+		return this->sparse.nonzeroCount * (sizeof(float) + sizeof(uint16_t)) + (static_cast<uint64_t>(this->neuronCount) + 1) * sizeof(uint32_t);
+	}
+	if (this->isReduced()) {
+		return this->weightCount * (sizeof(uint16_t) + (this->reduced.master ? sizeof(float) : 0));
+	}
+	return this->weightCount * sizeof(float);
+}
 
-	return *this;
+/* @brief Get a reference to the value SSBO. For CPU layers this is a display copy, see upload() and download()
+ * @return A reference to the value SSBo
+*/
+oglopp::SSBO& Layer::getValues() {
+	if (!this->values) {
+		this->values = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->values;
+}
+
+/* @brief Get a reference to the expected value SSBO. For CPU layers this is a display copy, see upload() and download()
+ * @return A reference to the expected value SSBo
+*/
+oglopp::SSBO& Layer::getExpected() {
+	if (!this->expected) {
+		this->expected = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->expected;
 }
 
-/* @brief Get a reference to the neuron SSBO
- * @return A reference to the neuron SSBo
+/* @brief Get a reference to the bias SSBO. Only valid for GPU layers
+ * @return A reference to the bias SSBo
 */
-oglopp::SSBO& Layer::getNeurons() {
-	return this->neurons;
+oglopp::SSBO& Layer::getBiases() {
+	if (!this->biases) {
+		this->biases = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->biases;
 }
 
-/* @brief Get a reference to the neuron SSBO
- * @return A reference to the neuron SSBo
+/* @brief Get a reference to the weights SSBO. Only valid for GPU layers
+ * @return A reference to the weights SSBo
 */
 oglopp::SSBO& Layer::getWeights() {
-	return this->weights;
+	if (!this->weights) {
+		this->weights = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->weights;
+}
+
+/* @brief Get a reference to the sparse index SSBO of a pruned GPU layer, see shaders/compute.glsl for the layout
+ * @return A reference to the sparse index SSBO
+*/
+oglopp::SSBO& Layer::getSparseIndex() {
+	if (!this->sparseIndex) {
+		this->sparseIndex = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->sparseIndex;
 }
 
-/* @brief Write the layer to
- * @param[in] stream	The stream to write the layer to
+/* @brief Get a reference to the optimizer state SSBO of a GPU layer, laid out like getHostMoments()
+ * @return A reference to the moment SSBO
+*/
+oglopp::SSBO& Layer::getMoments() {
+	if (!this->moments) {
+		this->moments = std::make_unique<oglopp::SSBO>();
+	}
+	return *this->moments;
+}
+
+/* @brief Get a host pointer to the values, independent of the backend. Must be followed by unmapValues()
+ * @param[in] readOnly	True if the values will not be modified
+ * @return				A pointer to getBatchSize() rows of getNeuronCount() values
+*/
+float* Layer::mapValues(bool readOnly) {
+	if (this->type == Backend::CPU) {
+		return this->hostValues.data();
+	}
+	return static_cast<float*>(this->getValues().map(readOnly ? oglopp::SSBO::READ : oglopp::SSBO::BOTH));
+}
+
+Layer& Layer::unmapValues() {
+	if (this->type == Backend::GPU) {
+		this->getValues().unmap();
+	}
+	return *this;
+}
+
+/* @brief Get a host pointer to the expected values, independent of the backend. Must be followed by unmapExpected()
+ * @param[in] readOnly	True if the expected values will not be modified
+ * @return				A pointer to getBatchSize() rows of getNeuronCount() expected values
+*/
+float* Layer::mapExpected(bool readOnly) {
+	if (this->type == Backend::CPU) {
+		return this->hostExpected.data();
+	}
+	return static_cast<float*>(this->getExpected().map(readOnly ? oglopp::SSBO::READ : oglopp::SSBO::BOTH));
+}
+
+Layer& Layer::unmapExpected() {
+	if (this->type == Backend::GPU) {
+		this->getExpected().unmap();
+	}
+	return *this;
+}
+
+/* @brief Get a host pointer to the weights, independent of the backend. Must be followed by unmapWeights()
+ * @return A pointer to getStoredWeightCount() weights, or nullptr for reduced layers without a master copy
+*/
+float* Layer::mapWeights() {
+	// Whoever maps the weights may change them
+	this->invalidateIncremental();
+	if (this->type == Backend::CPU) {
+		return this->getHostWeights();
+	}
+	// The SSBO holds packed halves, see mapReduced()
+	if (!this->hasMasterWeights()) {
+		return nullptr;
+	}
+	return static_cast<float*>(this->getWeights().map());
+}
+
+Layer& Layer::unmapWeights() {
+	if (this->type == Backend::GPU && this->hasMasterWeights()) {
+		this->getWeights().unmap();
+	}
+	return *this;
+}
+
+/* @brief Get a host pointer to the biases, independent of the backend. Must be followed by unmapBiases()
+ * @return A pointer to getNeuronCount() biases
+*/
+float* Layer::mapBiases() {
+	if (this->type == Backend::CPU) {
+		return this->hostBiases.data();
+	}
+	return static_cast<float*>(this->getBiases().map());
+}
+
+Layer& Layer::unmapBiases() {
+	if (this->type == Backend::GPU) {
+		this->getBiases().unmap();
+	}
+	return *this;
+}
+
+/* @brief Get the host value storage of a CPU layer
+ * @return A pointer to the values, or nullptr for GPU layers
+*/
+float* Layer::getHostValues() {
+	return this->type == Backend::CPU ? this->hostValues.data() : nullptr;
+}
+
+/* @brief Get the host expected value storage of a CPU layer
+ * @return A pointer to the expected values, or nullptr for GPU layers
+*/
+float* Layer::getHostExpected() {
+	return this->type == Backend::CPU ? this->hostExpected.data() : nullptr;
+}
+
+/* @brief Get the host bias storage of a CPU layer
+ * @return A pointer to the biases, or nullptr for GPU layers
+*/
+float* Layer::getHostBiases() {
+	return this->type == Backend::CPU ? this->hostBiases.data() : nullptr;
+}
+
+/* @brief Get the host weight storage of a CPU layer. Weights loaded from a v2 model live in the model's private mapping
+ * @return A pointer to getStoredWeightCount() weights, or nullptr for GPU layers, quantized layers and reduced layers without a master copy
+*/
+float* Layer::getHostWeights() {
+	if (this->type != Backend::CPU || this->isQuantized() || !this->hasMasterWeights()) {
+		return nullptr;
+	}
+	if (this->isSparse()) {
+		return this->sparse.values;
+	}
+	return this->modelWeights != nullptr ? this->modelWeights : this->hostWeights.data();
+}
+
+/* @brief Make room for an optimizer's moments, zeroing them the first time, or if the optimizer or the stored weights changed since the last update,
+ * and count one more update. Call before every update
+ * @param[in] slots	Moments per weight and bias, see Optimizer::getMomentSlots()
+ * @return			The number of updates the moments have seen, including this one
+*/
+uint64_t Layer::advanceMoments(uint32_t slots) {
+	uint64_t row = this->getStoredWeightCount() + this->neuronCount;
+	if (slots != this->momentSlots || row != this->momentRow) {
+		this->resetMoments();
+		this->momentSlots = slots;
+		this->momentRow = row;
+
+		size_t count = static_cast<size_t>(slots) * row;
+		if (this->type == Backend::CPU) {
+			this->hostMoments.assign(count, 0.0);
+		} else if (count > 0) {
+			std::vector<float> zeroed(count, 0.0);
+			this->getMoments().load(zeroed.data(), sizeof(float) * count);
+		}
+	}
+
+	return ++this->momentUpdates;
+}
+
+/* @brief Get the host optimizer state of a CPU layer, see advanceMoments(). Each moment is a row of getStoredWeightCount() weight moments followed by
+ * getNeuronCount() bias moments
+ * @return A pointer to the moments, or nullptr if there are none
+*/
+float* Layer::getHostMoments() {
+	return this->hostMoments.empty() ? nullptr : this->hostMoments.data();
+}
+
+/* @brief Drop the optimizer state, so the next update starts from zeroed moments
+*/
+void Layer::resetMoments() {
+	this->hostMoments.clear();
+	this->hostMoments.shrink_to_fit();
+	this->moments.reset();
+	this->momentSlots = 0;
+	this->momentRow = 0;
+	this->momentUpdates = 0;
+}
+
+/* @brief Drop the weights smaller than a threshold, then the smallest of the rest until a fraction of the weights is gone, and store the rest sparsely.
+ * Training only updates the weights that are left, so a pruned layer can be fine tuned
+ * @param[in] threshold	Weights with a smaller magnitude are dropped
+ * @param[in] sparsity	The fraction of the weights to drop, between 0 and 1
  * @return				A reference to this layer object
 */
-Layer& Layer::writeLayer(std::fstream& stream) {
-	// [uint32_t : Layer neuron count]
-	// [uint64_t : Last layer to this layer weights count]
-	// [float[] : Last layer to this layer weights]
-	// [float[] : Layer biases]
+Layer& Layer::prune(float threshold, float sparsity) {
+	uint32_t lastCount = this->neuronCount > 0 ? this->weightCount / this->neuronCount : 0;
+	if (this->isQuantized() || this->isReduced() || this->isConvolution() || this->weightCount == 0 || lastCount > SPARSE_MAX_COLUMNS) {
+		std::cerr << "Only dense unquantized fp32 layers with weights, fed by at most " << SPARSE_MAX_COLUMNS << " neurons, can be pruned" << std::endl;
+		return *this;
+	}
 
-	// Write the size of the neurons
-	uint32_t neuronSize = this->neurons.getSize() / sizeof(Neuron);
-	stream.write(static_cast<char*>(static_cast<void*>(&neuronSize)), sizeof(neuronSize));
+	// Work on a dense copy, so a sparse layer can be pruned further
+	std::vector<float> dense(this->weightCount, 0.0);
+	float const* weights = this->mapWeights();
+	if (this->isSparse()) {
+		for (uint32_t i=0;i<this->neuronCount;i++) {
+			for (uint32_t j=this->sparse.rowOffsets[i];j<this->sparse.rowOffsets[i+1];j++) {
+				dense[static_cast<size_t>(i) * lastCount + this->sparse.columns[j]] = weights[j];
+			}
+		}
+	} else {
+		std::memcpy(dense.data(), weights, sizeof(float) * this->weightCount);
+	}
+	this->unmapWeights();
 
-	// Write the size of the weights
-	uint64_t weightsSize = this->weights.getSize() / sizeof(float);
-	stream.write(static_cast<char*>(static_cast<void*>(&weightsSize)), sizeof(weightsSize));
+	// Weights at or below the magnitude of the smallest 'sparsity' of them are dropped too
+	size_t dropCount = static_cast<size_t>(std::clamp(sparsity, 0.0f, 1.0f) * dense.size());
+	float cutoff = -1.0;
+	if (dropCount > 0) {
+		std::vector<float> magnitudes(dense.size());
+		std::transform(dense.begin(), dense.end(), magnitudes.begin(), [](float w) { return std::fabs(w); });
+		std::nth_element(magnitudes.begin(), magnitudes.begin() + dropCount - 1, magnitudes.end());
+		cutoff = magnitudes[dropCount - 1];
+	}
 
-	// Write the weights
-	void* weightsMap = this->weights.map();
-	stream.write(static_cast<char*>(weightsMap), this->weights.getSize());
-	this->weights.unmap();
+	SparseWeights result;
+	result.offsetStorage.resize(this->neuronCount + 1);
+	result.offsetStorage[0] = 0;
+	for (uint32_t i=0;i<this->neuronCount;i++) {
+		for (uint32_t k=0;k<lastCount;k++) {
+			float weight = dense[static_cast<size_t>(i) * lastCount + k];
+			float magnitude = std::fabs(weight);
+			if (weight != 0.0 && magnitude >= threshold && magnitude > cutoff) {
+				result.columnStorage.push_back(k);
+				result.valueStorage.push_back(weight);
+			}
+		}
+		result.offsetStorage[i+1] = result.valueStorage.size();
+	}
 
-	// Write the biases
-	Neuron* neuronsMap = static_cast<Neuron*>(this->neurons.map());
-	for (size_t i=0;i<neuronSize;i++) {
-		// Write each bias
-		stream.write(static_cast<char*>(static_cast<void*>(&neuronsMap[i].bias)), sizeof(float));
+	result.rowOffsets = result.offsetStorage.data();
+	result.columns = result.columnStorage.data();
+	result.values = result.valueStorage.data();
+	result.nonzeroCount = result.valueStorage.size();
+	this->storeSparse(std::move(result));
+	return *this;
+}
+
+/* @brief Check if the layer has been pruned and stores its weights sparsely
+ * @return True if sparse
+*/
+bool Layer::isSparse() {
+	return this->sparse.rowOffsets != nullptr;
+}
+
+/* @brief Get the sparse weights of a pruned layer
+ * @return A reference to the sparse weights
+*/
+SparseWeights const& Layer::getSparse() {
+	return this->sparse;
+}
+
+/* @brief Make 'sparse' the weights of this layer. CPU layers drop their dense weights, GPU layers upload the values and the sparse index
+ * @param[in] result	The sparse weights. For GPU layers 'values' points at the values to upload
+*/
+void Layer::storeSparse(SparseWeights&& result) {
+	this->resetMoments();
+	this->invalidateIncremental();
+	this->hostWeights.clear();
+	this->hostWeights.shrink_to_fit();
+	this->modelWeights = nullptr;
+	this->model.reset();
+
+	if (this->type == Backend::CPU) {
+		this->sparse = std::move(result);
+		return;
+	}
+
+	// The backward pass walks the weights column by column, so every weight has a single writer. The shader gets both orders:
+	// [row offsets: neuronCount + 1][columns: nonzeroCount][column offsets: lastCount + 1][rows: nonzeroCount][positions in the rows: nonzeroCount]
+	uint32_t lastCount = this->weightCount / this->neuronCount;
+	size_t nonzeroCount = result.nonzeroCount;
+	std::vector<uint32_t> index(this->neuronCount + 1 + nonzeroCount + lastCount + 1 + nonzeroCount * 2, 0);
+	uint32_t* rowOffsets = index.data();
+	uint32_t* columns = rowOffsets + this->neuronCount + 1;
+	uint32_t* columnOffsets = columns + nonzeroCount;
+	uint32_t* rows = columnOffsets + lastCount + 1;
+	uint32_t* positions = rows + nonzeroCount;
+
+	std::copy(result.rowOffsets, result.rowOffsets + this->neuronCount + 1, rowOffsets);
+	std::copy(result.columns, result.columns + nonzeroCount, columns);
+	for (size_t j=0;j<nonzeroCount;j++) {
+		columnOffsets[columns[j] + 1]++;
 	}
-	this->neurons.unmap();
+	for (uint32_t k=0;k<lastCount;k++) {
+		columnOffsets[k+1] += columnOffsets[k];
+	}
+
+	std::vector<uint32_t> fill(columnOffsets, columnOffsets + lastCount);
+	for (uint32_t i=0;i<this->neuronCount;i++) {
+		for (uint32_t j=rowOffsets[i];j<rowOffsets[i+1];j++) {
+			uint32_t slot = fill[columns[j]]++;
+			rows[slot] = i;
+			positions[slot] = j;
+		}
+	}
+
+	this->getSparseIndex().load(index.data(), sizeof(uint32_t) * index.size());
+
+	// An empty buffer can not be bound, so a layer pruned down to nothing keeps one unused weight
+	float none = 0.0;
+	this->getWeights().load(nonzeroCount > 0 ? result.values : &none, sizeof(float) * std::max<size_t>(nonzeroCount, 1));
 
+	// The host keeps the index for saving, the values only live in the SSBO
+	if (result.offsetStorage.empty()) {
+		result.offsetStorage.assign(result.rowOffsets, result.rowOffsets + this->neuronCount + 1);
+		result.columnStorage.assign(result.columns, result.columns + nonzeroCount);
+	}
+	result.rowOffsets = result.offsetStorage.data();
+	result.columns = result.columnStorage.data();
+	result.values = nullptr;
+	result.valueStorage = AlignedVector<float>();
+	this->sparse = std::move(result);
+}
+
+/* @brief Check if the layer is a convolution or a transposed convolution
+ * @return True if convolutional
+*/
+bool Layer::isConvolution() {
+	return this->convolution.kernel > 0;
+}
 
+/* @brief Get the shape of a convolutional layer
+ * @return A reference to the shape. The kernel is 0 for dense layers
+*/
+ConvolutionShape const& Layer::getConvolution() {
+	return this->convolution;
+}
+
+/* @brief Get the activation function of the layer
+ * @return ACTIVATION_*
+*/
+uint32_t Layer::getActivation() {
+	return this->activation;
+}
+
+/* @brief Set the activation function of the layer. Every setup() resets it to sigmoid
+ * @param[in] activation	ACTIVATION_*
+ * @return					A reference to this layer object
+*/
+Layer& Layer::setActivation(uint32_t activation) {
+	this->activation = activation;
+	return *this;
+}
+
+/* @brief Get the kind of layer as stored in a model
+ * @return MODEL_LAYER_DENSE, MODEL_LAYER_CONV or MODEL_LAYER_CONV_TRANSPOSED
+*/
+uint16_t Layer::getKind() {
+	if (!this->isConvolution()) {
+		return MODEL_LAYER_DENSE;
+	}
+	return this->convolution.transposed ? MODEL_LAYER_CONV_TRANSPOSED : MODEL_LAYER_CONV;
+}
+
+/* @brief Get the image this layer's values make up, for the next layer to convolve. A dense layer is taken as a single channel square image
+ * @param[out] size		The width and height of the image
+ * @param[out] channels	The number of channels
+ * @return				False if the layer is dense and its neuron count is not a square
+*/
+bool Layer::getImageShape(uint32_t& size, uint32_t& channels) {
+	if (this->isConvolution()) {
+		size = this->convolution.transposed ? this->convolution.bigSize : this->convolution.smallSize;
+		channels = this->convolution.transposed ? this->convolution.bigChannels : this->convolution.smallChannels;
+		return true;
+	}
+
+	size = static_cast<uint32_t>(std::lround(std::sqrt(static_cast<double>(this->neuronCount))));
+	channels = 1;
+	return static_cast<uint64_t>(size) * size == this->neuronCount;
+}
+
+/* @brief Replace the fp32 weights of a CPU layer with int8 weights and one scale per neuron. The layer can still run forward, but no longer train
+ * @param[in] inputMin	The smallest value seen feeding this layer during calibration
+ * @param[in] inputMax	The largest value seen feeding this layer during calibration
+ * @return				A reference to this layer object
+*/
+Layer& Layer::quantize(float inputMin, float inputMax) {
+	if (this->type != Backend::CPU || this->isQuantized() || this->isSparse() || this->isReduced() || this->isConvolution() || this->weightCount == 0) {
+		std::cerr << "Only dense unquantized fp32 CPU layers with weights can be quantized" << std::endl;
+		return *this;
+	}
+
+	uint32_t lastCount = this->weightCount / this->neuronCount;
+	float const* weights = this->getHostWeights();
+	QuantizedWeights result;
+	result.stride = (lastCount + QUANT_ROW_ALIGNMENT - 1) / QUANT_ROW_ALIGNMENT * QUANT_ROW_ALIGNMENT;
+	result.storage.assign(static_cast<size_t>(this->neuronCount) * result.stride, 0);
+	result.scales.resize(this->neuronCount);
+	result.rowSums.resize(this->neuronCount);
+
+	// Activations are never negative, so they get all 8 bits. Anything else is centered on 128
+	if (inputMin >= 0.0) {
+		result.inputZero = 0;
+		result.inputScale = inputMax > 0.0 ? inputMax / UINT8_MAX : 1.0;
+	} else {
+		float range = std::max(-inputMin, inputMax);
+		result.inputZero = 128;
+		result.inputScale = range / 127.0;
+	}
+
+	// Symmetric per neuron scales, so one large weight only costs precision in its own row
+	for (uint32_t i=0;i<this->neuronCount;i++) {
+		float const* row = weights + static_cast<size_t>(i) * lastCount;
+		int8_t* quantRow = result.storage.data() + static_cast<size_t>(i) * result.stride;
+
+		float largest = 0.0;
+		for (uint32_t k=0;k<lastCount;k++) {
+			largest = std::max(largest, std::fabs(row[k]));
+		}
+
+		float scale = largest > 0.0 ? largest / 127.0 : 1.0;
+		int32_t sum = 0;
+		for (uint32_t k=0;k<lastCount;k++) {
+			quantRow[k] = static_cast<int8_t>(std::clamp(std::lround(row[k] / scale), -127l, 127l));
+			sum += quantRow[k];
+		}
+
+		result.scales[i] = scale;
+		result.rowSums[i] = sum;
+	}
+
+	// Drop the fp32 weights, so the layer only holds a quarter of the memory
+	result.weights = result.storage.data();
+	this->quantized = std::move(result);
+	this->hostWeights.clear();
+	this->hostWeights.shrink_to_fit();
+	this->modelWeights = nullptr;
+	this->model.reset();
+	this->invalidateIncremental();
+	return *this;
+}
+
+/* @brief Check if the layer runs on int8 weights
+ * @return True if quantized
+*/
+bool Layer::isQuantized() {
+	return this->quantized.weights != nullptr;
+}
+
+/* @brief Get the int8 weights of a quantized layer
+ * @return A reference to the quantized weights
+*/
+QuantizedWeights const& Layer::getQuantized() {
+	return this->quantized;
+}
+
+/* @brief Round fp32 weights to a reduced precision format
+ * @param[in] format	MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @param[in] weights	The weights to round
+ * @param[out] rounded	Where to store the rounded weights
+ * @param[in] count		The number of weights
+*/
+static void roundReduced(uint32_t format, float const* weights, uint16_t* rounded, size_t count) {
+	if (format == MODEL_FORMAT_BF16) {
+		kernelRoundBF16(weights, rounded, count);
+	} else {
+		kernelRoundFP16(weights, rounded, count);
+	}
+}
+
+/* @brief Store the weights of a dense layer in fp16 or bf16, which halves the memory the forward pass reads, or back in fp32.
+ * Rounding from the current weights, or widening them back if there is no fp32 copy left
+ * @param[in] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @param[in] master	True to keep the fp32 weights as a master copy to train, false to drop them. GPU layers with a master copy run in fp32
+ * @return				A reference to this layer object
+*/
+Layer& Layer::setPrecision(uint32_t format, bool master) {
+	if (format != MODEL_FORMAT_FP32 && format != MODEL_FORMAT_FP16 && format != MODEL_FORMAT_BF16) {
+		std::cerr << "Weights can only be stored in fp32, fp16 or bf16" << std::endl;
+		return *this;
+	}
+
+	if (format != MODEL_FORMAT_FP32 && (this->isQuantized() || this->isSparse() || this->isConvolution() || this->weightCount == 0)) {
+		std::cerr << "Only dense unquantized unpruned layers with weights can be stored in reduced precision" << std::endl;
+		return *this;
+	}
+
+	// fp32 weights are their own master copy
+	master = master || format == MODEL_FORMAT_FP32;
+	if (format == this->precision && master == this->hasMasterWeights()) {
+		return *this;
+	}
+
+	bool widened = !this->hasMasterWeights();
+	std::vector<float> weights = this->copyWeights();
+	this->invalidateIncremental();
+	this->precision = format;
+	this->reduced = ReducedWeights();
+	this->reduced.master = master && format != MODEL_FORMAT_FP32;
+
+	// Widened weights start a new master copy, which the moments were not accumulated for
+	if (widened) {
+		this->resetMoments();
+	}
+
+	if (this->type == Backend::GPU) {
+		// The shader widens packed halves as it reads them, but only trains fp32 weights, so layers with a master copy run on that.
+		// Buffers hold whole uints, so an odd count is padded with a zero half
+		if (master) {
+			this->getWeights().load(weights.data(), sizeof(float) * this->weightCount);
+		} else {
+			std::vector<uint16_t> rounded((this->weightCount + 1) / 2 * 2, 0);
+			roundReduced(format, weights.data(), rounded.data(), this->weightCount);
+			this->getWeights().load(rounded.data(), sizeof(uint16_t) * rounded.size());
+		}
+		return *this;
+	}
+
+	if (format != MODEL_FORMAT_FP32) {
+		this->reduced.storage.resize(this->weightCount);
+		roundReduced(format, weights.data(), this->reduced.storage.data(), this->weightCount);
+		this->reduced.weights = this->reduced.storage.data();
+	}
+
+	if (!master) {
+		// Drop the fp32 weights, so the layer only holds half the memory
+		this->hostWeights.clear();
+		this->hostWeights.shrink_to_fit();
+		this->modelWeights = nullptr;
+	} else if (widened) {
+		this->hostWeights.assign(weights.begin(), weights.end());
+	}
+
+	// The rounded weights no longer point into a mapped model
+	if (this->modelWeights == nullptr) {
+		this->model.reset();
+	}
+	return *this;
+}
+
+/* @brief Get the format the weights are stored in
+ * @return MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16. Quantized and pruned layers are MODEL_FORMAT_FP32
+*/
+uint32_t Layer::getPrecision() {
+	return this->precision;
+}
+
+/* @brief Check if the weights are stored in fp16 or bf16
+ * @return True if reduced
+*/
+bool Layer::isReduced() {
+	return this->precision != MODEL_FORMAT_FP32;
+}
+
+/* @brief Check if the layer has fp32 weights to train. False only for reduced layers that dropped them
+ * @return True if there are fp32 weights
+*/
+bool Layer::hasMasterWeights() {
+	return !this->isReduced() || this->reduced.master;
+}
+
+/* @brief Get the rounded weights of a reduced CPU layer
+ * @return A reference to the reduced weights
+*/
+ReducedWeights const& Layer::getReduced() {
+	return this->reduced;
+}
+
+/* @brief Round the master weights of a reduced CPU layer into its reduced weights again. Call after the master weights change
+ * @return A reference to this layer object
+*/
+Layer& Layer::roundWeights() {
+	if (this->type == Backend::CPU && this->isReduced() && this->reduced.master) {
+		roundReduced(this->precision, this->getHostWeights(), this->reduced.storage.data(), this->weightCount);
+	}
+	return *this;
+}
+
+/* @brief Get a host pointer to the rounded weights of a reduced layer, independent of the backend. Must be followed by unmapReduced()
+ * @return A pointer to getWeightCount() 16 bit weights
+*/
+uint16_t const* Layer::mapReduced() {
+	if (this->type == Backend::CPU) {
+		return this->reduced.weights;
+	}
+	if (!this->reduced.master) {
+		return static_cast<uint16_t const*>(this->getWeights().map());
+	}
+
+	// GPU layers with a master copy run on it, so they are only rounded when asked
+	std::vector<float> weights = this->copyWeights();
+	this->reduced.storage.resize(this->weightCount);
+	roundReduced(this->precision, weights.data(), this->reduced.storage.data(), this->weightCount);
+	return this->reduced.storage.data();
+}
+
+Layer& Layer::unmapReduced() {
+	if (this->type == Backend::GPU && this->reduced.master) {
+		this->reduced.storage.clear();
+		this->reduced.storage.shrink_to_fit();
+	} else if (this->type == Backend::GPU) {
+		this->getWeights().unmap();
+	}
+	return *this;
+}
+
+/* @brief Copy the dense weights out in fp32, widening the rounded weights if there is no master copy
+ * @return getWeightCount() weights
+*/
+std::vector<float> Layer::copyWeights() {
+	std::vector<float> copy(this->weightCount);
+	if (this->hasMasterWeights()) {
+		float const* weights = this->mapWeights();
+		std::copy(weights, weights + this->weightCount, copy.begin());
+		this->unmapWeights();
+		return copy;
+	}
+
+	uint16_t const* rounded = this->mapReduced();
+	for (uint64_t i=0;i<this->weightCount;i++) {
+		copy[i] = this->precision == MODEL_FORMAT_BF16 ? bf16ToFloat(rounded[i]) : fp16ToFloat(rounded[i]);
+	}
+	this->unmapReduced();
+	return copy;
+}
+
+/* @brief Get the cache of the last incremental forward pass of a CPU layer, see CPUBackend::incrementalPass()
+ * @return A reference to the cache
+*/
+IncrementalCache& Layer::getIncremental() {
+	return this->incremental;
+}
+
+/* @brief Drop the cache of the incremental forward pass, so the next one computes the layer in full. Needed whenever the values or weights change some other way
+ * @return A reference to this layer object
+*/
+Layer& Layer::invalidateIncremental() {
+	this->incremental.valid = false;
 	return *this;
 }
 
-/* @brief Write the layer to
- * @param[in] stream	The stream to write the layer to
+/* @brief Copy the host values and expected values of a CPU layer into the display SSBOs. Does nothing for GPU layers
+ * @return A reference to this layer object
+*/
+Layer& Layer::upload() {
+	if (this->type == Backend::CPU && this->neuronCount > 0) {
+		this->getValues().load(this->hostValues.data(), sizeof(float) * this->hostValues.size());
+		this->getExpected().load(this->hostExpected.data(), sizeof(float) * this->hostExpected.size());
+	}
+	return *this;
+}
+
+/* @brief Copy the display SSBOs of a CPU layer back into host memory, picking up anything the shaders wrote. Does nothing for GPU layers
+ * @return A reference to this layer object
+*/
+Layer& Layer::download() {
+	if (this->type == Backend::CPU && this->values && this->expected && this->neuronCount > 0) {
+		float* map = static_cast<float*>(this->values->map(oglopp::SSBO::READ));
+		std::memcpy(this->hostValues.data(), map, sizeof(float) * this->hostValues.size());
+		this->values->unmap();
+
+		map = static_cast<float*>(this->expected->map(oglopp::SSBO::READ));
+		std::memcpy(this->hostExpected.data(), map, sizeof(float) * this->hostExpected.size());
+		this->expected->unmap();
+	}
+	return *this;
+}
+
+/* @brief Read the layer from a v1 model stream
+ * @param[in] stream	The stream to read the layer from
+ * @param[in] type		The backend to create the layer storage for
  * @return				A reference to this layer object
 */
-Layer& Layer::readLayer(std::fstream& stream) {
+Layer& Layer::readLayer(std::fstream& stream, Backend::Type type) {
 	// [uint32_t : Layer neuron count]
 	// [uint64_t : Last layer to this layer weights count]
 	// [float[] : Last layer to this layer weights]
@@ -158,6 +935,12 @@ Layer& Layer::readLayer(std::fstream& stream) {
 	uint64_t weightsSize = 0;
 	stream.read(static_cast<char*>(static_cast<void*>(&weightsSize)), sizeof(weightsSize));
 
+	this->type = type;
+	this->neuronCount = neuronSize;
+	this->weightCount = weightsSize;
+	this->convolution = ConvolutionShape();
+	this->activation = ACTIVATION_SIGMOID;
+
 	// Read the weights
 	std::cout << "Allocating weights " << weightsSize << std::endl;
 	float* weights = new float[weightsSize];
@@ -166,23 +949,174 @@ Layer& Layer::readLayer(std::fstream& stream) {
 		return *this;
 	}
 	stream.read(static_cast<char*>(static_cast<void*>(weights)), weightsSize * sizeof(float));
-	this->weights.load(weights, weightsSize * sizeof(float));
-	delete[] weights;
 
-	// Write the biases
+	// Read the biases
 	std::cout << "Allocating neurons " << neuronSize << std::endl;
-	Neuron* neurons = new Neuron[neuronSize];
-	if (neurons == nullptr) {
-		std::cerr << "Failed to allocate weights buffer during read of file" << std::endl;
+	float* biases = new float[neuronSize];
+	if (biases == nullptr) {
+		std::cerr << "Failed to allocate biases buffer during read of file" << std::endl;
+		delete[] weights;
 		return *this;
 	}
-	for (size_t i=0;i<neuronSize;i++) {
-		// Write each bias
-		stream.read(static_cast<char*>(static_cast<void*>(&neurons[i].bias)), sizeof(float));
-		neurons[i].expected = 0.0; // Just initialize the data to something
-		neurons[i].value = 0.0;
+	stream.read(static_cast<char*>(static_cast<void*>(biases)), neuronSize * sizeof(float));
+
+	this->store(biases, weights);
+	delete[] weights;
+	delete[] biases;
+	return *this;
+}
+
+/* @brief Read the layer from a mapped v2 model. CPU layers use the mapped weights in place, GPU layers upload them straight from the mapping.
+ * Int8 layers stay quantized on the CPU, and are expanded back to fp32 for the GPU. fp16 and bf16 layers stay reduced, without a master copy
+ * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+ * @param[in] index	The index of this layer in the model
+ * @param[in] type	The backend to create the layer storage for
+ * @return			A reference to this layer object
+*/
+Layer& Layer::readLayer(std::shared_ptr<ModelFile> const& model, uint32_t index, Backend::Type type) {
+	ModelLayerEntry const& entry = model->getLayer(index);
+
+	this->type = type;
+	this->neuronCount = entry.neuronCount;
+	this->weightCount = entry.weightCount;
+	this->convolution = ConvolutionShape();
+	this->activation = entry.activation;
+	this->reduced = ReducedWeights();
+	this->precision = MODEL_FORMAT_FP32;
+	this->quantized = QuantizedWeights();
+	this->sparse = SparseWeights();
+
+	ModelConvHeader const* conv = model->getConvHeader(index);
+	if (conv != nullptr) {
+		this->convolution.transposed = entry.kind == MODEL_LAYER_CONV_TRANSPOSED;
+		this->convolution.kernel = conv->kernel;
+		this->convolution.stride = conv->stride;
+		this->convolution.padding = conv->padding;
+		this->convolution.smallSize = conv->smallSize;
+		this->convolution.smallChannels = conv->smallChannels;
+		this->convolution.bigSize = conv->bigSize;
+		this->convolution.bigChannels = conv->bigChannels;
+	}
+
+	if (entry.format == MODEL_FORMAT_INT8) {
+		return this->readQuantized(model, index);
+	}
+
+	if (entry.format == MODEL_FORMAT_CSR && entry.weightBytes > 0) {
+		return this->readSparse(model, index);
+	}
+
+	if (entry.format == MODEL_FORMAT_FP16 || entry.format == MODEL_FORMAT_BF16) {
+		return this->readReduced(model, index);
 	}
-	this->neurons.load(neurons, neuronSize * sizeof(Neuron));
-	delete[] neurons;
+
+	float* weights = model->getWeights(index);
+	if (type == Backend::GPU) {
+		// The SSBO is filled directly from the mapped pages, the mapping is not needed afterwards
+		this->store(model->getBiases(index), weights);
+		return *this;
+	}
+
+	this->store(model->getBiases(index), nullptr);
+	this->hostWeights.clear();
+	this->hostWeights.shrink_to_fit();
+	this->modelWeights = weights;
+	this->model = weights != nullptr ? model : nullptr;
+	return *this;
+}
+
+/* @brief Read an int8 layer from a mapped v2 model. CPU layers use the mapped int8 weights in place, GPU layers have no int8 path and get them expanded to fp32
+ * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+ * @param[in] index	The index of this layer in the model
+ * @return			A reference to this layer object
+*/
+Layer& Layer::readQuantized(std::shared_ptr<ModelFile> const& model, uint32_t index) {
+	ModelQuantHeader const* header = model->getQuantHeader(index);
+	float const* scales = model->getQuantScales(index);
+	int8_t const* weights = model->getQuantWeights(index);
+	uint32_t lastCount = model->getLayer(index).inputCount;
+
+	if (this->type == Backend::GPU) {
+		std::vector<float> expanded(this->weightCount);
+		for (uint32_t i=0;i<this->neuronCount;i++) {
+			int8_t const* row = weights + static_cast<size_t>(i) * header->stride;
+			for (uint32_t k=0;k<lastCount;k++) {
+				expanded[static_cast<size_t>(i) * lastCount + k] = scales[i] * row[k];
+			}
+		}
+		this->store(model->getBiases(index), expanded.data());
+		return *this;
+	}
+
+	this->store(model->getBiases(index), nullptr);
+	this->hostWeights.clear();
+	this->hostWeights.shrink_to_fit();
+	this->modelWeights = nullptr;
+
+	QuantizedWeights result;
+	result.weights = weights;
+	result.scales.assign(scales, scales + this->neuronCount);
+	result.rowSums.resize(this->neuronCount);
+	result.stride = header->stride;
+	result.inputScale = header->inputScale;
+	result.inputZero = header->inputZero;
+	for (uint32_t i=0;i<this->neuronCount;i++) {
+		int8_t const* row = weights + static_cast<size_t>(i) * header->stride;
+		int32_t sum = 0;
+		for (uint32_t k=0;k<lastCount;k++) {
+			sum += row[k];
+		}
+		result.rowSums[i] = sum;
+	}
+
+	this->quantized = std::move(result);
+	this->model = model;
+	return *this;
+}
+
+/* @brief Read a sparse layer from a mapped v2 model. CPU layers use the mapped index and weights in place
+ * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+ * @param[in] index	The index of this layer in the model
+ * @return			A reference to this layer object
+*/
+Layer& Layer::readSparse(std::shared_ptr<ModelFile> const& model, uint32_t index) {
+	SparseWeights result;
+	result.rowOffsets = model->getSparseOffsets(index);
+	result.columns = model->getSparseColumns(index);
+	result.values = model->getSparseValues(index);
+	result.nonzeroCount = model->getSparseHeader(index)->nonzeroCount;
+
+	this->store(model->getBiases(index), nullptr);
+	this->storeSparse(std::move(result));
+	if (this->type == Backend::CPU) {
+		this->model = model;
+	}
+	return *this;
+}
+
+/* @brief Read an fp16 or bf16 layer from a mapped v2 model. CPU layers use the mapped weights in place, GPU layers upload them packed
+ * @param[in] model	The mapped model, kept alive for as long as the layer uses its weights
+ * @param[in] index	The index of this layer in the model
+ * @return			A reference to this layer object
+*/
+Layer& Layer::readReduced(std::shared_ptr<ModelFile> const& model, uint32_t index) {
+	uint16_t const* weights = model->getReducedWeights(index);
+
+	this->store(model->getBiases(index), nullptr);
+	this->hostWeights.clear();
+	this->hostWeights.shrink_to_fit();
+	this->modelWeights = nullptr;
+	this->precision = model->getLayer(index).format;
+
+	if (this->type == Backend::GPU) {
+		// Buffers hold whole uints, so an odd count is padded with a zero half
+		std::vector<uint16_t> packed(weights, weights + this->weightCount);
+		packed.resize((this->weightCount + 1) / 2 * 2, 0);
+		this->getWeights().load(packed.data(), sizeof(uint16_t) * packed.size());
+		return *this;
+	}
+
+	this->reduced.weights = weights;
+	this->model = model;
 	return *this;
 }
@@ -9,12 +9,20 @@
 #include <cmath>
 #include <filesystem>
 #include <thread>
+#include <memory>
+#include <algorithm>
 #include <unistd.h>
+#include <csignal>
 
 #include "defines.h"
 #include "network.h"
-#include "neuron.h"
+#include "gpubackend.h"
+#include "cpubackend.h"
 #include "netutil.h"
+#include "dataset.h"
+#include "feeder.h"
+#include "profiler.h"
+#include "server.h"
 #include "oglopp/camera.h"
 #include "oglopp/compute.h"
 #include "oglopp/more_shapes.h"
@@ -25,9 +33,13 @@ using namespace oglopp;
 #define RESOLUTION	(32) // RESOLUTION x RESOLUTION pixels
 #define PIXELS		(RESOLUTION * RESOLUTION)
 #define TRAINSIZE 5
+// How often the window is redrawn by default, however fast training runs
+#define DISPLAY_FPS 60
+// Longest the window goes without a redraw while nothing changes
+#define IDLE_REDRAW_SECONDS 1.0
 #define KEY_SAVE_MODEL	GLFW_KEY_PAGE_DOWN
 
-#define OPT_STRING "h"
+#define OPT_STRING "hb:B:j:HgFV:m:s:C:c:u:a:L:I:O:T:o:r:R:w:W:pP:S:D:Q:z:Z:Y:k:e:K:"
 
 class InputBuffer {
 public:
@@ -56,34 +68,458 @@ void* InputBuffer::keyData = nullptr;
 float InputBuffer::drawSize = 30;
 
 
+/* @brief Build a network from a model file if one was given, otherwise from the requested topology
+ * @param[in] network		The network to setup
+ * @param[in] backend		The backend to run the network on
+ * @param[in] modelFile		The model to load, or an empty string for a new network
+ * @param[in] inputSize		The input layer size for a new network
+ * @param[in] hiddenSizes	The hidden layer sizes for a new network
+ * @param[in] outputSize	The output layer size for a new network
+ * @param[in] convolutions	One shape per layer after the input for a new network, see Network::setup()
+ * @param[in] activations	One ACTIVATION_* per layer after the input for a new network
+ * @param[in] optimizer		The optimizer settings to train with, or nullptr to keep the ones saved with the model
+ * @param[in] precision		The MODEL_FORMAT_* to store the dense layers in, or nullptr to keep the one they were loaded in
+ * @param[in] master		True to keep fp32 master weights of reduced layers to train
+*/
+static void setupNetwork(Network& network, Backend& backend, std::string const& modelFile, size_t inputSize, std::vector<size_t> const& hiddenSizes, size_t outputSize,
+	std::vector<ConvolutionShape> const& convolutions, std::vector<uint32_t> const& activations, OptimizerSettings const* optimizer, uint32_t const* precision,
+	bool master) {
+	if (modelFile.empty()) {
+		network.setup(backend, inputSize, hiddenSizes, outputSize, convolutions, activations);
+	} else {
+		network.setup(backend, modelFile);
+	}
+
+	if (optimizer != nullptr) {
+		network.getOptimizer().setSettings(*optimizer);
+	}
+
+	if (precision != nullptr && !network.getError()) {
+		network.setPrecision(*precision, master);
+	}
+}
+
+/* @brief Get the path of a file saved next to a model, with a tag before the extension
+ * @param[in] modelFile	The model the file belongs to
+ * @param[in] tag		The tag, like ".int8"
+ * @return				The path
+*/
+static std::string siblingPath(std::string const& modelFile, char const* tag) {
+	std::string path = modelFile;
+	if (path.size() >= strlen(MODEL_EXTENSION) && path.compare(path.size() - strlen(MODEL_EXTENSION), std::string::npos, MODEL_EXTENSION) == 0) {
+		path.erase(path.size() - strlen(MODEL_EXTENSION));
+	}
+	return path + tag + MODEL_EXTENSION;
+}
+
+/* @brief Write the profile as a Chrome trace, if one was asked for
+ * @param[in] tracePath	The file to write, or an empty string
+*/
+static void writeProfile(std::string const& tracePath) {
+	if (!tracePath.empty()) {
+		Profiler::writeTrace(tracePath);
+	}
+}
+
+/* @brief Serve a loaded model until interrupted
+ * @param[in] network		The network to serve
+ * @param[in] socketPath	The Unix domain socket to listen on
+ * @param[in] batchDelay	How long a request may wait for others to share its batch, in microseconds
+ * @return					The exit code
+*/
+static int serve(Network& network, std::string const& socketPath, uint32_t batchDelay) {
+	Server server(network, socketPath, batchDelay);
+	if (server.getError()) {
+		return 1;
+	}
+
+	signal(SIGINT, [](int) { Server::stop(); });
+	signal(SIGTERM, [](int) { Server::stop(); });
+	return server.run();
+}
+
 int main(int argc, char** argv) {
 	srand(time(NULL));
 
 
 	// Handle options
 	int opt;
+	Backend::Type backendType = Backend::GPU;
+	uint32_t batchSize = 1;
+	bool batchSizeGiven = false;
+	size_t threadCount = 0;
+	bool hogwild = false;
+	bool genericShader = false;
+	bool fuseLayers = false;
+	double displayFps = DISPLAY_FPS;
+	std::string modelFile;
+	std::string samplePath;
+	std::string convertDir;
+	size_t inputSize = PIXELS;
+	size_t outputSize = PIXELS;
+	std::vector<size_t> hiddenSizes;
+	// One per hidden layer, then the output layer. -c, -u and -a apply to whichever of -L and -O came last
+	std::vector<ConvolutionShape> hiddenConvolutions;
+	ConvolutionShape outputConvolution;
+	std::vector<uint32_t> hiddenActivations;
+	uint32_t outputActivation = ACTIVATION_SIGMOID;
+	int lastLayerOption = 0;
+	size_t trainIterations = 0;
+	uint64_t checkpointSteps = 0;
+	// Like rand(), a different order every run unless a seed is given
+	ShuffleSettings shuffle;
+	shuffle.seed = time(NULL);
+	// Any optimizer option replaces all of the settings saved with a loaded model
+	OptimizerSettings optimizerSettings;
+	bool optimizerGiven = false;
+	bool learningRateGiven = false;
+	bool profile = false;
+	std::string tracePath;
+	std::string socketPath;
+	uint32_t batchDelay = SERVER_BATCH_DELAY_US;
+	size_t calibrationSamples = 0;
+	bool pruning = false;
+	float pruneThreshold = 0.0;
+	float pruneSparsity = 0.0;
+	uint32_t precision = MODEL_FORMAT_FP32;
+	bool precisionGiven = false;
 	while ((opt = getopt(argc, argv, OPT_STRING)) != -1) {
 		switch(opt) {
+			case 'b':
+				if (strcmp(optarg, "cpu") == 0) {
+					backendType = Backend::CPU;
+				} else if (strcmp(optarg, "gpu") == 0) {
+					backendType = Backend::GPU;
+				} else {
+					std::cerr << "Unknown backend '" << optarg << "'. Expected one of 'gpu,cpu'" << std::endl;
+					return 1;
+				}
+				break;
+			case 'B':
+				batchSize = atoi(optarg);
+				batchSizeGiven = true;
+				if (batchSize < 1 || batchSize > MAX_BATCH_SIZE) {
+					std::cerr << "Batch size must be between 1 and " << MAX_BATCH_SIZE << std::endl;
+					return 1;
+				}
+				break;
+			case 'j':
+				threadCount = strtoul(optarg, nullptr, 10);
+				break;
+			case 'H':
+				hogwild = true;
+				break;
+			case 'g':
+				genericShader = true;
+				break;
+			case 'F':
+				fuseLayers = true;
+				break;
+			case 'V':
+				displayFps = strtod(optarg, nullptr);
+				if (!(displayFps > 0.0)) {
+					std::cerr << "The display rate must be above 0" << std::endl;
+					return 1;
+				}
+				break;
+			case 'm':
+				modelFile = optarg;
+				break;
+			case 's':
+				samplePath = optarg;
+				if (std::filesystem::is_directory(samplePath) && samplePath.back() != '/') {
+					samplePath += '/';
+				}
+				break;
+			case 'C':
+				convertDir = optarg;
+				if (convertDir.back() != '/') {
+					convertDir += '/';
+				}
+				break;
+			case 'c':
+			case 'u':
+				if (lastLayerOption == 0) {
+					std::cerr << "-" << static_cast<char>(opt) << " applies to the layer added by the -L or -O before it" << std::endl;
+					return 1;
+				}
+				if (!parseConvolution(optarg, opt == 'u', lastLayerOption == 'L' ? hiddenConvolutions.back() : outputConvolution)) {
+					return 1;
+				}
+				break;
+			case 'a':
+				if (lastLayerOption == 0) {
+					std::cerr << "-a applies to the layer added by the -L or -O before it" << std::endl;
+					return 1;
+				}
+				if (!parseActivation(optarg, lastLayerOption == 'L' ? hiddenActivations.back() : outputActivation)) {
+					return 1;
+				}
+				break;
+			case 'L':
+				hiddenSizes.push_back(strtoul(optarg, nullptr, 10));
+				hiddenConvolutions.emplace_back();
+				hiddenActivations.push_back(ACTIVATION_SIGMOID);
+				lastLayerOption = opt;
+				break;
+			case 'I':
+				inputSize = strtoul(optarg, nullptr, 10);
+				break;
+			case 'O':
+				outputSize = strtoul(optarg, nullptr, 10);
+				lastLayerOption = opt;
+				break;
+			case 'T':
+				trainIterations = strtoull(optarg, nullptr, 10);
+				break;
+			case 'k':
+				checkpointSteps = strtoull(optarg, nullptr, 10);
+				break;
+			case 'e':
+				shuffle.seed = strtoull(optarg, nullptr, 10);
+				break;
+			case 'K':
+				shuffle.bufferSize = strtoul(optarg, nullptr, 10);
+				break;
+			case 'o':
+				optimizerGiven = true;
+				if (!parseOptimizer(optarg, optimizerSettings)) {
+					return 1;
+				}
+				break;
+			case 'r':
+				optimizerGiven = true;
+				learningRateGiven = true;
+				optimizerSettings.learningRate = strtof(optarg, nullptr);
+				break;
+			case 'R':
+				optimizerGiven = true;
+				if (!parseSchedule(optarg, optimizerSettings)) {
+					return 1;
+				}
+				break;
+			case 'w':
+				optimizerGiven = true;
+				optimizerSettings.warmupSteps = strtoul(optarg, nullptr, 10);
+				break;
+			case 'W':
+				optimizerGiven = true;
+				optimizerSettings.weightDecay = strtof(optarg, nullptr);
+				break;
+			case 'p':
+				profile = true;
+				break;
+			case 'P':
+				profile = true;
+				tracePath = optarg;
+				break;
+			case 'S':
+				socketPath = optarg;
+				break;
+			case 'D':
+				batchDelay = strtoul(optarg, nullptr, 10);
+				break;
+			case 'Q':
+				calibrationSamples = strtoull(optarg, nullptr, 10);
+				if (calibrationSamples == 0) {
+					std::cerr << "Quantizing needs at least one calibration sample" << std::endl;
+					return 1;
+				}
+				break;
+			case 'z':
+				pruneThreshold = strtof(optarg, nullptr);
+				pruning = true;
+				break;
+			case 'Z':
+				pruneSparsity = strtof(optarg, nullptr);
+				pruning = true;
+				if (pruneSparsity < 0.0 || pruneSparsity >= 1.0) {
+					std::cerr << "Sparsity must be at least 0 and below 1" << std::endl;
+					return 1;
+				}
+				break;
+			case 'Y':
+				if (!parsePrecision(optarg, precision)) {
+					return 1;
+				}
+				precisionGiven = true;
+				break;
 			case 'h':
 				std::cout << " SketchML v" << SKML_VERSION << " - Help Menu" << std::endl << std::endl
 				<< "-h\t\tDisplay this help menu." << std::endl
+				<< "-b [backend]\tOne of 'gpu,cpu'. Where the network is stored and computed. Defaults to 'gpu'." << std::endl
+				<< "-B [samples]\tTrain on this many samples at once, applying their summed gradients in a single update. Defaults to 1." << std::endl
+				<< "-j [threads]\tSplit each batch across this many threads with the cpu backend. Defaults to one per physical core." << std::endl
+				<< "-H\t\tLet every thread update the weights as soon as its part of the batch is done, without locking (hogwild)." << std::endl
+				<< "-g\t\tRun every layer through the generic compute shader, instead of variants specialized on its shape and cached in" << std::endl
+				<< "\t\t" << SHADER_CACHE_DIRECTORY << " next to the executable." << std::endl
+				<< "-F\t\tCompute every layer of at most " << GPU_FUSE_NEURONS << " neurons in the same dispatch as the layer after it with the gpu backend." << std::endl
+				<< "-V [fps]\tRedraw the window at most this many times a second, training in between. Defaults to " << DISPLAY_FPS << "." << std::endl
 				<< "-m [model.skm]\tSelect a relative or status path to load a model from." << std::endl
-				<< "-s [sample dir]\tChoose the path where the dataset of samples can be located. " << std::endl
-				<< "-t [type]\tOne of 'classify,deep'" << std::endl
-				<< "-c [kernel]\tMake the previous hidden layer a convolutional layer. 'kernel' specifies which kernel containing a set of predefined filters to use." << std::endl
+				<< "-s [samples]\tChoose the path where the dataset of samples can be located. Either a " << DATASET_EXTENSION << " pack or a directory of .raw samples." << std::endl
+				<< "\t\tDefaults to " << DATASET_FILE << " next to the executable. Saved samples are appended to the pack." << std::endl
+				<< "-C [sample dir]\tPack a directory of .raw samples into the dataset given by -s, then exit." << std::endl
+				<< "-c [k,stride]\tMake the layer added by the previous -L or -O a convolution of the layer before it, with a k x k kernel. The images are square," << std::endl
+				<< "\t\tshrink by the stride, and have as many channels as the layer's neurons allow. The stride defaults to 1." << std::endl
+				<< "-u [k,stride]\tSame as -c with a transposed convolution, which grows the image by the stride. For the decoder." << std::endl
+				<< "-a [activation]\tOne of 'sigmoid,relu,tanh,linear'. The activation of the layer added by the previous -L or -O. Defaults to 'sigmoid'." << std::endl
 				<< "-L [neurons]\tAdd a new (hidden) layer of some size." << std::endl
 				<< "-I [neurons]\tSpecify the number of neurons to use in the input layer." << std::endl
 				<< "-O [neurons]\tSpecify the number of neurons to use in the output layer." << std::endl
-				<< "-T [iterations]\tTrain the network for some number of 'iterations' then save the model and exit." << std::endl;
+				<< "-T [iterations]\tTrain the network for some number of 'iterations' then save the model and exit." << std::endl
+				<< "\t\tAn iteration is one batch. No window is opened and nothing is drawn while training." << std::endl
+				<< "-k [steps]\tCheckpoint the model every 'steps' batches while training, to where it is saved. Checkpoints are written on a" << std::endl
+				<< "\t\tbackground thread, so training only waits for the weights to be copied." << std::endl
+				<< "-e [seed]\tSeed the order training visits the samples in, which is shuffled again every epoch. Defaults to the time." << std::endl
+				<< "-K [samples]\tRead the samples in the order they are stored, drawing every batch at random from a shuffle buffer of this many." << std::endl
+				<< "\t\tFor sample packs too large to stay in memory. Defaults to 0, shuffling the whole set." << std::endl
+				<< "-o [optimizer]\tOne of 'sgd,momentum[,m],adam[,b1,b2],adamw[,b1,b2]'. The optimizer training updates the weights with. Defaults to 'sgd'," << std::endl
+				<< "\t\tor to the optimizer saved with the model. Momentum defaults to " << SGD_MOMENTUM << ", the Adam betas to " << ADAM_BETA1 << "," << ADAM_BETA2 << "." << std::endl
+				<< "\t\tGiving any of -o, -r, -R, -w or -W replaces every optimizer setting saved with the model." << std::endl
+				<< "-r [rate]\tThe peak learning rate. Defaults to " << LEARNING_RATE << ", or " << ADAM_LEARNING_RATE << " for Adam." << std::endl
+				<< "-R [schedule]\tOne of 'constant', 'cosine,steps[,floor]' or 'step,steps[,factor]'. Decays the learning rate after the warmup, along a cosine" << std::endl
+				<< "\t\tdown to floor * rate over 'steps' batches, or by 'factor' every 'steps' batches. Defaults to 'constant'." << std::endl
+				<< "-w [steps]\tRamp the learning rate up from 0 over this many batches before the schedule starts." << std::endl
+				<< "-W [decay]\tWeight decay. Added to the gradient, or applied to the weights separately with 'adamw'. Defaults to 0." << std::endl
+				<< "-p\t\tTime every layer on the CPU and GPU, and print a summary of the timings every couple of seconds." << std::endl
+				<< "-P [trace.json]\tSame as -p, and write every timing to a Chrome trace (chrome://tracing) on exit." << std::endl
+				<< "-S [socket]\tServe the model given by -m on a Unix domain socket instead of opening the window. Requests are batched" << std::endl
+				<< "\t\tup to the batch size, which defaults to " << MAX_BATCH_SIZE << " when serving." << std::endl
+				<< "-D [us]\t\tHow long a request may wait for others to share its batch when serving. Defaults to " << SERVER_BATCH_DELAY_US << "." << std::endl
+				<< "-Q [samples]\tQuantize the model given by -m to int8, calibrating on this many samples from -s, report the error and save it" << std::endl
+				<< "\t\tnext to the model as .int8" << MODEL_EXTENSION << ", then exit. Quantized models only run inference on the cpu backend." << std::endl
+				<< "-z [magnitude]\tPrune the weights of the model given by -m smaller than this, save it next to the model as .pruned" << MODEL_EXTENSION << " and exit." << std::endl
+				<< "\t\tPruned layers are stored and computed sparsely. Combine with -T to fine tune the pruned model before saving it." << std::endl
+				<< "-Z [fraction]\tSame as -z, pruning this fraction of the weights of every layer, smallest first. May be combined with -z." << std::endl
+				<< "-Y [precision]\tOne of 'fp32,fp16,bf16'. Store the weights of the dense layers in this precision, halving what the forward pass reads." << std::endl
+				<< "\t\tTraining keeps fp32 master weights and saves them rounded. Given -m, save the model next to it as .fp16" << MODEL_EXTENSION << " (or" << std::endl
+				<< "\t\t.bf16" << MODEL_EXTENSION << ") and exit, fine tuning it first if -T is given. Serving with -S runs on the reduced weights alone." << std::endl;
 				exit(0); // Close the program after displaying help
 				break;
+			default:
+				return 1;
 		}
 	}
 
+	// A model can also be given as the first positional argument
+	if (modelFile.empty() && optind < argc) {
+		modelFile = argv[optind];
+	}
+
+	if (hiddenSizes.empty()) {
+		hiddenSizes = {50*50, 20*20, 16, 20*20, 50*50};
+		hiddenConvolutions.resize(hiddenSizes.size());
+		hiddenActivations.resize(hiddenSizes.size(), ACTIVATION_SIGMOID);
+	}
+	std::vector<ConvolutionShape> convolutions = hiddenConvolutions;
+	convolutions.push_back(outputConvolution);
+	std::vector<uint32_t> activations = hiddenActivations;
+	activations.push_back(outputActivation);
 
-	// Setup some window options to make it invisible
+	if (!learningRateGiven && Optimizer::getMomentSlots(optimizerSettings.optimizer) == 2) {
+		optimizerSettings.learningRate = ADAM_LEARNING_RATE;
+	}
+	if (!Optimizer::validSettings(optimizerSettings)) {
+		return 1;
+	}
+	OptimizerSettings const* optimizer = optimizerGiven ? &optimizerSettings : nullptr;
+
+	std::string MY_PATH = std::filesystem::canonical("/proc/self/exe");
+	std::size_t pos = MY_PATH.find_last_of('/');
+	if (pos == std::string::npos) {
+		std::cerr << "Current path does not have a '/' character.. I don't know how to handle this. Path was: '" << MY_PATH << "'" << std::endl;
+		return 1;
+	}
+	MY_PATH = MY_PATH.substr(0, pos + 1);
+
+	if (samplePath.empty()) {
+		samplePath = MY_PATH + DATASET_FILE;
+	}
+
+	if (!convertDir.empty()) {
+		return Dataset::convert(convertDir, samplePath) == 0 ? 0 : 1;
+	}
+
+	if (profile) {
+		Profiler::enable();
+	}
+
+	if (!socketPath.empty()) {
+		if (modelFile.empty()) {
+			std::cerr << "Serving needs a model, see -m" << std::endl;
+			return 1;
+		}
+		if (!batchSizeGiven) {
+			batchSize = MAX_BATCH_SIZE;
+		}
+	}
+
+	if (pruning && modelFile.empty()) {
+		std::cerr << "Pruning needs a model, see -m" << std::endl;
+		return 1;
+	}
+
+	if (precisionGiven && (pruning || calibrationSamples > 0)) {
+		std::cerr << "-Y can not be combined with -Q, -z or -Z" << std::endl;
+		return 1;
+	}
+
+	// Quantizing never needs an OpenGL context, and the int8 kernels only exist on the CPU
+	if (calibrationSamples > 0) {
+		if (modelFile.empty()) {
+			std::cerr << "Quantizing needs a model, see -m" << std::endl;
+			return 1;
+		}
+
+		CPUBackend cpuBackend(threadCount);
+		Network network;
+		network.setBatchSize(batchSizeGiven ? batchSize : MAX_BATCH_SIZE);
+		setupNetwork(network, cpuBackend, modelFile, inputSize, hiddenSizes, outputSize, convolutions, activations, optimizer, nullptr, true);
+		if (network.getError()) {
+			return 1;
+		}
+
+		return quantizeModel(network, samplePath, calibrationSamples, siblingPath(modelFile, ".int8"));
+	}
+
+	// New models are saved to the model directory, loaded models are saved over themselves
+	std::string modelPath = modelFile.empty() ? MY_PATH + MODEL_DIRECTORY : "";
+	// Loaded models given a precision are converted, unless served, which runs on the reduced weights without fp32 master weights
+	bool converting = precisionGiven && !modelFile.empty() && socketPath.empty();
+	bool headless = trainIterations > 0 || !socketPath.empty() || pruning || converting;
+	uint32_t const* setupPrecision = precisionGiven && !converting ? &precision : nullptr;
+	bool master = socketPath.empty();
+
+	// Pruning or converting, then fine tuning if -T was given, training, or serving
+	auto runHeadless = [&](Network& network) {
+		if (pruning) {
+			return pruneModel(network, pruneThreshold, pruneSparsity, samplePath, shuffle, trainIterations, siblingPath(modelFile, ".pruned"));
+		}
+		if (converting) {
+			std::string tag = std::string(".") + getPrecisionName(precision);
+			return reduceModel(network, precision, samplePath, shuffle, trainIterations, siblingPath(modelFile, tag.c_str()));
+		}
+		return socketPath.empty() ? trainHeadless(network, samplePath, shuffle, trainIterations, modelPath) : serve(network, socketPath, batchDelay);
+	};
+
+	// Headless CPU work never needs an OpenGL context
+	if (headless && backendType == Backend::CPU) {
+		CPUBackend cpuBackend(threadCount, hogwild);
+		Network network;
+		network.setBatchSize(batchSize);
+		setupNetwork(network, cpuBackend, modelFile, inputSize, hiddenSizes, outputSize, convolutions, activations, optimizer, setupPrecision, master);
+		if (network.getError()) {
+			return 1;
+		}
+		network.setCheckpointInterval(checkpointSteps, modelPath);
+		int result = runHeadless(network);
+		writeProfile(tracePath);
+		return result;
+	}
+
+	// Setup some window options. The window stays invisible when only pruning, converting, training or serving
 	Window::Settings options;
-	options.visible = true;
+	options.visible = !headless;
 	options.doFaceCulling = false;
 	options.modifyPointSize = true;
 	options.clearColor = glm::vec4(glm::vec3(0.05), 1.0);
@@ -95,16 +531,42 @@ int main(int argc, char** argv) {
 	glfwSetScrollCallback(window.getWindow(), InputBuffer::scrollCallback);
 	glfwSetKeyCallback(window.getWindow(), InputBuffer::keyCallback);
 
-	std::string MY_PATH = std::filesystem::canonical("/proc/self/exe");
-	std::size_t pos = MY_PATH.find_last_of('/');
-	if (pos == std::string::npos) {
-		std::cerr << "Current path does not have a '/' character.. I don't know how to handle this. Path was: '" << MY_PATH << "'" << std::endl;
+	// Initialize our shader object(s)
+	Compute compute((MY_PATH + "shaders/compute.glsl").c_str(), ShaderType::FILE);
+
+	// Variants of it specialized on each layer's shape, unless the generic shader was asked for
+	std::unique_ptr<ShaderVariants> variants;
+	if (backendType == Backend::GPU && !genericShader) {
+		variants = std::make_unique<ShaderVariants>(MY_PATH + "shaders/compute.glsl", MY_PATH + SHADER_CACHE_DIRECTORY);
+		if (variants->getError()) {
+			variants.reset();
+		}
+	}
+
+	// Pick the backend to run the network on
+	GPUBackend gpuBackend(compute, variants.get());
+	gpuBackend.setFusion(fuseLayers);
+	CPUBackend cpuBackend(backendType == Backend::CPU ? threadCount : 1, hogwild);
+	Backend& backend = backendType == Backend::CPU ? static_cast<Backend&>(cpuBackend) : static_cast<Backend&>(gpuBackend);
+
+	// Create a network
+	Network network;
+	network.setBatchSize(batchSize);
+	setupNetwork(network, backend, modelFile, inputSize, hiddenSizes, outputSize, convolutions, activations, optimizer, setupPrecision, master);
+	if (network.getError()) {
 		return 1;
 	}
-	MY_PATH = MY_PATH.substr(0, pos + 1);
+	network.setCheckpointInterval(checkpointSteps, modelPath);
+
+	// Headless GPU work only uses the window for its context
+	if (headless) {
+		int result = runHeadless(network);
+		writeProfile(tracePath);
+		return result;
+	}
+
+	network.setupUI();
 
-	// Initialize our shader object(s)
-	Compute compute((MY_PATH + "shaders/compute.glsl").c_str(), ShaderType::FILE);
 	Shader shader((MY_PATH + "shaders/vertex.glsl").c_str(), (MY_PATH + "shaders/fragment.glsl").c_str(), ShaderType::FILE);
 
 	std::this_thread::sleep_for(std::chrono::duration(std::chrono::seconds(1)));
@@ -114,65 +576,64 @@ int main(int argc, char** argv) {
 	screen.setScale(glm::vec3(1.0, 1.0, 1.0));
 	screen.setPosition(glm::vec3(0.0, 0.0, 1.0));
 
-	// Create a network
-	Network network;
-	std::string modelPath;
-	if (argc < 2) {
-		modelPath = MY_PATH + MODEL_DIRECTORY;
-		network.setup(32*32, {50*50, 20*20, 16, 20*20, 50*50}, 32*32);
-	} else {
-		modelPath = "";
-		network.setup(argv[1]);
-	}
-
 	int width, height;
 	int8_t keyDown = 0;
 	bool justPressed = false;
 	bool enterPressed = false;
 	bool trainingToggle = false;
 	bool pgdownPressed = false; // Page Down = save network
-	size_t trainingOffset = 0;
 
 	// Load and train the network before we begin
-	std::vector<std::vector<float>> files;
-	std::vector<uint32_t> fileIndices;
+	Dataset dataset;
+	std::vector<uint32_t> sampleIndices;
+	std::unique_ptr<Feeder> feeder;
+
+	auto lastSummary = std::chrono::steady_clock::now();
+
+	// The forward pass only runs when the input or the weights changed since the last one, and then only recomputes what the change reaches. The window is only redrawn at the display rate,
+	// and only when something could look different. Training runs flat out in between
+	std::chrono::duration<double> frameTime(1.0 / displayFps);
+	auto lastFrame = std::chrono::steady_clock::now() - frameTime;
+	auto lastDraw = lastFrame;
+	bool dirty = true;
+	bool redraw = true;
+	glm::vec2 lastCursor(-1.0);
+	float lastDrawSize = InputBuffer::drawSize;
 
 	while (!window.shouldClose()) {
 		keyDown = 0;
-		window.getSize(&width, &height);
-		window.getCam().updateProjectionView(width, height, 800.f, oglopp::Camera::ORTHO);
-
-		network.feedForward(compute);
 
-		Layer* output = &network.getLayers().back();
-		//Neuron* neurons = static_cast<Neuron*>(output->getNeurons().map(oglopp::SSBO::BOTH));
 		for (int i=0;i<10;i++) {
-		 	//neurons[i].expected = window.keyPressed(GLFW_KEY_0 + i) ? 1.0 : 0.0;
 			keyDown = window.keyPressed(GLFW_KEY_0 + i) ? GLFW_KEY_0 + i : keyDown;
 		}
 		for (int i=0;i<26;i++) {
-			//neurons[i + 10].expected = window.keyPressed(GLFW_KEY_A + i) ? 1.0 : 0.0;
 			keyDown = window.keyPressed(GLFW_KEY_A + i) ? GLFW_KEY_A + i : keyDown;
 		}
-		//output->getNeurons().unmap();
 
 		if (keyDown > 0 && !justPressed) {
 			justPressed = true;
+
+			// Back propagation needs the values of the drawing as it is now
+			if (dirty) {
+				network.feedForwardIncremental();
+			}
 			setExpectedOutput(network);
 			std::cout << "pressed" << std::endl;
-			saveTrainingElement(network.getLayers().front().getNeurons(), keyDown, MY_PATH);
+			saveTrainingElement(network.getLayers().front(), keyDown, samplePath);
 
-			network.backProp(compute);
+			network.backProp();
 
-			output = &network.getLayers().front();
-			Neuron* neurons = static_cast<Neuron*>(output->getNeurons().map(oglopp::SSBO::BOTH));
+			// Clear the drawing
+			Layer* input = &network.getLayers().front();
+			float* values = input->mapValues();
+			float* expected = input->mapExpected();
 
-			for (size_t i=0;i<output->getNeurons().getSize()/sizeof(Neuron);i++) {
-				neurons[i].expected = 0.0;
-				neurons[i].value = 0.0;
-			}
+			std::fill(values, values + input->getNeuronCount(), 0.0f);
+			std::fill(expected, expected + input->getNeuronCount(), 0.0f);
 
-			output->getNeurons().unmap();
+			input->unmapExpected();
+			input->unmapValues();
+			dirty = true;
 		}
 
 		if (keyDown == 0) {
@@ -183,11 +644,14 @@ int main(int argc, char** argv) {
 		if (window.keyPressed(GLFW_KEY_ENTER)) {
 			if (enterPressed == false) {
 				// Enter was just pressed
-				trainingOffset = 0;
 				trainingToggle = !trainingToggle;
+				// The feeder reads from the dataset, so it must stop before the dataset is reopened
+				feeder.reset();
 				if (trainingToggle) {
-					loadTrainingFiles(files, fileIndices, MY_PATH);
+					loadTrainingSet(dataset, sampleIndices, samplePath);
+					feeder = std::make_unique<Feeder>(dataset, sampleIndices, network.getBatchSize(), network.getLayers().front().getNeuronCount(), shuffle);
 				}
+				redraw = true;
 			}
 			enterPressed = true;
 
@@ -196,30 +660,62 @@ int main(int argc, char** argv) {
 		}
 
 		if (trainingToggle) {
-			doSomeSamples(compute, network, MY_PATH, files, fileIndices, trainingOffset, TRAINSIZE);
+			doSomeSamples(network, *feeder, TRAINSIZE);
+			dirty = true;
 		}
 
 
-		// Saving the network
+		// Saving the network, written in the background so the window keeps drawing
 		if (window.keyPressed(GLFW_KEY_PAGE_DOWN)) {
 			if (pgdownPressed == false) {
-				network.save(modelPath);
+				network.checkpoint(modelPath);
 			}
 			pgdownPressed = true;
 		} else {
 			pgdownPressed = false;
 		}
 
+		if (Profiler::isEnabled() && std::chrono::steady_clock::now() - lastSummary >= std::chrono::duration<double>(PROFILER_SUMMARY_SECONDS)) {
+			std::cout << Profiler::summary() << std::endl;
+			lastSummary = std::chrono::steady_clock::now();
+		}
+
+		// Keep training until the next frame is due
+		auto now = std::chrono::steady_clock::now();
+		if (now - lastFrame < frameTime) {
+			if (trainingToggle) {
+				window.pollEvents();
+			} else {
+				glfwWaitEventsTimeout(std::chrono::duration<double>(frameTime - (now - lastFrame)).count());
+			}
+			continue;
+		}
+		lastFrame = now;
 
-		//if (window.keyPressed(GLFW_KEY_RIGHT_ALT)) {
-		//	network.backProp(compute);
-		//}
+		// The fragment shader paints into the input layer while a button is held, and draws the brush under the cursor
+		window.getSize(&width, &height);
+		glm::vec2 cursor = window.getCursorPos();
+		bool painting = window.mousePressed(GLFW_MOUSE_BUTTON_LEFT) || window.mousePressed(GLFW_MOUSE_BUTTON_RIGHT);
+		redraw = redraw || dirty || painting || cursor != lastCursor || InputBuffer::drawSize != lastDrawSize
+			|| now - lastDraw >= std::chrono::duration<double>(IDLE_REDRAW_SECONDS);
+		if (!redraw) {
+			// Nothing changed, so sleep until something does
+			if (!trainingToggle) {
+				glfwWaitEventsTimeout(IDLE_REDRAW_SECONDS);
+			}
+			continue;
+		}
 
+		if (dirty) {
+			network.feedForwardIncremental();
+			dirty = false;
+		}
 
+		window.getCam().updateProjectionView(width, height, 800.f, oglopp::Camera::ORTHO);
 		window.clear();
 
 		shader.use();
-		shader.setVec2("cursor", window.getCursorPos());
+		shader.setVec2("cursor", cursor);
 		shader.setBool("lalt", window.keyPressed(GLFW_KEY_LEFT_ALT));
 		shader.setBool("lctrl", window.keyPressed(GLFW_KEY_LEFT_CONTROL));
 		shader.setBool("leftClick", window.mousePressed(GLFW_MOUSE_BUTTON_LEFT));
@@ -227,12 +723,19 @@ int main(int argc, char** argv) {
 		shader.setVec2("resolution", glm::vec2(width, height));
 		shader.setFloat("drawSize", InputBuffer::drawSize);
 		network.draw(window, shader);
-		//screen.draw(window, &shader);
 		SSBO::unbind();
 
 		window.bufferSwap();
 		window.pollEvents();
+
+		// Whatever was painted has to be fed forward before the next frame
+		dirty = dirty || painting;
+		redraw = false;
+		lastDraw = now;
+		lastCursor = cursor;
+		lastDrawSize = InputBuffer::drawSize;
 	}
 
+	writeProfile(tracePath);
 	return 0;
 }
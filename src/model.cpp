@@ -0,0 +1,663 @@
+#include "model.h"
+#include "activation.h"
+#include "layer.h"
+#include "checksum.h"
+
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* @brief Round a byte count up to the model alignment
+ * @param[in] bytes	The byte count
+ * @return			The aligned byte count
+*/
+static uint64_t alignUp(uint64_t bytes) {
+	return (bytes + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+/* @brief Check that a blob lies inside the mapping. Subtracts instead of adding, as the offset and size come from the file and their sum could wrap
+ * @param[in] offset		The byte offset of the blob
+ * @param[in] bytes			The size of the blob
+ * @param[in] mappingSize	The size of the mapping
+ * @return					True if the blob fits
+*/
+static bool fitsMapping(uint64_t offset, uint64_t bytes, uint64_t mappingSize) {
+	return offset <= mappingSize && bytes <= mappingSize - offset;
+}
+
+/* @brief Check that a blob holds exactly count values. Divides instead of multiplying, as the count comes from the file and the product could wrap
+ * @param[in] bytes		The size of the blob
+ * @param[in] count		The number of values
+ * @param[in] size		The size of one value
+ * @return				True if the blob is the right size
+*/
+static bool holdsValues(uint64_t bytes, uint64_t count, uint64_t size) {
+	return bytes % size == 0 && bytes / size == count;
+}
+
+/* @brief Get the size of the weight blob of an int8 layer
+ * @param[in] neuronCount	The number of neurons in the layer
+ * @param[in] stride		The bytes per row of weights
+ * @return					The blob size in bytes
+*/
+static uint64_t quantBlobBytes(uint32_t neuronCount, uint32_t stride) {
+	return sizeof(ModelQuantHeader) + alignUp(static_cast<uint64_t>(neuronCount) * sizeof(float)) + static_cast<uint64_t>(neuronCount) * stride;
+}
+
+/* @brief Get the byte offsets of the parts of the weight blob of a pruned layer
+ * @param[in] neuronCount	The number of neurons in the layer
+ * @param[in] nonzeroCount	The number of weights left after pruning
+ * @param[out] columns		The offset of the column indices
+ * @param[out] values		The offset of the weights
+ * @return					The blob size in bytes
+*/
+static uint64_t sparseBlobBytes(uint32_t neuronCount, uint64_t nonzeroCount, uint64_t& columns, uint64_t& values) {
+	columns = sizeof(ModelSparseHeader) + alignUp((static_cast<uint64_t>(neuronCount) + 1) * sizeof(uint32_t));
+	values = columns + alignUp(nonzeroCount * sizeof(uint16_t));
+	return values + nonzeroCount * sizeof(float);
+}
+
+/* @brief Check that the index of a pruned layer stays inside its weights and the layer feeding it, so the kernels never have to
+ * @param[in] offsets		neuronCount + 1 row offsets
+ * @param[in] columns		nonzeroCount column indices
+ * @param[in] neuronCount	The number of neurons in the layer
+ * @param[in] inputCount	The number of neurons feeding the layer
+ * @param[in] nonzeroCount	The number of weights left after pruning
+ * @return					True if the index is valid
+*/
+static bool validSparseIndex(uint32_t const* offsets, uint16_t const* columns, uint32_t neuronCount, uint32_t inputCount, uint64_t nonzeroCount) {
+	if (offsets[0] != 0 || offsets[neuronCount] != nonzeroCount) {
+		return false;
+	}
+	for (uint32_t i=0;i<neuronCount;i++) {
+		if (offsets[i+1] < offsets[i]) {
+			return false;
+		}
+	}
+	for (uint64_t j=0;j<nonzeroCount;j++) {
+		if (columns[j] >= inputCount) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* @brief Check that the shape of a convolutional layer matches the layers on both sides of it and its weights, so the kernels never leave either image
+ * @param[in] conv	The shape
+ * @param[in] entry	The table of contents entry of the layer
+ * @return			True if the shape is valid
+*/
+static bool validConvolution(ModelConvHeader const* conv, ModelLayerEntry const& entry) {
+	// Small enough that none of the products below can overflow
+	if (conv->kernel > UINT16_MAX || conv->smallSize > UINT16_MAX || conv->bigSize > UINT16_MAX || conv->smallChannels > UINT16_MAX || conv->bigChannels > UINT16_MAX) {
+		return false;
+	}
+
+	uint64_t smallCount = static_cast<uint64_t>(conv->smallSize) * conv->smallSize * conv->smallChannels;
+	uint64_t bigCount = static_cast<uint64_t>(conv->bigSize) * conv->bigSize * conv->bigChannels;
+	bool transposed = entry.kind == MODEL_LAYER_CONV_TRANSPOSED;
+	return conv->kernel > 0 && conv->stride > 0 && conv->padding < conv->kernel && smallCount > 0 && bigCount > 0
+		&& (transposed ? bigCount : smallCount) == entry.neuronCount && (transposed ? smallCount : bigCount) == entry.inputCount
+		&& entry.weightCount == static_cast<uint64_t>(conv->smallChannels) * conv->bigChannels * conv->kernel * conv->kernel;
+}
+
+ModelFile::ModelFile(std::string const& path) {
+	this->open(path);
+}
+
+ModelFile::~ModelFile() {
+	this->close();
+}
+
+/* @brief Map a model file and validate its header and table of contents, replacing any file already open
+ * @param[in] path	The file to map
+ * @return			A reference to this model file object
+*/
+ModelFile& ModelFile::open(std::string const& path) {
+	this->close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Failed to open model " << path << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ModelHeader)) {
+		std::cerr << "Model " << path << " is too small to hold a header" << std::endl;
+		::close(fd);
+		this->error = true;
+		return *this;
+	}
+
+	// Private and writable: CPU layers train on the mapped weights, and the pages are copied on the first write instead of reaching the file
+	void* map = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file alive
+	::close(fd);
+
+	if (map == MAP_FAILED) {
+		std::cerr << "Failed to map model " << path << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	this->mapping = static_cast<uint8_t*>(map);
+	this->mappingSize = info.st_size;
+	madvise(this->mapping, this->mappingSize, MADV_WILLNEED);
+
+	ModelHeader const* header = reinterpret_cast<ModelHeader const*>(this->mapping);
+	if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0 || header->version != MODEL_FORMAT_VERSION) {
+		std::cerr << "Model " << path << " is not a version " << MODEL_FORMAT_VERSION << " model" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	if (header->endianMarker != MODEL_ENDIAN_MARKER) {
+		std::cerr << "Model " << path << " was saved on a machine with a different byte order" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	uint64_t tocBytes = static_cast<uint64_t>(header->layerCount) * sizeof(ModelLayerEntry);
+	if (header->fileSize != this->mappingSize || header->tocOffset % MODEL_ALIGNMENT != 0 || !fitsMapping(header->tocOffset, tocBytes, this->mappingSize)) {
+		std::cerr << "Model " << path << " is truncated" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	if (crc32c(this->mapping + header->tocOffset, tocBytes) != header->tocChecksum) {
+		std::cerr << "Model " << path << " has a corrupt table of contents" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	if (header->trainingOffset != 0 && (header->trainingOffset % MODEL_ALIGNMENT != 0 || !fitsMapping(header->trainingOffset, sizeof(ModelTrainingState), this->mappingSize)
+		|| crc32c(this->mapping + header->trainingOffset, sizeof(ModelTrainingState)) != header->trainingChecksum)) {
+		std::cerr << "Model " << path << " has a corrupt training state" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	ModelLayerEntry const* toc = reinterpret_cast<ModelLayerEntry const*>(this->mapping + header->tocOffset);
+	for (uint32_t i=0;i<header->layerCount;i++) {
+		ModelLayerEntry const& entry = toc[i];
+		bool fits = fitsMapping(entry.weightOffset, entry.weightBytes, this->mappingSize) && fitsMapping(entry.biasOffset, entry.biasBytes, this->mappingSize);
+		bool aligned = entry.weightOffset % MODEL_ALIGNMENT == 0 && entry.biasOffset % MODEL_ALIGNMENT == 0;
+		bool sized = entry.biasBytes == 0 || entry.biasBytes == entry.neuronCount * sizeof(float);
+
+		if (entry.kind != MODEL_LAYER_DENSE && i == 0) {
+			sized = false;
+		} else if (entry.format == MODEL_FORMAT_INT8 && entry.weightBytes > 0) {
+			// The rest of the blob is sized by its header, so the header has to fit before it can be read
+			ModelQuantHeader const* quant = reinterpret_cast<ModelQuantHeader const*>(this->mapping + entry.weightOffset);
+			sized = sized && fits && entry.weightBytes >= sizeof(ModelQuantHeader) && quant->stride >= entry.inputCount && quant->stride % MODEL_ALIGNMENT == 0
+				&& quant->inputZero <= UINT8_MAX && static_cast<uint64_t>(entry.neuronCount) * quant->stride <= entry.weightBytes
+				&& entry.weightBytes == quantBlobBytes(entry.neuronCount, quant->stride)
+				&& entry.weightCount == static_cast<uint64_t>(entry.neuronCount) * entry.inputCount;
+		} else if (entry.format == MODEL_FORMAT_CSR && entry.weightBytes > 0) {
+			ModelSparseHeader const* sparse = reinterpret_cast<ModelSparseHeader const*>(this->mapping + entry.weightOffset);
+			uint64_t columns = 0;
+			uint64_t values = 0;
+			sized = sized && fits && entry.weightBytes >= sizeof(ModelSparseHeader) && entry.inputCount <= SPARSE_MAX_COLUMNS
+				&& entry.weightCount == static_cast<uint64_t>(entry.neuronCount) * entry.inputCount && sparse->nonzeroCount <= entry.weightCount
+				&& entry.weightBytes == sparseBlobBytes(entry.neuronCount, sparse->nonzeroCount, columns, values);
+			sized = sized && validSparseIndex(reinterpret_cast<uint32_t const*>(sparse + 1), reinterpret_cast<uint16_t const*>(this->mapping + entry.weightOffset + columns),
+				entry.neuronCount, entry.inputCount, sparse->nonzeroCount);
+		} else if (entry.format == MODEL_FORMAT_FP16 || entry.format == MODEL_FORMAT_BF16) {
+			sized = sized && holdsValues(entry.weightBytes, entry.weightCount, sizeof(uint16_t)) && entry.weightCount == static_cast<uint64_t>(entry.neuronCount) * entry.inputCount;
+		} else if (entry.kind != MODEL_LAYER_DENSE) {
+			sized = sized && fits && entry.weightBytes >= sizeof(ModelConvHeader) && holdsValues(entry.weightBytes - sizeof(ModelConvHeader), entry.weightCount, sizeof(float))
+				&& validConvolution(reinterpret_cast<ModelConvHeader const*>(this->mapping + entry.weightOffset), entry);
+		} else {
+			sized = sized && holdsValues(entry.weightBytes, entry.weightCount, sizeof(float)) && entry.weightCount == static_cast<uint64_t>(entry.neuronCount) * entry.inputCount;
+		}
+
+		// Convolutions are only stored in fp32
+		bool dense = entry.kind == MODEL_LAYER_DENSE;
+		bool convolution = (entry.kind == MODEL_LAYER_CONV || entry.kind == MODEL_LAYER_CONV_TRANSPOSED) && entry.format == MODEL_FORMAT_FP32;
+		if ((!dense && !convolution) || entry.format > MODEL_FORMAT_BF16) {
+			std::cerr << "Model " << path << " layer " << i << " has an unsupported kind or format" << std::endl;
+			this->error = true;
+			return *this;
+		}
+
+		if (entry.activation > ACTIVATION_LINEAR) {
+			std::cerr << "Model " << path << " layer " << i << " has an unsupported activation" << std::endl;
+			this->error = true;
+			return *this;
+		}
+
+		// Every layer after the input has weights, the kernels read them without checking
+		if (!fits || !aligned || !sized || (i > 0 && (entry.inputCount != toc[i-1].neuronCount || entry.weightBytes == 0))) {
+			std::cerr << "Model " << path << " layer " << i << " has a bad table of contents entry" << std::endl;
+			this->error = true;
+			return *this;
+		}
+	}
+
+	this->header = header;
+	this->toc = toc;
+	return *this;
+}
+
+/* @brief Release the mapping
+ * @return A reference to this model file object
+*/
+ModelFile& ModelFile::close() {
+	if (this->mapping != nullptr) {
+		munmap(this->mapping, this->mappingSize);
+	}
+
+	this->mapping = nullptr;
+	this->mappingSize = 0;
+	this->header = nullptr;
+	this->toc = nullptr;
+	this->error = false;
+
+	return *this;
+}
+
+/* @brief True if there was an error opening the model, false otherwise
+ * @return True if error, false otherwise
+*/
+bool ModelFile::getError() {
+	return this->error;
+}
+
+/* @brief Get the number of layers, including the input layer
+ * @return The layer count
+*/
+uint32_t ModelFile::getLayerCount() {
+	return this->header != nullptr ? this->header->layerCount : 0;
+}
+
+/* @brief Get the training state saved with the model, straight from the mapping
+ * @return A pointer to the state, or nullptr if the model was saved without one
+*/
+ModelTrainingState const* ModelFile::getTraining() {
+	if (this->header == nullptr || this->header->trainingOffset == 0) {
+		return nullptr;
+	}
+	return reinterpret_cast<ModelTrainingState const*>(this->mapping + this->header->trainingOffset);
+}
+
+/* @brief Get the table of contents entry of a layer
+ * @param[in] index	The layer index
+ * @return			A reference to the entry
+*/
+ModelLayerEntry const& ModelFile::getLayer(uint32_t index) {
+	return this->toc[index];
+}
+
+/* @brief Get a pointer to the weights of an fp32 layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).weightCount weights aligned to MODEL_ALIGNMENT, or nullptr if there are none
+*/
+float* ModelFile::getWeights(uint32_t index) {
+	if (this->toc[index].weightBytes == 0 || this->toc[index].format != MODEL_FORMAT_FP32) {
+		return nullptr;
+	}
+	uint64_t header = this->toc[index].kind != MODEL_LAYER_DENSE ? sizeof(ModelConvHeader) : 0;
+	return reinterpret_cast<float*>(this->mapping + this->toc[index].weightOffset + header);
+}
+
+/* @brief Get the shape of a convolutional layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to the header, or nullptr if the layer is dense
+*/
+ModelConvHeader const* ModelFile::getConvHeader(uint32_t index) {
+	if (this->toc[index].weightBytes == 0 || this->toc[index].kind == MODEL_LAYER_DENSE) {
+		return nullptr;
+	}
+	return reinterpret_cast<ModelConvHeader const*>(this->mapping + this->toc[index].weightOffset);
+}
+
+/* @brief Get the quantization header of an int8 layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to the header, or nullptr if the layer is not int8
+*/
+ModelQuantHeader const* ModelFile::getQuantHeader(uint32_t index) {
+	if (this->toc[index].weightBytes == 0 || this->toc[index].format != MODEL_FORMAT_INT8) {
+		return nullptr;
+	}
+	return reinterpret_cast<ModelQuantHeader const*>(this->mapping + this->toc[index].weightOffset);
+}
+
+/* @brief Get the per neuron weight scales of an int8 layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).neuronCount scales, or nullptr if the layer is not int8
+*/
+float const* ModelFile::getQuantScales(uint32_t index) {
+	if (this->getQuantHeader(index) == nullptr) {
+		return nullptr;
+	}
+	return reinterpret_cast<float const*>(this->mapping + this->toc[index].weightOffset + sizeof(ModelQuantHeader));
+}
+
+/* @brief Get the int8 weights of a layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).neuronCount rows of getQuantHeader(index)->stride weights, or nullptr if the layer is not int8
+*/
+int8_t const* ModelFile::getQuantWeights(uint32_t index) {
+	if (this->getQuantHeader(index) == nullptr) {
+		return nullptr;
+	}
+	ModelLayerEntry const& entry = this->toc[index];
+	return reinterpret_cast<int8_t const*>(this->mapping + entry.weightOffset + sizeof(ModelQuantHeader) + alignUp(static_cast<uint64_t>(entry.neuronCount) * sizeof(float)));
+}
+
+/* @brief Get the sparse header of a pruned layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to the header, or nullptr if the layer is not sparse
+*/
+ModelSparseHeader const* ModelFile::getSparseHeader(uint32_t index) {
+	if (this->toc[index].weightBytes == 0 || this->toc[index].format != MODEL_FORMAT_CSR) {
+		return nullptr;
+	}
+	return reinterpret_cast<ModelSparseHeader const*>(this->mapping + this->toc[index].weightOffset);
+}
+
+/* @brief Get the row offsets of a pruned layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).neuronCount + 1 offsets, or nullptr if the layer is not sparse
+*/
+uint32_t const* ModelFile::getSparseOffsets(uint32_t index) {
+	ModelSparseHeader const* header = this->getSparseHeader(index);
+	if (header == nullptr) {
+		return nullptr;
+	}
+	return reinterpret_cast<uint32_t const*>(header + 1);
+}
+
+/* @brief Get the column indices of a pruned layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getSparseHeader(index)->nonzeroCount indices, or nullptr if the layer is not sparse
+*/
+uint16_t const* ModelFile::getSparseColumns(uint32_t index) {
+	ModelSparseHeader const* header = this->getSparseHeader(index);
+	if (header == nullptr) {
+		return nullptr;
+	}
+	uint64_t columns = 0;
+	uint64_t values = 0;
+	sparseBlobBytes(this->toc[index].neuronCount, header->nonzeroCount, columns, values);
+	return reinterpret_cast<uint16_t const*>(this->mapping + this->toc[index].weightOffset + columns);
+}
+
+/* @brief Get the weights of a pruned layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getSparseHeader(index)->nonzeroCount weights, or nullptr if the layer is not sparse
+*/
+float* ModelFile::getSparseValues(uint32_t index) {
+	ModelSparseHeader const* header = this->getSparseHeader(index);
+	if (header == nullptr) {
+		return nullptr;
+	}
+	uint64_t columns = 0;
+	uint64_t values = 0;
+	sparseBlobBytes(this->toc[index].neuronCount, header->nonzeroCount, columns, values);
+	return reinterpret_cast<float*>(this->mapping + this->toc[index].weightOffset + values);
+}
+
+/* @brief Get the weights of an fp16 or bf16 layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).weightCount 16 bit weights, or nullptr if the layer is not stored in reduced precision
+*/
+uint16_t const* ModelFile::getReducedWeights(uint32_t index) {
+	if (this->toc[index].weightBytes == 0 || (this->toc[index].format != MODEL_FORMAT_FP16 && this->toc[index].format != MODEL_FORMAT_BF16)) {
+		return nullptr;
+	}
+	return reinterpret_cast<uint16_t const*>(this->mapping + this->toc[index].weightOffset);
+}
+
+/* @brief Get a pointer to the biases of a layer, straight from the mapping
+ * @param[in] index	The layer index
+ * @return			A pointer to getLayer(index).neuronCount biases, or nullptr if there are none
+*/
+float* ModelFile::getBiases(uint32_t index) {
+	if (this->toc[index].biasBytes == 0) {
+		return nullptr;
+	}
+	return reinterpret_cast<float*>(this->mapping + this->toc[index].biasOffset);
+}
+
+/* @brief Check the weight and bias checksums of a layer. Must be called before the layer's weights are modified
+ * @param[in] index	The layer index
+ * @return			True if both blobs match their checksums
+*/
+bool ModelFile::verify(uint32_t index) {
+	ModelLayerEntry const& entry = this->toc[index];
+	return crc32c(this->mapping + entry.weightOffset, entry.weightBytes) == entry.weightChecksum
+		&& crc32c(this->mapping + entry.biasOffset, entry.biasBytes) == entry.biasChecksum;
+}
+
+/* @brief Check if a file starts with the v2 magic
+ * @param[in] path	The file to check
+ * @return			True if the file is a v2 model
+*/
+bool ModelFile::isModelFile(std::string const& path) {
+	char magic[4] = {};
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	stream.read(magic, sizeof(magic));
+	return !stream.fail() && memcmp(magic, MODEL_MAGIC, sizeof(magic)) == 0;
+}
+
+/* @brief Write layers to a v2 model file. The file is written beside the target and renamed over it, so a model that is
+ * currently mapped can be saved over safely
+ * @param[in] path		The file to write
+ * @param[in] layers	The layers to write, starting with the input layer
+ * @param[in] training	The training state to save with the layers, or nullptr for none
+ * @return				0 on success, -1 on failure
+*/
+int ModelFile::write(std::string const& path, std::vector<Layer>& layers, ModelTrainingState const* training) {
+	ModelSnapshot snapshot;
+	snapshot.capture(layers, training);
+	return snapshot.write(path);
+}
+
+/* @brief Copy layers into the snapshot, laid out as they are saved, replacing anything it held. Its memory is kept for the next capture
+ * @param[in] layers	The layers to copy, starting with the input layer
+ * @param[in] training	The training state to save with the layers, or nullptr for none
+ * @return				A reference to this snapshot object
+*/
+ModelSnapshot& ModelSnapshot::capture(std::vector<Layer>& layers, ModelTrainingState const* training) {
+	// [ModelHeader][ModelTrainingState, if any][ModelLayerEntry * layerCount][padding]
+	// [layer 1 weights][padding][layer 1 biases][padding]
+	// ...
+	// [layer N weights][padding][layer N biases][padding]
+	//
+	// The input layer has an entry with no blobs
+
+	ModelHeader& header = this->header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+	header.version = MODEL_FORMAT_VERSION;
+	header.endianMarker = MODEL_ENDIAN_MARKER;
+	header.layerCount = layers.size();
+	header.tocOffset = alignUp(sizeof(ModelHeader));
+	memset(&this->training, 0, sizeof(this->training));
+	if (training != nullptr) {
+		this->training = *training;
+		header.trainingOffset = header.tocOffset;
+		header.tocOffset = alignUp(header.trainingOffset + sizeof(ModelTrainingState));
+	}
+
+	// Lay out every blob before copying anything, so the image can be sized once
+	std::vector<ModelLayerEntry>& toc = this->toc;
+	toc.resize(layers.size());
+	const uint64_t dataOffset = alignUp(header.tocOffset + toc.size() * sizeof(ModelLayerEntry));
+	uint64_t offset = dataOffset;
+	for (size_t i=0;i<layers.size();i++) {
+		ModelLayerEntry& entry = toc[i];
+		memset(&entry, 0, sizeof(entry));
+		entry.neuronCount = layers[i].getNeuronCount();
+		entry.inputCount = i > 0 ? layers[i-1].getNeuronCount() : 0;
+		entry.kind = layers[i].getKind();
+		entry.format = MODEL_FORMAT_FP32;
+		entry.activation = layers[i].getActivation();
+
+		if (i == 0) {
+			continue;
+		}
+
+		entry.weightCount = layers[i].getWeightCount();
+		entry.weightOffset = offset;
+		entry.weightBytes = entry.weightCount * sizeof(float);
+		if (layers[i].isQuantized()) {
+			entry.format = MODEL_FORMAT_INT8;
+			entry.weightBytes = quantBlobBytes(entry.neuronCount, layers[i].getQuantized().stride);
+		} else if (layers[i].isSparse()) {
+			uint64_t columns = 0;
+			uint64_t values = 0;
+			entry.format = MODEL_FORMAT_CSR;
+			entry.weightBytes = sparseBlobBytes(entry.neuronCount, layers[i].getSparse().nonzeroCount, columns, values);
+		} else if (layers[i].isReduced()) {
+			entry.format = layers[i].getPrecision();
+			entry.weightBytes = entry.weightCount * sizeof(uint16_t);
+		} else if (layers[i].isConvolution()) {
+			entry.weightBytes += sizeof(ModelConvHeader);
+		}
+		offset = alignUp(offset + entry.weightBytes);
+
+		entry.biasOffset = offset;
+		entry.biasBytes = static_cast<uint64_t>(entry.neuronCount) * sizeof(float);
+		offset = alignUp(offset + entry.biasBytes);
+	}
+	header.fileSize = offset;
+
+	// Padding is part of some checksums, so it has to be zero. The header and table of contents are filled in by write()
+	this->image.assign(header.fileSize, 0);
+	uint8_t* image = this->image.data();
+
+	for (size_t i=1;i<layers.size();i++) {
+		ModelLayerEntry& entry = toc[i];
+		uint8_t* blob = image + entry.weightOffset;
+
+		if (entry.format == MODEL_FORMAT_INT8) {
+			// [ModelQuantHeader][float scales][padding][int8 rows]
+			QuantizedWeights const& quantized = layers[i].getQuantized();
+			ModelQuantHeader* quant = reinterpret_cast<ModelQuantHeader*>(blob);
+			quant->inputScale = quantized.inputScale;
+			quant->inputZero = quantized.inputZero;
+			quant->stride = quantized.stride;
+
+			uint64_t scaleBytes = static_cast<uint64_t>(entry.neuronCount) * sizeof(float);
+			uint64_t rowBytes = static_cast<uint64_t>(entry.neuronCount) * quantized.stride;
+			memcpy(blob + sizeof(ModelQuantHeader), quantized.scales.data(), scaleBytes);
+			memcpy(blob + sizeof(ModelQuantHeader) + alignUp(scaleBytes), quantized.weights, rowBytes);
+		} else if (entry.format == MODEL_FORMAT_CSR) {
+			// [ModelSparseHeader][uint32 row offsets][padding][uint16 columns][padding][float weights]
+			SparseWeights const& sparse = layers[i].getSparse();
+			reinterpret_cast<ModelSparseHeader*>(blob)->nonzeroCount = sparse.nonzeroCount;
+
+			uint64_t columns = 0;
+			uint64_t values = 0;
+			sparseBlobBytes(entry.neuronCount, sparse.nonzeroCount, columns, values);
+			memcpy(blob + sizeof(ModelSparseHeader), sparse.rowOffsets, (static_cast<uint64_t>(entry.neuronCount) + 1) * sizeof(uint32_t));
+			memcpy(blob + columns, sparse.columns, sparse.nonzeroCount * sizeof(uint16_t));
+			memcpy(blob + values, layers[i].mapWeights(), sparse.nonzeroCount * sizeof(float));
+			layers[i].unmapWeights();
+		} else if (entry.format == MODEL_FORMAT_FP16 || entry.format == MODEL_FORMAT_BF16) {
+			memcpy(blob, layers[i].mapReduced(), entry.weightBytes);
+			layers[i].unmapReduced();
+		} else if (entry.kind != MODEL_LAYER_DENSE) {
+			// [ModelConvHeader][float weights]
+			ConvolutionShape const& shape = layers[i].getConvolution();
+			ModelConvHeader* conv = reinterpret_cast<ModelConvHeader*>(blob);
+			conv->kernel = shape.kernel;
+			conv->stride = shape.stride;
+			conv->padding = shape.padding;
+			conv->smallSize = shape.smallSize;
+			conv->smallChannels = shape.smallChannels;
+			conv->bigSize = shape.bigSize;
+			conv->bigChannels = shape.bigChannels;
+
+			memcpy(blob + sizeof(ModelConvHeader), layers[i].mapWeights(), entry.weightCount * sizeof(float));
+			layers[i].unmapWeights();
+		} else {
+			memcpy(blob, layers[i].mapWeights(), entry.weightBytes);
+			layers[i].unmapWeights();
+		}
+
+		memcpy(image + entry.biasOffset, layers[i].mapBiases(), entry.biasBytes);
+		layers[i].unmapBiases();
+	}
+
+	return *this;
+}
+
+/* @brief Checksum the snapshot and write it to a v2 model file. The file is written and flushed to disk beside the target, then renamed over it, so a
+ * crash part way through leaves the last file whole, and a model that is currently mapped can be saved over safely.
+ * Only touches the snapshot, so it may run on another thread than the capture, as long as the two never overlap
+ * @param[in] path	The file to write
+ * @return			0 on success, -1 on failure
+*/
+int ModelSnapshot::write(std::string const& path) {
+	ModelHeader& header = this->header;
+	uint8_t* image = this->image.data();
+	if (this->image.empty()) {
+		std::cerr << "Nothing was captured to write to " << path << std::endl;
+		return -1;
+	}
+
+	// Every blob was copied with its padding, so each checksum covers one contiguous range
+	for (size_t i=1;i<this->toc.size();i++) {
+		ModelLayerEntry& entry = this->toc[i];
+		entry.weightChecksum = crc32c(image + entry.weightOffset, entry.weightBytes);
+		entry.biasChecksum = crc32c(image + entry.biasOffset, entry.biasBytes);
+	}
+
+	header.tocChecksum = crc32c(this->toc.data(), this->toc.size() * sizeof(ModelLayerEntry));
+	if (header.trainingOffset != 0) {
+		header.trainingChecksum = crc32c(&this->training, sizeof(ModelTrainingState));
+		memcpy(image + header.trainingOffset, &this->training, sizeof(ModelTrainingState));
+	}
+	memcpy(image, &header, sizeof(header));
+	memcpy(image + header.tocOffset, this->toc.data(), this->toc.size() * sizeof(ModelLayerEntry));
+
+	std::string tempPath = path + ".tmp";
+	int file = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) {
+		std::cerr << "Failed to open " << tempPath << " for writing" << std::endl;
+		return -1;
+	}
+
+	size_t written = 0;
+	while (written < this->image.size()) {
+		ssize_t result = ::write(file, image + written, this->image.size() - written);
+		if (result < 0) {
+			break;
+		}
+		written += result;
+	}
+
+	// Flushed before the rename, or a crash could leave the new name on a file whose data never reached the disk
+	bool failed = written != this->image.size() || ::fsync(file) != 0;
+	failed = ::close(file) != 0 || failed;
+	if (failed) {
+		std::cerr << "Failed to write model " << tempPath << std::endl;
+		std::remove(tempPath.c_str());
+		return -1;
+	}
+
+	if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+		std::cerr << "Failed to replace model " << path << std::endl;
+		std::remove(tempPath.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+/* @brief Get the size of the file the snapshot writes
+ * @return The size in bytes, 0 before the first capture
+*/
+uint64_t ModelSnapshot::getSize() const {
+	return this->image.size();
+}
@@ -1,4 +1,11 @@
 #include "netutil.h"
+#include "model.h"
+#include "profiler.h"
+#include "quantize.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
 size_t charToIndex(char key) {
 	std::cout << "key was " << key << std::endl;
@@ -9,12 +16,20 @@ size_t charToIndex(char key) {
 	}
 }
 
-int saveTrainingElement(oglopp::SSBO& buffer, uint8_t key, std::string const& parentDir) {
-	// Generate a filename with time
-	std::string dir = parentDir + SAMPLES_DIR;
-	std::filesystem::create_directory(dir);
+int saveTrainingElement(Layer& layer, uint8_t key, std::string const& samplePath) {
+	// Copy the values of the first sample
+	float* values = layer.mapValues(true);
+	std::vector<float> sample(values, values + layer.getNeuronCount());
+	layer.unmapValues();
+
+	// Append to the pack, unless pointed at a directory of loose .raw samples
+	if (!std::filesystem::is_directory(samplePath)) {
+		std::cout << "Saving training element for " << key << " to " << samplePath << std::endl;
+		return Dataset::append(samplePath, sample.data(), sample.size(), key);
+	}
 
-	std::string filename = dir + static_cast<char>(key) + "_" + std::to_string(time(NULL)) + "_" + std::to_string(rand()) + ".raw";
+	// Generate a filename with time
+	std::string filename = samplePath + static_cast<char>(key) + "_" + std::to_string(time(NULL)) + "_" + std::to_string(rand()) + ".raw";
 	std::cout << "Saving training element for " << key << " to " << filename << std::endl;
 
 	// Open a file for writing
@@ -24,16 +39,7 @@ int saveTrainingElement(oglopp::SSBO& buffer, uint8_t key, std::string const& pa
 		return -1;
 	}
 
-	// Map the ssbo
-	Neuron* neurons = static_cast<Neuron*>(buffer.map());
-
-	// Write to the file
-	for (size_t i=0;i<buffer.getSize()/sizeof(Neuron);i++) {
-		file.write(static_cast<char*>(static_cast<void*>(&neurons[i].value)), sizeof(neurons[i].value));
-	}
-
-	// Ummap ssbo
-	buffer.unmap();
+	file.write(reinterpret_cast<char const*>(sample.data()), sample.size() * sizeof(float));
 
 	// Close the ifle
 	file.close();
@@ -41,130 +47,352 @@ int saveTrainingElement(oglopp::SSBO& buffer, uint8_t key, std::string const& pa
 	return 0;
 }
 
-void loadTrainingFiles(std::vector<std::vector<float>>& files, std::vector<uint32_t>& fileIndices, std::string const& parentDir) {
-	std::string dir = parentDir + SAMPLES_DIR;
-	std::filesystem::create_directory(dir);
+void loadTrainingSet(Dataset& dataset, std::vector<uint32_t>& sampleIndices, std::string const& samplePath) {
+	sampleIndices.clear();
+
+	// Nothing has been saved yet
+	if (!std::filesystem::exists(samplePath)) {
+		dataset.close();
+		return;
+	}
+
+	dataset.open(samplePath);
+	std::cout << "Loaded " << dataset.size() << " training samples from " << samplePath << std::endl;
+
+	for (uint32_t i=0;i<dataset.size();i++) {
+		sampleIndices.push_back(i);
+	}
+}
+
+void setExpectedOutput(Network& network) {
+	Layer* inputLayer = &network.getLayers().front();
+	Layer* outputLayer = &network.getLayers().back();
+	size_t outputCount = outputLayer->getNeuronCount();
+	size_t copyCount = glm::min(outputCount, static_cast<size_t>(inputLayer->getNeuronCount()));
 
-	files.clear();
+	ProfileScope scope("setExpected");
+	scope.addBytes(sizeof(float) * (copyCount + 2 * outputCount * outputLayer->getBatchSize()));
 
-	// Count files in dir
-	uint32_t index = 0;
-	std::string filename;
-	std::vector<float> fileData;
-	float thisItem;
+	// Map the input values
+	float* inputValues = inputLayer->mapValues(true);
+	// Set the expected values in the final layer
+	float* outputValues = outputLayer->mapValues(true);
+	float* outputExpected = outputLayer->mapExpected();
 
-	for (auto const& entry : std::filesystem::directory_iterator(dir)) {
-		if (entry.is_regular_file()) {
-			filename = entry.path().filename().string();
-			std::cout << "Loading training sample " << filename << std::endl;
-			fileData.clear();
+	// The drawn input is the expected output
+	std::memcpy(outputExpected, inputValues, sizeof(float) * copyCount);
+	std::fill(outputExpected + copyCount, outputExpected + outputCount, 0.0f);
 
-			// Load the file into a string
+	// Only the first sample is drawn. Any other samples in the batch expect exactly what they output, so they carry no error into backprop
+	std::memcpy(outputExpected + outputCount, outputValues + outputCount, sizeof(float) * outputCount * (outputLayer->getBatchSize() - 1));
 
-			// Open file
-			std::ifstream file(dir + filename, std::ios::in | std::ios::binary);
-			std::cout << "Opening file [" << index << "] " << dir + filename << std::endl;
-			if (file.fail()) {
-				std::cerr << "File failed to open" << std::endl;
-				return;
-			}
+	// Unmap the buffers
+	outputLayer->unmapExpected();
+	outputLayer->unmapValues();
+	inputLayer->unmapValues();
+}
 
-			// Read each byte from file
-			while (!file.eof() && !file.fail()) {
-				file.read(static_cast<char*>(static_cast<void*>(&thisItem)), sizeof(thisItem));
+void doSomeSamples(Network& network, Feeder& feeder, size_t countToDo) {
+	if (feeder.size() == 0) {
+		return;
+	}
 
-				if (!file.eof() && !file.fail()) {
-					fileData.push_back(thisItem);
-				}
-			}
+	uint32_t batchSize = network.getBatchSize();
 
-			// Close file
-			file.close();
+	// Whole batches are trained at once, so round up to the next full batch
+	countToDo = glm::min(countToDo, feeder.size());
+	size_t batches = (countToDo + batchSize - 1) / batchSize;
 
-			// Push the file contents to the vector
-			files.push_back(fileData);
-			fileIndices.push_back(index++);
+	for (size_t i=0;i<batches;i++) {
+		// The backend copies the staged batch into the input and output layers without mapping them, so the slot can be refilled straight away
+		float const* batch = nullptr;
+		{
+			// Time spent waiting on the feeder thread
+			ProfileScope scope("acquire");
+			batch = feeder.acquire();
 		}
+		network.loadBatch(batch);
+		feeder.release();
+
+		// Do forward propagation
+		network.feedForward();
+		// Now back propagate to train the network, applying the summed gradients of the batch once
+		network.backProp();
+	}
+
+	Profiler::addSamples(batches * batchSize);
+}
+
+int trainHeadless(Network& network, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations, std::string const& modelDir) {
+	if (network.isQuantized()) {
+		std::cerr << "Quantized models can only run inference" << std::endl;
+		return 1;
+	}
+
+	Dataset dataset;
+	std::vector<uint32_t> sampleIndices;
+
+	loadTrainingSet(dataset, sampleIndices, samplePath);
+	if (sampleIndices.empty()) {
+		std::cerr << "No training samples found in " << samplePath << std::endl;
+		return 1;
 	}
 
-	// Shuffle the file indices
-	std::cout << "Shuffling training data" << std::endl;
-	size_t swapIndex = 0;
-	for (size_t i=0;i<fileIndices.size();i++) {
-		swapIndex = rand() % fileIndices.size();
-		uint32_t temp = fileIndices[i];
-		fileIndices[i] = fileIndices[swapIndex];
-		fileIndices[swapIndex] = temp;
+	Feeder feeder(dataset, sampleIndices, network.getBatchSize(), network.getLayers().front().getNeuronCount(), shuffle);
+
+	uint32_t batchSize = network.getBatchSize();
+	Optimizer& optimizer = network.getOptimizer();
+	std::cout << "Training on " << sampleIndices.size() << " samples for " << iterations << " iterations of " << batchSize << " samples with "
+		<< Optimizer::getOptimizerName(optimizer.getSettings().optimizer) << ", from step " << optimizer.getStep() << std::endl;
+	std::cout << "Shuffling with seed " << shuffle.seed;
+	if (shuffle.bufferSize > 0) {
+		std::cout << " through a buffer of " << std::min<size_t>(shuffle.bufferSize, sampleIndices.size()) << " samples";
 	}
+	std::cout << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	auto lastReport = start;
+	size_t lastReportIteration = 0;
+
+	for (size_t i=1;i<=iterations;i++) {
+		// One iteration is one batch
+		doSomeSamples(network, feeder, batchSize);
+
+		auto now = std::chrono::steady_clock::now();
+		double sinceReport = std::chrono::duration<double>(now - lastReport).count();
+		if (sinceReport >= HEADLESS_REPORT_SECONDS || i == iterations) {
+			double samplesPerSecond = (i - lastReportIteration) * batchSize / sinceReport;
+			std::cout << "Iteration " << i << "/" << iterations
+				<< "\t" << samplesPerSecond << " samples/s"
+				<< "\tloss " << network.getLoss()
+				<< "\tlr " << optimizer.getLearningRate(optimizer.getStep())
+				<< "\telapsed " << std::chrono::duration<double>(now - start).count() << "s" << std::endl;
+
+			if (Profiler::isEnabled()) {
+				std::cout << Profiler::summary() << std::endl;
+			}
+
+			lastReport = now;
+			lastReportIteration = i;
+		}
+	}
+
+	network.save(modelDir);
+	return 0;
 }
 
-void setExpectedOutput(Network& network) {
-	Layer* inputLayer = &network.getLayers().front();
-	Layer* outputLayer = &network.getLayers().back();
-	Neuron* inputMap = nullptr;
-	Neuron* outputMap = nullptr;
+int quantizeModel(Network& network, std::string const& samplePath, size_t calibrationSamples, std::string const& modelPath) {
+	Dataset dataset(samplePath);
+	Quantizer quantizer(network);
 
-	// Map the input buffer
-	inputMap = static_cast<Neuron*>(inputLayer->getNeurons().map(oglopp::SSBO::READ));
-	// Set the expected values in the final layer
-	outputMap = static_cast<Neuron*>(outputLayer->getNeurons().map(oglopp::SSBO::BOTH));
+	std::cout << "Calibrating on " << std::min<uint64_t>(calibrationSamples, dataset.size()) << " of " << dataset.size() << " samples from " << samplePath << std::endl;
+	quantizer.calibrate(dataset, calibrationSamples).apply();
+	if (quantizer.getError()) {
+		return 1;
+	}
+
+	QuantizationReport report = quantizer.evaluate(dataset);
+	std::cout << "Weights " << report.fp32Bytes / (1024.0 * 1024.0) << "MB fp32, " << report.int8Bytes / (1024.0 * 1024.0) << "MB int8" << std::endl
+		<< "Reconstruction loss over " << report.samples << " samples\tfp32 " << report.fp32Loss << "\tint8 " << report.int8Loss << std::endl
+		<< "Output difference from fp32\tmse " << report.outputError << "\tmax " << report.maxError << std::endl;
 
-	// Set all the values to 0, unless they match the expected index
-	for (size_t l=0;l<outputLayer->getNeurons().getSize() / sizeof(Neuron);l++) {
-		outputMap[l].expected = inputMap[l].value;
+	if (ModelFile::write(modelPath, network.getLayers()) != 0) {
+		std::cerr << "Failed to save quantized model " << modelPath << std::endl;
+		return 1;
 	}
 
-	// Unmap the neurons
-	outputLayer->getNeurons().unmap();
-	// Unmap the neurons
-	inputLayer->getNeurons().unmap();
+	std::cout << "Saved quantized model to " << modelPath << std::endl;
+	return 0;
 }
 
-void doSomeSamples(oglopp::Compute& compute, Network& network, std::string const& parentDir, std::vector<std::vector<float>>& files, std::vector<uint32_t>& fileIndices, size_t& offset, size_t countToDo) {
-	std::string dir = parentDir + SAMPLES_DIR;
-	std::filesystem::create_directory(dir);
+int pruneModel(Network& network, float threshold, float sparsity, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations,
+	std::string const& modelPath) {
+	if (network.isQuantized()) {
+		std::cerr << "Quantized models can not be pruned" << std::endl;
+		return 1;
+	}
 
-	Layer* inputLayer = &network.getLayers().front();
-	Layer* outputLayer = &network.getLayers().back();
-	Neuron* inputMap = nullptr;
-	Neuron* outputMap = nullptr;
+	uint64_t denseBytes = 0;
+	for (size_t l=1;l<network.size();l++) {
+		denseBytes += network[l].getWeightBytes();
+	}
+
+	network.prune(threshold, sparsity);
+
+	uint64_t sparseBytes = 0;
+	for (size_t l=1;l<network.size();l++) {
+		Layer& layer = network[l];
+		if (layer.isConvolution()) {
+			std::cout << "Layer " << l << "\tis convolutional, leaving it dense" << std::endl;
+			sparseBytes += layer.getWeightBytes();
+			continue;
+		}
+		if (!layer.isSparse()) {
+			return 1;
+		}
+
+		uint64_t kept = layer.getStoredWeightCount();
+		std::cout << "Layer " << l << "\tkept " << kept << " of " << layer.getWeightCount() << " weights ("
+			<< 100.0 * kept / std::max<uint64_t>(layer.getWeightCount(), 1) << "%)" << std::endl;
+		sparseBytes += layer.getWeightBytes();
+	}
+	std::cout << "Weights " << denseBytes / (1024.0 * 1024.0) << "MB before, " << sparseBytes / (1024.0 * 1024.0) << "MB pruned" << std::endl;
 
-	countToDo = glm::min(countToDo, files.size());
+	// Training only updates the weights that were kept, so fine tuning recovers accuracy without filling the layers back in
+	network.setFilename(modelPath);
+	if (iterations > 0) {
+		return trainHeadless(network, samplePath, shuffle, iterations, "");
+	}
+
+	network.save("");
+	return 0;
+}
+
+int reduceModel(Network& network, uint32_t format, std::string const& samplePath, ShuffleSettings const& shuffle, size_t iterations, std::string const& modelPath) {
+	if (network.isQuantized()) {
+		std::cerr << "Quantized models can not be stored in reduced precision" << std::endl;
+		return 1;
+	}
+
+	uint64_t fullBytes = 0;
+	for (size_t l=1;l<network.size();l++) {
+		fullBytes += network[l].getWeightBytes();
+	}
+
+	// Fine tuning trains the fp32 weights, so they are only dropped when there is none
+	network.setPrecision(format, iterations > 0);
+
+	// As saved, without the master weights
+	uint64_t reducedBytes = 0;
+	for (size_t l=1;l<network.size();l++) {
+		Layer& layer = network[l];
+		if (layer.isConvolution() || layer.isSparse()) {
+			std::cout << "Layer " << l << "\tis " << (layer.isConvolution() ? "convolutional" : "pruned") << ", leaving it in fp32" << std::endl;
+		}
+		reducedBytes += layer.isReduced() ? layer.getWeightCount() * sizeof(uint16_t) : layer.getWeightBytes();
+	}
+	std::cout << "Weights " << fullBytes / (1024.0 * 1024.0) << "MB before, " << reducedBytes / (1024.0 * 1024.0) << "MB in " << getPrecisionName(format) << std::endl;
+
+	network.setFilename(modelPath);
+	if (iterations > 0) {
+		return trainHeadless(network, samplePath, shuffle, iterations, "");
+	}
 
-	//size_t expectedIndex = 0;
-	for (size_t i=0;i<countToDo;i++) {
-		size_t fileIndex = fileIndices[(offset + i) % fileIndices.size()];
+	network.save("");
+	return 0;
+}
 
-		// Map the input buffer
-		inputMap = static_cast<Neuron*>(inputLayer->getNeurons().map(oglopp::SSBO::BOTH));
+char const* getPrecisionName(uint32_t format) {
+	switch (format) {
+		case MODEL_FORMAT_FP16:
+			return "fp16";
+		case MODEL_FORMAT_BF16:
+			return "bf16";
+		default:
+			return "fp32";
+	}
+}
 
-		// Read from the file into the neuron indices
-		for (size_t n=0;n<files[fileIndex].size();n++) {
-			inputMap[n].value = files[fileIndex][n];
+bool parsePrecision(char const* option, uint32_t& format) {
+	for (uint32_t f : {MODEL_FORMAT_FP32, MODEL_FORMAT_FP16, MODEL_FORMAT_BF16}) {
+		if (strcmp(option, getPrecisionName(f)) == 0) {
+			format = f;
+			return true;
 		}
+	}
+
+	std::cerr << "Unknown precision '" << option << "'. Expected one of 'fp32,fp16,bf16'" << std::endl;
+	return false;
+}
+
+bool parseConvolution(char const* option, bool transposed, ConvolutionShape& shape) {
+	char* end = nullptr;
+	shape = ConvolutionShape();
+	shape.transposed = transposed;
+	shape.kernel = strtoul(option, &end, 10);
+	if (*end == ',') {
+		shape.stride = strtoul(end + 1, &end, 10);
+	}
 
-		// Set the expected values in the final layer
-		outputMap = static_cast<Neuron*>(outputLayer->getNeurons().map(oglopp::SSBO::BOTH));
+	if (*end != '\0' || shape.kernel == 0 || shape.stride == 0) {
+		std::cerr << "Expected a convolution as kernel,stride with both above 0, got '" << option << "'" << std::endl;
+		return false;
+	}
+	return true;
+}
 
-		// Set all the values to 0, unless they match the expected index
-		for (size_t l=0;l<outputLayer->getNeurons().getSize() / sizeof(Neuron);l++) {
-			//neuronMap[l].expected = (l == expectedIndex) ? 1.0 :0.0;
-			outputMap[l].expected = inputMap[l].value;
+bool parseActivation(char const* option, uint32_t& activation) {
+	for (uint32_t a=ACTIVATION_SIGMOID;a<=ACTIVATION_LINEAR;a++) {
+		if (strcmp(option, getActivationName(a)) == 0) {
+			activation = a;
+			return true;
 		}
+	}
 
-		// Unmap the neurons
-		outputLayer->getNeurons().unmap();
-		// Unmap the neurons
-		inputLayer->getNeurons().unmap();
+	std::cerr << "Unknown activation '" << option << "'. Expected one of 'sigmoid,relu,tanh,linear'" << std::endl;
+	return false;
+}
 
+bool parseOptimizer(char const* option, OptimizerSettings& settings) {
+	char const* comma = strchr(option, ',');
+	std::string name(option, comma != nullptr ? comma - option : strlen(option));
+	uint32_t parameters = 0;
+
+	if (name == "sgd") {
+		settings.optimizer = OPTIMIZER_SGD;
+	} else if (name == "momentum") {
+		settings.optimizer = OPTIMIZER_MOMENTUM;
+		settings.momentum = SGD_MOMENTUM;
+		parameters = 1;
+	} else if (name == "adam" || name == "adamw") {
+		settings.optimizer = name == "adam" ? OPTIMIZER_ADAM : OPTIMIZER_ADAMW;
+		settings.momentum = ADAM_BETA1;
+		settings.beta2 = ADAM_BETA2;
+		parameters = 2;
+	} else {
+		std::cerr << "Unknown optimizer '" << name << "'. Expected one of 'sgd,momentum,adam,adamw'" << std::endl;
+		return false;
+	}
 
+	// The momentum, then beta2
+	float* targets[2] = {&settings.momentum, &settings.beta2};
+	char* end = const_cast<char*>(option) + name.size();
+	for (uint32_t i=0;i<parameters && *end == ',';i++) {
+		*targets[i] = strtof(end + 1, &end);
+	}
 
+	if (*end != '\0') {
+		std::cerr << "Too many or malformed parameters for the " << name << " optimizer, got '" << option << "'" << std::endl;
+		return false;
+	}
+	return true;
+}
 
-		// Do forward propagation
-		network.feedForward(compute);
-		// Now back propagate to train the network
-		network.backProp(compute);
+bool parseSchedule(char const* option, OptimizerSettings& settings) {
+	char const* comma = strchr(option, ',');
+	std::string name(option, comma != nullptr ? comma - option : strlen(option));
+	char* end = const_cast<char*>(option) + name.size();
+
+	if (name == "constant") {
+		settings.schedule = SCHEDULE_CONSTANT;
+	} else if (name == "cosine" || name == "step") {
+		settings.schedule = name == "cosine" ? SCHEDULE_COSINE : SCHEDULE_STEP;
+		settings.decayFactor = name == "cosine" ? 0.0 : 0.1;
+		settings.decaySteps = 0;
+		if (*end == ',') {
+			settings.decaySteps = strtoul(end + 1, &end, 10);
+		}
+		if (*end == ',') {
+			settings.decayFactor = strtof(end + 1, &end);
+		}
+	} else {
+		std::cerr << "Unknown schedule '" << name << "'. Expected one of 'constant,cosine,step'" << std::endl;
+		return false;
 	}
 
-	offset = (offset + countToDo) % files.size();
+	if (*end != '\0' || (settings.schedule != SCHEDULE_CONSTANT && settings.decaySteps == 0)) {
+		std::cerr << "Expected a schedule as constant, cosine,steps[,floor] or step,steps[,factor] with steps above 0, got '" << option << "'" << std::endl;
+		return false;
+	}
+	return true;
 }
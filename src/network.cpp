@@ -1,17 +1,24 @@
 #include "network.h"
+#include "model.h"
+#include "profiler.h"
 #include "oglopp/compute.h"
 #include "oglopp/more_shapes.h"
 #include "oglopp/window.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
+#include <iostream>
 #include <sstream>
 
-Network::Network(size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize) {
-	this->setup(inputSize, hiddenSizes, outputSize);
+Network::Network(Backend& backend, size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize, std::vector<ConvolutionShape> convolutions,
+	std::vector<uint32_t> activations) {
+	this->setup(backend, inputSize, hiddenSizes, outputSize, convolutions, activations);
 }
 
-Network::Network(std::string const& filename) {
-	this->setup(filename);
+Network::Network(Backend& backend, std::string const& filename) {
+	this->setup(backend, filename);
 }
 
 Network::~Network() {
@@ -27,46 +34,145 @@ glm::vec3 calcRectPos(uint32_t index) {
 }
 
 /* @brief Setup the network based on a list of layers and sizes
+ * @param[in] backend		The backend which stores and executes every layer of the network
  * @param[in] inputSize		The input layer size
  * @param[in] layerSizes	The number of neurons in each hidden layer
  * @param[in] outputSize	The ouput layer size
+ * @param[in] convolutions	Empty for a dense network, or one shape per layer after the input, see shapeConvolutions(). Layers with a kernel of 0 are dense
+ * @param[in] activations	Empty for sigmoid everywhere, or one ACTIVATION_* per layer after the input
  */
-Network& Network::setup(size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize) {
-	// Generate a filename
+Network& Network::setup(Backend& backend, size_t inputSize, std::vector<size_t> hiddenSizes, size_t outputSize, std::vector<ConvolutionShape> convolutions,
+	std::vector<uint32_t> activations) {
+	this->backend = &backend;
+	Backend::Type type = backend.getType();
+
+	std::vector<size_t> sizes = {inputSize};
+	sizes.insert(sizes.end(), hiddenSizes.begin(), hiddenSizes.end());
+	sizes.push_back(outputSize);
+
+	if (convolutions.empty()) {
+		convolutions.resize(sizes.size() - 1);
+	}
+	if (convolutions.size() != sizes.size() - 1 || !shapeConvolutions(sizes, convolutions)) {
+		std::cerr << "Could not lay out the convolutional layers" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	if (activations.empty()) {
+		activations.resize(sizes.size() - 1, ACTIVATION_SIGMOID);
+	}
+	if (activations.size() != sizes.size() - 1) {
+		std::cerr << "Expected one activation per layer after the input" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	// Generate a filename. Convolutions are tagged c, transposed convolutions t
 	std::ostringstream filename;
 	filename << "skml_" << inputSize << "_";
-	for (size_t i=0;i<hiddenSizes.size();i++) {
-		filename << hiddenSizes[i] << "_";
+	for (size_t i=1;i<sizes.size();i++) {
+		filename << sizes[i];
+		if (convolutions[i-1].kernel > 0) {
+			filename << (convolutions[i-1].transposed ? "t" : "c");
+		}
+		filename << "_";
 	}
-	filename << outputSize << "_" << std::to_string(time(NULL)) << "-" << std::to_string(rand()) << MODEL_EXTENSION;
+	filename << std::to_string(time(NULL)) << "-" << std::to_string(rand()) << MODEL_EXTENSION;
 	this->networkFilename = filename.str();
 
-	this->layers.resize(2 + hiddenSizes.size());
+	this->layers.resize(sizes.size());
 
 	// Setup input
-	size_t lastSize = inputSize;
-	this->layers[0].setup(inputSize, 0);
-
-	// Setup hidden
-	for (size_t i=1;i<=hiddenSizes.size();i++) {
-		this->layers[i].setup(hiddenSizes[i-1], lastSize);
-		lastSize = hiddenSizes[i-1];
+	this->layers[0].setup(inputSize, 0, type, this->batchSize);
+
+	// Setup hidden and output
+	for (size_t i=1;i<sizes.size();i++) {
+		if (convolutions[i-1].kernel > 0) {
+			this->layers[i].setup(convolutions[i-1], type, this->batchSize);
+		} else {
+			this->layers[i].setup(sizes[i], sizes[i-1], type, this->batchSize);
+		}
+		this->layers[i].setActivation(activations[i-1]);
 	}
 
-	// Setup output
-	this->layers[hiddenSizes.size() + 1].setup(outputSize, lastSize);
+	return *this;
+}
+
+/* @brief Work out the padding, image sizes and channels of convolutional layers from their kernel, stride and neuron count. A convolution shrinks the image
+ * feeding it by its stride, a transposed convolution grows it by its stride, and both take as many channels as their neuron count allows.
+ * A dense layer feeding a convolution is taken as a single channel square image
+ * @param[in] sizes				The neuron count of every layer, input layer first
+ * @param[in,out] convolutions	One shape per layer after the input, with 'transposed', 'kernel' and 'stride' set. Layers with a kernel of 0 are left dense
+ * @return						False if some layer's neuron count does not fit its image, printing why
+*/
+bool Network::shapeConvolutions(std::vector<size_t> const& sizes, std::vector<ConvolutionShape>& convolutions) {
+	// The image the last layer makes up
+	uint64_t lastSize = 0;
+	uint64_t lastChannels = 0;
+
+	for (size_t i=1;i<sizes.size();i++) {
+		ConvolutionShape& shape = convolutions[i-1];
+		if (shape.kernel == 0) {
+			continue;
+		}
+
+		if (i == 1 || convolutions[i-2].kernel == 0) {
+			lastSize = static_cast<uint64_t>(std::llround(std::sqrt(static_cast<double>(sizes[i-1]))));
+			lastChannels = 1;
+			if (lastSize * lastSize != sizes[i-1]) {
+				std::cerr << "Layer " << i << " convolves layer " << i-1 << ", whose " << sizes[i-1] << " neurons are not a square image" << std::endl;
+				return false;
+			}
+		}
+
+		if (shape.stride == 0 || shape.kernel > UINT16_MAX || shape.stride > UINT16_MAX) {
+			std::cerr << "Layer " << i << " has a bad kernel or stride" << std::endl;
+			return false;
+		}
+
+		uint64_t size = shape.transposed ? lastSize * shape.stride : (lastSize + shape.stride - 1) / shape.stride;
+		uint64_t channels = size > 0 ? sizes[i] / (size * size) : 0;
+		if (channels == 0 || channels * size * size != sizes[i] || size > UINT16_MAX || channels > UINT16_MAX) {
+			std::cerr << "Layer " << i << " has " << sizes[i] << " neurons, which is not a whole number of " << size << "x" << size << " channels" << std::endl;
+			return false;
+		}
+
+		if (shape.transposed) {
+			shape.smallSize = lastSize;
+			shape.smallChannels = lastChannels;
+			shape.bigSize = size;
+			shape.bigChannels = channels;
+		} else {
+			shape.bigSize = lastSize;
+			shape.bigChannels = lastChannels;
+			shape.smallSize = size;
+			shape.smallChannels = channels;
+		}
+
+		// Split the padding needed for the kernels to cover the big image evenly between both sides
+		int64_t reach = static_cast<int64_t>(shape.smallSize - 1) * shape.stride + shape.kernel - shape.bigSize;
+		shape.padding = std::max<int64_t>(reach, 0) / 2;
 
-	return this->setupUI();
+		lastSize = size;
+		lastChannels = channels;
+	}
+
+	return true;
 }
 
-Network& Network::setup(std::string const& filename) {
+Network& Network::setup(Backend& backend, std::string const& filename) {
+	this->backend = &backend;
 	this->networkFilename = filename;
 
 	this->load(this->networkFilename);
 
-	return this->setupUI();
+	return *this;
 }
 
+/* @brief Create the rectangles the layers are drawn on. Only needed when the network is drawn, and requires an OpenGL context
+ * @return A reference to this network object
+*/
 Network& Network::setupUI() {
 	oglopp::Rectangle* newRect = nullptr;
 
@@ -115,70 +221,257 @@ size_t Network::size() {
 	return this->layers.size();
 }
 
+/* @brief Get the backend the network was constructed with
+ * @return A reference to the backend
+*/
+Backend& Network::getBackend() {
+	return *this->backend;
+}
+
+/* @brief Set the number of samples every layer processes at once. Resets the neuron values, keeps the weights and biases
+ * @param[in] batchSize	The number of samples, between 1 and MAX_BATCH_SIZE
+ * @return				A reference to this network object
+*/
+Network& Network::setBatchSize(uint32_t batchSize) {
+	if (batchSize < 1 || batchSize > MAX_BATCH_SIZE) {
+		std::cerr << "Batch size " << batchSize << " is out of range, expected 1 to " << MAX_BATCH_SIZE << std::endl;
+		return *this;
+	}
+
+	this->batchSize = batchSize;
+	for (size_t i=0;i<this->layers.size();i++) {
+		this->layers[i].setBatchSize(batchSize);
+	}
+
+	return *this;
+}
+
+/* @brief Get the number of samples every layer processes at once
+ * @return The batch size
+*/
+uint32_t Network::getBatchSize() {
+	return this->batchSize;
+}
+
 /* @brief Perform a feed forward computation on the network. Performs layer 1, then 2, then 3, etc...
- * @param[in] compute	A reference to a compute shader to use
  * @return	A reference to the output layer storing the calculated result
 */
-Layer& Network::feedForward(oglopp::Compute& compute) {
-	// We start with the first hidden layer, so start by providing the first layer as the "last" layer
-	Layer* lastLayer = &this->layers[0];
+Layer& Network::feedForward() {
+	return this->feedForward(1, this->size() - 1);
+}
+
+/* @brief Perform a feed forward computation on a range of layers, starting from the values already in the layer before the first
+ * @param[in] first	The first layer to compute, at least 1
+ * @param[in] last	The last layer to compute
+ * @return			A reference to the last layer computed
+*/
+Layer& Network::feedForward(size_t first, size_t last) {
+	// Unless every layer is being timed on its own, the backend runs the whole range at once
+	if (!Profiler::isEnabled()) {
+		this->backend->forwardPass(this->layers, first, last);
+		return this->layers[last];
+	}
+
+	// Start by providing the layer before the first as the "last" layer
+	Layer* lastLayer = &this->layers[first - 1];
 	Layer* thisLayer = nullptr;
 
 	// Feed forward each layer one at a time
-	for (size_t i=1;i<this->size();i++) {
+	for (size_t i=first;i<=last;i++) {
 		// Get the current layer
 		thisLayer = &this->layers[i];
 
 		// Feed forward the layer given the last layer
-		thisLayer->feedForward(*lastLayer, compute);
+		ProfileScope scope("forward", i, this->backend->getType() == Backend::GPU);
+		thisLayer->feedForward(*lastLayer, *this->backend);
 
 		// Update last layer to the current layer for the next iteration
 		lastLayer = thisLayer;
 	}
 
-	// Return a reference to the output layer
-	return this->layers[this->size() - 1];
+	return this->layers[last];
 }
 
-/* @brief Perform back propagation on the network
- * @param[in] compute	A reference to a compute shader to use
- * @return	A reference to the output layer storing the calculated result
+/* @brief Feed the input forward again, recomputing only as much of the network as the inputs that changed since the last call reach. Meant for
+ * redrawing a drawing as it is painted, see Backend::incrementalPass()
+ * @param[in] tolerance	How far a value has to move before the layer it feeds is recomputed
+ * @return				A reference to the output layer storing the calculated result
 */
-Network& Network::backProp(oglopp::Compute& compute) {
-	// We start with the first hidden layer, so start by providing the first layer as the "last" layer
-	Layer* lastLayer = nullptr;
-	Layer* thisLayer = nullptr;
+Layer& Network::feedForwardIncremental(float tolerance) {
+	ProfileScope scope("forward.incremental", -1, this->backend->getType() == Backend::GPU);
+	this->backend->incrementalPass(this->layers, tolerance);
+	return this->layers.back();
+}
 
-	// Feed forward each layer one at a time
-	bool isLastLayer = true;
-	for (size_t i=this->size()-1;i>0;i--) {
-		// Get the current layer
-		lastLayer = &this->layers[i-1];
-		thisLayer = &this->layers[i];
+/* @brief Get the index of the smallest hidden layer, which holds the encoding of an autoencoder
+ * @return The layer index, or the output layer index if there are no hidden layers
+*/
+size_t Network::getBottleneck() {
+	size_t bottleneck = this->size() - 1;
+	for (size_t i=1;i+1<this->size();i++) {
+		if (this->layers[i].getNeuronCount() < this->layers[bottleneck].getNeuronCount() || bottleneck == this->size() - 1) {
+			bottleneck = i;
+		}
+	}
+	return bottleneck;
+}
 
-		// Feed forward the layer given the last layer
-		thisLayer->backPropagate(*lastLayer, compute, isLastLayer);
-		isLastLayer = false;
+/* @brief Perform back propagation on the network with the next step of the optimizer. Does nothing if any layer is quantized.
+ * Reduced precision layers without fp32 weights get them back first, widened from the reduced weights
+ * @return	A reference to this network object
+*/
+Network& Network::backProp() {
+	if (this->isQuantized()) {
+		std::cerr << "Quantized networks can not be trained" << std::endl;
+		return *this;
+	}
+
+	for (size_t i=1;i<this->size();i++) {
+		if (!this->layers[i].hasMasterWeights()) {
+			this->layers[i].setPrecision(this->layers[i].getPrecision(), true);
+		}
+	}
+
+	// Every layer is updated with the same scheduled rate
+	OptimizerStep step = this->optimizer.nextStep();
+
+	if (!Profiler::isEnabled()) {
+		this->backend->backwardPass(this->layers, step);
+	} else {
+		// We start with the first hidden layer, so start by providing the first layer as the "last" layer
+		Layer* lastLayer = nullptr;
+		Layer* thisLayer = nullptr;
+
+		// Feed forward each layer one at a time
+		bool isLastLayer = true;
+		for (size_t i=this->size()-1;i>0;i--) {
+			// Get the current layer
+			lastLayer = &this->layers[i-1];
+			thisLayer = &this->layers[i];
+
+			// Feed forward the layer given the last layer
+			ProfileScope scope("backward", i, this->backend->getType() == Backend::GPU);
+			thisLayer->backPropagate(*lastLayer, *this->backend, isLastLayer, step);
+			isLastLayer = false;
+		}
+	}
+
+	if (this->checkpointInterval > 0 && this->optimizer.getStep() % this->checkpointInterval == 0) {
+		this->checkpoint(this->checkpointDirectory);
+	}
+
+	return *this;
+}
+
+/* @brief Get the optimizer backProp() trains with. Its settings and step count are saved with the model, and restored when a model is loaded
+ * @return A reference to the optimizer
+*/
+Optimizer& Network::getOptimizer() {
+	return this->optimizer;
+}
+
+/* @brief Check if any layer runs on int8 weights, which makes the network inference only
+ * @return True if quantized
+*/
+bool Network::isQuantized() {
+	for (size_t i=1;i<this->size();i++) {
+		if (this->layers[i].isQuantized()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* @brief Prune every layer, see Layer::prune(). Each layer drops the same fraction of its own weights
+ * @param[in] threshold	Weights with a smaller magnitude are dropped
+ * @param[in] sparsity	The fraction of the weights of each layer to drop, between 0 and 1
+ * @return				A reference to this network object
+*/
+Network& Network::prune(float threshold, float sparsity) {
+	// Convolutions have few enough weights already
+	for (size_t i=1;i<this->size();i++) {
+		if (!this->layers[i].isConvolution()) {
+			this->layers[i].prune(threshold, sparsity);
+		}
+	}
+	return *this;
+}
+
+/* @brief Store the weights of every dense layer in fp16, bf16 or fp32, see Layer::setPrecision(). Convolutions, pruned and quantized layers stay as they are
+ * @param[in] format	MODEL_FORMAT_FP32, MODEL_FORMAT_FP16 or MODEL_FORMAT_BF16
+ * @param[in] master	True to keep fp32 master weights to train, false for inference only
+ * @return				A reference to this network object
+*/
+Network& Network::setPrecision(uint32_t format, bool master) {
+	for (size_t i=1;i<this->size();i++) {
+		Layer& layer = this->layers[i];
+		if (!layer.isConvolution() && !layer.isSparse() && !layer.isQuantized()) {
+			layer.setPrecision(format, master);
+		}
 	}
+	return *this;
+}
+
+/* @brief Load a batch of samples into the input layer, and into the expected values of the output layer
+ * @param[in] batch	getBatchSize() rows of input layer neuron count floats
+ * @return			A reference to this network object
+*/
+Network& Network::loadBatch(float const* batch) {
+	Layer& input = this->layers.front();
+	ProfileScope scope("loadBatch", -1, this->backend->getType() == Backend::GPU);
+	scope.addBytes(sizeof(float) * input.getNeuronCount() * input.getBatchSize());
+
+	this->backend->loadBatch(this->layers.front(), this->layers.back(), batch);
 
 	return *this;
 }
 
+/* @brief Get the mean squared error between the output layer's values and expected values, over every sample in the batch
+ * @return The loss of the last feed forward
+*/
+float Network::getLoss() {
+	Layer& output = this->layers.back();
+	size_t count = static_cast<size_t>(output.getNeuronCount()) * output.getBatchSize();
+	if (count == 0) {
+		return 0.0;
+	}
+
+	ProfileScope scope("loss");
+	scope.addBytes(2 * sizeof(float) * count);
+
+	double loss = 0.0;
+	float* values = output.mapValues(true);
+	float* expected = output.mapExpected(true);
+	for (size_t i=0;i<count;i++) {
+		double error = values[i] - expected[i];
+		loss += error * error;
+	}
+	output.unmapExpected();
+	output.unmapValues();
+
+	return static_cast<float>(loss / count);
+}
+
 /* @brief Bind the network to a shader
  * @param[in] shader	The shader object to bind the layers' ssbo objects for display
 */
 Network& Network::draw(oglopp::Window& window, oglopp::Shader& shader) {
+	ProfileScope scope("draw", -1, true);
+
 	// Bind all the layers
 	double res = 0;
 
 	for (size_t i=0;i<this->size();i++) {
-		this->layers[i].getNeurons().bind(0);
+		// CPU layers are mirrored into their display SSBOs for the fragment shader
+		this->layers[i].upload();
+		this->layers[i].getValues().bind(0);
+		this->layers[i].getExpected().bind(1);
 
 		if (i < this->monitors.size()) {
-			res = ceil(sqrt(this->layers[i].getNeurons().getSize() / sizeof(Neuron)));
-			//std::cout << "size is " << this->layers[i].getNeurons().getSize() / sizeof(Neuron) << ", res is " << res << std::endl;
+			res = ceil(sqrt(this->layers[i].getNeuronCount()));
+			//std::cout << "size is " << this->layers[i].getValues().getSize() / sizeof(float) << ", res is " << res << std::endl;
 			//if (i == this->size() - 1) {
-			//	shader.setVec2("layerSize", glm::vec2(this->layers[this->layers.size()-1].getNeurons().getSize() / sizeof(Neuron), 1));
+			//	shader.setVec2("layerSize", glm::vec2(this->layers[this->layers.size()-1].getValues().getSize() / sizeof(float), 1));
 			//} else {
 				//shader.setVec2("layerSize", glm::vec2(res, res));
 				//}
@@ -191,6 +484,14 @@ Network& Network::draw(oglopp::Window& window, oglopp::Shader& shader) {
 		}
 	}
 
+	// The fragment shader paints into the values and expected values, so pull those edits back into any CPU layers
+	if (this->backend != nullptr && this->backend->getType() == Backend::CPU) {
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		for (size_t i=0;i<this->size();i++) {
+			this->layers[i].download();
+		}
+	}
+
 	return *this;
 }
 
@@ -202,26 +503,12 @@ std::vector<Layer>& Network::getLayers() {
 	return this->layers;
 }
 
-/* @brief Save the network layers to a model file. The model file is tagged using information about the model layers, as well as a timestamp
+/* @brief Save the network layers and the optimizer state to a v2 model file. The model file is tagged using information about the model layers, as well as a timestamp
  * @param[in] directory	The directory to save the file into
  * @return A reference to this network object
 */
 Network& Network::save(std::string const& directory) {
-	// [uint32_t : hidden layer count]
-	// [uint32_t : input neuron count]
-	// [uint32_t : hidden layer 1 neuron count]
-	// [uint64_t : input to hidden layer 1 weights count]
-	// [float[] : input to hidden layer 1 weights]
-	// [float[] : hidden layer 1 biases]
-	// [uint32_t : hidden layer N neuron count]
-	// [uint64_t : hidden layer N-1 to hidden layer N weights count]
-	// [float[] : hidden layer N-1 to hidden layer N weights]
-	// [float[] : hidden layer N biases]
-	// [uint32_t : output layer neuron count]
-	// [uint64_t : hidden layer N to output layer weights count]
-	// [float[] : hidden layer N to output layer weights]
-	// [float[] : output layer biases]
-	//
+	// See ModelFile::write for the layout
 
 	if (directory.size() > 0) {
 		std::filesystem::create_directory(directory);
@@ -231,38 +518,164 @@ Network& Network::save(std::string const& directory) {
 	std::string fullPath = directory + this->networkFilename;
 	std::cout << "Saving model to " << fullPath << std::endl;
 
-	// Open the file
-	std::fstream file(fullPath, std::ios::out | std::ios::binary);
-	if (file.bad()) {
-		std::cerr << "Failed ot open file!" << std::endl;
+	// Checkpoints write to the same temporary file
+	if (this->checkpointer) {
+		this->checkpointer->wait();
+	}
+
+	ModelTrainingState training = this->getTrainingState();
+	ProfileScope scope("save");
+	if (ModelFile::write(fullPath, this->layers, &training) != 0) {
+		std::cerr << "Failed to save model " << fullPath << std::endl;
 		return *this;
 	}
+	scope.addBytes(std::filesystem::file_size(fullPath));
 
-	// Write hidden layer count
-	uint32_t hiddenLayers = this->layers.size() - 2; // includes hidden and output actually but...
-	std::cout << "Hidden layers " << hiddenLayers << std::endl;
-	file.write(static_cast<char*>(static_cast<void*>(&hiddenLayers)), sizeof(hiddenLayers));
+	return *this;
+}
 
-	// Write input neuron count
-	uint32_t inputNeuronCount = this->layers[0].getNeurons().getSize() / sizeof(Neuron); // includes hidden and output actually but...
-	std::cout << "Input neurons " << inputNeuronCount << std::endl;
-	file.write(static_cast<char*>(static_cast<void*>(&inputNeuronCount)), sizeof(inputNeuronCount));
+/* @brief Save the network like save(), but only copy it here and write it on a background thread, see Checkpointer. A checkpoint still waiting to be
+ * written is replaced. save() and destroying the network wait for the checkpoints to be written
+ * @param[in] directory	The directory to save the file into
+ * @return				A reference to this network object
+*/
+Network& Network::checkpoint(std::string const& directory) {
+	if (directory.size() > 0) {
+		std::filesystem::create_directory(directory);
+	}
 
-	// Write all layers except input
-	for (size_t i=1;i<this->layers.size();i++) {
-		std::cout << "Saving layer " << i << std::endl;
-		this->layers[i].writeLayer(file);
+	if (!this->checkpointer) {
+		this->checkpointer = std::make_unique<Checkpointer>();
 	}
 
-	file.close();
+	std::string fullPath = directory + this->networkFilename;
+	std::cout << "Checkpointing model to " << fullPath << " at step " << this->optimizer.getStep() << std::endl;
+
+	// Only the copy is timed, the write happens on the checkpointer's thread
+	ModelTrainingState training = this->getTrainingState();
+	ProfileScope scope("checkpoint");
+	scope.addBytes(this->checkpointer->save(this->layers, &training, fullPath));
+
+	return *this;
+}
+
+/* @brief Checkpoint the network every so many optimizer steps of backProp(), see checkpoint()
+ * @param[in] steps		The number of steps between checkpoints, 0 to never checkpoint
+ * @param[in] directory	The directory to save the checkpoints into
+ * @return				A reference to this network object
+*/
+Network& Network::setCheckpointInterval(uint64_t steps, std::string const& directory) {
+	this->checkpointInterval = steps;
+	this->checkpointDirectory = directory;
+	return *this;
+}
+
+/* @brief Get the optimizer state saved with the model
+ * @return The training state
+*/
+ModelTrainingState Network::getTrainingState() {
+	OptimizerSettings const& settings = this->optimizer.getSettings();
+	ModelTrainingState training;
+	memset(&training, 0, sizeof(training));
+	training.step = this->optimizer.getStep();
+	training.optimizer = settings.optimizer;
+	training.schedule = settings.schedule;
+	training.learningRate = settings.learningRate;
+	training.momentum = settings.momentum;
+	training.beta2 = settings.beta2;
+	training.epsilon = settings.epsilon;
+	training.weightDecay = settings.weightDecay;
+	training.warmupSteps = settings.warmupSteps;
+	training.decaySteps = settings.decaySteps;
+	training.decayFactor = settings.decayFactor;
+	return training;
+}
+
+/* @brief Set the name save() gives the model file
+ * @param[in] filename	The file name, relative to the directory given to save()
+ * @return				A reference to this network object
+*/
+Network& Network::setFilename(std::string const& filename) {
+	this->networkFilename = filename;
 	return *this;
 }
 
-/* @brief Load network layers from a model file. The file can have any name.
+/* @brief Load network layers from a model file. The file can have any name. v2 files are memory mapped, v1 files are read through a stream.
+ * The optimizer picks up the settings and step count saved with a v2 model, and starts over otherwise
  * @param[in] networkFile	The network file to load
  * @return					A reference to this network object
 */
 Network& Network::load(std::string const& networkFile) {
+	std::cout << "Loading model from " << networkFile << std::endl;
+	this->optimizer.setStep(0);
+
+	if (ModelFile::isModelFile(networkFile)) {
+		return this->loadMapped(networkFile);
+	}
+
+	return this->loadStream(networkFile);
+}
+
+/* @brief Load network layers from a mapped v2 model file, checking every layer's checksums first
+ * @param[in] networkFile	The network file to load
+ * @return					A reference to this network object
+*/
+Network& Network::loadMapped(std::string const& networkFile) {
+	std::shared_ptr<ModelFile> model = std::make_shared<ModelFile>(networkFile);
+	if (model->getError() || model->getLayerCount() < 2) {
+		this->error = true;
+		return *this;
+	}
+
+	// Nothing has written to the mapping yet, so this is the only chance to check the blobs against the file
+	for (uint32_t i=1;i<model->getLayerCount();i++) {
+		if (!model->verify(i)) {
+			std::cerr << "Model " << networkFile << " layer " << i << " failed its checksum" << std::endl;
+			this->error = true;
+			return *this;
+		}
+	}
+
+	this->layers.resize(model->getLayerCount());
+	Backend::Type type = this->backend != nullptr ? this->backend->getType() : Backend::GPU;
+	this->layers[0].setup(model->getLayer(0).neuronCount, 0, type, this->batchSize);
+
+	// The file does not depend on the backend, so models move freely between them
+	for (uint32_t i=1;i<model->getLayerCount();i++) {
+		this->layers[i].setBatchSize(this->batchSize);
+		this->layers[i].readLayer(model, i, type);
+	}
+
+	ModelTrainingState const* training = model->getTraining();
+	if (training != nullptr) {
+		OptimizerSettings settings;
+		settings.optimizer = training->optimizer;
+		settings.schedule = training->schedule;
+		settings.learningRate = training->learningRate;
+		settings.momentum = training->momentum;
+		settings.beta2 = training->beta2;
+		settings.epsilon = training->epsilon;
+		settings.weightDecay = training->weightDecay;
+		settings.warmupSteps = training->warmupSteps;
+		settings.decaySteps = training->decaySteps;
+		settings.decayFactor = training->decayFactor;
+
+		// Settings from a newer build, or a damaged file, only cost the model its schedule
+		if (Optimizer::validSettings(settings)) {
+			this->optimizer.setSettings(settings).setStep(training->step);
+		} else {
+			std::cerr << "Ignoring the training state saved with " << networkFile << std::endl;
+		}
+	}
+
+	return *this;
+}
+
+/* @brief Load network layers from a v1 model file
+ * @param[in] networkFile	The network file to load
+ * @return					A reference to this network object
+*/
+Network& Network::loadStream(std::string const& networkFile) {
 	// [uint32_t : hidden layer count]
 	// [uint32_t : input neuron count]
 	// [uint32_t : hidden layer 1 neuron count]
@@ -279,15 +692,11 @@ Network& Network::load(std::string const& networkFile) {
 	// [float[] : output layer biases]
 	//
 
-	// Now get the full filepath
-	std::cout << "Loading model from " << networkFile << std::endl;
-
 	// Open the file
 	std::fstream file(networkFile, std::ios::in | std::ios::binary);
 	if (file.bad()) {
 		return *this;
 	}
-
 	// Write hidden layer count (plus output layer)
 	uint32_t hiddenLayers;
 	file.read(static_cast<char*>(static_cast<void*>(&hiddenLayers)), sizeof(hiddenLayers));
@@ -300,12 +709,14 @@ Network& Network::load(std::string const& networkFile) {
 
 	// Setup input layer normally
 	this->layers.resize(hiddenLayers + 2);
-	this->layers[0].setup(inputNeuronCount, 0);
+	Backend::Type type = this->backend != nullptr ? this->backend->getType() : Backend::GPU;
+	this->layers[0].setup(inputNeuronCount, 0, type, this->batchSize);
 
-	// Read all layers except input
+	// Read all layers except input. The file does not depend on the backend, so models move freely between them
 	for (size_t i=0;i<=hiddenLayers;i++) {
 		std::cout << "Reading " << i + 1 << std::endl;
-		this->layers[i + 1].readLayer(file);
+		this->layers[i + 1].setBatchSize(this->batchSize);
+		this->layers[i + 1].readLayer(file, type);
 	}
 
 	file.close();
@@ -0,0 +1,189 @@
+#include "optimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/* @brief Start an optimizer
+ * @param[in] settings	The optimizer settings
+ * @param[in] step		The number of batches already trained
+*/
+Optimizer::Optimizer(OptimizerSettings const& settings, uint64_t step) : settings(settings), step(step) {}
+
+/* @brief Get the settings and scheduled rate of the next batch, counting the batch
+ * @return The step
+*/
+OptimizerStep Optimizer::nextStep() {
+	OptimizerStep next;
+	next.settings = this->settings;
+	next.learningRate = this->getLearningRate(this->step);
+	this->step++;
+	return next;
+}
+
+/* @brief Get the scheduled learning rate of a batch
+ * @param[in] step	The number of batches trained before it
+ * @return			The learning rate
+*/
+float Optimizer::getLearningRate(uint64_t step) const {
+	OptimizerSettings const& s = this->settings;
+
+	// Ramp up linearly, so the first batches can not throw the weights far off while the moments are still empty
+	if (step < s.warmupSteps) {
+		return s.learningRate * (step + 1) / s.warmupSteps;
+	}
+	step -= s.warmupSteps;
+
+	switch (s.schedule) {
+		case SCHEDULE_COSINE: {
+			double progress = std::min(static_cast<double>(step) / std::max<uint32_t>(s.decaySteps, 1), 1.0);
+			double floor = s.decayFactor * s.learningRate;
+			return floor + (s.learningRate - floor) * 0.5 * (1.0 + std::cos(M_PI * progress));
+		}
+		case SCHEDULE_STEP:
+			return s.learningRate * std::pow(s.decayFactor, static_cast<double>(step / std::max<uint32_t>(s.decaySteps, 1)));
+		default:
+			return s.learningRate;
+	}
+}
+
+/* @brief Get the optimizer settings
+ * @return A reference to the settings
+*/
+OptimizerSettings const& Optimizer::getSettings() const {
+	return this->settings;
+}
+
+/* @brief Replace the optimizer settings, keeping the step count
+ * @param[in] settings	The settings, see validSettings()
+ * @return				A reference to this optimizer object
+*/
+Optimizer& Optimizer::setSettings(OptimizerSettings const& settings) {
+	this->settings = settings;
+	return *this;
+}
+
+/* @brief Get the number of batches trained so far
+ * @return The step count
+*/
+uint64_t Optimizer::getStep() const {
+	return this->step;
+}
+
+/* @brief Set the number of batches trained so far, which is where the schedule resumes
+ * @param[in] step	The step count
+ * @return			A reference to this optimizer object
+*/
+Optimizer& Optimizer::setStep(uint64_t step) {
+	this->step = step;
+	return *this;
+}
+
+/* @brief Check that settings are in range
+ * @param[in] settings	The settings to check
+ * @return				False if some setting is out of range, printing why
+*/
+bool Optimizer::validSettings(OptimizerSettings const& settings) {
+	if (settings.optimizer > OPTIMIZER_ADAMW || settings.schedule > SCHEDULE_STEP) {
+		std::cerr << "Unknown optimizer " << settings.optimizer << " or schedule " << settings.schedule << std::endl;
+		return false;
+	}
+
+	// Written so NaNs fail too
+	if (!(settings.learningRate > 0.0) || !(settings.momentum >= 0.0 && settings.momentum < 1.0) || !(settings.beta2 >= 0.0 && settings.beta2 < 1.0)
+		|| !(settings.epsilon > 0.0) || !(settings.weightDecay >= 0.0)) {
+		std::cerr << "The learning rate and epsilon must be above 0, the momentum and betas at least 0 and below 1, and the weight decay at least 0" << std::endl;
+		return false;
+	}
+
+	if (settings.schedule != SCHEDULE_CONSTANT && (settings.decaySteps == 0 || !(settings.decayFactor >= 0.0 && settings.decayFactor <= 1.0))) {
+		std::cerr << "A decaying schedule needs at least one step to decay over, and a factor between 0 and 1" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/* @brief Get the number of moments an optimizer keeps per weight and bias
+ * @param[in] optimizer	OPTIMIZER_*
+ * @return				0 for SGD, 1 for momentum, 2 for Adam
+*/
+uint32_t Optimizer::getMomentSlots(uint32_t optimizer) {
+	switch (optimizer) {
+		case OPTIMIZER_MOMENTUM:
+			return 1;
+		case OPTIMIZER_ADAM:
+		case OPTIMIZER_ADAMW:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+/* @brief Get what the output error is scaled by. SGD and momentum fold the learning rate into it, like plain backprop always has, so their
+ * gradients come out already scaled. Adam normalizes the gradient away, so it runs on the plain error and applies the rate itself
+ * @param[in] step	The step
+ * @return			The error scale
+*/
+float Optimizer::getErrorScale(OptimizerStep const& step) {
+	return getMomentSlots(step.settings.optimizer) == 2 ? 1.0 : step.learningRate;
+}
+
+/* @brief True if the backends can apply the gradient of a step straight to the weights as it is calculated, without any state or decay
+ * @param[in] step	The step
+ * @return			True for SGD without weight decay
+*/
+bool Optimizer::isPlainStep(OptimizerStep const& step) {
+	return step.settings.optimizer == OPTIMIZER_SGD && step.settings.weightDecay == 0.0;
+}
+
+/* @brief Work out the fused update of a layer's weights for a step
+ * @param[in] step		The step
+ * @param[in] updates	The number of updates the layer's moments have seen, including this one, for Adam's bias correction
+ * @return				The weight update. The biases use the same update without any decay
+*/
+OptimizerUpdate Optimizer::getUpdate(OptimizerStep const& step, uint64_t updates) {
+	OptimizerSettings const& s = step.settings;
+	OptimizerUpdate update;
+	update.optimizer = s.optimizer;
+	update.rate = step.learningRate;
+	update.momentum = s.momentum;
+	update.beta2 = s.beta2;
+	update.epsilon = s.epsilon;
+
+	switch (s.optimizer) {
+		case OPTIMIZER_ADAM:
+		case OPTIMIZER_ADAMW:
+			// The moments start at zero, so they are scaled back up until they have seen enough updates
+			update.firstCorrection = 1.0 / (1.0 - std::pow(static_cast<double>(s.momentum), static_cast<double>(std::max<uint64_t>(updates, 1))));
+			update.secondCorrection = 1.0 / (1.0 - std::pow(static_cast<double>(s.beta2), static_cast<double>(std::max<uint64_t>(updates, 1))));
+			if (s.optimizer == OPTIMIZER_ADAM) {
+				update.l2Decay = s.weightDecay;
+			} else {
+				update.decoupledDecay = s.weightDecay;
+			}
+			break;
+		default:
+			// The gradient already carries the rate, the decay has to as well
+			update.l2Decay = step.learningRate * s.weightDecay;
+			break;
+	}
+
+	return update;
+}
+
+/* @brief Get the name of an optimizer
+ * @param[in] optimizer	OPTIMIZER_*
+ * @return				One of 'sgd,momentum,adam,adamw'
+*/
+char const* Optimizer::getOptimizerName(uint32_t optimizer) {
+	switch (optimizer) {
+		case OPTIMIZER_MOMENTUM:
+			return "momentum";
+		case OPTIMIZER_ADAM:
+			return "adam";
+		case OPTIMIZER_ADAMW:
+			return "adamw";
+		default:
+			return "sgd";
+	}
+}
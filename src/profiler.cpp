@@ -0,0 +1,289 @@
+#include "profiler.h"
+#include "oglopp/compute.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* One timed section, in nanoseconds since the profiler was first enabled
+*/
+struct ProfileEvent {
+	char const* name;
+	int layer;
+	uint32_t thread;	// 0 is the GPU
+	int64_t start;
+	int64_t duration;
+};
+
+/* Totals of one section and layer over a summary window
+*/
+struct ProfileCounter {
+	uint64_t calls = 0;
+	uint64_t gpuCalls = 0;
+	double cpuSeconds = 0.0;
+	double gpuSeconds = 0.0;
+	uint64_t bytes = 0;
+};
+
+/* A section whose GPU timestamps have not been read back yet
+*/
+struct PendingQuery {
+	char const* name;
+	int layer;
+	uint32_t begin;
+	uint32_t end;
+};
+
+static std::mutex profileLock;
+static std::chrono::steady_clock::time_point epoch;
+static std::chrono::steady_clock::time_point windowStart;
+static bool started = false;
+
+// Ring of the most recent PROFILER_MAX_EVENTS events
+static std::vector<ProfileEvent> events;
+static size_t eventHead = 0;
+
+static std::map<std::pair<std::string, int>, ProfileCounter> counters;
+static std::unordered_map<std::thread::id, uint32_t> threadIds;
+
+// GPU queries are only touched from the thread owning the OpenGL context, so they need no lock
+static std::vector<uint32_t> freeQueries;
+static std::vector<PendingQuery> pendingQueries;
+static int64_t gpuOffset = 0;
+static bool calibrated = false;
+
+/* @brief Store an event, replacing the oldest once the ring is full. The lock must be held
+ * @param[in] event	The event to store
+*/
+static void pushEvent(ProfileEvent const& event) {
+	if (events.size() < PROFILER_MAX_EVENTS) {
+		events.push_back(event);
+		return;
+	}
+	events[eventHead] = event;
+	eventHead = (eventHead + 1) % PROFILER_MAX_EVENTS;
+}
+
+/* @brief Get a query object from the pool
+ * @return The query object
+*/
+static uint32_t takeQuery() {
+	if (freeQueries.empty()) {
+		GLuint query = 0;
+		glGenQueries(1, &query);
+		return query;
+	}
+
+	uint32_t query = freeQueries.back();
+	freeQueries.pop_back();
+	return query;
+}
+
+/* @brief Start collecting timings
+ * @return True if the profiler was enabled
+*/
+bool Profiler::enable() {
+	std::lock_guard<std::mutex> guard(profileLock);
+	if (!started) {
+		epoch = std::chrono::steady_clock::now();
+		events.reserve(PROFILER_MAX_EVENTS);
+		started = true;
+	}
+
+	windowStart = std::chrono::steady_clock::now();
+	enabled = true;
+	return true;
+}
+
+/* @brief Stop collecting timings. Collected counters and events are kept
+*/
+void Profiler::disable() {
+	enabled = false;
+}
+
+/* @brief Record a finished CPU section. Used by ProfileScope
+ * @param[in] name	The section name, a string literal
+ * @param[in] layer	The layer index, or -1 if the section is not about one layer
+ * @param[in] start	When the section started
+ * @param[in] end	When the section ended
+ * @param[in] bytes	Bytes the section moved between host and device or disk
+*/
+void Profiler::recordCPU(char const* name, int layer, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, uint64_t bytes) {
+	std::lock_guard<std::mutex> guard(profileLock);
+
+	ProfileCounter& counter = counters[{name, layer}];
+	counter.calls++;
+	counter.cpuSeconds += std::chrono::duration<double>(end - start).count();
+	counter.bytes += bytes;
+
+	// Thread 0 is reserved for the GPU track
+	auto thread = threadIds.emplace(std::this_thread::get_id(), threadIds.size() + 1).first;
+
+	ProfileEvent event;
+	event.name = name;
+	event.layer = layer;
+	event.thread = thread->second;
+	event.start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count();
+	event.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	pushEvent(event);
+}
+
+/* @brief Issue a GPU timestamp query. Used by ProfileScope
+ * @return The query object
+*/
+uint32_t Profiler::beginGPU() {
+	// GPU timestamps run on their own clock, line them up with the CPU events once
+	if (!calibrated) {
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		gpuOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count() - gpuNow;
+		calibrated = true;
+	}
+
+	uint32_t query = takeQuery();
+	glQueryCounter(query, GL_TIMESTAMP);
+	return query;
+}
+
+/* @brief Issue the closing GPU timestamp query of a section. The result is read back later by collect(). Used by ProfileScope
+ * @param[in] name	The section name, a string literal
+ * @param[in] layer	The layer index, or -1
+ * @param[in] begin	The query returned by beginGPU()
+*/
+void Profiler::endGPU(char const* name, int layer, uint32_t begin) {
+	uint32_t end = takeQuery();
+	glQueryCounter(end, GL_TIMESTAMP);
+	pendingQueries.push_back({name, layer, begin, end});
+}
+
+/* @brief Read back any GPU timestamp queries whose results are ready
+ * @param[in] wait	True to wait for every outstanding query instead
+*/
+void Profiler::collect(bool wait) {
+	size_t done = 0;
+	for (;done<pendingQueries.size();done++) {
+		PendingQuery const& pending = pendingQueries[done];
+
+		// Queries complete in order, so the first one that is not ready ends the pass
+		if (!wait) {
+			GLint available = 0;
+			glGetQueryObjectiv(pending.end, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				break;
+			}
+		}
+
+		GLuint64 begin = 0;
+		GLuint64 end = 0;
+		glGetQueryObjectui64v(pending.begin, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(pending.end, GL_QUERY_RESULT, &end);
+		freeQueries.push_back(pending.begin);
+		freeQueries.push_back(pending.end);
+
+		std::lock_guard<std::mutex> guard(profileLock);
+		ProfileCounter& counter = counters[{pending.name, pending.layer}];
+		counter.gpuCalls++;
+		counter.gpuSeconds += (end - begin) * 1e-9;
+
+		ProfileEvent event;
+		event.name = pending.name;
+		event.layer = pending.layer;
+		event.thread = 0;
+		event.start = static_cast<int64_t>(begin) + gpuOffset;
+		event.duration = end - begin;
+		pushEvent(event);
+	}
+
+	pendingQueries.erase(pendingQueries.begin(), pendingQueries.begin() + done);
+}
+
+/* @brief Build a one line summary of the counters since the last summary, then start a new summary window
+ * @return The summary, or an empty string if nothing was recorded
+*/
+std::string Profiler::summary() {
+	collect();
+
+	std::lock_guard<std::mutex> guard(profileLock);
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - windowStart).count();
+	if (counters.empty() || seconds <= 0.0) {
+		return "";
+	}
+
+	std::ostringstream line;
+	line << std::fixed << std::setprecision(3) << "profile";
+	if (samples > 0) {
+		line << " | " << std::setprecision(1) << samples / seconds << " samples/s" << std::setprecision(3);
+	}
+
+	// Average time per call, so layers of different sizes can be compared directly
+	for (auto const& [key, counter] : counters) {
+		line << " | " << key.first;
+		if (key.second >= 0) {
+			line << "[" << key.second << "]";
+		}
+		if (counter.calls > 0) {
+			line << " " << counter.cpuSeconds * 1e3 / counter.calls << "ms";
+		}
+		if (counter.gpuCalls > 0) {
+			line << " gpu " << counter.gpuSeconds * 1e3 / counter.gpuCalls << "ms";
+		}
+		if (counter.bytes > 0) {
+			line << " " << std::setprecision(1) << counter.bytes / seconds / (1024.0 * 1024.0) << "MB/s" << std::setprecision(3);
+		}
+	}
+
+	counters.clear();
+	samples = 0;
+	windowStart = now;
+	return line.str();
+}
+
+/* @brief Write every recorded event as Chrome trace_event JSON. Waits for outstanding GPU queries first
+ * @param[in] path	The file to write
+ * @return			0 on success, -1 on failure
+*/
+int Profiler::writeTrace(std::string const& path) {
+	collect(true);
+
+	std::ofstream stream(path, std::ios::out | std::ios::trunc);
+	if (stream.fail()) {
+		std::cerr << "Failed to open " << path << " for writing" << std::endl;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> guard(profileLock);
+	stream << std::fixed << std::setprecision(3);
+	stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+	stream << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"GPU\"}}";
+	for (auto const& [id, thread] : threadIds) {
+		stream << "," << std::endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread << ", \"args\": {\"name\": \"CPU " << thread << "\"}}";
+	}
+
+	// Oldest first. Timestamps are in microseconds
+	for (size_t i=0;i<events.size();i++) {
+		ProfileEvent const& event = events[(eventHead + i) % events.size()];
+		stream << "," << std::endl << "{\"name\": \"" << event.name << "\", \"cat\": \"" << (event.thread == 0 ? "gpu" : "cpu")
+			<< "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread << ", \"ts\": " << event.start * 1e-3 << ", \"dur\": " << event.duration * 1e-3;
+		if (event.layer >= 0) {
+			stream << ", \"args\": {\"layer\": " << event.layer << "}";
+		}
+		stream << "}";
+	}
+	stream << std::endl << "]}" << std::endl;
+
+	if (stream.fail()) {
+		std::cerr << "Failed to write trace " << path << std::endl;
+		return -1;
+	}
+
+	std::cout << "Wrote " << events.size() << " profile events to " << path << std::endl;
+	return 0;
+}
@@ -0,0 +1,207 @@
+#include "quantize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+/* @brief Prepare to quantize a network
+ * @param[in] network	The network to quantize. Must be on the CPU backend
+*/
+Quantizer::Quantizer(Network& network) : network(network) {
+	if (network.getBackend().getType() != Backend::CPU) {
+		std::cerr << "Quantized layers only run on the cpu backend" << std::endl;
+		this->error = true;
+	}
+}
+
+/* @brief Run samples through the fp32 network, recording the range of the values feeding every layer, and the outputs evaluate() compares with
+ * @param[in] dataset				The samples
+ * @param[in] calibrationSamples	The number of samples to take the ranges from, spread over the dataset
+ * @param[in] evaluationSamples		The number of samples to keep the outputs of, spread over the dataset between the calibration samples
+ * @return							A reference to this quantizer object
+*/
+Quantizer& Quantizer::calibrate(Dataset& dataset, size_t calibrationSamples, size_t evaluationSamples) {
+	if (this->error) {
+		return *this;
+	}
+
+	if (dataset.getError() || dataset.size() == 0 || calibrationSamples == 0) {
+		std::cerr << "Quantizing needs samples to calibrate with" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	if (this->network.isQuantized()) {
+		std::cerr << "The network is already quantized" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	this->inputMin.assign(this->network.size(), std::numeric_limits<float>::max());
+	this->inputMax.assign(this->network.size(), std::numeric_limits<float>::lowest());
+
+	// Only the samples in the batch count, the zeroed rows padding out the last batch would widen the ranges
+	this->run(dataset, spread(dataset.size(), calibrationSamples, 0.0), [this](size_t, size_t count) {
+		for (size_t l=0;l+1<this->network.size();l++) {
+			Layer& layer = this->network[l];
+			float const* values = layer.mapValues(true);
+			auto range = std::minmax_element(values, values + count * layer.getNeuronCount());
+			this->inputMin[l+1] = std::min(this->inputMin[l+1], *range.first);
+			this->inputMax[l+1] = std::max(this->inputMax[l+1], *range.second);
+			layer.unmapValues();
+		}
+	});
+
+	this->evaluationIndices = spread(dataset.size(), evaluationSamples, 0.5);
+	Layer& output = this->network[this->network.size() - 1];
+	size_t outputCount = output.getNeuronCount();
+	this->reference.assign(this->evaluationIndices.size() * outputCount, 0.0);
+
+	double loss = 0.0;
+	this->run(dataset, this->evaluationIndices, [&](size_t first, size_t count) {
+		float const* values = output.mapValues(true);
+		float const* expected = output.mapExpected(true);
+		for (size_t i=0;i<count*outputCount;i++) {
+			double error = values[i] - expected[i];
+			loss += error * error;
+		}
+		std::memcpy(this->reference.data() + first * outputCount, values, sizeof(float) * count * outputCount);
+		output.unmapExpected();
+		output.unmapValues();
+	});
+	this->fp32Loss = loss / std::max<size_t>(this->reference.size(), 1);
+
+	this->fp32Bytes = 0;
+	for (size_t l=1;l<this->network.size();l++) {
+		this->fp32Bytes += this->network[l].getWeightBytes();
+	}
+
+	return *this;
+}
+
+/* @brief Quantize every layer of the network with the calibrated ranges
+ * @return A reference to this quantizer object
+*/
+Quantizer& Quantizer::apply() {
+	if (this->error) {
+		return *this;
+	}
+
+	if (this->inputMin.size() != this->network.size()) {
+		std::cerr << "The network has to be calibrated before it is quantized" << std::endl;
+		this->error = true;
+		return *this;
+	}
+
+	for (size_t l=1;l<this->network.size();l++) {
+		// Pruned layers are already small, and the int8 kernels are dense
+		if (this->network[l].isSparse()) {
+			std::cout << "Layer " << l << " is pruned, leaving it in fp32" << std::endl;
+			continue;
+		}
+		// The int8 kernels are dense matrix products
+		if (this->network[l].isConvolution()) {
+			std::cout << "Layer " << l << " is convolutional, leaving it in fp32" << std::endl;
+			continue;
+		}
+		this->network[l].quantize(this->inputMin[l], this->inputMax[l]);
+	}
+
+	if (!this->network.isQuantized()) {
+		std::cerr << "The network has no layers that can be quantized" << std::endl;
+		this->error = true;
+	}
+
+	return *this;
+}
+
+/* @brief Run the evaluation samples through the quantized network and compare with the fp32 outputs kept by calibrate()
+ * @param[in] dataset	The dataset given to calibrate()
+ * @return				The report
+*/
+QuantizationReport Quantizer::evaluate(Dataset& dataset) {
+	QuantizationReport report;
+	if (this->error || !this->network.isQuantized()) {
+		return report;
+	}
+
+	Layer& output = this->network[this->network.size() - 1];
+	size_t outputCount = output.getNeuronCount();
+
+	double loss = 0.0;
+	double difference = 0.0;
+	this->run(dataset, this->evaluationIndices, [&](size_t first, size_t count) {
+		float const* values = output.mapValues(true);
+		float const* expected = output.mapExpected(true);
+		float const* reference = this->reference.data() + first * outputCount;
+		for (size_t i=0;i<count*outputCount;i++) {
+			double error = values[i] - expected[i];
+			double drift = values[i] - reference[i];
+			loss += error * error;
+			difference += drift * drift;
+			report.maxError = std::max(report.maxError, std::fabs(drift));
+		}
+		output.unmapExpected();
+		output.unmapValues();
+	});
+
+	size_t count = std::max<size_t>(this->reference.size(), 1);
+	report.samples = this->evaluationIndices.size();
+	report.fp32Loss = this->fp32Loss;
+	report.int8Loss = loss / count;
+	report.outputError = difference / count;
+	report.fp32Bytes = this->fp32Bytes;
+	for (size_t l=1;l<this->network.size();l++) {
+		report.int8Bytes += this->network[l].getWeightBytes();
+	}
+
+	return report;
+}
+
+/* @brief True if the network could not be quantized, false otherwise
+ * @return True if error, false otherwise
+*/
+bool Quantizer::getError() {
+	return this->error;
+}
+
+/* @brief Run samples through the network a batch at a time
+ * @param[in] dataset	The samples
+ * @param[in] indices	The samples to run
+ * @param[in] visit		Called after every batch with the index of its first sample in 'indices' and the number of samples in it
+*/
+void Quantizer::run(Dataset& dataset, std::vector<uint64_t> const& indices, std::function<void(size_t first, size_t count)> const& visit) {
+	uint32_t batchSize = this->network.getBatchSize();
+	uint32_t inputCount = this->network[0].getNeuronCount();
+	uint32_t copyCount = std::min(inputCount, dataset.getSampleSize());
+	std::vector<float> batch(static_cast<size_t>(batchSize) * inputCount, 0.0);
+
+	for (size_t first=0;first<indices.size();first+=batchSize) {
+		size_t count = std::min<size_t>(batchSize, indices.size() - first);
+		std::fill(batch.begin(), batch.end(), 0.0f);
+		for (size_t b=0;b<count;b++) {
+			std::memcpy(batch.data() + b * inputCount, dataset.getSample(indices[first + b]), sizeof(float) * copyCount);
+		}
+
+		this->network.loadBatch(batch.data());
+		this->network.feedForward();
+		visit(first, count);
+	}
+}
+
+/* @brief Pick samples spread evenly over a dataset
+ * @param[in] size		The number of samples in the dataset
+ * @param[in] count		The number of samples to pick
+ * @param[in] offset	Where in each gap between picks to pick from, between 0 and 1
+ * @return				The sample indices
+*/
+std::vector<uint64_t> Quantizer::spread(uint64_t size, size_t count, double offset) {
+	count = std::min<uint64_t>(count, size);
+	std::vector<uint64_t> indices(count);
+	for (size_t i=0;i<count;i++) {
+		indices[i] = std::min<uint64_t>(static_cast<uint64_t>((i + offset) * size / count), size - 1);
+	}
+	return indices;
+}
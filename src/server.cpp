@@ -0,0 +1,422 @@
+#include "server.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest request accepted, so a bad header cannot make the reader allocate without bound
+#define SERVER_MAX_FLOATS	(1u << 24)
+
+static volatile sig_atomic_t stopping = 0;
+
+/* One connection. The socket is closed once the reader and every pending request are done with it
+*/
+struct ServerClient {
+	int fd;
+	std::vector<uint8_t> input;
+	std::mutex writeLock;
+
+	ServerClient(int fd) : fd(fd) {}
+	~ServerClient() {
+		close(this->fd);
+	}
+};
+
+/* @brief Listen on a socket, replacing any socket file already at the path
+ * @param[in] network		The network to serve. Its batch size is the largest batch the server forms
+ * @param[in] socketPath	The path of the socket
+ * @param[in] batchDelay	How long the oldest request may wait for others to share its batch, in microseconds
+*/
+Server::Server(Network& network, std::string const& socketPath, uint32_t batchDelay) : network(network), socketPath(socketPath), batchDelay(batchDelay) {
+	this->bottleneck = network.getBottleneck();
+	this->maxBatch = network.getBatchSize();
+	this->staging.assign(static_cast<size_t>(this->maxBatch) * network[0].getNeuronCount(), 0.0);
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path " << socketPath << " is too long" << std::endl;
+		this->error = true;
+		return;
+	}
+	strcpy(address.sun_path, socketPath.c_str());
+
+	// A socket left behind by a server that did not shut down cleanly
+	struct stat info;
+	if (stat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+		unlink(socketPath.c_str());
+	}
+
+	this->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (this->listener < 0 || bind(this->listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(this->listener, SOMAXCONN) != 0) {
+		std::cerr << "Failed to listen on " << socketPath << ": " << strerror(errno) << std::endl;
+		this->error = true;
+		return;
+	}
+}
+
+Server::~Server() {
+	stop();
+	if (this->reader.joinable()) {
+		this->reader.join();
+	}
+
+	if (this->listener >= 0) {
+		close(this->listener);
+		unlink(this->socketPath.c_str());
+	}
+}
+
+/* @brief True if the socket could not be opened, false otherwise
+ * @return True if error, false otherwise
+*/
+bool Server::getError() {
+	return this->error;
+}
+
+/* @brief Ask run() to return. Safe to call from a signal handler
+*/
+void Server::stop() {
+	stopping = 1;
+}
+
+/* @brief Serve requests until stop() is called
+ * @return 0 on a clean stop, 1 on error
+*/
+int Server::run() {
+	if (this->error) {
+		return 1;
+	}
+
+	stopping = 0;
+	std::cout << "Serving on " << this->socketPath << " in batches of up to " << this->maxBatch << ", encoding into layer " << this->bottleneck
+		<< " of " << this->network[this->bottleneck].getNeuronCount() << " neurons" << std::endl;
+
+	this->windowStart = std::chrono::steady_clock::now();
+	this->reader = std::thread(&Server::readLoop, this);
+
+	std::vector<ServerPending> batch;
+	while (!stopping) {
+		uint32_t op = this->gather(batch);
+		if (op != 0) {
+			this->execute(op, batch);
+		}
+
+		if (std::chrono::steady_clock::now() - this->windowStart >= std::chrono::duration<double>(SERVER_REPORT_SECONDS)) {
+			this->report();
+		}
+	}
+
+	this->queued.notify_all();
+	this->reader.join();
+	this->report();
+	return 0;
+}
+
+/* @brief Accept connections and read requests into the queues, on the reader thread
+*/
+void Server::readLoop() {
+	std::vector<std::shared_ptr<ServerClient>> clients;
+	std::vector<pollfd> fds;
+	uint8_t buffer[65536];
+
+	while (!stopping) {
+		fds.assign(1, {this->listener, POLLIN, 0});
+		for (auto const& client : clients) {
+			fds.push_back({client->fd, POLLIN, 0});
+		}
+
+		// Wake up regularly to notice stop()
+		if (poll(fds.data(), fds.size(), 100) <= 0) {
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(this->listener, nullptr, nullptr);
+			if (fd >= 0) {
+				clients.push_back(std::make_shared<ServerClient>(fd));
+			}
+		}
+
+		// Walk backwards so hung up connections can be removed in place
+		for (size_t i=fds.size()-1;i>0;i--) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+
+			std::shared_ptr<ServerClient> client = clients[i-1];
+			ssize_t bytes = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+			if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+
+			bool keep = bytes > 0;
+			if (keep) {
+				client->input.insert(client->input.end(), buffer, buffer + bytes);
+				keep = this->parse(client);
+			}
+
+			// Pending requests keep the connection alive until they are answered
+			if (!keep) {
+				shutdown(client->fd, SHUT_RD);
+				clients.erase(clients.begin() + (i-1));
+			}
+		}
+	}
+}
+
+/* @brief Parse every complete request in a connection's input buffer
+ * @param[in] client	The connection
+ * @return				False if the connection sent a bad request and must be closed
+*/
+bool Server::parse(std::shared_ptr<ServerClient> const& client) {
+	size_t offset = 0;
+	bool queuedAny = false;
+	bool valid = true;
+
+	while (client->input.size() - offset >= sizeof(ServerRequest)) {
+		ServerRequest request;
+		memcpy(&request, client->input.data() + offset, sizeof(request));
+
+		if (request.op == SERVER_OP_STATS) {
+			offset += sizeof(request);
+			float stats[SERVER_STATS_COUNT];
+			{
+				std::lock_guard<std::mutex> lock(this->statsLock);
+				memcpy(stats, this->stats, sizeof(stats));
+			}
+			respond(*client, SERVER_STATUS_OK, stats, SERVER_STATS_COUNT);
+			continue;
+		}
+
+		if (request.op == 0 || request.op >= SERVER_OP_COUNT || request.count != this->getInputCount(request.op) || request.count > SERVER_MAX_FLOATS) {
+			respond(*client, SERVER_STATUS_BAD_REQUEST, nullptr, 0);
+			valid = false;
+			break;
+		}
+
+		size_t requestSize = sizeof(request) + static_cast<size_t>(request.count) * sizeof(float);
+		if (client->input.size() - offset < requestSize) {
+			break;
+		}
+
+		ServerPending pending;
+		pending.client = client;
+		pending.input.resize(request.count);
+		memcpy(pending.input.data(), client->input.data() + offset + sizeof(request), sizeof(float) * request.count);
+		pending.arrival = std::chrono::steady_clock::now();
+		offset += requestSize;
+
+		std::lock_guard<std::mutex> lock(this->queueLock);
+		this->queues[request.op].push_back(std::move(pending));
+		queuedAny = true;
+	}
+
+	client->input.erase(client->input.begin(), client->input.begin() + offset);
+	if (queuedAny) {
+		this->queued.notify_one();
+	}
+	return valid;
+}
+
+/* @brief Wait for a batch of requests of one operation. Waits up to batchDelay after the oldest request for the batch to fill
+ * @param[out] batch	The requests, oldest first
+ * @return				The operation, or 0 if the server is stopping
+*/
+uint32_t Server::gather(std::vector<ServerPending>& batch) {
+	batch.clear();
+	std::unique_lock<std::mutex> lock(this->queueLock);
+
+	// The operation with the oldest request goes next, so no operation starves
+	auto oldest = [this]() {
+		uint32_t op = 0;
+		for (uint32_t i=1;i<SERVER_OP_COUNT;i++) {
+			if (!this->queues[i].empty() && (op == 0 || this->queues[i].front().arrival < this->queues[op].front().arrival)) {
+				op = i;
+			}
+		}
+		return op;
+	};
+
+	uint32_t op = 0;
+	while (!stopping && (op = oldest()) == 0) {
+		this->queued.wait_for(lock, std::chrono::milliseconds(100));
+	}
+	if (op == 0) {
+		return 0;
+	}
+
+	// Give other requests a chance to share the batch, up to the latency budget of the oldest one
+	auto deadline = this->queues[op].front().arrival + std::chrono::microseconds(this->batchDelay);
+	while (!stopping && this->queues[op].size() < this->maxBatch && std::chrono::steady_clock::now() < deadline) {
+		this->queued.wait_until(lock, deadline);
+	}
+
+	size_t count = std::min<size_t>(this->queues[op].size(), this->maxBatch);
+	for (size_t i=0;i<count;i++) {
+		batch.push_back(std::move(this->queues[op].front()));
+		this->queues[op].pop_front();
+	}
+
+	return op;
+}
+
+/* @brief Run a batch of requests through the network and send the responses
+ * @param[in] op	The operation of every request in the batch
+ * @param[in] batch	The requests
+*/
+void Server::execute(uint32_t op, std::vector<ServerPending>& batch) {
+	ProfileScope scope("serve");
+
+	size_t first = 1;
+	size_t last = this->network.size() - 1;
+	if (op == SERVER_OP_ENCODE) {
+		last = this->bottleneck;
+	} else if (op == SERVER_OP_DECODE) {
+		first = this->bottleneck + 1;
+	}
+
+	// Shrink the network to the next power of two above the request count, so a lone request does not pay for a full batch.
+	// Resizing only reallocates the values, and powers of two keep it from happening on every batch
+	uint32_t rows = 1;
+	while (rows < batch.size()) {
+		rows *= 2;
+	}
+	rows = std::min(rows, this->maxBatch);
+	if (this->network.getBatchSize() != rows) {
+		this->network.setBatchSize(rows);
+	}
+
+	// Requests fill the first rows, the rest of the batch is computed on zeros and thrown away
+	Layer& inputLayer = this->network[first - 1];
+	uint32_t inputCount = inputLayer.getNeuronCount();
+	std::fill(this->staging.begin(), this->staging.begin() + static_cast<size_t>(rows) * inputCount, 0.0f);
+	for (size_t i=0;i<batch.size();i++) {
+		memcpy(this->staging.data() + i * inputCount, batch[i].input.data(), sizeof(float) * inputCount);
+	}
+
+	if (first == 1) {
+		// The same staged upload training uses
+		this->network.loadBatch(this->staging.data());
+	} else {
+		float* values = inputLayer.mapValues();
+		memcpy(values, this->staging.data(), sizeof(float) * inputCount * inputLayer.getBatchSize());
+		inputLayer.unmapValues();
+	}
+
+	Layer& outputLayer = this->network.feedForward(first, last);
+	uint32_t outputCount = outputLayer.getNeuronCount();
+
+	float const* values = outputLayer.mapValues(true);
+	for (size_t i=0;i<batch.size();i++) {
+		respond(*batch[i].client, SERVER_STATUS_OK, values + i * outputCount, outputCount);
+	}
+	outputLayer.unmapValues();
+
+	auto now = std::chrono::steady_clock::now();
+	for (ServerPending const& pending : batch) {
+		this->latencies.push_back(std::chrono::duration<double>(now - pending.arrival).count());
+	}
+	this->batches++;
+	Profiler::addSamples(batch.size());
+	batch.clear();
+}
+
+/* @brief Send a response to a connection
+ * @param[in] client	The connection
+ * @param[in] status	SERVER_STATUS_*
+ * @param[in] data		The floats to send
+ * @param[in] count		The number of floats
+*/
+void Server::respond(ServerClient& client, uint32_t status, float const* data, uint32_t count) {
+	ServerResponse response = {status, count};
+
+	iovec parts[2] = {
+		{&response, sizeof(response)},
+		{const_cast<float*>(data), sizeof(float) * count}
+	};
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = parts;
+	message.msg_iovlen = count > 0 ? 2 : 1;
+
+	// The reader and run() can both answer the same connection
+	std::lock_guard<std::mutex> lock(client.writeLock);
+	size_t remaining = sizeof(response) + sizeof(float) * count;
+	while (remaining > 0) {
+		ssize_t sent = sendmsg(client.fd, &message, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// The client went away, its responses are dropped
+			return;
+		}
+
+		remaining -= sent;
+		// Skip past whatever was sent of the header and floats
+		while (sent > 0 && message.msg_iovlen > 0) {
+			size_t part = std::min<size_t>(sent, message.msg_iov->iov_len);
+			message.msg_iov->iov_base = static_cast<uint8_t*>(message.msg_iov->iov_base) + part;
+			message.msg_iov->iov_len -= part;
+			sent -= part;
+			if (message.msg_iov->iov_len == 0) {
+				message.msg_iov++;
+				message.msg_iovlen--;
+			}
+		}
+	}
+}
+
+/* @brief Print the throughput and latency since the last report, and keep them for stats requests
+*/
+void Server::report() {
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - this->windowStart).count();
+	this->windowStart = now;
+
+	if (this->latencies.empty()) {
+		return;
+	}
+
+	std::sort(this->latencies.begin(), this->latencies.end());
+	double p50 = this->latencies[this->latencies.size() / 2] * 1e3;
+	double p99 = this->latencies[std::min(this->latencies.size() - 1, this->latencies.size() * 99 / 100)] * 1e3;
+	double rate = this->latencies.size() / seconds;
+	double meanBatch = static_cast<double>(this->latencies.size()) / this->batches;
+
+	std::cout << std::fixed << std::setprecision(3) << "Served " << this->latencies.size() << " requests"
+		<< "\t" << std::setprecision(1) << rate << " requests/s"
+		<< "\tp50 " << std::setprecision(3) << p50 << "ms"
+		<< "\tp99 " << p99 << "ms"
+		<< "\tbatch " << std::setprecision(1) << meanBatch << std::defaultfloat << std::endl;
+
+	{
+		std::lock_guard<std::mutex> lock(this->statsLock);
+		this->stats[0] = rate;
+		this->stats[1] = p50;
+		this->stats[2] = p99;
+		this->stats[3] = meanBatch;
+	}
+
+	this->latencies.clear();
+	this->batches = 0;
+}
+
+/* @brief Get the number of floats a request of some operation must carry
+ * @param[in] op	The operation
+ * @return			The float count
+*/
+uint32_t Server::getInputCount(uint32_t op) {
+	return op == SERVER_OP_DECODE ? this->network[this->bottleneck].getNeuronCount() : this->network[0].getNeuronCount();
+}
@@ -0,0 +1,285 @@
+#include "shadervariants.h"
+#include "checksum.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+/* @brief Get the GLSL declaring this variant's constants, inserted after the #version line of the shader
+ * @return The declarations, which also identify the variant
+*/
+std::string ShaderVariant::getDeclarations() const {
+	// The function main() runs, so the other passes are never reached and get dropped
+	char const* entry = "doLoadBatch";
+	if (this->pass == SHADER_PASS_FORWARD) {
+		entry = this->fusedInputs != 0 ? "doFusedForwardPass" : this->convolution != 0 ? "doConvolutionForwardPass" : this->sparse ? "doSparseForwardPass" : "doForwardPass";
+	} else if (this->pass == SHADER_PASS_BACKWARD) {
+		entry = this->convolution != 0 ? "doConvolutionBackProp" : this->sparse ? "doSparseBackProp" : "doBackProp2";
+	}
+
+	std::ostringstream text;
+	text << "#define SPECIALIZED\n"
+		<< "#define ENTRY_POINT " << entry << "\n"
+		// Size the per-sample arrays for this batch rather than the largest one
+		<< "#define BATCH_CAPACITY " << std::max<uint32_t>(this->batchSize, 1) << "\n"
+		<< "const bool loadBatch = " << (this->pass == SHADER_PASS_LOAD ? "true" : "false") << ";\n"
+		<< "const bool backProp = " << (this->pass == SHADER_PASS_BACKWARD ? "true" : "false") << ";\n"
+		<< "const bool isLastLayer = " << (this->isLastLayer ? "true" : "false") << ";\n"
+		<< "const bool sparse = " << (this->sparse ? "true" : "false") << ";\n"
+		<< "const int lastCount = " << this->lastCount << ";\n"
+		<< "const int thisCount = " << this->thisCount << ";\n"
+		<< "const int batchSize = " << this->batchSize << ";\n"
+		<< "const int activationType = " << this->activation << ";\n"
+		<< "const int convolution = " << this->convolution << ";\n"
+		<< "const int kernelSize = " << this->kernelSize << ";\n"
+		<< "const int kernelStride = " << this->kernelStride << ";\n"
+		<< "const int kernelPadding = " << this->kernelPadding << ";\n"
+		<< "const int smallSize = " << this->smallSize << ";\n"
+		<< "const int smallChannels = " << this->smallChannels << ";\n"
+		<< "const int bigSize = " << this->bigSize << ";\n"
+		<< "const int bigChannels = " << this->bigChannels << ";\n"
+		<< "const int backPropPass = " << this->backPropPass << ";\n"
+		<< "const int optimizer = " << this->optimizer << ";\n"
+		<< "const int storedWeights = " << this->storedWeights << ";\n"
+		<< "const int weightFormat = " << this->weightFormat << ";\n";
+	if (this->fusedInputs != 0) {
+		// The small layer is the last layer of the fused pass
+		text << "#define FUSED_COUNT " << this->lastCount << "\n"
+			<< "#define FUSED_INPUTS " << this->fusedInputs << "\n"
+			<< "#define FUSED_ACTIVATION " << this->fusedActivation << "\n";
+	}
+	// Keep the line numbers of compile errors matching the file
+	text << "#line 2\n";
+	return text.str();
+}
+
+/* @brief Read the shader source and open the cache. Check getError() after
+ * @param[in] sourcePath		The path to shaders/compute.glsl
+ * @param[in] cacheDirectory	Where program binaries are cached, created if missing. Empty to always compile
+*/
+ShaderVariants::ShaderVariants(std::string const& sourcePath, std::string const& cacheDirectory) : cacheDirectory(cacheDirectory) {
+	std::ifstream file(sourcePath);
+	std::stringstream text;
+	text << file.rdbuf();
+	std::string source = text.str();
+
+	// The declarations have to come after the #version line
+	size_t split = source.find('\n');
+	if (file.fail() || source.compare(0, 8, "#version") != 0 || split == std::string::npos) {
+		std::cerr << "Failed to read the shader source from " << sourcePath << std::endl;
+		this->error = true;
+		return;
+	}
+
+	this->version = source.substr(0, split + 1);
+	this->source = source.substr(split + 1);
+	this->sourceHash = crc32c(source.data(), source.size());
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	this->binaries = formats > 0 && !this->cacheDirectory.empty();
+	if (!this->binaries) {
+		return;
+	}
+
+	std::error_code code;
+	std::filesystem::create_directories(this->cacheDirectory, code);
+	if (code) {
+		std::cerr << "Failed to create the shader cache " << this->cacheDirectory << ": " << code.message() << ". Shaders will be compiled every launch" << std::endl;
+		this->binaries = false;
+		return;
+	}
+
+	for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+		GLubyte const* value = glGetString(name);
+		this->driver += value != nullptr ? reinterpret_cast<char const*>(value) : "";
+		this->driver += '\n';
+	}
+}
+
+ShaderVariants::~ShaderVariants() {
+	for (auto& entry : this->programs) {
+		if (entry.second != 0) {
+			glDeleteProgram(entry.second);
+		}
+	}
+}
+
+/* @brief Get the program of a variant, loading it from the cache or compiling it on first use
+ * @param[in] variant	The variant
+ * @return				The linked program, or 0 if it failed to build, in which case the caller should fall back to the generic shader
+*/
+GLuint ShaderVariants::getProgram(ShaderVariant const& variant) {
+	if (this->error) {
+		return 0;
+	}
+
+	std::string declarations = variant.getDeclarations();
+	auto found = this->programs.find(declarations);
+	if (found != this->programs.end()) {
+		return found->second;
+	}
+
+	GLuint program = 0;
+	std::string key;
+	std::string path;
+	if (this->binaries) {
+		std::ostringstream hash;
+		hash << std::hex << std::setfill('0') << std::setw(8) << this->sourceHash;
+		key = this->driver + hash.str() + "\n" + declarations;
+
+		// Named by the hash of the key. The whole key is kept in the file, so a collision only costs a compile
+		std::ostringstream name;
+		name << std::hex << std::setfill('0') << std::setw(8) << crc32c(key.data(), key.size()) << ".bin";
+		path = (std::filesystem::path(this->cacheDirectory) / name.str()).string();
+
+		program = this->loadBinary(key, path);
+	}
+
+	if (program == 0) {
+		program = this->compile(declarations);
+		if (program != 0 && this->binaries) {
+			this->saveBinary(program, key, path);
+		}
+	}
+
+	this->programs[declarations] = program;
+	return program;
+}
+
+/* @brief Check if the shader source could not be read
+ * @return True on error
+*/
+bool ShaderVariants::getError() const {
+	return this->error;
+}
+
+/* @brief Compile and link a variant
+ * @param[in] declarations	The variant's declarations
+ * @return					The program, or 0 on failure, printing the log
+*/
+GLuint ShaderVariants::compile(std::string const& declarations) {
+	std::string text = this->version + declarations + this->source;
+	char const* textPtr = text.c_str();
+
+	GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(shader, 1, &textPtr, nullptr);
+	glCompileShader(shader);
+
+	GLint status = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), '\0');
+		glGetShaderInfoLog(shader, log.size(), nullptr, &log[0]);
+		std::cerr << "Failed to compile shader variant:\n" << declarations << log << std::endl;
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	if (this->binaries) {
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	glAttachShader(program, shader);
+	glLinkProgram(program);
+	// Only flagged for deletion until the program goes
+	glDeleteShader(shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		GLint length = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), '\0');
+		glGetProgramInfoLog(program, log.size(), nullptr, &log[0]);
+		std::cerr << "Failed to link shader variant:\n" << declarations << log << std::endl;
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+/* @brief Load a variant from its cached binary. The file holds SHADER_CACHE_MAGIC, the binary format, the key length, the binary length
+ * and the binary's CRC-32C as 32 bit words, then the key and the binary
+ * @param[in] key	The cache key, which has to match the one the binary was saved with
+ * @param[in] path	The cache file
+ * @return			The program, or 0 if there is no valid binary for this driver
+*/
+GLuint ShaderVariants::loadBinary(std::string const& key, std::string const& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		return 0;
+	}
+
+	uint32_t header[5] = {};
+	if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != SHADER_CACHE_MAGIC || header[2] != key.size() || header[3] == 0) {
+		return 0;
+	}
+
+	std::string savedKey(header[2], '\0');
+	std::vector<char> binary(header[3]);
+	if (!file.read(&savedKey[0], savedKey.size()) || !file.read(binary.data(), binary.size()) || savedKey != key
+		|| crc32c(binary.data(), binary.size()) != header[4]) {
+		return 0;
+	}
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header[1], binary.data(), binary.size());
+
+	// Drivers reject binaries they no longer understand, even with a matching version string
+	GLint status = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+/* @brief Save the binary of a linked variant to the cache. Written to a temporary file and renamed over the old one, so a launch racing
+ * this one never reads half a binary
+ * @param[in] program	The program
+ * @param[in] key		The cache key
+ * @param[in] path		The cache file
+*/
+void ShaderVariants::saveBinary(GLuint program, std::string const& key, std::string const& path) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
+	}
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &format, binary.data());
+	if (written <= 0) {
+		return;
+	}
+	binary.resize(written);
+
+	uint32_t header[5] = {SHADER_CACHE_MAGIC, format, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(binary.size()), crc32c(binary.data(), binary.size())};
+
+	std::string temp = path + "." + std::to_string(getpid()) + ".tmp";
+	std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<char const*>(header), sizeof(header));
+	file.write(key.data(), key.size());
+	file.write(binary.data(), binary.size());
+	file.close();
+
+	std::error_code code;
+	if (!file.fail()) {
+		std::filesystem::rename(temp, path, code);
+	}
+	if (file.fail() || code) {
+		std::cerr << "Failed to cache shader binary " << path << std::endl;
+		std::filesystem::remove(temp, code);
+	}
+}
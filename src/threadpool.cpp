@@ -0,0 +1,183 @@
+#include "threadpool.h"
+
+#include <set>
+#include <string>
+#include <fstream>
+#include <utility>
+
+/* @brief Start the workers
+ * @param[in] threadCount	The number of threads working on each loop, including the caller. 0 uses one per physical core
+*/
+ThreadPool::ThreadPool(size_t threadCount) {
+	if (threadCount == 0) {
+		threadCount = getPhysicalCoreCount();
+	}
+	threadCount = threadCount > 0 ? threadCount : 1;
+
+	for (size_t i=0;i<threadCount;i++) {
+		this->queues.push_back(std::make_unique<Queue>());
+	}
+
+	// The caller works on its own loops, so one less thread is started
+	for (size_t i=0;i+1<threadCount;i++) {
+		this->workers.emplace_back(&ThreadPool::run, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wake.notify_all();
+
+	for (std::thread& worker : this->workers) {
+		worker.join();
+	}
+}
+
+/* @brief Get the number of threads working on each loop, including the caller
+ * @return The thread count
+*/
+size_t ThreadPool::size() {
+	return this->queues.size();
+}
+
+/* @brief Run task(0) through task(count - 1) across the pool and wait for all of them to finish
+ * @param[in] count	The number of tasks
+ * @param[in] task	The task to run, given its index
+ * @return			A reference to this pool object
+*/
+ThreadPool& ThreadPool::parallelFor(size_t count, std::function<void(size_t)> const& task) {
+	if (count == 0) {
+		return *this;
+	}
+
+	// Nothing to share, skip the queues entirely
+	if (count == 1 || this->workers.empty()) {
+		for (size_t i=0;i<count;i++) {
+			task(i);
+		}
+		return *this;
+	}
+
+	Loop loop;
+	loop.task = &task;
+	loop.remaining = count;
+
+	// Count the jobs before queueing them, so 'pending' never drops below the number of queued jobs
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pending += count;
+	}
+
+	// Deal the jobs out round robin so every worker starts on its own share before it has to steal
+	for (size_t i=0;i<count;i++) {
+		Queue& queue = *this->queues[i % this->queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back({&loop, i});
+	}
+	this->wake.notify_all();
+
+	// Help out until every job has been taken, then wait for the ones still running
+	size_t self = this->queues.size() - 1;
+	Job job;
+	while (loop.remaining.load(std::memory_order_acquire) > 0 && this->take(self, job)) {
+		this->execute(job);
+	}
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->finished.wait(lock, [&loop] { return loop.remaining.load(std::memory_order_acquire) == 0; });
+
+	return *this;
+}
+
+/* @brief Worker loop, sleeping whenever there are no jobs left anywhere
+ * @param[in] self	The index of this worker's queue
+*/
+void ThreadPool::run(size_t self) {
+	Job job;
+
+	while (true) {
+		if (this->take(self, job)) {
+			this->execute(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->wake.wait(lock, [this] { return this->stopping || this->pending.load() > 0; });
+		if (this->stopping) {
+			return;
+		}
+	}
+}
+
+/* @brief Take a job from our own queue, or steal one from another
+ * @param[in] self	The queue to look in first
+ * @param[out] job	The job that was taken
+ * @return			True if a job was taken
+*/
+bool ThreadPool::take(size_t self, Job& job) {
+	if (this->pending.load() == 0) {
+		return false;
+	}
+
+	// Our own jobs come off the back, stolen jobs come off the front of the victim's queue
+	for (size_t i=0;i<this->queues.size();i++) {
+		Queue& queue = *this->queues[(self + i) % this->queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.jobs.empty()) {
+			continue;
+		}
+
+		if (i == 0) {
+			job = queue.jobs.back();
+			queue.jobs.pop_back();
+		} else {
+			job = queue.jobs.front();
+			queue.jobs.pop_front();
+		}
+
+		this->pending--;
+		return true;
+	}
+
+	return false;
+}
+
+/* @brief Run a job and signal its loop if it was the last one
+ * @param[in] job	The job to run
+*/
+void ThreadPool::execute(Job const& job) {
+	(*job.loop->task)(job.index);
+
+	if (job.loop->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		// Take the lock so the wakeup cannot slip in between the caller checking 'remaining' and going to sleep
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->finished.notify_all();
+	}
+}
+
+/* @brief Count the physical cores of the machine. Hyperthreads share the SIMD units of their core, so they add little to the kernels
+ * @return The number of physical cores, or the number of hardware threads if the topology cannot be read
+*/
+size_t ThreadPool::getPhysicalCoreCount() {
+	size_t hardwareThreads = std::thread::hardware_concurrency();
+	std::set<std::pair<int, int>> cores;
+
+	for (size_t cpu=0;cpu<hardwareThreads;cpu++) {
+		std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		std::ifstream packageFile(topology + "physical_package_id");
+		std::ifstream coreFile(topology + "core_id");
+
+		int package = 0;
+		int core = 0;
+		if (!(packageFile >> package) || !(coreFile >> core)) {
+			return hardwareThreads > 0 ? hardwareThreads : 1;
+		}
+
+		cores.insert({package, core});
+	}
+
+	return cores.empty() ? 1 : cores.size();
+}